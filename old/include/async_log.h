@@ -0,0 +1,47 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stdint.h>
+
+#include <38-moths/logging.h>
+
+/* Logging that never blocks the caller. Each thread formats into its own ring
+ * and a writer thread drains all of them in batches. If a ring is full the
+ * message is dropped and counted rather than waited on, and any one call site
+ * spamming the same message gets sampled down to LOG_SAMPLE_BURST a second.
+ *
+ * Until log_start() is called (the tools and tests never bother) messages
+ * are written synchronously instead.
+ */
+
+/* Messages a thread can have queued before we start dropping them. */
+#define LOG_RING_SIZE 256
+/* Longest message we keep, anything past this is cut off. */
+#define LOG_MSG_SIZE 240
+/* Messages a single call site gets per second, per thread. */
+#define LOG_SAMPLE_BURST 20
+/* How long the writer naps when there's nothing to do. */
+#define LOG_IDLE_SLEEP_MS 10
+
+/* Anything below this is thrown away before it's formatted. Set from
+ * WFU_LOG_LEVEL (db, info, warn, err) by log_start(). */
+extern LOG_LEVEL log_level;
+
+#define log_msg(level, ...) \
+	do { \
+		if ((level) >= log_level) \
+			log_msg_unfiltered((level), __VA_ARGS__); \
+	} while (0)
+
+void log_msg_unfiltered(const LOG_LEVEL level, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/* Starts the writer thread. Returns 0 on success. */
+int log_start();
+
+/* Writes out everything queued so far. Registered with atexit() by
+ * log_start(). */
+void log_flush();
+
+/* Messages dropped because a ring was full or they were sampled away. */
+uint64_t log_dropped_total();
+uint64_t log_sampled_total();
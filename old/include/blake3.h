@@ -0,0 +1,42 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* BLAKE3, unkeyed with 32 byte output. The input is split into 1KB chunks
+ * that hash independently and get merged up a binary tree, so one big file
+ * can be spread over several cores and, within a core, eight chunks at a
+ * time through vector registers. Digests match the reference implementation.
+ */
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+/* Chunks hashed side by side in the vector path. */
+#define BLAKE3_SIMD_DEGREE 8
+/* Subtrees smaller than this aren't worth a thread. */
+#define BLAKE3_PARALLEL_MIN (1024 * 1024)
+/* Enough for 2^54 chunks, which is more file than we'll ever see. */
+#define BLAKE3_MAX_DEPTH 54
+
+/* For input that arrives a piece at a time. */
+typedef struct blake3_hasher {
+	uint32_t chunk_cv[8];
+	uint64_t chunk_counter;
+	uint8_t block[BLAKE3_BLOCK_LEN];
+	uint8_t block_len;
+	uint8_t blocks_compressed;
+
+	/* Chaining values of finished subtrees, waiting on their right sibling. */
+	uint32_t cv_stack[BLAKE3_MAX_DEPTH][8];
+	uint8_t cv_stack_len;
+} blake3_hasher;
+
+void blake3_init(blake3_hasher *hasher);
+void blake3_update(blake3_hasher *hasher, const void *data, size_t len);
+/* Doesn't change the hasher, more can be added afterwards. */
+void blake3_final(const blake3_hasher *hasher, uint8_t out[static BLAKE3_OUT_LEN]);
+
+/* All at once, which is faster than the above. Uses up to threads threads
+ * (including the caller's) for big enough inputs. */
+void blake3_hash(const void *data, const size_t len, const unsigned int threads,
+		uint8_t out[static BLAKE3_OUT_LEN]);
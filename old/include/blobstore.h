@@ -0,0 +1,38 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include "common_defs.h"
+
+/* Content-addressed storage for webms and their thumbnails. Each file lives
+ * once under WFU_WEBMS_DIR/.blobs/AB/CD/<hash>.<ext>, keyed on its file hash,
+ * and the usual board/filename paths become symlinks into it. Turned on with
+ * WFU_BLOB_STORE=1, otherwise everything stays in the flat board directories.
+ */
+#define BLOB_DIR_NAME ".blobs"
+/* Hex characters of the hash used for each level of fan-out directories. */
+#define BLOB_FANOUT_WIDTH 2
+#define BLOB_WEBM_EXT "webm"
+#define BLOB_THUMB_EXT "jpg"
+
+int blob_store_enabled();
+
+/* Absolute path of the blob for a hash, creating the fan-out directories on
+ * the way. Returns 0 on success. */
+int get_blob_path(const char hash[static HASH_IMAGE_STR_SIZE], const char *ext,
+		char out[static MAX_IMAGE_FILENAME_SIZE]);
+
+/* Moves a webm into the store and leaves a symlink where it was. If we
+ * already have a blob with that hash and size, the file is dropped instead.
+ * Returns 0 once file_path points at the blob.
+ */
+int blob_store_webm(const char *file_path, const char hash[static HASH_IMAGE_STR_SIZE]);
+
+/* Same, for a thumbnail of the webm with webm_hash. Any existing thumbnail
+ * blob wins, whatever its size. */
+int blob_store_thumbnail(const char *thumb_path, const char webm_hash[static HASH_IMAGE_STR_SIZE]);
+
+/* If file_path is a link into the store, fills out with where its thumbnail
+ * blob lives. Returns 0 if it is. */
+int get_blob_thumbnail_path(const char *file_path, char out[static MAX_IMAGE_FILENAME_SIZE]);
+
+/* Atomically points link_path at blob_path, replacing whatever was there. */
+int blob_link(const char *blob_path, const char *link_path);
@@ -0,0 +1,31 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* Plain Bloom filter. Adds and lookups are lock free, so one can be shared
+ * between threads as long as nobody frees it out from under them. About 1%
+ * false positives when it holds as many keys as it was sized for. */
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_HASHES 7
+
+typedef struct bloom {
+	/* Always a power of two. */
+	uint64_t nbits;
+	uint32_t hashes;
+	/* Keys added, give or take duplicates. */
+	uint64_t count;
+	uint64_t *bits;
+} bloom;
+
+/* Sized for capacity keys. NULL if we're out of memory. */
+bloom *bloom_new(const uint64_t capacity);
+/* Wraps bits someone else read in, which the filter now owns. */
+bloom *bloom_from_bits(uint64_t *bits, const uint64_t nbits, const uint32_t hashes, const uint64_t count);
+void bloom_free(bloom *filter);
+
+void bloom_add(bloom *filter, const char *key, const size_t len);
+/* 0 if key was definitely never added, 1 if it might have been. */
+int bloom_maybe(const bloom *filter, const char *key, const size_t len);
+/* Whether it's holding more than it was sized for. */
+int bloom_overfull(const bloom *filter);
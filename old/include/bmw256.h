@@ -0,0 +1,29 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* Blue Midnight Wish 256, the same digests as the reference code in
+ * blue_midnight_wish.c but a good deal quicker: the compression function is
+ * unrolled with every index and rotation known at compile time, the word
+ * parallel parts are written as vector operations, and whole blocks are
+ * read straight out of the caller's buffer.
+ *
+ * Lengths are in bits, like the reference Update()/Final().
+ */
+#define BMW256_BLOCK_SIZE 64
+#define BMW256_DIGEST_SIZE 32
+
+typedef struct bmw256_state {
+	uint32_t pipe[16];
+	uint64_t bits_processed;
+} bmw256_state;
+
+void bmw256_init(bmw256_state *state);
+void bmw256_blocks(bmw256_state *state, const uint8_t *data, const size_t blocks);
+/* Whatever's left after the last whole block, up to 511 bits. */
+void bmw256_final(bmw256_state *state, const uint8_t *tail, const uint64_t tail_bits,
+		uint8_t out[static BMW256_DIGEST_SIZE]);
+
+/* Hash(256, data, bits, out), in one go. */
+void bmw256_hash(const uint8_t *data, const uint64_t bits, uint8_t out[static BMW256_DIGEST_SIZE]);
@@ -0,0 +1,62 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common_defs.h"
+
+/* Append-only log of the catalog and thread JSON a crawl fetched, so the
+ * same crawl can be fed back through ingest later (downloader -r/-p). A file
+ * is CRAWL_ARCHIVE_MAGIC followed by records, each a crawl_record_header,
+ * the board name and then the payload with a NUL on the end so it can be
+ * parsed straight out of the mapping. Integers are in host byte order; these
+ * aren't meant to leave the machine that wrote them.
+ */
+#define CRAWL_ARCHIVE_MAGIC "MZCRAWL1"
+#define CRAWL_RECORD_MAGIC 0x6D7A6372
+
+typedef enum {
+	CRAWL_CATALOG = 1,
+	CRAWL_THREAD = 2,
+} CRAWL_RECORD_TYPE;
+
+typedef struct __attribute__((__packed__)) crawl_record_header {
+	uint32_t magic;
+	uint8_t type;
+	uint8_t board_len;
+	/* Not counting the NUL. */
+	uint32_t payload_len;
+	uint64_t fetched_at_ms;
+	/* 0 for catalogs. */
+	uint64_t thread_num;
+} crawl_record_header;
+
+typedef struct crawl_record {
+	CRAWL_RECORD_TYPE type;
+	uint64_t fetched_at_ms;
+	uint64_t thread_num;
+	char board[MAX_BOARD_NAME_SIZE];
+	/* Points into the archive, valid until it's closed. */
+	const char *payload;
+	size_t payload_len;
+} crawl_record;
+
+typedef struct crawl_archive crawl_archive;
+
+/* Opens path for appending, creating it if need be. A record a crash cut
+ * short is cut off first. NULL on failure or if path isn't an archive. */
+crawl_archive *crawl_archive_open_write(const char *path);
+/* Maps path for reading. NULL if it isn't there or isn't an archive. */
+crawl_archive *crawl_archive_open_read(const char *path);
+
+/* Writes and flushes one record, stamped with the current time. Returns 0
+ * on success. Not thread safe, the downloader only has the one crawler. */
+int crawl_archive_append(crawl_archive *archive, const CRAWL_RECORD_TYPE type,
+		const char *board, const uint64_t thread_num, const char *payload, const size_t payload_len);
+
+/* Fills out the next record. Returns 1 if there was one, 0 at the end and -1
+ * if the file is garbage from here on. A record cut short by a crash counts
+ * as the end. */
+int crawl_archive_next(crawl_archive *archive, crawl_record *out);
+
+void crawl_archive_close(crawl_archive *archive);
@@ -3,18 +3,57 @@
 #include <libpq-fe.h>
 #include <stdint.h>
 #include "common_defs.h"
+#include "hashing.h"
 
 #define DB_PG_CONNECTION_INFO "postgresql:///mzbh"
 
 /* Gets an aliased image from the DB. */
 struct webm_alias *get_aliased_image_by_oleg_key(const char filepath[static MAX_IMAGE_FILENAME_SIZE], char out_key[static MAX_KEY_SIZE]);
-/* Gets a regular webm from the DB. */
+/* Gets a regular webm from the DB, by file_hash_bin (or file_hash for rows
+ * from before 004_binary_keys.sql). */
 struct webm *get_image_by_oleg_key(const char image_hash[static HASH_ARRAY_SIZE], char out_key[static MAX_KEY_SIZE]);
+/* get_image_by_oleg_key() for a file already hashed with the default backend.
+ * If that isn't bmw256 and nothing matches, tries the file's bmw256 hash too
+ * so rows from before the switch still dedupe. On a bmw256 match image_hash
+ * and algorithm are switched over to it. */
+struct webm *get_image_for_file(const char *file_path, char image_hash[static HASH_IMAGE_STR_SIZE],
+		HASH_ALGORITHM *algorithm, char out_key[static MAX_KEY_SIZE]);
+/* Whether any webm might be the same file as one with this size and
+ * fingerprint (see hash_fingerprint_file()). 0 means it's definitely new, and
+ * errors count as a maybe. */
+int fingerprint_seen(const size_t size, const char fingerprint[static HASH_IMAGE_STR_SIZE]);
 PGresult *get_aliases_by_webm_id(const unsigned int id);
 PGresult *get_images_by_popularity(const unsigned int offset, const unsigned int limit);
 /* Similar to get_aliased_image(2), but by key directly. */
 struct webm_alias *get_aliased_image_with_key(const char key[static MAX_KEY_SIZE]);
 
+/* Batches: between db_batch_begin() and db_batch_commit() everything this
+ * thread runs shares one connection and one transaction, instead of the usual
+ * connection per query. If anything in it fails the commit rolls the lot back
+ * and returns -1. Returns 0 on success. */
+int db_batch_begin();
+int db_batch_commit();
+void db_batch_rollback();
+
+/* Bulk loading for the reindex tool, only inside a batch.
+ * reindex_stage_begin() makes temp tables to COPY rows into (columns in the
+ * order given below), reindex_merge() moves them into webms and webm_aliases,
+ * skipping anything that's already there, and says how many rows it added.
+ * Canonical webms whose hash is already in under another path go in as
+ * aliases of that one. All return 0 on success.
+ */
+#define REINDEX_WEBMS_STAGE "reindex_webms"
+/* oleg_key, alias_key, file_hash, hash_algorithm, fingerprint, filename,
+ * board, file_path, size, created_at (Unix seconds), duration_ms, width,
+ * height, video_codec, audio_codec, has_audio */
+#define REINDEX_ALIASES_STAGE "reindex_aliases"
+/* oleg_key, webm_key, file_hash, hash_algorithm, filename, board,
+ * file_path, created_at (Unix seconds) */
+int reindex_stage_begin();
+/* rows is COPY text format, any number of whole lines. */
+int db_copy_rows(const char *table, const char *rows, const size_t len);
+int reindex_merge(unsigned int *out_webms, unsigned int *out_aliases);
+
 /* Get the number of records in a table. */
 unsigned int get_record_count_in_table(const char *query_command);
 
@@ -38,6 +77,40 @@ struct thread *get_thread_by_id(const unsigned int thread_id);
  */
 int associate_alias_with_webm(const struct webm *webm, const char alias_key[static MAX_KEY_SIZE]);
 
+/* (id, oleg_key) rows past after_id in id order, for known_keys.h. */
+PGresult *get_post_keys_after(const unsigned int after_id, const unsigned int limit);
+PGresult *get_alias_keys_after(const unsigned int after_id, const unsigned int limit);
+/* (id, body_content) rows, the same way, for text_index.h. */
+PGresult *get_post_bodies_after(const unsigned int after_id, const unsigned int limit);
+/* (id, filename, board, thread_id) for filename_index.h. thread_id is NULL
+ * if we don't have the post. */
+PGresult *get_webm_filenames_after(const unsigned int after_id, const unsigned int limit);
+PGresult *get_alias_filenames_after(const unsigned int after_id, const unsigned int limit);
+/* Webms and aliases with what meta_snapshot.h keeps of them, the same way.
+ * The post's columns are NULL if we don't have it. */
+PGresult *get_webm_snapshot_rows_after(const unsigned int after_id, const unsigned int limit);
+PGresult *get_alias_snapshot_rows_after(const unsigned int after_id, const unsigned int limit);
+/* Those posts (in no particular order) with w_filename and wa_filename for
+ * any webm or alias they have. */
+PGresult *get_posts_by_ids(const unsigned int *ids, const size_t count);
+
+/* Webms we haven't read the headers of or fingerprinted yet, for the
+ * backfill tool, with needs_metadata and needs_fingerprint saying which. Pages
+ * by id so files we can't parse don't come back around forever. */
+PGresult *get_webms_to_backfill(const unsigned int after_id, const unsigned int limit);
+/* How many webms up to up_to_id still need their metadata read, or -1. */
+int64_t count_webms_missing_metadata(const unsigned int up_to_id);
+/* Returns 1 on success. */
+struct webm_metadata;
+int update_webm_metadata(const unsigned int id, const struct webm_metadata *metadata);
+int update_webm_fingerprint(const unsigned int id, const char fingerprint[static HASH_IMAGE_STR_SIZE]);
+/* Webms and aliases on a board at least min_duration_ms long, newest first.
+ * Every row has a "total" column with the number of matches overall.
+ */
+PGresult *get_webms_by_board_filtered(const char board[static MAX_BOARD_NAME_SIZE],
+		const uint64_t min_duration_ms, const int require_audio,
+		const unsigned int offset, const unsigned int limit);
+
 PGresult *get_api_index_state_webms();
 PGresult *get_api_index_state_aliases();
 PGresult *get_api_index_state_posts();
@@ -0,0 +1,37 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <38-moths/vector.h>
+
+#include "common_defs.h"
+
+/* Entries read per getdents64() call and statx()es in flight per ring. */
+#define DIRSCAN_GETDENTS_SIZE (64 * 1024)
+#define DIRSCAN_RING_ENTRIES 256
+
+typedef struct scanned_file {
+	char fname[MAX_IMAGE_FILENAME_SIZE];
+	time_t mtime;
+	size_t size;
+	/* Of the file, so two links to the same one match. */
+	uint64_t ino;
+	uint64_t dev;
+} scanned_file;
+
+/* Lists the regular files in dir whose names end in suffix (or everything,
+ * if suffix is NULL), skipping dotfiles. Symlinks are followed, same as
+ * stat(). Names come from getdents64() and metadata from dirfd-relative
+ * statx() batched through io_uring when the kernel lets us, plain statx()
+ * otherwise. Returns a vector of scanned_file, or NULL if dir can't be read.
+ */
+vector *scan_directory(const char *dir, const char *suffix);
+
+/* scan_directory() over several directories at once, spread across
+ * num_threads threads. out[i] gets the result for dirs[i]. Returns 0 if
+ * every directory was scanned.
+ */
+int scan_directories(const char *dirs[], const size_t count, const char *suffix,
+		vector *out[], const unsigned int num_threads);
@@ -0,0 +1,30 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* How much of the file we look at. Info and Tracks come before the first
+ * Cluster in anything a normal muxer spits out, which is well inside this. */
+#define EBML_READ_SIZE (64 * 1024)
+#define EBML_MAX_CODEC_SIZE 16
+
+/* Anything at least this long (in milliseconds) counts as "long". */
+#define WEBM_LONG_DURATION_MS (60 * 1000)
+
+typedef struct webm_metadata {
+	uint64_t duration_ms;
+	unsigned int width;
+	unsigned int height;
+	char video_codec[EBML_MAX_CODEC_SIZE];
+	char audio_codec[EBML_MAX_CODEC_SIZE];
+	int has_audio;
+} webm_metadata;
+
+/* Pulls duration, dimensions and codecs out of the Matroska headers at the
+ * start of a webm without decoding anything. Returns 1 if the buffer looked
+ * like a webm, 0 otherwise. Fields we couldn't find are left zeroed.
+ */
+int parse_webm_metadata_buf(const unsigned char *buf, const size_t len, webm_metadata *out);
+
+/* Same as above, but reads the first EBML_READ_SIZE bytes of a file. */
+int parse_webm_metadata(const char *file_path, webm_metadata *out);
@@ -0,0 +1,61 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common_defs.h"
+
+/* Substring search over webm and alias filenames, for the server. Every
+ * filename is broken into trigrams (lowercased, with &#039; and friends
+ * decoded) and each trigram keeps the list of filenames it appears in. A query
+ * intersects its trigrams' lists and then checks what's left for the actual
+ * substring.
+ *
+ * filename_index_start() loads WFU_WEBMS_DIR/.filename_index if it's there,
+ * catches up on rows added since from the DB and saves it again, then keeps
+ * catching up every FILENAME_INDEX_REFRESH_SECS so new ingests show up. Only
+ * the filenames are saved, the trigrams get rebuilt on load.
+ */
+#define FILENAME_INDEX_FILE ".filename_index"
+#define FILENAME_INDEX_MAGIC "MZFNAME1"
+#define FILENAME_INDEX_REFRESH_SECS 30
+/* Rows per query when catching up from the DB. */
+#define FILENAME_INDEX_PAGE 50000
+/* Past this many filenames new ones are dropped, so memory stays bounded. */
+#define FILENAME_INDEX_MAX_ENTRIES (4 * 1024 * 1024)
+#define FILENAME_INDEX_MAX_BOARDS 256
+/* Most filenames a query looks at, newest first, so a query that matches
+ * everything costs the same as one that matches this many. */
+#define FILENAME_SEARCH_MAX_CANDIDATES 5000
+#define FILENAME_SEARCH_MAX_RESULTS 50
+/* Queries are trigrams, so anything shorter can't be looked up. */
+#define FILENAME_SEARCH_MIN_QUERY 3
+
+typedef struct filename_hit {
+	char filename[MAX_IMAGE_FILENAME_SIZE];
+	char board[MAX_BOARD_NAME_SIZE];
+	unsigned int id; /* webms.id, or webm_aliases.id if is_alias. */
+	unsigned int thread_id; /* 0 if we don't know. */
+	int is_alias;
+} filename_hit;
+
+/* Loads and refreshes the index on a thread of its own. Returns 0 if that
+ * got going. */
+int filename_index_start();
+/* Loads what filename_index_save() saved, on top of whatever's in there.
+ * Returns how many filenames it read, or -1 if there wasn't a usable one. */
+int filename_index_load();
+/* Catches up from the DB once. Returns how many filenames it added, or -1. */
+int filename_index_refresh();
+/* Adds one, for ingest and tests. Returns 0 if it was added. */
+int filename_index_add(const int is_alias, const unsigned int id, const char *filename,
+		const char *board, const unsigned int thread_id);
+/* Returns 0 on success. */
+int filename_index_save();
+/* Empties it. */
+void filename_index_clear();
+
+/* Best matches first: filenames starting with query, then ones with it at the
+ * start of a word, then anywhere, shorter and newer first within each. Returns
+ * how many went in out. */
+size_t filename_index_search(const char *query, filename_hit *out, const size_t max);
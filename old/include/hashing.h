@@ -0,0 +1,77 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stddef.h>
+
+#include "common_defs.h"
+
+/* What a stored file_hash was made with. Each webm and alias row records
+ * its own, so the corpus can move from one to the other a bit at a time.
+ * The names are what's in the DB, don't change them.
+ *
+ * bmw256 is the digest we've always stored, which (thanks to hash_string()
+ * handing Hash() a byte count as a bit count) only covers the first eighth
+ * of the file. blake3 covers all of it and is faster anyway.
+ */
+typedef enum {
+	HASH_BMW256 = 0,
+	HASH_BLAKE3,
+	HASH_ALGORITHMS
+} HASH_ALGORITHM;
+
+/* Ways of computing them, picked with WFU_HASH_BACKEND. bmw256-ref is the
+ * original reference code and bmw256 the fast kernel, both give the same
+ * digests. */
+typedef enum {
+	HASH_BACKEND_BMW256_REF = 0,
+	HASH_BACKEND_BMW256,
+	HASH_BACKEND_BLAKE3,
+	HASH_BACKENDS
+} HASH_BACKEND;
+
+const char *hash_algorithm_name(const HASH_ALGORITHM algorithm);
+/* HASH_ALGORITHMS if it isn't one. */
+HASH_ALGORITHM hash_algorithm_from_name(const char *name);
+const char *hash_backend_name(const HASH_BACKEND backend);
+/* HASH_BACKENDS if it isn't one. */
+HASH_BACKEND hash_backend_from_name(const char *name);
+HASH_ALGORITHM hash_backend_algorithm(const HASH_BACKEND backend);
+
+/* What new hashes are made with. Defaults to the fast bmw256. */
+HASH_BACKEND hash_default_backend();
+HASH_ALGORITHM hash_default_algorithm();
+/* How many threads hashing one file can use (only blake3 does). One per CPU
+ * up to HASH_MAX_THREADS, or WFU_HASH_THREADS. */
+#define HASH_MAX_THREADS 8
+unsigned int hash_threads();
+
+/* file_hash strings as the bytes the bytea columns hold, and back. The first
+ * is 0 if it isn't exactly HASH_ARRAY_SIZE bytes' worth of hex. */
+int hash_hex_to_bytes(const char *hex, unsigned char out[static HASH_ARRAY_SIZE]);
+void hash_bytes_to_hex(const unsigned char hash[static HASH_ARRAY_SIZE], char outbuf[static HASH_IMAGE_STR_SIZE]);
+
+int hash_string_with(const HASH_BACKEND backend, const unsigned char *string, const size_t siz,
+		char outbuf[static HASH_IMAGE_STR_SIZE]);
+int hash_file_with(const HASH_BACKEND backend, const char *file_path, char outbuf[static HASH_IMAGE_STR_SIZE]);
+
+/* The above with hash_default_backend(). */
+int hash_string(const unsigned char *string, const size_t siz, char outbuf[static HASH_IMAGE_STR_SIZE]);
+int hash_file(const char *filepath, char outbuf[static HASH_IMAGE_STR_SIZE]);
+
+/* A cheap stand-in for the full hash: blake3 of the size plus the first,
+ * middle and last HASH_FINGERPRINT_SAMPLE bytes of the first eighth of the
+ * file (or all of that, if it's smaller). That's the part every algorithm
+ * covers, so files with different fingerprints never have the same hash, and
+ * the same fingerprint only means it's worth hashing all of it. Sets out_size
+ * to the file's size.
+ */
+#define HASH_FINGERPRINT_SAMPLE (64 * 1024)
+int hash_fingerprint_file(const char *file_path, size_t *out_size, char outbuf[static HASH_IMAGE_STR_SIZE]);
+
+/* Incrementally hashes a file that is still being written, giving the same
+ * result as hash_file() on the finished file. hash_stream_finish() frees the
+ * stream regardless of outcome.
+ */
+struct hash_stream;
+struct hash_stream *hash_stream_new();
+int hash_stream_update_from_fd(struct hash_stream *stream, const int fd, const size_t available);
+int hash_stream_finish(struct hash_stream *stream, const int fd, const size_t total, char outbuf[static HASH_IMAGE_STR_SIZE]);
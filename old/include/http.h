@@ -6,4 +6,8 @@
 #include "common_defs.h"
 
 char *receive_chunked_http(const int request_fd);
-size_t download_sent_webm_url(const char *url, const char filename[static MAX_IMAGE_FILENAME_SIZE], char outpath[static MAX_IMAGE_FILENAME_SIZE]);
+/* Downloads a user-submitted webm into ./user_uploaded, hashing it as it
+ * arrives unless out_hash (HASH_IMAGE_STR_SIZE) is NULL. Returns the number
+ * of bytes written, or 0 on failure. */
+size_t download_sent_webm_url(const char *url, const char filename[static MAX_IMAGE_FILENAME_SIZE],
+		char outpath[static MAX_IMAGE_FILENAME_SIZE], char *out_hash);
@@ -0,0 +1,86 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "parse.h"
+
+/* Write-ahead journal between the downloader and Postgres. With
+ * WFU_INGEST_JOURNAL set, parsed posts and finished downloads are appended
+ * here instead of going straight into the DB, and an applier thread drains
+ * them into Postgres a batch (one transaction) at a time. The crawl keeps
+ * going at network speed when the DB is slow or down, and whatever was
+ * journaled gets applied once it's back, across restarts too.
+ *
+ * Appends are buffered and made durable by journal_sync(), which the applier
+ * calls every JOURNAL_SYNC_MS; so a crash loses at most that much. How far
+ * the applier got lives in <path>.checkpoint. Once everything has been
+ * applied the journal is truncated back to nothing.
+ */
+#define JOURNAL_MAGIC 0x6D7A6A6C
+#define JOURNAL_BUFFER_SIZE (64 * 1024)
+#define JOURNAL_SYNC_MS 100
+/* Entries per transaction. */
+#define JOURNAL_APPLY_BATCH 512
+/* How long the applier backs off for, at most, while the DB is away. */
+#define JOURNAL_MAX_BACKOFF_S 30
+
+typedef enum {
+	JOURNAL_POST = 1,
+	JOURNAL_IMAGE = 2,
+} JOURNAL_ENTRY_TYPE;
+
+typedef struct __attribute__((__packed__)) journal_header {
+	uint32_t magic;
+	uint32_t type;
+	/* Of the payload, which follows. */
+	uint32_t len;
+	uint32_t checksum;
+	uint64_t seq;
+} journal_header;
+
+typedef struct journal_entry {
+	JOURNAL_ENTRY_TYPE type;
+	uint64_t seq;
+	/* body_content is malloc'd, free it with journal_entry_free(). */
+	post_match post;
+	/* Images only. The post it belongs to, and where the file is. */
+	uint64_t post_seq;
+	char file_path[MAX_IMAGE_FILENAME_SIZE];
+	char filename[MAX_IMAGE_FILENAME_SIZE];
+} journal_entry;
+
+typedef struct ingest_journal ingest_journal;
+
+/* Opens (or creates) the journal at path and picks up from its checkpoint.
+ * NULL on failure. */
+ingest_journal *journal_open(const char *path);
+/* Syncs and closes. Stop the applier first. */
+void journal_close(ingest_journal *journal);
+
+/* Returns the entry's sequence number, which stands in for the post's ID
+ * until it's applied, or 0 on failure. */
+uint64_t journal_append_post(ingest_journal *journal, const post_match *p_match);
+/* Returns 0 on success. */
+int journal_append_image(ingest_journal *journal, const post_match *p_match, const uint64_t post_seq,
+		const char *file_path, const char *filename);
+/* Writes out anything buffered and fdatasync()s it. Returns 0 on success. */
+int journal_sync(ingest_journal *journal);
+
+/* Reads the entry at offset, if it's been synced. Returns 1 and sets
+ * next_offset if there was one, 0 at the end (or at a torn write) and -1 if
+ * the journal is corrupt. */
+int journal_read(ingest_journal *journal, const uint64_t offset, journal_entry *out, uint64_t *next_offset);
+void journal_entry_free(journal_entry *entry);
+
+/* Applies up to max_entries past the checkpoint in one transaction and moves
+ * the checkpoint past them. If the transaction fails they go in one at a
+ * time, skipping any the DB turns down, until the DB goes away. Returns how
+ * many were applied, or -1 if the DB wasn't having it. */
+int journal_apply(ingest_journal *journal, const unsigned int max_entries);
+/* Synced bytes not applied yet. */
+uint64_t journal_pending_bytes(ingest_journal *journal);
+
+/* Runs journal_sync() and journal_apply() in a loop on a thread of its own. */
+int journal_start_applier(ingest_journal *journal);
+void journal_stop_applier(ingest_journal *journal);
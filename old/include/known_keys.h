@@ -0,0 +1,52 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stdint.h>
+
+#include <libpq-fe.h>
+
+/* Bloom filters of what we already have, so the downloader only pays for an
+ * exact check (a stat() or a query) when something might be a duplicate:
+ * post oleg_keys, alias oleg_keys and board/filename for files on disk.
+ * Nothing uses them until known_keys_load() is called, and until then every
+ * known_maybe() is a "maybe".
+ *
+ * They're saved to WFU_WEBMS_DIR/.known_keys. The DB ones remember the last
+ * row ID they've seen, whether caught up on or added since, and pick up from
+ * there on load; files get rescanned
+ * for any board directory that's changed since the save. Anything that can't
+ * be brought up to date (say the DB is down) is left off, since a filter
+ * that's missing keys would have us inserting duplicates.
+ */
+#define KNOWN_KEYS_FILE ".known_keys"
+#define KNOWN_KEYS_MAGIC "MZKNOWN1"
+/* Rows per query when catching up from the DB. */
+#define KNOWN_KEYS_PAGE 50000
+/* Smallest anything gets sized for, about 1.2MB of bits. */
+#define KNOWN_KEYS_MIN_CAPACITY (1 << 20)
+
+typedef enum {
+	KNOWN_POSTS = 0,
+	KNOWN_ALIASES,
+	KNOWN_FILES,
+	KNOWN_KINDS
+} KNOWN_KIND;
+
+/* Returns how many of the filters are usable. */
+int known_keys_load();
+/* Returns 0 on success. */
+int known_keys_save();
+/* Throws them away, back to every lookup being a maybe. */
+void known_keys_unload();
+
+/* 0 if key is definitely new. */
+int known_maybe(const KNOWN_KIND kind, const char *key);
+/* row_id is the ID it was inserted with, for the DB ones, or 0. */
+void known_add(const KNOWN_KIND kind, const char *key, const uint64_t row_id);
+/* Highest row ID in kind's filter. */
+uint64_t known_keys_watermark(const KNOWN_KIND kind);
+
+/* Where a DB filter catches up from: (id, oleg_key) rows after after_id, like
+ * get_post_keys_after() and get_alias_keys_after(), which are the defaults.
+ * For tests, NULL puts the default back. */
+typedef PGresult *(*known_keys_source)(const unsigned int after_id, const unsigned int limit);
+void known_keys_set_source(const KNOWN_KIND kind, known_keys_source source);
@@ -0,0 +1,94 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stdint.h>
+#include <time.h>
+
+#include <libpq-fe.h>
+#include <38-moths/vector.h>
+
+#include "common_defs.h"
+
+struct webm;
+struct webm_alias;
+struct post;
+
+/* A read only copy of what the server looks up the most, so it doesn't have
+ * to ask Postgres. The downloader writes it after every pass and the server
+ * mmaps it. There are two files in WFU_WEBMS_DIR:
+ *
+ * .meta_snapshot is every webm (sorted by file hash), alias (sorted by key),
+ * the posts they came from (sorted by ID), each webm's aliases newest first
+ * and every board's files newest first. It gets rebuilt from scratch once
+ * the delta gets too big, or once the backfill tool has filled in metadata
+ * for webms already in it, which bumps its generation.
+ *
+ * .meta_snapshot.delta is the same thing, but only for rows added since the
+ * snapshot. It's rewritten every pass and only counts if its generation
+ * matches the snapshot's.
+ *
+ * Both are written to a .tmp and renamed over. Readers look at the files at
+ * most once every META_SNAPSHOT_CHECK_SECS, so lookups don't make any
+ * syscalls. Anything added since the last pass isn't in either, so every
+ * lookup that misses should go to the DB.
+ */
+#define META_SNAPSHOT_FILE ".meta_snapshot"
+#define META_SNAPSHOT_DELTA_FILE ".meta_snapshot.delta"
+#define META_SNAPSHOT_MAGIC "MZMETA01"
+/* Bumped whenever the layout changes, old files are ignored. */
+#define META_SNAPSHOT_VERSION 5
+/* Rows per query when reading from the DB. */
+#define META_SNAPSHOT_PAGE 20000
+/* Past this many new rows the delta gets folded into a new snapshot. */
+#define META_SNAPSHOT_MAX_DELTA 50000
+#define META_SNAPSHOT_CHECK_SECS 1
+/* "<created_at>-<w or a><id>", NUL included. */
+#define META_SNAPSHOT_CURSOR_SIZE 48
+
+typedef struct newest_hit {
+	char filename[MAX_IMAGE_FILENAME_SIZE];
+	char board[MAX_BOARD_NAME_SIZE];
+	unsigned int id; /* webms.id, or webm_aliases.id if is_alias. */
+	int is_alias;
+	time_t created_at;
+} newest_hit;
+
+/* Brings the files up to date with the DB. Returns 0 on success. */
+int meta_snapshot_update();
+/* Writes a snapshot of just these rows, or a delta on top of the current
+ * snapshot with the ones it doesn't have. Rows are as
+ * get_webm_snapshot_rows_after() and get_alias_snapshot_rows_after() give
+ * them. meta_snapshot_update() without the DB, for tests. */
+int meta_snapshot_write(const PGresult *webms, const PGresult *aliases, const int is_delta);
+
+/* Maps whatever's there now. Returns 0 if there was a snapshot. */
+int meta_snapshot_open();
+/* Drops the mappings. */
+void meta_snapshot_close();
+
+/* These all return NULL if it isn't in the snapshot. Free what they give you
+ * like what the get_*() in db.h give you. The webm only has its ID, hash and
+ * hash algorithm, filename, board, post ID and date, the alias the same minus
+ * the hash plus its webm's ID and the post only its thread, 4chan post ID and
+ * body. */
+struct webm *meta_snapshot_get_webm(const char image_hash[static HASH_IMAGE_STR_SIZE]);
+struct webm_alias *meta_snapshot_get_alias(const char file_path[static MAX_IMAGE_FILENAME_SIZE]);
+struct post *meta_snapshot_get_post(const unsigned int id);
+
+/* Appends webm_id's aliases to out (of webm_alias), newest first. Returns
+ * how many, or -1 if the snapshot doesn't know about webm_id. */
+int meta_snapshot_get_aliases(const unsigned int webm_id, vector *out);
+/* Like get_webms_by_board_filtered(): appends the filenames (each
+ * MAX_IMAGE_FILENAME_SIZE) on the page to out and returns how many there are
+ * in all, or -1 if there's no snapshot or board isn't in it. The all, long and
+ * audio filters the board pages use are counted up front, anything else
+ * walks the whole board to count. */
+int meta_snapshot_board_page(const char *board,
+		const uint64_t min_duration_ms, const int require_audio,
+		const unsigned int offset, const unsigned int limit, vector *out);
+/* Webms and aliases on every board, newest first, starting just after cursor
+ * (NULL or "" for the newest). Every board's list is already in order, so this
+ * is a binary search into each and then a merge costing log(boards) per hit.
+ * Returns how many went in out, or -1 if cursor isn't one. */
+int meta_snapshot_newest(const char *cursor, newest_hit *out, const size_t max);
+/* The cursor for the page after hit. */
+void meta_snapshot_cursor(const newest_hit *hit, char out[static META_SNAPSHOT_CURSOR_SIZE]);
@@ -0,0 +1,57 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* Counters for /api/metrics. Latencies come from trace.h, these are the
+ * things a histogram can't tell you: status codes, bytes, errors and cache
+ * hits. Everything is a relaxed atomic, so recording is cheap enough to leave
+ * on everywhere.
+ */
+
+/* Distinct routes/queries/caches we'll keep counters for. */
+#define METRICS_MAX_NAMES 128
+
+/* Where the downloader publishes how it's getting on, for the server. */
+#define METRICS_DOWNLOADER_SHM "/mzbh_downloader"
+#define METRICS_DOWNLOADER_MAGIC 0x6D7A6268
+
+typedef struct downloader_progress {
+	uint32_t magic;
+	int32_t pid;
+	uint64_t passes;
+	uint64_t threads_fetched;
+	uint64_t thread_fetch_errors;
+	uint64_t files_downloaded;
+	uint64_t download_errors;
+	uint64_t bytes_downloaded;
+	/* Unix seconds. */
+	uint64_t pass_started_at;
+	uint64_t pass_bytes;
+	uint64_t last_update;
+	/* With WFU_INGEST_JOURNAL, see journal.h. */
+	uint64_t journal_pending_bytes;
+	uint64_t journal_applied;
+} downloader_progress;
+
+/* name must outlive the process, same as trace_begin(). */
+void metrics_route_request(const char *name, const int status, const size_t bytes);
+void metrics_db_connection(const int ok);
+void metrics_db_query(const char *name, const int ok);
+void metrics_cache(const char *name, const int hit);
+void metrics_cache_totals(const char *name, uint64_t *hits, uint64_t *misses);
+/* Totals across every query, for summaries. */
+void metrics_db_totals(uint64_t *connections, uint64_t *queries);
+
+/* Downloader side. Creates the shared segment the first time it's called and
+ * returns NULL if that didn't work, in which case the update functions below
+ * quietly do nothing. */
+downloader_progress *metrics_downloader_attach();
+void metrics_downloader_pass_started();
+void metrics_downloader_thread_fetched(const int ok);
+void metrics_downloader_file_downloaded(const int ok, const size_t bytes);
+void metrics_downloader_journal(const uint64_t pending_bytes, const uint64_t applied);
+
+/* Renders everything in the Prometheus text format. Returns a malloc'd
+ * buffer, or NULL. */
+char *metrics_render(size_t *out_len);
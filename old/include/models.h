@@ -6,6 +6,16 @@
 #include <libpq-fe.h>
 
 #include "common_defs.h"
+#include "ebml.h"
+#include "hashing.h"
+#include "pg_fields.h"
+
+/* Each model also comes as a *_row: the same fields decoded straight out of
+ * a PGresult (binary, ideally), with strings pointing into the result rather
+ * than copied, so a row is only good until the result is PQclear()ed. Look
+ * the columns up once per result with *_cols_init(), then *_row_get() each
+ * row. Whatever the query didn't select comes out 0 or NULL.
+ */
 
 /* The unsigned chars in the struct are used to null terminate the
  * strings while still allowing us to use 'sizeof(webm.file_hash)'.
@@ -25,11 +35,47 @@ typedef struct webm {
 	char file_path[MAX_IMAGE_FILENAME_SIZE];
 	unsigned char _null_term_hax_4;
 
+	/* Empty until it's been backfilled, see hash_fingerprint_file(). */
+	char fingerprint[HASH_IMAGE_STR_SIZE];
+	unsigned char _null_term_hax_5;
+
 	uint64_t post_id;
 	time_t created_at;
 	size_t size;
+	HASH_ALGORITHM hash_algorithm; /* What made file_hash. */
+	webm_metadata metadata; /* Zeroed if we couldn't read the headers. */
 } __attribute__((__packed__)) webm;
 
+typedef struct webm_cols {
+	pg_col id, file_hash, file_hash_bin, filename, board, file_path, post_id, created_at, size;
+	pg_col hash_algorithm, fingerprint;
+	pg_col duration_ms, width, height, video_codec, audio_codec, has_audio;
+} webm_cols;
+
+typedef struct webm_row {
+	uint64_t id;
+	uint64_t post_id;
+	uint64_t size;
+	time_t created_at;
+	HASH_ALGORITHM hash_algorithm;
+	const char *file_hash;
+	const char *filename;
+	const char *board;
+	const char *file_path;
+	const char *fingerprint;
+
+	int has_metadata;
+	uint64_t duration_ms;
+	unsigned int width;
+	unsigned int height;
+	int has_audio;
+	const char *video_codec;
+	const char *audio_codec;
+} webm_row;
+
+void webm_cols_init(webm_cols *cols, const PGresult *res);
+void webm_row_get(webm_row *row, const webm_cols *cols, const PGresult *res, const int idx);
+
 void create_webm_key(const char file_hash[static HASH_IMAGE_STR_SIZE], char outbuf[static MAX_KEY_SIZE]);
 char *serialize_webm(const webm *to_serialize);
 webm *deserialize_webm_from_tuples(const PGresult *res, const unsigned int idx);
@@ -53,11 +99,36 @@ typedef struct webm_alias {
 
 	uint64_t post_id;
 	uint64_t webm_id;
+	HASH_ALGORITHM hash_algorithm;
 
 	time_t created_at;
 } __attribute__((__packed__)) webm_alias;
 
+typedef struct webm_alias_cols {
+	pg_col id, file_hash, file_hash_bin, filename, board, file_path, post_id, webm_id, created_at;
+	pg_col hash_algorithm;
+} webm_alias_cols;
+
+typedef struct webm_alias_row {
+	uint64_t id;
+	uint64_t post_id;
+	uint64_t webm_id;
+	time_t created_at;
+	HASH_ALGORITHM hash_algorithm;
+	const char *file_hash;
+	const char *filename;
+	const char *board;
+	const char *file_path;
+} webm_alias_row;
+
+void webm_alias_cols_init(webm_alias_cols *cols, const PGresult *res);
+void webm_alias_row_get(webm_alias_row *row, const webm_alias_cols *cols, const PGresult *res, const int idx);
+
 void create_alias_key(const char file_path[static MAX_IMAGE_FILENAME_SIZE], char outbuf[static MAX_KEY_SIZE]);
+/* An alias key as webm_aliases.key_bin: the bmw256 half's bytes followed by
+ * the fnv1a half, big-endian. 0 if it isn't a key create_alias_key() made. */
+#define ALIAS_KEY_BIN_SIZE (HASH_ARRAY_SIZE + 8)
+int alias_key_to_bin(const char key[static MAX_KEY_SIZE], unsigned char out[static ALIAS_KEY_BIN_SIZE]);
 char *serialize_alias(const webm_alias *to_serialize);
 //webm_alias *deserialize_alias(const char *json);
 webm_alias *deserialize_alias_from_tuples(const PGresult *res, const unsigned int idx);
@@ -75,6 +146,21 @@ typedef struct thread {
 	char *subject;
 } __attribute__((__packed__)) thread;
 
+typedef struct thread_cols {
+	pg_col id, oleg_key, board, subject, created_at;
+} thread_cols;
+
+typedef struct thread_row {
+	uint64_t id;
+	time_t created_at;
+	const char *oleg_key;
+	const char *board;
+	const char *subject;
+} thread_row;
+
+void thread_cols_init(thread_cols *cols, const PGresult *res);
+void thread_row_get(thread_row *row, const thread_cols *cols, const PGresult *res, const int idx);
+
 void create_thread_key(const char board[static MAX_BOARD_NAME_SIZE], const char *thread_id,
 		char outbuf[static MAX_KEY_SIZE]);
 char *serialize_thread(const thread *to_serialize);
@@ -96,13 +182,39 @@ typedef struct post {
 	uint64_t fourchan_post_no; /* post number */
 
 	char *body_content;
-	vector *replied_to_keys; /* keys that this post replied to. */
+	vector *replied_to; /* uint64_t post numbers this one quotes. */
 
 	uint64_t id; /* DB ID */
 	uint64_t thread_id; /* "Foreign key" to thread object. */
 	time_t created_at;
 } __attribute__((__packed__)) post;
 
+typedef struct post_cols {
+	pg_col id, oleg_key, fourchan_post_id, fourchan_post_no, thread_id, board;
+	pg_col body_content, replied_to, created_at;
+} post_cols;
+
+typedef struct post_row {
+	uint64_t id;
+	uint64_t thread_id;
+	uint64_t fourchan_post_id;
+	uint64_t fourchan_post_no;
+	time_t created_at;
+	const char *oleg_key;
+	const char *board;
+	const char *body_content;
+	/* pg_get_int_array() on replied_to for the numbers themselves. */
+	unsigned int replied_to_count;
+} post_row;
+
+void post_cols_init(post_cols *cols, const PGresult *res);
+void post_row_get(post_row *row, const post_cols *cols, const PGresult *res, const int idx);
+
+/* Post numbers quoted (>>12345, HTML escaped or not) in a post's body, each
+ * once and in the order they first show up. Returns how many, at most max. */
+#define POST_MAX_QUOTES 64
+size_t extract_quote_links(const char *body_content, uint64_t *out, const size_t max);
+
 void create_post_key(const char board[static MAX_BOARD_NAME_SIZE], const char *post_id,
 	char outbuf[static MAX_KEY_SIZE]);
 char *serialize_post(const post *to_serialize);
@@ -0,0 +1,30 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libpq-fe.h>
+
+/* Typed access to result columns, for results in either format but mostly
+ * for binary ones (resultFormat=1), where there's no text to atol(). Look a
+ * column up once per result with pg_col_lookup() and then use it on every
+ * row. A column the query didn't select reads as NULL.
+ */
+typedef struct pg_col {
+	int num; /* -1 if it isn't there. */
+	Oid type;
+	int binary;
+} pg_col;
+
+pg_col pg_col_lookup(const PGresult *res, const char *name);
+
+int pg_isnull(const PGresult *res, const int row, const pg_col col);
+/* Any integer type, numeric and float8 (both truncated), and timestamps as
+ * seconds since the epoch. 0 if NULL. */
+int64_t pg_get_int(const PGresult *res, const int row, const pg_col col);
+int pg_get_bool(const PGresult *res, const int row, const pg_col col);
+/* Points into the result. NULL if NULL. jsonb comes back as its JSON text. */
+const char *pg_get_str(const PGresult *res, const int row, const pg_col col);
+/* A one dimensional integer array (NULLs as 0). Says how many elements it
+ * has, of which the first max go in out. */
+size_t pg_get_int_array(const PGresult *res, const int row, const pg_col col, int64_t *out, const size_t max);
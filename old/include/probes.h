@@ -0,0 +1,36 @@
+// vim: noet ts=4 sw=4
+#pragma once
+
+/* USDT probes for attaching bpftrace/perf to a running binary, see
+ * scripts/bpftrace/. Unattached they're a single nop. We pick these up
+ * whenever <sys/sdt.h> is around (systemtap-sdt-dev on Debian), and they
+ * compile to nothing otherwise or with -DMZBH_NO_PROBES.
+ *
+ * Names use double underscores, which tools show as dashes:
+ * usdt:./mzbh_server:mzbh:route__done, or mzbh:route-done in perf.
+ */
+
+#if !defined(MZBH_NO_PROBES) && defined(__has_include)
+	#if __has_include(<sys/sdt.h>)
+		#include <sys/sdt.h>
+		#define MZBH_HAVE_PROBES 1
+	#endif
+#endif
+
+#ifdef MZBH_HAVE_PROBES
+	#define MZBH_PROBE0(name) DTRACE_PROBE(mzbh, name)
+	#define MZBH_PROBE1(name, a) DTRACE_PROBE1(mzbh, name, a)
+	#define MZBH_PROBE2(name, a, b) DTRACE_PROBE2(mzbh, name, a, b)
+	#define MZBH_PROBE3(name, a, b, c) DTRACE_PROBE3(mzbh, name, a, b, c)
+	#define MZBH_PROBE4(name, a, b, c, d) DTRACE_PROBE4(mzbh, name, a, b, c, d)
+#else
+	/* Referenced but never run, so anything only there for a probe doesn't
+	 * count as unused. */
+	#define _MZBH_USE(x) if (0) { (void)(x); }
+	#define MZBH_PROBE0(name) do {} while (0)
+	#define MZBH_PROBE1(name, a) do { _MZBH_USE(a) } while (0)
+	#define MZBH_PROBE2(name, a, b) do { _MZBH_USE(a) _MZBH_USE(b) } while (0)
+	#define MZBH_PROBE3(name, a, b, c) do { _MZBH_USE(a) _MZBH_USE(b) _MZBH_USE(c) } while (0)
+	#define MZBH_PROBE4(name, a, b, c, d) \
+		do { _MZBH_USE(a) _MZBH_USE(b) _MZBH_USE(c) _MZBH_USE(d) } while (0)
+#endif
@@ -0,0 +1,74 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stdint.h>
+#include <time.h>
+
+#include "common_defs.h"
+
+#define SEARCH_JOB_NUM_THREADS 2
+/* Total number of jobs we keep track of, queued, running or finished. */
+#define SEARCH_JOB_MAX 128
+/* How many unfinished jobs any one client may have at a time. */
+#define SEARCH_JOB_MAX_PER_CLIENT 2
+/* Finished jobs stick around this long (seconds) so they can be polled. */
+#define SEARCH_JOB_EXPIRY 300
+/* Longest a long-poll request will block an HTTP worker for, in seconds. */
+#define SEARCH_JOB_LONG_POLL 20
+
+#define SEARCH_JOB_MAX_URL_SIZE 1024
+#define SEARCH_JOB_MAX_CLIENT_SIZE 64
+
+typedef enum {
+	SEARCH_JOB_FREE = 0,
+	SEARCH_JOB_QUEUED,
+	SEARCH_JOB_RUNNING,
+	SEARCH_JOB_DONE,
+	SEARCH_JOB_FAILED
+} search_job_state;
+
+/* Returned from search_job_submit(). */
+typedef enum {
+	SEARCH_JOB_OK = 0,
+	SEARCH_JOB_ERR_FULL,
+	SEARCH_JOB_ERR_CLIENT_LIMIT,
+	SEARCH_JOB_ERR_BAD_URL
+} search_job_rc;
+
+typedef struct search_job {
+	uint64_t id;
+	search_job_state state;
+	char client[SEARCH_JOB_MAX_CLIENT_SIZE];
+	char url[SEARCH_JOB_MAX_URL_SIZE];
+	char error[128];
+	time_t finished_at;
+
+	/* Results, valid once state is SEARCH_JOB_DONE. */
+	int found;
+	int is_alias;
+	char filename[MAX_IMAGE_FILENAME_SIZE];
+	char board[MAX_BOARD_NAME_SIZE];
+	uint64_t thread_id;
+	uint64_t post_id;
+	char *post_content;
+	/* Thumbnail of the uploaded file itself, under /static/user_thumbs/. */
+	char upload_thumbnail[MAX_IMAGE_FILENAME_SIZE];
+} search_job;
+
+/* Spins up the worker pool that fetches, hashes and looks up submitted URLs.
+ * Returns 0 on success.
+ */
+int search_jobs_start(const unsigned int num_threads);
+
+/* Queues a search for url on behalf of client. The new job's ID is written to
+ * out_id.
+ */
+search_job_rc search_job_submit(const char *client, const char *url, uint64_t *out_id);
+
+/* Copies the current state of job id into out, waiting up to timeout seconds
+ * for it to finish first. Returns 0 if the job exists. The copy must be
+ * released with search_job_snapshot_free().
+ */
+int search_job_get(const uint64_t id, const unsigned int timeout, search_job *out);
+void search_job_snapshot_free(search_job *snapshot);
+
+const char *search_job_state_name(const search_job_state state);
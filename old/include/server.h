@@ -4,12 +4,13 @@
 #include "utils.h"
 
 #define DEFAULT_NUM_THREADS 2
+#define RESULTS_PER_PAGE 160
+/* Still URL encoded, NUL included. */
+#define TEXT_SEARCH_MAX_QUERY 256
 
-/* Used for sorting files inside of directories. */
-struct file_and_time {
-	char fname[MAX_IMAGE_FILENAME_SIZE];
-	const time_t ctime;
-};
+/* Not handlers, but the bench target wants to time them. */
+char *thumbnail_for_image(const char *argument);
+void get_webm_from_board(char file_name_decoded[static MAX_IMAGE_FILENAME_SIZE], const m38_http_request *request);
 
 int static_handler(const m38_http_request *request, m38_http_response *response);
 int user_thumbs_static_handler(const m38_http_request *request, m38_http_response *response);
@@ -19,11 +20,27 @@ int webm_handler(const m38_http_request *request, m38_http_response *response);
 int by_alias_handler(const m38_http_request *request, m38_http_response *response);
 int board_handler(const m38_http_request *request, m38_http_response *response);
 int paged_board_handler(const m38_http_request *request, m38_http_response *response);
+int filtered_board_handler(const m38_http_request *request, m38_http_response *response);
 int favicon_handler(const m38_http_request *request, m38_http_response *response);
 int robots_handler(const m38_http_request *request, m38_http_response *response);
 int by_thread_handler(const m38_http_request *request, m38_http_response *response);
+/* /newest and /newest.json, every board's files newest first out of
+ * meta_snapshot.h, with /newest/<cursor> and /newest.json?after=<cursor> for
+ * the pages after. */
+int newest_handler(const m38_http_request *request, m38_http_response *response);
+int paged_newest_handler(const m38_http_request *request, m38_http_response *response);
+int newest_json_handler(const m38_http_request *request, m38_http_response *response);
+int paged_newest_json_handler(const m38_http_request *request, m38_http_response *response);
 int url_search_handler(const m38_http_request *request, m38_http_response *response);
+int search_job_handler(const m38_http_request *request, m38_http_response *response);
+int search_job_wait_handler(const m38_http_request *request, m38_http_response *response);
+/* /search/text.json?q=... over text_index.h. */
+int text_search_handler(const m38_http_request *request, m38_http_response *response);
+/* /search/filename.json?q=... over filename_index.h. */
+int filename_search_handler(const m38_http_request *request, m38_http_response *response);
 
 int api_index_stats(const m38_http_request *request, m38_http_response *response);
+int metrics_handler(const m38_http_request *request, m38_http_response *response);
 
+int admin_trace_handler(const m38_http_request *request, m38_http_response *response);
 int admin_index_handler(const m38_http_request *request, m38_http_response *response);
@@ -0,0 +1,63 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libpq-fe.h>
+
+/* Full text search over post bodies. The downloader tokenizes posts it hasn't
+ * seen yet (tags stripped, lowercased) and folds them into an inverted index
+ * under WFU_WEBMS_DIR, which the server mmaps and searches.
+ *
+ * The index is a base file, .text_index, plus numbered segments written on
+ * top of it, .text_index.1, .text_index.2 and so on. Each is a sorted table of
+ * fixed size term entries, the IDs of posts below its watermark that weren't
+ * there yet, then the posting lists: post IDs ascending, each as a varint of
+ * the gap from the one before plus a varint of how many times the term shows
+ * up in it. An update only writes what it found as a new segment, and once
+ * there are more than TEXT_INDEX_MAX_SEGMENTS of them they all get merged
+ * into the base (to a .tmp, then renamed over).
+ *
+ * A post whose transaction commits after a later one's turns up below the
+ * watermark, so the IDs skipped on the way up are kept for a while and the
+ * next update looks for them again.
+ */
+#define TEXT_INDEX_FILE ".text_index"
+#define TEXT_INDEX_MAGIC "MZTEXT02"
+/* Longer terms get cut down to this, NUL included. */
+#define TEXT_INDEX_MAX_TERM 24
+/* Posts per query when catching up from the DB. */
+#define TEXT_INDEX_PAGE 20000
+/* Posts held in memory before they get written out. */
+#define TEXT_INDEX_FLUSH_POSTS 500000
+/* Segments on top of the base before they get merged into it. */
+#define TEXT_INDEX_MAX_SEGMENTS 8
+/* How far under the watermark a skipped ID still gets looked for, and how
+ * many of them get kept. */
+#define TEXT_INDEX_RESCAN 5000
+#define TEXT_INDEX_MAX_GAPS 4096
+#define TEXT_INDEX_MAX_QUERY_TERMS 8
+#define TEXT_INDEX_MAX_RESULTS 50
+
+typedef struct text_hit {
+	unsigned int post_id;
+	float score;
+} text_hit;
+
+/* Returns a pointer just past the next term in text, which goes in term, or
+ * NULL once there aren't any more. Skips tags, entities and bare numbers. */
+const char *text_next_term(const char *text, char term[static TEXT_INDEX_MAX_TERM]);
+
+/* Indexes every post added since the last update. Returns 0 on success. */
+int text_index_update();
+/* Indexes rows of (id, body_content) in ID order, skipping any it already
+ * has. text_index_update() without the DB, for tests. */
+int text_index_add_posts(const PGresult *res);
+
+/* Ranked best first, posts that have every term in query. Returns how many
+ * went in out. Picks up a newer file on its own. */
+size_t text_index_search(const char *query, text_hit *out, const size_t max);
+/* Drops the mappings, if there are any. */
+void text_index_close();
+/* Closes and deletes the base and every segment. */
+void text_index_remove();
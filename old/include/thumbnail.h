@@ -0,0 +1,40 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stddef.h>
+
+#include "common_defs.h"
+
+/* Thumbnails are scaled to fit in a box this big, same as 4chan's. */
+#define THUMBNAIL_MAX_DIMENSION 250
+/* MJPEG qscale, lower is better. */
+#define THUMBNAIL_QSCALE 4
+/* Upper bound on thumbnail workers, regardless of how many cores we have. */
+#define THUMBNAIL_MAX_THREADS 4
+/* Jobs waiting for a worker. thumbnail_enqueue() fails once this is full. */
+#define THUMBNAIL_QUEUE_SIZE 256
+/* Workers run at this niceness so they never starve the server or crawler. */
+#define THUMBNAIL_NICENESS 10
+
+/* Decodes the first keyframe of a webm, scales it down and writes it to
+ * out_filepath as a JPEG. Does nothing if the thumbnail already exists.
+ * Returns the size of the thumbnail, or 0 on failure.
+ */
+size_t create_thumbnail_for_webm(const char webm_file_path[static MAX_IMAGE_FILENAME_SIZE], const char *out_filepath);
+
+/* ./webms/b/123_cat.webm -> ./webms/b/t/thumb_123_cat.jpg, creating the t/
+ * directory if need be. */
+void get_thumb_path_for_webm(const char *webm_file_path, char out[static MAX_IMAGE_FILENAME_SIZE]);
+
+/* Number of workers to use, from WFU_THUMB_THREADS or the number of CPUs. */
+unsigned int thumbnail_default_threads();
+
+/* Starts the thumbnail worker pool. Returns 0 on success. */
+int thumbnail_pool_start(const unsigned int num_threads);
+
+/* Queues a thumbnail to be generated. Returns 0 on success, or -1 if the
+ * queue is full and the caller should generate it themselves.
+ */
+int thumbnail_enqueue(const char *webm_file_path, const char *out_filepath);
+
+/* Blocks until every queued thumbnail has been written. */
+void thumbnail_pool_drain();
@@ -0,0 +1,71 @@
+// vim: noet ts=4 sw=4
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* Always-on timing for the things that matter: route handlers, queries,
+ * hashing, template rendering and fetches. Each thread records into its own
+ * histograms with no locks, and readers add them all up when asked.
+ */
+
+/* Distinct span names we'll keep track of. Anything past this isn't recorded. */
+#define TRACE_MAX_SPANS 128
+/* Completed spans each thread remembers, for looking at nesting. */
+#define TRACE_RING_SIZE 128
+
+/* Histograms are log-linear like HDR histograms: every power of two is split
+ * into 2^TRACE_SUB_BUCKET_BITS buckets, so values are kept to within 12.5%. */
+#define TRACE_SUB_BUCKET_BITS 3
+#define TRACE_SUB_BUCKETS (1 << TRACE_SUB_BUCKET_BITS)
+#define TRACE_HIST_BUCKETS ((64 - TRACE_SUB_BUCKET_BITS + 1) * TRACE_SUB_BUCKETS)
+
+typedef struct trace_span {
+	unsigned int id;
+	unsigned int depth;
+	uint64_t start_ns;
+	struct trace_span *parent;
+} trace_span;
+
+typedef struct trace_histogram {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint64_t buckets[TRACE_HIST_BUCKETS];
+} trace_histogram;
+
+/* A span that finished recently, as kept in the per-thread rings. */
+typedef struct trace_record {
+	unsigned int thread;
+	unsigned int id;
+	unsigned int parent_id;
+	unsigned int depth;
+	uint64_t start_ns;
+	uint64_t duration_ns;
+} trace_record;
+
+/* Sentinel parent_id for spans with no parent. */
+#define TRACE_NO_PARENT ((unsigned int)-1)
+
+uint64_t trace_now_ns();
+
+/* Starts a span on this thread, nested under whatever span is already open.
+ * name must outlive the process, a string literal or __func__ is ideal. Spans
+ * must end in the reverse order they began.
+ */
+void trace_begin(trace_span *span, const char *name);
+void trace_end(trace_span *span);
+
+/* Records a duration directly, for things we time some other way. */
+void trace_record_ns(const char *name, const uint64_t duration_ns);
+
+/* Reading things back out. Safe to call while other threads record. */
+unsigned int trace_span_count();
+const char *trace_span_name(const unsigned int id);
+void trace_merge_histogram(const unsigned int id, trace_histogram *out);
+uint64_t trace_histogram_percentile(const trace_histogram *hist, const double percentile);
+/* Upper bound of the values that land in a bucket. */
+uint64_t trace_bucket_upper_ns(const unsigned int bucket);
+/* Copies up to max recently finished spans from every thread, oldest
+ * first per thread. Returns how many were copied. */
+size_t trace_recent_spans(trace_record *out, const size_t max);
@@ -29,11 +29,6 @@ int get_non_colliding_image_file_path(char fname[static MAX_IMAGE_FILENAME_SIZE]
 void get_thumb_filename(char thumb_filename[static MAX_IMAGE_FILENAME_SIZE], const struct post_match *p_match);
 void ensure_thumb_directory(const struct post_match *p_match);
 
-int hash_string(const unsigned char *string, const size_t siz, char outbuf[static HASH_IMAGE_STR_SIZE]);
-int hash_file(const char *filepath, char outbuf[static HASH_IMAGE_STR_SIZE]);
-
 int hash_string_fnv1a(const unsigned char *string, const size_t siz, char outbuf[static HASH_IMAGE_STR_SIZE]);
 char *get_full_path_for_webm(const char current_board[MAX_BOARD_NAME_SIZE], const char file_name_decoded[MAX_IMAGE_FILENAME_SIZE]);
 char *get_full_path_for_file(const char *dir, const char file_name[static MAX_IMAGE_FILENAME_SIZE]);
-
-size_t create_thumbnail_for_webm(const char webm_file_path[static MAX_IMAGE_FILENAME_SIZE], const char *out_filepath);
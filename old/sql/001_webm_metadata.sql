@@ -0,0 +1,15 @@
+-- Container metadata pulled out of the EBML headers at ingest. NULL has_audio
+-- means we haven't looked yet, see the backfill tool.
+BEGIN;
+
+ALTER TABLE webms ADD COLUMN IF NOT EXISTS duration_ms BIGINT;
+ALTER TABLE webms ADD COLUMN IF NOT EXISTS width INTEGER;
+ALTER TABLE webms ADD COLUMN IF NOT EXISTS height INTEGER;
+ALTER TABLE webms ADD COLUMN IF NOT EXISTS video_codec TEXT;
+ALTER TABLE webms ADD COLUMN IF NOT EXISTS audio_codec TEXT;
+ALTER TABLE webms ADD COLUMN IF NOT EXISTS has_audio BOOLEAN;
+
+CREATE INDEX IF NOT EXISTS webms_board_duration_idx ON webms (board, duration_ms);
+CREATE INDEX IF NOT EXISTS webms_missing_metadata_idx ON webms (id) WHERE has_audio IS NULL;
+
+COMMIT;
@@ -0,0 +1,7 @@
+-- Which algorithm made each file_hash. Everything before this was bmw256.
+BEGIN;
+
+ALTER TABLE webms ADD COLUMN IF NOT EXISTS hash_algorithm TEXT NOT NULL DEFAULT 'bmw256';
+ALTER TABLE webm_aliases ADD COLUMN IF NOT EXISTS hash_algorithm TEXT NOT NULL DEFAULT 'bmw256';
+
+COMMIT;
@@ -0,0 +1,10 @@
+-- Cheap first pass for dedupe, see hash_fingerprint_file(). Run ./backfill to
+-- fill it in for existing webms; until then they match on size alone.
+BEGIN;
+
+ALTER TABLE webms ADD COLUMN IF NOT EXISTS fingerprint TEXT;
+
+CREATE INDEX IF NOT EXISTS webms_size_fingerprint_idx ON webms (size, fingerprint);
+CREATE INDEX IF NOT EXISTS webms_missing_fingerprint_idx ON webms (id) WHERE fingerprint IS NULL;
+
+COMMIT;
@@ -0,0 +1,71 @@
+-- Hashes as 32 bytes instead of 64 characters of hex, and threads and posts
+-- keyed on (board_id, number) instead of oleg_key strings like PSTwsg1234.
+-- The old columns stay and are still written, and lookups fall back to them
+-- for rows this didn't fill in (WFU_LEGACY_KEYS=0 stops that), so writers can
+-- be upgraded one at a time. They get dropped once nothing reads them.
+BEGIN;
+
+CREATE TABLE IF NOT EXISTS boards (
+	id SMALLSERIAL PRIMARY KEY,
+	name TEXT NOT NULL UNIQUE
+);
+
+INSERT INTO boards (name)
+	SELECT board FROM (
+		SELECT board FROM threads UNION SELECT board FROM posts
+		UNION SELECT board FROM webms UNION SELECT board FROM webm_aliases
+	) AS b
+	WHERE board IS NOT NULL
+	ON CONFLICT DO NOTHING;
+
+-- webms
+ALTER TABLE webms ADD COLUMN IF NOT EXISTS file_hash_bin BYTEA
+	CHECK (octet_length(file_hash_bin) = 32);
+
+UPDATE webms SET file_hash_bin = decode(file_hash, 'hex')
+	WHERE file_hash_bin IS NULL AND file_hash ~ '^[0-9A-F]{64}$';
+
+CREATE UNIQUE INDEX IF NOT EXISTS webms_file_hash_bin_idx ON webms (file_hash_bin);
+
+-- webm_aliases: key_bin is the two hashes in an alias<bmw256><fnv1a> key, see
+-- alias_key_to_bin().
+ALTER TABLE webm_aliases ADD COLUMN IF NOT EXISTS file_hash_bin BYTEA
+	CHECK (octet_length(file_hash_bin) = 32);
+ALTER TABLE webm_aliases ADD COLUMN IF NOT EXISTS key_bin BYTEA
+	CHECK (octet_length(key_bin) = 40);
+
+UPDATE webm_aliases SET file_hash_bin = decode(file_hash, 'hex')
+	WHERE file_hash_bin IS NULL AND file_hash ~ '^[0-9A-F]{64}$';
+UPDATE webm_aliases
+	SET key_bin = decode(substr(oleg_key, 6, 64), 'hex')
+		|| decode(lpad(substr(oleg_key, 70), 16, '0'), 'hex')
+	WHERE key_bin IS NULL AND oleg_key ~ '^alias[0-9A-F]{65,80}$';
+
+CREATE INDEX IF NOT EXISTS webm_aliases_key_bin_idx ON webm_aliases (key_bin);
+
+-- threads
+ALTER TABLE threads ADD COLUMN IF NOT EXISTS board_id SMALLINT REFERENCES boards (id);
+ALTER TABLE threads ADD COLUMN IF NOT EXISTS thread_no BIGINT;
+
+UPDATE threads AS t
+	SET board_id = b.id, thread_no = substr(t.oleg_key, 5 + length(t.board))::BIGINT
+	FROM boards AS b
+	WHERE b.name = t.board AND t.board_id IS NULL
+		AND left(t.oleg_key, 4 + length(t.board)) = 'THRD' || t.board
+		AND substr(t.oleg_key, 5 + length(t.board)) ~ '^[0-9]{1,18}$';
+
+CREATE UNIQUE INDEX IF NOT EXISTS threads_board_thread_no_idx ON threads (board_id, thread_no);
+
+-- posts: oleg_key has the post's date in it rather than its number, but
+-- either picks out one post. Old rows without a post number keep going by key.
+ALTER TABLE posts ADD COLUMN IF NOT EXISTS board_id SMALLINT REFERENCES boards (id);
+ALTER TABLE posts ADD COLUMN IF NOT EXISTS post_no BIGINT;
+
+UPDATE posts AS p
+	SET board_id = b.id, post_no = NULLIF(p.fourchan_post_no, 0)
+	FROM boards AS b
+	WHERE b.name = p.board AND p.board_id IS NULL;
+
+CREATE INDEX IF NOT EXISTS posts_board_post_no_idx ON posts (board_id, post_no);
+
+COMMIT;
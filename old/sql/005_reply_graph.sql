@@ -0,0 +1,18 @@
+-- Post numbers each post quotes (>>12345), pulled out of body_content when
+-- it's saved, see extract_quote_links(). Replaces replied_to_keys, which was
+-- always an empty JSON list. It stays until nothing reads it.
+BEGIN;
+
+ALTER TABLE posts ADD COLUMN IF NOT EXISTS replied_to BIGINT[] NOT NULL DEFAULT '{}';
+
+-- Same rules as the C side, more or less. Good enough for old rows.
+UPDATE posts
+	SET replied_to = ARRAY(
+		SELECT DISTINCT m[1]::BIGINT
+		FROM regexp_matches(body_content, '(?:&gt;&gt;|>>)([0-9]{1,18})(?![0-9])', 'g') AS m)
+	WHERE replied_to = '{}' AND body_content ~ '(&gt;&gt;|>>)[0-9]';
+
+-- "Who replied to this" is replied_to @> ARRAY[post_no].
+CREATE INDEX IF NOT EXISTS posts_replied_to_idx ON posts USING GIN (replied_to);
+
+COMMIT;
@@ -0,0 +1,9 @@
+-- Fingerprints used to sample the whole file, but bmw256 hashes only cover
+-- its first eighth, so files that were the same as far as the hash went could
+-- look new. They only sample that eighth now, and the old ones don't compare
+-- with the new. Run ./backfill afterwards; until then they match on size alone.
+BEGIN;
+
+UPDATE webms SET fingerprint = NULL WHERE fingerprint IS NOT NULL;
+
+COMMIT;
@@ -0,0 +1,284 @@
+// vim: noet ts=4 sw=4
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "async_log.h"
+#include "utils.h"
+
+/* How much the writer gathers up before each write(). */
+#define _BATCH_SIZE (64 * 1024)
+/* Call sites each thread tracks for sampling. Collisions just reset the
+ * count, which errs on the side of logging. */
+#define _SAMPLE_SLOTS 32
+
+typedef struct _log_slot {
+	uint64_t ts_ns;
+	LOG_LEVEL level;
+	char msg[LOG_MSG_SIZE];
+} _log_slot;
+
+/* Single producer (the owning thread), single consumer (whoever holds
+ * _drain_lock). Never freed, same as the trace histograms. */
+typedef struct _log_ring {
+	_log_slot slots[LOG_RING_SIZE];
+	uint64_t head;
+	uint64_t tail;
+	uint64_t dropped;
+	uint64_t dropped_reported;
+	struct _log_ring *next;
+} _log_ring;
+
+typedef struct _sample {
+	const char *fmt;
+	uint64_t second;
+	unsigned int count;
+	unsigned int suppressed;
+} _sample;
+
+LOG_LEVEL log_level = LOG_DB;
+
+static _log_ring *_rings = NULL;
+static pthread_mutex_t _rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t _drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static int _started = 0;
+static uint64_t _dropped_total = 0;
+static uint64_t _sampled_total = 0;
+
+static __thread _log_ring *_self = NULL;
+static __thread _sample _samples[_SAMPLE_SLOTS];
+
+static const char *_level_names[] = {"DB", "INFO", "WARN", "ERR", "FUN"};
+
+static uint64_t _now_ns() {
+	struct timespec spec;
+	clock_gettime(CLOCK_REALTIME_COARSE, &spec);
+	return (uint64_t)spec.tv_sec * 1000000000ULL + spec.tv_nsec;
+}
+
+static void _write_all(const char *buf, size_t len) {
+	while (len > 0) {
+		const ssize_t written = write(STDOUT_FILENO, buf, len);
+		if (written <= 0)
+			return;
+		buf += written;
+		len -= written;
+	}
+}
+
+/* "[2016-01-01 00:00:00] WARN: msg\n" into out, which has to have room for
+ * LOG_MSG_SIZE plus the prefix. */
+static size_t _format_line(char *out, const size_t out_size, const uint64_t ts_ns,
+		const LOG_LEVEL level, const char *msg) {
+	const time_t seconds = ts_ns / 1000000000ULL;
+	struct tm tm;
+	localtime_r(&seconds, &tm);
+
+	char stamp[32] = {0};
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+
+	const char *level_name = (unsigned int)level < sizeof(_level_names)/sizeof(_level_names[0]) ?
+		_level_names[level] : "???";
+	const int len = snprintf(out, out_size, "[%s] %s: %s\n", stamp, level_name, msg);
+	if (len < 0)
+		return 0;
+	return (size_t)len < out_size ? (size_t)len : out_size - 1;
+}
+
+static _log_ring *_get_ring() {
+	if (_self)
+		return _self;
+
+	_log_ring *ring = calloc(1, sizeof(_log_ring));
+	if (!ring)
+		return NULL;
+
+	pthread_mutex_lock(&_rings_lock);
+	ring->next = _rings;
+	__atomic_store_n(&_rings, ring, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&_rings_lock);
+
+	_self = ring;
+	return ring;
+}
+
+static void _emitv(const LOG_LEVEL level, const uint64_t ts_ns, const char *fmt, va_list args) {
+	_log_ring *ring = __atomic_load_n(&_started, __ATOMIC_ACQUIRE) ? _get_ring() : NULL;
+
+	if (!ring) {
+		char msg[LOG_MSG_SIZE] = {0};
+		char line[LOG_MSG_SIZE + 64] = {0};
+		vsnprintf(msg, sizeof(msg), fmt, args);
+		_write_all(line, _format_line(line, sizeof(line), ts_ns, level, msg));
+		return;
+	}
+
+	const uint64_t head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+		__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&_dropped_total, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	_log_slot *slot = &ring->slots[head % LOG_RING_SIZE];
+	slot->ts_ns = ts_ns;
+	slot->level = level;
+	vsnprintf(slot->msg, sizeof(slot->msg), fmt, args);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void _emit(const LOG_LEVEL level, const uint64_t ts_ns, const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	_emitv(level, ts_ns, fmt, args);
+	va_end(args);
+}
+
+/* Call sites are told apart by their format string. Once one has logged
+ * LOG_SAMPLE_BURST times in a second the rest are counted instead, and the
+ * count goes out the next time that call site logs. */
+static int _should_log(const LOG_LEVEL level, const char *fmt, const uint64_t ts_ns) {
+	const uint64_t second = ts_ns / 1000000000ULL;
+	_sample *sample = &_samples[((uintptr_t)fmt >> 3) % _SAMPLE_SLOTS];
+
+	if (sample->fmt != fmt || sample->second != second) {
+		if (sample->suppressed > 0)
+			_emit(level, ts_ns, "Skipped %u more messages like \"%.64s\".",
+					sample->suppressed, sample->fmt);
+		sample->fmt = fmt;
+		sample->second = second;
+		sample->count = 0;
+		sample->suppressed = 0;
+	}
+
+	if (++sample->count > LOG_SAMPLE_BURST) {
+		sample->suppressed++;
+		__atomic_fetch_add(&_sampled_total, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	return 1;
+}
+
+void log_msg_unfiltered(const LOG_LEVEL level, const char *fmt, ...) {
+	const uint64_t ts_ns = _now_ns();
+	if (!_should_log(level, fmt, ts_ns))
+		return;
+
+	va_list args;
+	va_start(args, fmt);
+	_emitv(level, ts_ns, fmt, args);
+	va_end(args);
+}
+
+/* Empties every ring into as few write()s as we can get away with. Returns
+ * how many messages went out. */
+static size_t _drain() {
+	static char batch[_BATCH_SIZE];
+	const size_t line_max = LOG_MSG_SIZE + 64;
+	size_t used = 0, drained = 0;
+
+	pthread_mutex_lock(&_drain_lock);
+
+	_log_ring *ring;
+	for (ring = __atomic_load_n(&_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		const uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64_t tail = ring->tail;
+
+		for (; tail < head; tail++) {
+			if (used + line_max > sizeof(batch)) {
+				_write_all(batch, used);
+				used = 0;
+			}
+
+			const _log_slot *slot = &ring->slots[tail % LOG_RING_SIZE];
+			used += _format_line(batch + used, line_max, slot->ts_ns, slot->level, slot->msg);
+			drained++;
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		const uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != ring->dropped_reported) {
+			if (used + line_max > sizeof(batch)) {
+				_write_all(batch, used);
+				used = 0;
+			}
+
+			char msg[LOG_MSG_SIZE] = {0};
+			snprintf(msg, sizeof(msg), "Log ring full, dropped %"PRIu64" messages.",
+					dropped - ring->dropped_reported);
+			used += _format_line(batch + used, line_max, _now_ns(), LOG_WARN, msg);
+			ring->dropped_reported = dropped;
+		}
+	}
+
+	_write_all(batch, used);
+	pthread_mutex_unlock(&_drain_lock);
+
+	return drained;
+}
+
+static void *_writer(void *arg) {
+	UNUSED(arg);
+	const struct timespec idle = {
+		.tv_sec = 0,
+		.tv_nsec = LOG_IDLE_SLEEP_MS * 1000000L
+	};
+
+	while (1) {
+		if (_drain() == 0)
+			nanosleep(&idle, NULL);
+	}
+
+	return NULL;
+}
+
+void log_flush() {
+	_drain();
+}
+
+static void _level_from_env() {
+	const char *env = getenv("WFU_LOG_LEVEL");
+	if (!env)
+		return;
+
+	if (strcmp(env, "db") == 0)
+		log_level = LOG_DB;
+	else if (strcmp(env, "info") == 0)
+		log_level = LOG_INFO;
+	else if (strcmp(env, "warn") == 0)
+		log_level = LOG_WARN;
+	else if (strcmp(env, "err") == 0)
+		log_level = LOG_ERR;
+}
+
+int log_start() {
+	if (__atomic_load_n(&_started, __ATOMIC_ACQUIRE))
+		return 0;
+
+	_level_from_env();
+
+	pthread_t writer;
+	if (pthread_create(&writer, NULL, _writer, NULL) != 0) {
+		log_msg(LOG_ERR, "Could not start the log writer, logging synchronously.");
+		return -1;
+	}
+	pthread_detach(writer);
+
+	atexit(log_flush);
+	__atomic_store_n(&_started, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+uint64_t log_dropped_total() {
+	return __atomic_load_n(&_dropped_total, __ATOMIC_RELAXED);
+}
+
+uint64_t log_sampled_total() {
+	return __atomic_load_n(&_sampled_total, __ATOMIC_RELAXED);
+}
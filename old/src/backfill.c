@@ -0,0 +1,159 @@
+// vim: noet ts=4 sw=4
+#ifdef __clang__
+	#pragma clang diagnostic ignored "-Wmissing-field-initializers"
+#endif
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "async_log.h"
+#include "db.h"
+#include "ebml.h"
+#include "hashing.h"
+#include "models.h"
+
+/* Rows handed out to the workers at a time. */
+#define BACKFILL_BATCH_SIZE 1000
+
+/* Reads EBML headers and fingerprints every webm that was ingested before we
+ * did those at ingest time. Main thread pulls a batch of rows, workers claim
+ * rows from it one at a time.
+ */
+typedef struct backfill_batch {
+	const PGresult *res;
+	int next_row;
+	int num_rows;
+	unsigned int parsed;
+	unsigned int failed;
+	pthread_mutex_t lock;
+} backfill_batch;
+
+static void *_backfill_worker(void *arg) {
+	backfill_batch *batch = (backfill_batch *)arg;
+	const int id_col = PQfnumber(batch->res, "id");
+	const int file_path_col = PQfnumber(batch->res, "file_path");
+	const int needs_metadata_col = PQfnumber(batch->res, "needs_metadata");
+	const int needs_fingerprint_col = PQfnumber(batch->res, "needs_fingerprint");
+
+	while (1) {
+		pthread_mutex_lock(&batch->lock);
+		const int row = batch->next_row++;
+		pthread_mutex_unlock(&batch->lock);
+
+		if (row >= batch->num_rows)
+			break;
+
+		const unsigned int id = (unsigned int)atol(PQgetvalue(batch->res, row, id_col));
+		const char *file_path = PQgetvalue(batch->res, row, file_path_col);
+
+		int ok = 1;
+		if (PQgetvalue(batch->res, row, needs_metadata_col)[0] == 't') {
+			webm_metadata metadata = {0};
+			ok = parse_webm_metadata(file_path, &metadata) && update_webm_metadata(id, &metadata);
+		}
+
+		if (PQgetvalue(batch->res, row, needs_fingerprint_col)[0] == 't') {
+			size_t size = 0;
+			char fingerprint[HASH_IMAGE_STR_SIZE] = {0};
+			ok = hash_fingerprint_file(file_path, &size, fingerprint) &&
+				update_webm_fingerprint(id, fingerprint) && ok;
+		}
+
+		pthread_mutex_lock(&batch->lock);
+		if (ok)
+			batch->parsed++;
+		else
+			batch->failed++;
+		pthread_mutex_unlock(&batch->lock);
+
+		if (!ok)
+			log_msg(LOG_WARN, "Could not backfill webm %u (%s).", id, file_path);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads <= 0)
+		num_threads = 1;
+
+	int i;
+	for (i = 1; i < argc; i++) {
+		const char *cur_arg = argv[i];
+		if (strncmp(cur_arg, "-t", strlen("-t")) == 0) {
+			if ((i + 1) < argc) {
+				num_threads = strtol(argv[++i], NULL, 10);
+				if (num_threads <= 0) {
+					log_msg(LOG_ERR, "Thread count must be at least 1.");
+					return -1;
+				}
+			} else {
+				log_msg(LOG_ERR, "Not enough arguments to -t.");
+				return -1;
+			}
+		}
+	}
+
+	pthread_t *workers = calloc(num_threads, sizeof(pthread_t));
+	if (!workers)
+		return -1;
+
+	log_msg(LOG_INFO, "Backfilling webm metadata and fingerprints with %ld threads.", num_threads);
+
+	unsigned int after_id = 0, total_parsed = 0, total_failed = 0;
+	while (1) {
+		PGresult *res = get_webms_to_backfill(after_id, BACKFILL_BATCH_SIZE);
+		if (!res) {
+			log_msg(LOG_ERR, "Could not get webms to backfill.");
+			free(workers);
+			return -1;
+		}
+
+		const int num_rows = PQntuples(res);
+		if (num_rows == 0) {
+			PQclear(res);
+			break;
+		}
+
+		backfill_batch batch = {
+			.res = res,
+			.next_row = 0,
+			.num_rows = num_rows,
+			.lock = PTHREAD_MUTEX_INITIALIZER
+		};
+
+		long started = 0;
+		for (started = 0; started < num_threads; started++) {
+			if (pthread_create(&workers[started], NULL, _backfill_worker, &batch) != 0) {
+				log_msg(LOG_ERR, "Could not start backfill worker %ld.", started);
+				break;
+			}
+		}
+
+		/* Even with no workers at all we'd just come back to the same rows. */
+		if (started == 0) {
+			PQclear(res);
+			free(workers);
+			return -1;
+		}
+
+		long j;
+		for (j = 0; j < started; j++)
+			pthread_join(workers[j], NULL);
+
+		after_id = (unsigned int)atol(PQgetvalue(res, num_rows - 1, PQfnumber(res, "id")));
+		total_parsed += batch.parsed;
+		total_failed += batch.failed;
+		PQclear(res);
+
+		log_msg(LOG_INFO, "Backfilled up to webm %u (%u ok, %u failed).",
+				after_id, total_parsed, total_failed);
+	}
+
+	free(workers);
+	log_msg(LOG_INFO, "Done. %u webms backfilled, %u failed.", total_parsed, total_failed);
+	return 0;
+}
@@ -0,0 +1,1163 @@
+// vim: noet ts=4 sw=4
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libpq-fe.h>
+#include <38-moths/38-moths.h>
+
+#include "async_log.h"
+#include "filename_index.h"
+#include "hashing.h"
+#include "http.h"
+#include "meta_snapshot.h"
+#include "models.h"
+#include "parse.h"
+#include "server.h"
+#include "stack.h"
+#include "text_index.h"
+#include "utils.h"
+
+/* Microbenchmarks for the CPU-bound bits of the crawler and server, run
+ * against the fixtures in ./fixtures/ (see scripts/generate_bench_fixtures.py).
+ * Each benchmark is calibrated to take about -t milliseconds per run, run
+ * BENCH_RUNS times, and the median is reported. -j prints one JSON object
+ * per benchmark to stdout for scripts/bench_compare.py, with the table going
+ * to stderr instead.
+ */
+#define BENCH_RUNS 5
+#define BENCH_DEFAULT_RUN_MS 100
+#define BENCH_DEFAULT_MAX_MB 50
+#define BENCH_CHUNK_SIZE 4096
+
+/* Every allocation in the process goes through these, so allocs/op counts
+ * libraries too. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t _allocs = 0;
+
+void *malloc(size_t size) {
+	__atomic_fetch_add(&_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+	__atomic_fetch_add(&_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	__atomic_fetch_add(&_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+typedef struct bench {
+	char name[64];
+	void (*fn)(void *arg);
+	void *arg;
+	/* Input bytes per op, for throughput. 0 if that doesn't mean anything. */
+	size_t bytes;
+} bench;
+
+typedef struct bench_options {
+	const char *fixtures_dir;
+	unsigned int run_ms;
+	unsigned int max_mb;
+	int json;
+	char **filters;
+	int num_filters;
+} bench_options;
+
+static uint64_t _now_ns() {
+	struct timespec spec;
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+	return (uint64_t)spec.tv_sec * 1000000000ULL + spec.tv_nsec;
+}
+
+static int _compare_doubles(const void *a, const void *b) {
+	const double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static uint64_t _time_iterations(const bench *b, const uint64_t iterations) {
+	const uint64_t start = _now_ns();
+	uint64_t i;
+	for (i = 0; i < iterations; i++)
+		b->fn(b->arg);
+	return _now_ns() - start;
+}
+
+static void _run_bench(const bench *b, const bench_options *opts) {
+	const uint64_t target_ns = (uint64_t)opts->run_ms * 1000000ULL;
+
+	/* Warm up, then grow the iteration count until one run is long enough. */
+	b->fn(b->arg);
+	uint64_t iterations = 1;
+	uint64_t elapsed = _time_iterations(b, iterations);
+	while (elapsed < target_ns) {
+		uint64_t next = elapsed > 0 ? iterations * target_ns / elapsed : iterations * 100;
+		if (next <= iterations)
+			next = iterations * 2;
+		if (next > iterations * 100)
+			next = iterations * 100;
+		iterations = next;
+		elapsed = _time_iterations(b, iterations);
+	}
+
+	double ns_per_op[BENCH_RUNS] = {0};
+	const uint64_t allocs_before = __atomic_load_n(&_allocs, __ATOMIC_RELAXED);
+	unsigned int run;
+	for (run = 0; run < BENCH_RUNS; run++)
+		ns_per_op[run] = (double)_time_iterations(b, iterations) / iterations;
+	const uint64_t allocs = __atomic_load_n(&_allocs, __ATOMIC_RELAXED) - allocs_before;
+
+	qsort(ns_per_op, BENCH_RUNS, sizeof(double), _compare_doubles);
+	const double median = ns_per_op[BENCH_RUNS / 2];
+	const double allocs_per_op = (double)allocs / (iterations * BENCH_RUNS);
+	const double bytes_per_sec = b->bytes ? b->bytes / (median / 1.0e9) : 0;
+
+	FILE *table = opts->json ? stderr : stdout;
+	fprintf(table, "%-32s %12.0f ns/op", b->name, median);
+	if (b->bytes)
+		fprintf(table, " %10.1f MB/s", bytes_per_sec / (1024 * 1024));
+	else
+		fprintf(table, " %15s", "");
+	fprintf(table, " %10.1f allocs/op  (%.0f-%.0f ns, %"PRIu64" ops/run)\n",
+			allocs_per_op, ns_per_op[0], ns_per_op[BENCH_RUNS - 1], iterations);
+
+	if (opts->json)
+		printf("{\"name\":\"%s\",\"iterations\":%"PRIu64",\"runs\":%d,\"ns_per_op\":%.1f,"
+				"\"min_ns_per_op\":%.1f,\"max_ns_per_op\":%.1f,\"bytes_per_sec\":%.0f,"
+				"\"allocs_per_op\":%.2f}\n",
+				b->name, iterations, BENCH_RUNS, median, ns_per_op[0], ns_per_op[BENCH_RUNS - 1],
+				bytes_per_sec, allocs_per_op);
+}
+
+static int _wanted(const bench_options *opts, const char *name) {
+	if (opts->num_filters == 0)
+		return 1;
+
+	int i;
+	for (i = 0; i < opts->num_filters; i++) {
+		if (strstr(name, opts->filters[i]))
+			return 1;
+	}
+	return 0;
+}
+
+static char *_read_fixture(const bench_options *opts, const char *name, size_t *out_len) {
+	char path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	snprintf(path, sizeof(path), "%s/%s", opts->fixtures_dir, name);
+
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		log_msg(LOG_ERR, "Could not open fixture %s.", path);
+		return NULL;
+	}
+
+	fseek(f, 0, SEEK_END);
+	const long len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	char *buf = __libc_malloc(len + 1);
+	if (buf && fread(buf, 1, len, f) != (size_t)len) {
+		free(buf);
+		buf = NULL;
+	}
+	fclose(f);
+
+	if (!buf)
+		return NULL;
+	buf[len] = '\0';
+	*out_len = len;
+	return buf;
+}
+
+/* parse_catalog_json / parse_thread_json */
+
+typedef struct _json_ctx {
+	const char *json;
+	thread_match match;
+} _json_ctx;
+
+static void _free_stack(ol_stack *stack, const int post_matches) {
+	while (stack->next != NULL) {
+		void *data = (void *)spop(&stack);
+		if (post_matches)
+			free(((post_match *)data)->body_content);
+		free(data);
+	}
+	free(stack);
+}
+
+static void _bench_parse_catalog(void *arg) {
+	const _json_ctx *ctx = arg;
+	_free_stack(parse_catalog_json(ctx->json, ctx->match.board), 0);
+}
+
+static void _bench_parse_thread(void *arg) {
+	const _json_ctx *ctx = arg;
+	_free_stack(parse_thread_json(ctx->json, &ctx->match), 1);
+}
+
+/* hash_file / hash_string */
+
+typedef struct _hash_ctx {
+	char path[MAX_IMAGE_FILENAME_SIZE];
+	unsigned char *data;
+	size_t size;
+} _hash_ctx;
+
+static void _bench_hash_file(void *arg) {
+	const _hash_ctx *ctx = arg;
+	char out[HASH_IMAGE_STR_SIZE] = {0};
+	hash_file(ctx->path, out);
+}
+
+static void _bench_hash_fingerprint(void *arg) {
+	const _hash_ctx *ctx = arg;
+	char out[HASH_IMAGE_STR_SIZE] = {0};
+	size_t size = 0;
+	hash_fingerprint_file(ctx->path, &size, out);
+}
+
+static void _bench_hash_string(void *arg) {
+	const _hash_ctx *ctx = arg;
+	char out[HASH_IMAGE_STR_SIZE] = {0};
+	hash_string(ctx->data, ctx->size, out);
+}
+
+/* hash_string_with, one backend each. */
+typedef struct _backend_hash_ctx {
+	const _hash_ctx *input;
+	HASH_BACKEND backend;
+} _backend_hash_ctx;
+
+static void _bench_hash_backend(void *arg) {
+	const _backend_hash_ctx *ctx = arg;
+	char out[HASH_IMAGE_STR_SIZE] = {0};
+	hash_string_with(ctx->backend, ctx->input->data, ctx->input->size, out);
+}
+
+static int _make_hash_input(_hash_ctx *ctx, const size_t size) {
+	ctx->size = size;
+	ctx->data = __libc_malloc(size);
+	if (!ctx->data)
+		return -1;
+
+	/* Fixed xorshift so every run hashes the same bytes. */
+	uint64_t x = 0x38383838;
+	size_t i;
+	for (i = 0; i < size; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		ctx->data[i] = x;
+	}
+
+	snprintf(ctx->path, sizeof(ctx->path), "/tmp/mzbh_bench_XXXXXX");
+	const int fd = mkstemp(ctx->path);
+	if (fd < 0)
+		return -1;
+
+	size_t written = 0;
+	while (written < size) {
+		const ssize_t rc = write(fd, ctx->data + written, size - written);
+		if (rc <= 0) {
+			close(fd);
+			return -1;
+		}
+		written += rc;
+	}
+	close(fd);
+	return 0;
+}
+
+/* url_decode / get_webm_from_board */
+
+#define _ENCODED_NAME "%5Bwsg%5D%20Comfy%20%27loop%27%20%28music%29%20%2B%20more%26stuff%20%E3%83%86.webm"
+
+static void _bench_url_decode(void *arg) {
+	UNUSED(arg);
+	char out[MAX_IMAGE_FILENAME_SIZE] = {0};
+	url_decode(_ENCODED_NAME, strlen(_ENCODED_NAME), out);
+}
+
+static void _bench_get_webm_from_board(void *arg) {
+	const m38_http_request *request = arg;
+	char out[MAX_IMAGE_FILENAME_SIZE] = {0};
+	get_webm_from_board(out, request);
+}
+
+/* receive_chunked_http */
+
+typedef struct _chunked_ctx {
+	char *response;
+	size_t len;
+} _chunked_ctx;
+
+typedef struct _writer_arg {
+	int fd;
+	const char *buf;
+	size_t len;
+} _writer_arg;
+
+static void *_chunked_writer(void *arg) {
+	_writer_arg *w = arg;
+	while (w->len > 0) {
+		const ssize_t rc = write(w->fd, w->buf, w->len);
+		if (rc <= 0)
+			break;
+		w->buf += rc;
+		w->len -= rc;
+	}
+	close(w->fd);
+	return NULL;
+}
+
+/* Writes as much as the socket will take up front, and only starts a
+ * thread for the rest if it didn't all fit. */
+static void _bench_receive_chunked(void *arg) {
+	const _chunked_ctx *ctx = arg;
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+		return;
+
+	const int flags = fcntl(fds[1], F_GETFL);
+	fcntl(fds[1], F_SETFL, flags | O_NONBLOCK);
+	ssize_t sent = write(fds[1], ctx->response, ctx->len);
+	if (sent < 0)
+		sent = 0;
+	fcntl(fds[1], F_SETFL, flags);
+
+	pthread_t writer;
+	_writer_arg w = { .fd = fds[1], .buf = ctx->response + sent, .len = ctx->len - sent };
+	const int threaded = w.len > 0 && pthread_create(&writer, NULL, _chunked_writer, &w) == 0;
+	if (!threaded)
+		close(fds[1]);
+
+	free(receive_chunked_http(fds[0]));
+
+	if (threaded)
+		pthread_join(writer, NULL);
+	close(fds[0]);
+}
+
+static char *_chunk_encode(const char *body, const size_t body_len, size_t *out_len) {
+	const char header[] = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+		"Transfer-Encoding: chunked\r\n\r\n";
+	const size_t max_len = sizeof(header) + body_len + (body_len / BENCH_CHUNK_SIZE + 2) * 16;
+	char *out = __libc_malloc(max_len);
+	if (!out)
+		return NULL;
+
+	size_t len = snprintf(out, max_len, "%s", header);
+	size_t offset;
+	for (offset = 0; offset < body_len; offset += BENCH_CHUNK_SIZE) {
+		const size_t chunk = body_len - offset < BENCH_CHUNK_SIZE ? body_len - offset : BENCH_CHUNK_SIZE;
+		len += snprintf(out + len, max_len - len, "%zx\r\n", chunk);
+		memcpy(out + len, body + offset, chunk);
+		len += chunk;
+		len += snprintf(out + len, max_len - len, "\r\n");
+	}
+	len += snprintf(out + len, max_len - len, "0\r\n\r\n");
+
+	*out_len = len;
+	return out;
+}
+
+/* deserialize_post_from_tuples, and whole results both ways */
+
+typedef struct _tuples_ctx {
+	PGresult *res;
+	unsigned int rows;
+	unsigned int next;
+} _tuples_ctx;
+
+static void _bench_deserialize_post(void *arg) {
+	_tuples_ctx *ctx = arg;
+	post *p = deserialize_post_from_tuples(ctx->res, ctx->next);
+	ctx->next = (ctx->next + 1) % ctx->rows;
+	if (!p)
+		return;
+	free(p->body_content);
+	vector_free(p->replied_to);
+	free(p);
+}
+
+/* What the handlers did before *_row_get(): a heap copy per row. */
+static void _bench_decode_posts_text(void *arg) {
+	_tuples_ctx *ctx = arg;
+	unsigned int i;
+	for (i = 0; i < ctx->rows; i++)
+		_bench_deserialize_post(ctx);
+}
+
+static void _bench_decode_posts_binary(void *arg) {
+	_tuples_ctx *ctx = arg;
+	post_cols cols;
+	post_cols_init(&cols, ctx->res);
+
+	uint64_t sum = 0;
+	unsigned int i;
+	for (i = 0; i < ctx->rows; i++) {
+		post_row row;
+		post_row_get(&row, &cols, ctx->res, i);
+		sum += row.fourchan_post_id + (row.body_content ? (unsigned char)row.body_content[0] : 0);
+	}
+	__asm__ volatile("" : : "r"(sum));
+}
+
+static void _bench_decode_webms_text(void *arg) {
+	_tuples_ctx *ctx = arg;
+	unsigned int i;
+	for (i = 0; i < ctx->rows; i++)
+		free(deserialize_webm_from_tuples(ctx->res, i));
+}
+
+static void _bench_decode_webms_binary(void *arg) {
+	_tuples_ctx *ctx = arg;
+	webm_cols cols;
+	webm_cols_init(&cols, ctx->res);
+
+	uint64_t sum = 0;
+	unsigned int i;
+	for (i = 0; i < ctx->rows; i++) {
+		webm_row row;
+		webm_row_get(&row, &cols, ctx->res, i);
+		sum += row.size + row.duration_ms + (unsigned char)row.filename[0];
+	}
+	__asm__ volatile("" : : "r"(sum));
+}
+
+/* Type oids, and values the way Postgres sends them in each format. */
+#define _INT4OID 23
+#define _INT8OID 20
+#define _BOOLOID 16
+#define _TEXTOID 25
+#define _JSONBOID 3802
+#define _NUMERICOID 1700
+#define _INT8ARRAYOID 1016
+
+typedef struct _tuples_col {
+	const char *name;
+	Oid type;
+} _tuples_col;
+
+static PGresult *_make_tuples(const _tuples_col *columns, const int num_columns, const int binary) {
+	PGresult *res = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+	if (!res)
+		return NULL;
+
+	PGresAttDesc attrs[32];
+	memset(attrs, 0, sizeof(attrs));
+	int col;
+	for (col = 0; col < num_columns; col++) {
+		attrs[col].name = (char *)columns[col].name;
+		attrs[col].typid = columns[col].type;
+		attrs[col].typlen = -1;
+		attrs[col].format = binary;
+	}
+	if (!PQsetResultAttrs(res, num_columns, attrs)) {
+		PQclear(res);
+		return NULL;
+	}
+
+	return res;
+}
+
+static int _set_int(PGresult *res, const int row, const int col, const Oid type,
+		const int binary, const int64_t value) {
+	char buf[32] = {0};
+	if (!binary)
+		return PQsetvalue(res, row, col, buf, snprintf(buf, sizeof(buf), "%"PRId64, value));
+
+	if (type == _INT4OID) {
+		const uint32_t v = htobe32((uint32_t)value);
+		memcpy(buf, &v, sizeof(v));
+		return PQsetvalue(res, row, col, buf, sizeof(v));
+	} else if (type == _INT8OID) {
+		const uint64_t v = htobe64((uint64_t)value);
+		memcpy(buf, &v, sizeof(v));
+		return PQsetvalue(res, row, col, buf, sizeof(v));
+	}
+
+	/* Numeric, like EXTRACT(EPOCH ...) gives: base 10000 digits, most
+	 * significant first. Whole non-negative numbers will do here. */
+	uint16_t digits[8] = {0};
+	int ndigits = 0;
+	uint64_t rest = value;
+	do {
+		memmove(digits + 1, digits, ndigits * sizeof(digits[0]));
+		digits[0] = rest % 10000;
+		ndigits++;
+		rest /= 10000;
+	} while (rest);
+
+	const uint16_t header[] = { htobe16(ndigits), htobe16(ndigits - 1), 0, 0 };
+	memcpy(buf, header, sizeof(header));
+	int i;
+	for (i = 0; i < ndigits; i++) {
+		const uint16_t d = htobe16(digits[i]);
+		memcpy(buf + sizeof(header) + i * 2, &d, sizeof(d));
+	}
+	return PQsetvalue(res, row, col, buf, sizeof(header) + ndigits * 2);
+}
+
+static int _set_str(PGresult *res, const int row, const int col, const Oid type,
+		const int binary, const char *value) {
+	if (binary && type == _JSONBOID) {
+		char buf[256] = {1};
+		const size_t len = strnlen(value, sizeof(buf) - 2);
+		memcpy(buf + 1, value, len);
+		return PQsetvalue(res, row, col, buf, len + 1);
+	}
+	return PQsetvalue(res, row, col, (char *)value, strlen(value));
+}
+
+/* A bigint[] of two elements. */
+static int _set_int8_pair(PGresult *res, const int row, const int col,
+		const int binary, const int64_t a, const int64_t b) {
+	char buf[64] = {0};
+	if (!binary)
+		return PQsetvalue(res, row, col, buf,
+				snprintf(buf, sizeof(buf), "{%"PRId64",%"PRId64"}", a, b));
+
+	/* ndim, has nulls, element type, size and lower bound, then length
+	 * prefixed elements. */
+	const uint32_t header[] = { htobe32(1), 0, htobe32(_INT8OID), htobe32(2), htobe32(1) };
+	memcpy(buf, header, sizeof(header));
+	const int64_t elems[] = { a, b };
+	size_t offset = sizeof(header);
+	int i;
+	for (i = 0; i < 2; i++) {
+		const uint32_t len = htobe32(sizeof(uint64_t));
+		const uint64_t v = htobe64((uint64_t)elems[i]);
+		memcpy(buf + offset, &len, sizeof(len));
+		memcpy(buf + offset + sizeof(len), &v, sizeof(v));
+		offset += sizeof(len) + sizeof(v);
+	}
+	return PQsetvalue(res, row, col, buf, offset);
+}
+
+/* A result set like get_posts_by_thread_id() would hand back, built
+ * without a database. */
+static PGresult *_make_post_tuples(const char *thread_json, const unsigned int rows, const int binary) {
+	static const _tuples_col columns[] = {
+		{"created_at", _NUMERICOID}, {"id", _INT4OID}, {"oleg_key", _TEXTOID},
+		{"fourchan_post_id", _INT8OID}, {"fourchan_post_no", _INT8OID}, {"thread_id", _INT4OID},
+		{"board", _TEXTOID}, {"body_content", _TEXTOID}, {"replied_to", _INT8ARRAYOID}
+	};
+	PGresult *res = _make_tuples(columns, sizeof(columns) / sizeof(columns[0]), binary);
+	if (!res)
+		return NULL;
+
+	/* Bodies come out of the thread fixture so they're realistically sized. */
+	const char *cursor = thread_json;
+	unsigned int row;
+	for (row = 0; row < rows; row++) {
+		char body[2048] = {0};
+		const char *com = strstr(cursor, "\"com\":\"");
+		if (com) {
+			com += strlen("\"com\":\"");
+			const char *end = strchr(com, '"');
+			const size_t len = end && (size_t)(end - com) < sizeof(body) ? (size_t)(end - com) : 0;
+			memcpy(body, com, len);
+			cursor = end ? end : thread_json;
+		} else {
+			cursor = thread_json;
+		}
+
+		char key[64];
+		snprintf(key, sizeof(key), "PSTwsg%u", 2000000 + row);
+
+		if (!_set_int(res, row, 0, _NUMERICOID, binary, 1451606400 + row) ||
+				!_set_int(res, row, 1, _INT4OID, binary, row + 1) ||
+				!_set_str(res, row, 2, _TEXTOID, binary, key) ||
+				!_set_int(res, row, 3, _INT8OID, binary, 2000000 + row) ||
+				!_set_int(res, row, 4, _INT8OID, binary, row) ||
+				!_set_int(res, row, 5, _INT4OID, binary, 2000000) ||
+				!_set_str(res, row, 6, _TEXTOID, binary, "wsg") ||
+				!_set_str(res, row, 7, _TEXTOID, binary, body) ||
+				!_set_int8_pair(res, row, 8, binary, 2000000 + row + 1, 2000000 + row + 7))
+			goto error;
+	}
+
+	return res;
+
+error:
+	PQclear(res);
+	return NULL;
+}
+
+/* And like get_images_by_popularity(). */
+static PGresult *_make_webm_tuples(const unsigned int rows, const int binary) {
+	static const _tuples_col columns[] = {
+		{"created_at", _NUMERICOID}, {"id", _INT4OID}, {"oleg_key", _TEXTOID},
+		{"file_hash", _TEXTOID}, {"filename", _TEXTOID}, {"board", _TEXTOID},
+		{"file_path", _TEXTOID}, {"post_id", _INT4OID}, {"size", _INT4OID},
+		{"duration_ms", _INT8OID}, {"width", _INT4OID}, {"height", _INT4OID},
+		{"video_codec", _TEXTOID}, {"audio_codec", _TEXTOID}, {"has_audio", _BOOLOID},
+		{"hash_algorithm", _TEXTOID}, {"fingerprint", _TEXTOID}
+	};
+	PGresult *res = _make_tuples(columns, sizeof(columns) / sizeof(columns[0]), binary);
+	if (!res)
+		return NULL;
+
+	unsigned int row;
+	for (row = 0; row < rows; row++) {
+		char hash[HASH_IMAGE_STR_SIZE] = {0}, key[MAX_KEY_SIZE] = {0};
+		snprintf(hash, sizeof(hash), "%064X", row);
+		create_webm_key(hash, key);
+		char filename[64], file_path[128];
+		snprintf(filename, sizeof(filename), "%u_comfy loop %u.webm", 1451606400 + row, row);
+		snprintf(file_path, sizeof(file_path), "./webms/wsg/%s", filename);
+
+		if (!_set_int(res, row, 0, _NUMERICOID, binary, 1451606400 + row) ||
+				!_set_int(res, row, 1, _INT4OID, binary, row + 1) ||
+				!_set_str(res, row, 2, _TEXTOID, binary, key) ||
+				!_set_str(res, row, 3, _TEXTOID, binary, hash) ||
+				!_set_str(res, row, 4, _TEXTOID, binary, filename) ||
+				!_set_str(res, row, 5, _TEXTOID, binary, "wsg") ||
+				!_set_str(res, row, 6, _TEXTOID, binary, file_path) ||
+				!_set_int(res, row, 7, _INT4OID, binary, row + 1) ||
+				!_set_int(res, row, 8, _INT4OID, binary, 3 * 1024 * 1024 + row) ||
+				!_set_int(res, row, 9, _INT8OID, binary, 30000 + row) ||
+				!_set_int(res, row, 10, _INT4OID, binary, 1280) ||
+				!_set_int(res, row, 11, _INT4OID, binary, 720) ||
+				!_set_str(res, row, 12, _TEXTOID, binary, "vp9") ||
+				!_set_str(res, row, 13, _TEXTOID, binary, "opus") ||
+				!PQsetvalue(res, row, 14, binary ? "\x01" : "t", 1) ||
+				!_set_str(res, row, 15, _TEXTOID, binary, "bmw256") ||
+				!_set_str(res, row, 16, _TEXTOID, binary, hash))
+			goto error;
+	}
+
+	return res;
+
+error:
+	PQclear(res);
+	return NULL;
+}
+
+/* text_index_search(), over an index of posts built from the thread fixture
+ * in a temporary WFU_WEBMS_DIR. Every post gets a song<n> that only one in a
+ * thousand share, so there's a rare term to look for next to the common ones. */
+typedef struct _text_search_ctx {
+	char dir[64];
+	const char *query;
+} _text_search_ctx;
+
+static int _make_text_index(_text_search_ctx *ctx, const char *thread_json, const unsigned int rows) {
+	snprintf(ctx->dir, sizeof(ctx->dir), "/tmp/mzbh_bench_text_XXXXXX");
+	if (!mkdtemp(ctx->dir))
+		return -1;
+	setenv("WFU_WEBMS_DIR", ctx->dir, 1);
+	if (strcmp(webm_location(), ctx->dir) != 0)
+		return -1;
+
+	static const _tuples_col columns[] = { {"id", _INT4OID}, {"body_content", _TEXTOID} };
+	PGresult *res = _make_tuples(columns, sizeof(columns) / sizeof(columns[0]), 0);
+	if (!res)
+		return -1;
+
+	const char *cursor = thread_json;
+	unsigned int row;
+	for (row = 0; row < rows; row++) {
+		char body[2048] = {0};
+		const char *com = strstr(cursor, "\"com\":\"");
+		size_t len = 0;
+		if (com) {
+			com += strlen("\"com\":\"");
+			const char *end = strchr(com, '"');
+			len = end && (size_t)(end - com) < sizeof(body) - 16 ? (size_t)(end - com) : 0;
+			memcpy(body, com, len);
+			cursor = end ? end : thread_json;
+		} else {
+			cursor = thread_json;
+		}
+		snprintf(body + len, sizeof(body) - len, " song%u", row % 1000);
+
+		if (!_set_int(res, row, 0, _INT4OID, 0, row + 1) || !_set_str(res, row, 1, _TEXTOID, 0, body)) {
+			PQclear(res);
+			return -1;
+		}
+	}
+
+	const int rc = text_index_add_posts(res);
+	PQclear(res);
+	return rc;
+}
+
+static void _remove_text_index(_text_search_ctx *ctx) {
+	text_index_remove();
+	rmdir(ctx->dir);
+}
+
+/* filename_index_search() over names like the ones people give webms. */
+static void _make_filename_index(const unsigned int rows) {
+	static const char *words[] = {
+		"comfy", "loop", "music", "kino", "based", "sauce", "original", "edit",
+		"thread", "webm", "please", "anyone", "dance", "cat", "rain", "night"
+	};
+	const size_t nwords = sizeof(words) / sizeof(words[0]);
+
+	filename_index_clear();
+	unsigned int row;
+	for (row = 0; row < rows; row++) {
+		char filename[MAX_IMAGE_FILENAME_SIZE] = {0};
+		snprintf(filename, sizeof(filename), "%u_%s %s (%s) %u.webm", 1451606400 + row,
+				words[row % nwords], words[(row / nwords) % nwords], words[(row * 7) % nwords], row % 5000);
+		filename_index_add(row % 4 == 0, row + 1, filename, row % 2 ? "wsg" : "gif", row / 100);
+	}
+}
+
+static void _bench_filename_search(void *arg) {
+	filename_hit hits[FILENAME_SEARCH_MAX_RESULTS];
+	const size_t found = filename_index_search(arg, hits, FILENAME_SEARCH_MAX_RESULTS);
+	__asm__ volatile("" : : "r"(found));
+}
+
+static void _bench_text_search(void *arg) {
+	const _text_search_ctx *ctx = arg;
+	text_hit hits[TEXT_INDEX_MAX_RESULTS];
+	const size_t found = text_index_search(ctx->query, hits, TEXT_INDEX_MAX_RESULTS);
+	__asm__ volatile("" : : "r"(found));
+}
+
+/* meta_snapshot.h lookups, against a snapshot of 100k webms spread over a
+ * few boards in a temporary WFU_WEBMS_DIR. */
+#define _META_LOOKUPS 64
+
+typedef struct _meta_ctx {
+	char dir[64];
+	char hashes[_META_LOOKUPS][HASH_IMAGE_STR_SIZE];
+	unsigned int next;
+} _meta_ctx;
+
+static int _make_meta_snapshot(_meta_ctx *ctx, const unsigned int rows) {
+	snprintf(ctx->dir, sizeof(ctx->dir), "/tmp/mzbh_bench_meta_XXXXXX");
+	if (!mkdtemp(ctx->dir))
+		return -1;
+	setenv("WFU_WEBMS_DIR", ctx->dir, 1);
+	if (strcmp(webm_location(), ctx->dir) != 0)
+		return -1;
+
+	static const _tuples_col columns[] = {
+		{"id", _INT4OID}, {"file_hash", _TEXTOID}, {"filename", _TEXTOID}, {"board", _TEXTOID},
+		{"created_at", _INT8OID}, {"duration_ms", _INT8OID}, {"has_audio", _BOOLOID},
+		{"post_id", _INT4OID}, {"thread_id", _INT4OID}, {"fourchan_post_id", _INT8OID},
+		{"body_content", _TEXTOID}
+	};
+	static const char *boards[] = {"b", "gif", "tv", "wsg"};
+	PGresult *webms = _make_tuples(columns, sizeof(columns) / sizeof(columns[0]), 0);
+	PGresult *aliases = _make_tuples(columns, 1, 0);
+	int rc = -1;
+	if (!webms || !aliases)
+		goto end;
+
+	unsigned int row;
+	for (row = 0; row < rows; row++) {
+		char hash[HASH_IMAGE_STR_SIZE] = {0};
+		hash_string((const unsigned char *)&row, sizeof(row), hash);
+		if (row % (rows / _META_LOOKUPS) == 0 && row / (rows / _META_LOOKUPS) < _META_LOOKUPS)
+			memcpy(ctx->hashes[row / (rows / _META_LOOKUPS)], hash, sizeof(hash));
+
+		char filename[MAX_IMAGE_FILENAME_SIZE] = {0};
+		snprintf(filename, sizeof(filename), "%u_comfy loop %u.webm", 1451606400 + row, row);
+		if (!_set_int(webms, row, 0, _INT4OID, 0, row + 1) ||
+				!_set_str(webms, row, 1, _TEXTOID, 0, hash) ||
+				!_set_str(webms, row, 2, _TEXTOID, 0, filename) ||
+				!_set_str(webms, row, 3, _TEXTOID, 0, boards[row % 4]) ||
+				!_set_int(webms, row, 4, _INT8OID, 0, 1451606400 + row) ||
+				!_set_int(webms, row, 5, _INT8OID, 0, (row % 90) * 1000) ||
+				!PQsetvalue(webms, row, 6, row % 3 ? "t" : "f", 1) ||
+				!_set_int(webms, row, 7, _INT4OID, 0, row + 1) ||
+				!_set_int(webms, row, 8, _INT4OID, 0, row / 100) ||
+				!_set_int(webms, row, 9, _INT8OID, 0, 1451606400 + row) ||
+				!_set_str(webms, row, 10, _TEXTOID, 0, "comfy loop, anyone got the sauce?"))
+			goto end;
+	}
+
+	if (meta_snapshot_write(webms, aliases, 0) == 0 && meta_snapshot_open() == 0)
+		rc = 0;
+
+end:
+	if (webms)
+		PQclear(webms);
+	if (aliases)
+		PQclear(aliases);
+	return rc;
+}
+
+static void _remove_meta_snapshot(_meta_ctx *ctx) {
+	char path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	snprintf(path, sizeof(path), "%s/%s", ctx->dir, META_SNAPSHOT_FILE);
+	meta_snapshot_close();
+	unlink(path);
+	rmdir(ctx->dir);
+}
+
+/* What webm_handler() looks up for a page: the webm, its post and aliases. */
+static void _bench_meta_webm_page(void *arg) {
+	_meta_ctx *ctx = arg;
+	webm *_webm = meta_snapshot_get_webm(ctx->hashes[ctx->next++ % _META_LOOKUPS]);
+	if (!_webm)
+		return;
+
+	post *_post = meta_snapshot_get_post(_webm->post_id);
+	if (_post) {
+		free(_post->body_content);
+		vector_free(_post->replied_to);
+		free(_post);
+	}
+
+	vector *aliases = vector_new(sizeof(webm_alias), 8);
+	meta_snapshot_get_aliases(_webm->id, aliases);
+	vector_free(aliases);
+	free(_webm);
+}
+
+/* A page of /newest from about halfway back. */
+static void _bench_meta_newest_page(void *arg) {
+	UNUSED(arg);
+	newest_hit *hits = malloc(RESULTS_PER_PAGE * sizeof(newest_hit));
+	const int found = meta_snapshot_newest("1451656400-w50001", hits, RESULTS_PER_PAGE);
+	__asm__ volatile("" : : "r"(found));
+	free(hits);
+}
+
+/* The fifth page of long webms on a board. */
+static void _bench_meta_board_page(void *arg) {
+	UNUSED(arg);
+	vector *filenames = vector_new(MAX_IMAGE_FILENAME_SIZE, RESULTS_PER_PAGE);
+	const int total = meta_snapshot_board_page("wsg", WEBM_LONG_DURATION_MS, 0,
+			RESULTS_PER_PAGE * 4, RESULTS_PER_PAGE, filenames);
+	__asm__ volatile("" : : "r"(total));
+	vector_free(filenames);
+}
+
+/* Rendering a full board page */
+
+static void _bench_render_board(void *arg) {
+	UNUSED(arg);
+
+	greshunkel_ctext *ctext = gshkl_init_context();
+	gshkl_add_filter(ctext, "thumbnail_for_image", thumbnail_for_image, gshkl_filter_cleanup);
+	gshkl_add_string(ctext, "current_board", "wsg");
+	gshkl_add_string(ctext, "page_base", "/chug/wsg");
+	gshkl_add_string(ctext, "current_filter", "all");
+
+	greshunkel_var images = gshkl_add_array(ctext, "IMAGES");
+	unsigned int i;
+	for (i = 0; i < RESULTS_PER_PAGE; i++) {
+		char name[64] = {0};
+		snprintf(name, sizeof(name), "%u_comfy loop %u.webm", 1451606400 + i, i);
+		gshkl_add_string_to_loop(&images, name);
+	}
+
+	greshunkel_var pages = gshkl_add_array(ctext, "PAGES");
+	for (i = 0; i < 20; i++)
+		gshkl_add_int_to_loop(&pages, i);
+	gshkl_add_string(ctext, "prev_page", "");
+	gshkl_add_int(ctext, "next_page", 1);
+
+	static const char *boards[] = {"b", "gif", "pol", "tv", "v", "wsg"};
+	greshunkel_var board_loop = gshkl_add_array(ctext, "BOARDS");
+	for (i = 0; i < sizeof(boards) / sizeof(boards[0]); i++)
+		gshkl_add_string_to_loop(&board_loop, boards[i]);
+	gshkl_add_int(ctext, "total", RESULTS_PER_PAGE * 20);
+
+	m38_http_response response = {0};
+	m38_render_file(ctext, "./templates/board.html", &response);
+	free(response.out);
+}
+
+static void _usage(const char *name) {
+	fprintf(stderr, "Usage: %s [-f fixtures_dir] [-t run_ms] [-m max_hash_mb] [-j] [name filter...]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	bench_options opts = {
+		.fixtures_dir = "./fixtures",
+		.run_ms = BENCH_DEFAULT_RUN_MS,
+		.max_mb = BENCH_DEFAULT_MAX_MB,
+		.json = 0,
+		.filters = NULL,
+		.num_filters = 0
+	};
+
+	int i;
+	for (i = 1; i < argc; i++) {
+		const char *cur_arg = argv[i];
+		if (strcmp(cur_arg, "-f") == 0 && i + 1 < argc) {
+			opts.fixtures_dir = argv[++i];
+		} else if (strcmp(cur_arg, "-t") == 0 && i + 1 < argc) {
+			opts.run_ms = strtoul(argv[++i], NULL, 10);
+		} else if (strcmp(cur_arg, "-m") == 0 && i + 1 < argc) {
+			opts.max_mb = strtoul(argv[++i], NULL, 10);
+		} else if (strcmp(cur_arg, "-j") == 0) {
+			opts.json = 1;
+		} else if (cur_arg[0] == '-') {
+			_usage(argv[0]);
+			return -1;
+		} else {
+			opts.filters = &argv[i];
+			opts.num_filters = argc - i;
+			break;
+		}
+	}
+
+	/* The parsers log every thread and hit. That's worth knowing about but
+	 * it isn't what we're measuring. */
+	log_level = LOG_ERR;
+
+	size_t catalog_len = 0, thread_len = 0;
+	char *catalog_json = _read_fixture(&opts, "catalog.json", &catalog_len);
+	char *thread_json = _read_fixture(&opts, "thread.json", &thread_len);
+	if (!catalog_json || !thread_json)
+		return -1;
+
+	bench benches[48];
+	unsigned int num_benches = 0;
+	memset(benches, 0, sizeof(benches));
+
+	_json_ctx catalog_ctx = { .json = catalog_json };
+	strncpy(catalog_ctx.match.board, "wsg", sizeof(catalog_ctx.match.board) - 1);
+	benches[num_benches++] = (bench){ "parse_catalog_json", _bench_parse_catalog, &catalog_ctx, catalog_len };
+
+	_json_ctx thread_ctx = { .json = thread_json };
+	strncpy(thread_ctx.match.board, "wsg", sizeof(thread_ctx.match.board) - 1);
+	thread_ctx.match.thread_num = 2000000;
+	benches[num_benches++] = (bench){ "parse_thread_json", _bench_parse_thread, &thread_ctx, thread_len };
+
+	static const unsigned int hash_sizes_mb[] = {1, 10, 50};
+	_hash_ctx hash_ctxs[sizeof(hash_sizes_mb) / sizeof(hash_sizes_mb[0])];
+	memset(hash_ctxs, 0, sizeof(hash_ctxs));
+	unsigned int h;
+	for (h = 0; h < sizeof(hash_sizes_mb) / sizeof(hash_sizes_mb[0]); h++) {
+		if (hash_sizes_mb[h] > opts.max_mb)
+			continue;
+
+		bench *file_bench = &benches[num_benches];
+		bench *string_bench = &benches[num_benches + 1];
+		bench *fingerprint_bench = &benches[num_benches + 2];
+		snprintf(file_bench->name, sizeof(file_bench->name), "hash_file/%uMB", hash_sizes_mb[h]);
+		snprintf(string_bench->name, sizeof(string_bench->name), "hash_string/%uMB", hash_sizes_mb[h]);
+		snprintf(fingerprint_bench->name, sizeof(fingerprint_bench->name), "hash_fingerprint/%uMB", hash_sizes_mb[h]);
+
+		/* Making 50MB of input isn't free, so only bother if we'll use it. */
+		if (!_wanted(&opts, file_bench->name) && !_wanted(&opts, string_bench->name) &&
+				!_wanted(&opts, fingerprint_bench->name))
+			continue;
+
+		if (_make_hash_input(&hash_ctxs[h], (size_t)hash_sizes_mb[h] * 1024 * 1024) != 0) {
+			log_msg(LOG_ERR, "Could not make %uMB of hash input.", hash_sizes_mb[h]);
+			continue;
+		}
+
+		file_bench->fn = _bench_hash_file;
+		file_bench->arg = &hash_ctxs[h];
+		file_bench->bytes = hash_ctxs[h].size;
+		string_bench->fn = _bench_hash_string;
+		string_bench->arg = &hash_ctxs[h];
+		string_bench->bytes = hash_ctxs[h].size;
+		fingerprint_bench->fn = _bench_hash_fingerprint;
+		fingerprint_bench->arg = &hash_ctxs[h];
+		fingerprint_bench->bytes = hash_ctxs[h].size;
+		num_benches += 3;
+	}
+
+	/* The same 10MB through every backend, to see what switching would buy. */
+	_hash_ctx backend_input = {0};
+	_backend_hash_ctx backend_ctxs[HASH_BACKENDS];
+	unsigned int b;
+	for (b = 0; b < HASH_BACKENDS && opts.max_mb >= 10; b++) {
+		bench *backend_bench = &benches[num_benches];
+		snprintf(backend_bench->name, sizeof(backend_bench->name), "hash_backend/%s/10MB", hash_backend_name(b));
+		if (!_wanted(&opts, backend_bench->name))
+			continue;
+
+		if (!backend_input.data && _make_hash_input(&backend_input, 10 * 1024 * 1024) != 0) {
+			log_msg(LOG_ERR, "Could not make 10MB of hash input.");
+			break;
+		}
+
+		backend_ctxs[b] = (_backend_hash_ctx){ .input = &backend_input, .backend = b };
+		backend_bench->fn = _bench_hash_backend;
+		backend_bench->arg = &backend_ctxs[b];
+		backend_bench->bytes = backend_input.size;
+		num_benches++;
+	}
+
+	benches[num_benches++] = (bench){ "url_decode", _bench_url_decode, NULL, strlen(_ENCODED_NAME) };
+
+	m38_http_request request = {0};
+	const char resource[] = "/chug/wsg/" _ENCODED_NAME;
+	strncpy(request.resource, resource, sizeof(request.resource) - 1);
+	request.matches[1].rm_so = strlen("/chug/");
+	request.matches[1].rm_eo = strlen("/chug/wsg");
+	request.matches[2].rm_so = strlen("/chug/wsg/");
+	request.matches[2].rm_eo = strlen(resource);
+	benches[num_benches++] = (bench){ "get_webm_from_board", _bench_get_webm_from_board, &request, 0 };
+
+	_chunked_ctx chunked_ctx = {0};
+	chunked_ctx.response = _chunk_encode(thread_json, thread_len, &chunked_ctx.len);
+	if (chunked_ctx.response)
+		benches[num_benches++] = (bench){ "receive_chunked_http", _bench_receive_chunked, &chunked_ctx, chunked_ctx.len };
+
+	_tuples_ctx tuples_ctx = { .rows = RESULTS_PER_PAGE, .next = 0 };
+	tuples_ctx.res = _make_post_tuples(thread_json, tuples_ctx.rows, 0);
+	if (tuples_ctx.res)
+		benches[num_benches++] = (bench){ "deserialize_post_from_tuples", _bench_deserialize_post, &tuples_ctx, 0 };
+
+	/* The same 10k rows in each format. */
+	_tuples_ctx decode_ctxs[4] = {
+		{ .res = NULL, .rows = 10000, .next = 0 }, { .res = NULL, .rows = 10000, .next = 0 },
+		{ .res = NULL, .rows = 10000, .next = 0 }, { .res = NULL, .rows = 10000, .next = 0 }
+	};
+	static const struct {
+		const char *name;
+		void (*fn)(void *arg);
+		int webms;
+		int binary;
+	} decode_benches[] = {
+		{ "decode_posts/text/10k", _bench_decode_posts_text, 0, 0 },
+		{ "decode_posts/binary/10k", _bench_decode_posts_binary, 0, 1 },
+		{ "decode_webms/text/10k", _bench_decode_webms_text, 1, 0 },
+		{ "decode_webms/binary/10k", _bench_decode_webms_binary, 1, 1 }
+	};
+	for (b = 0; b < sizeof(decode_benches) / sizeof(decode_benches[0]); b++) {
+		if (!_wanted(&opts, decode_benches[b].name))
+			continue;
+
+		_tuples_ctx *ctx = &decode_ctxs[b];
+		ctx->res = decode_benches[b].webms ?
+			_make_webm_tuples(ctx->rows, decode_benches[b].binary) :
+			_make_post_tuples(thread_json, ctx->rows, decode_benches[b].binary);
+		if (!ctx->res)
+			continue;
+
+		bench *decode_bench = &benches[num_benches++];
+		snprintf(decode_bench->name, sizeof(decode_bench->name), "%s", decode_benches[b].name);
+		decode_bench->fn = decode_benches[b].fn;
+		decode_bench->arg = ctx;
+		decode_bench->bytes = 0;
+	}
+
+	/* Built once for all of them, and only if one's wanted. */
+	_text_search_ctx text_ctxs[] = {
+		{ .dir = {0}, .query = "comfy" },
+		{ .dir = {0}, .query = "comfy music loop" },
+		{ .dir = {0}, .query = "comfy song42" }
+	};
+	static const char *text_bench_names[] = {
+		"text_search/common/100k", "text_search/common_and/100k", "text_search/rare/100k"
+	};
+	int text_index_built = 0;
+	for (b = 0; b < sizeof(text_ctxs) / sizeof(text_ctxs[0]); b++) {
+		if (!_wanted(&opts, text_bench_names[b]))
+			continue;
+		if (!text_index_built) {
+			if (_make_text_index(&text_ctxs[0], thread_json, 100000) != 0) {
+				log_msg(LOG_ERR, "Could not build a text index to search.");
+				break;
+			}
+			text_index_built = 1;
+		}
+		benches[num_benches++] = (bench){ "", _bench_text_search, &text_ctxs[b], 0 };
+		snprintf(benches[num_benches - 1].name, sizeof(benches[num_benches - 1].name), "%s", text_bench_names[b]);
+	}
+
+	static const struct {
+		const char *name;
+		const char *query;
+	} filename_benches[] = {
+		{ "filename_search/common/500k", "comfy" },
+		{ "filename_search/phrase/500k", "comfy loop" },
+		{ "filename_search/rare/500k", "rain (kino) 123" }
+	};
+	int filename_index_built = 0;
+	for (b = 0; b < sizeof(filename_benches) / sizeof(filename_benches[0]); b++) {
+		if (!_wanted(&opts, filename_benches[b].name))
+			continue;
+		if (!filename_index_built) {
+			_make_filename_index(500000);
+			filename_index_built = 1;
+		}
+		benches[num_benches++] = (bench){ "", _bench_filename_search, (void *)filename_benches[b].query, 0 };
+		snprintf(benches[num_benches - 1].name, sizeof(benches[num_benches - 1].name), "%s", filename_benches[b].name);
+	}
+
+	_meta_ctx meta_ctx = {0};
+	static const struct {
+		const char *name;
+		void (*fn)(void *arg);
+	} meta_benches[] = {
+		{ "meta_snapshot/webm_page/100k", _bench_meta_webm_page },
+		{ "meta_snapshot/board_page/100k", _bench_meta_board_page },
+		{ "meta_snapshot/newest_page/100k", _bench_meta_newest_page }
+	};
+	int meta_snapshot_built = 0;
+	for (b = 0; b < sizeof(meta_benches) / sizeof(meta_benches[0]); b++) {
+		if (!_wanted(&opts, meta_benches[b].name))
+			continue;
+		if (!meta_snapshot_built) {
+			if (_make_meta_snapshot(&meta_ctx, 100000) != 0) {
+				log_msg(LOG_ERR, "Could not build a metadata snapshot to read.");
+				break;
+			}
+			meta_snapshot_built = 1;
+		}
+		benches[num_benches++] = (bench){ "", meta_benches[b].fn, &meta_ctx, 0 };
+		snprintf(benches[num_benches - 1].name, sizeof(benches[num_benches - 1].name), "%s", meta_benches[b].name);
+	}
+
+	benches[num_benches++] = (bench){ "render_board_page", _bench_render_board, NULL, 0 };
+
+	unsigned int j;
+	for (j = 0; j < num_benches; j++) {
+		if (_wanted(&opts, benches[j].name))
+			_run_bench(&benches[j], &opts);
+	}
+
+	for (h = 0; h < sizeof(hash_sizes_mb) / sizeof(hash_sizes_mb[0]); h++) {
+		if (hash_ctxs[h].data) {
+			unlink(hash_ctxs[h].path);
+			free(hash_ctxs[h].data);
+		}
+	}
+	if (backend_input.data) {
+		unlink(backend_input.path);
+		free(backend_input.data);
+	}
+	if (tuples_ctx.res)
+		PQclear(tuples_ctx.res);
+	for (b = 0; b < sizeof(decode_ctxs) / sizeof(decode_ctxs[0]); b++) {
+		if (decode_ctxs[b].res)
+			PQclear(decode_ctxs[b].res);
+	}
+	if (text_index_built)
+		_remove_text_index(&text_ctxs[0]);
+	if (filename_index_built)
+		filename_index_clear();
+	if (meta_snapshot_built)
+		_remove_meta_snapshot(&meta_ctx);
+	free(chunked_ctx.response);
+	free(catalog_json);
+	free(thread_json);
+
+	return 0;
+}
@@ -0,0 +1,351 @@
+// vim: noet ts=4 sw=4
+#include <pthread.h>
+#include <string.h>
+
+#include "blake3.h"
+
+#define _CHUNK_START (1 << 0)
+#define _CHUNK_END (1 << 1)
+#define _PARENT (1 << 2)
+#define _ROOT (1 << 3)
+
+static const uint32_t _iv[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+/* Message word order for each of the seven rounds. */
+static const uint8_t _schedule[7][16] = {
+	{ 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15},
+	{ 2,  6,  3, 10,  7,  0,  4, 13,  1, 11, 12,  5,  9, 14, 15,  8},
+	{ 3,  4, 10, 12, 13,  2,  7, 14,  6,  5,  9,  0, 11, 15,  8,  1},
+	{10,  7, 12,  9, 14,  3, 13, 15,  4,  0, 11,  2,  5,  8,  1,  6},
+	{12, 13,  9, 11, 15, 10, 14,  8,  7,  2,  5,  3,  0,  1,  6,  4},
+	{ 9, 14, 11,  5,  8, 12, 15,  1, 13,  3,  0, 10,  2,  6,  4,  7},
+	{11, 15,  5,  0,  1,  9,  8,  6, 14, 10,  2, 12,  3,  4,  7, 13},
+};
+
+/* Eight lanes of 32 bits. GCC lowers this to whatever the target has, two
+ * SSE2 registers on plain x86-64, one with AVX2. */
+typedef uint32_t _u32x8 __attribute__((vector_size(32)));
+
+/* These work the same on uint32_t and _u32x8, so both compressors share
+ * them. */
+#define _ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define _G(v, a, b, c, d, x, y) do { \
+	v[a] = v[a] + v[b] + (x); v[d] = _ROTR(v[d] ^ v[a], 16); \
+	v[c] = v[c] + v[d];       v[b] = _ROTR(v[b] ^ v[c], 12); \
+	v[a] = v[a] + v[b] + (y); v[d] = _ROTR(v[d] ^ v[a], 8); \
+	v[c] = v[c] + v[d];       v[b] = _ROTR(v[b] ^ v[c], 7); \
+} while (0)
+#define _ROUNDS(v, m) do { \
+	int _r; \
+	for (_r = 0; _r < 7; _r++) { \
+		const uint8_t *_s = _schedule[_r]; \
+		_G(v, 0, 4,  8, 12, m[_s[ 0]], m[_s[ 1]]); \
+		_G(v, 1, 5,  9, 13, m[_s[ 2]], m[_s[ 3]]); \
+		_G(v, 2, 6, 10, 14, m[_s[ 4]], m[_s[ 5]]); \
+		_G(v, 3, 7, 11, 15, m[_s[ 6]], m[_s[ 7]]); \
+		_G(v, 0, 5, 10, 15, m[_s[ 8]], m[_s[ 9]]); \
+		_G(v, 1, 6, 11, 12, m[_s[10]], m[_s[11]]); \
+		_G(v, 2, 7,  8, 13, m[_s[12]], m[_s[13]]); \
+		_G(v, 3, 4,  9, 14, m[_s[14]], m[_s[15]]); \
+	} \
+} while (0)
+
+static inline uint32_t _load32(const uint8_t *p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void _store32(uint8_t *p, const uint32_t x) {
+	p[0] = x;
+	p[1] = x >> 8;
+	p[2] = x >> 16;
+	p[3] = x >> 24;
+}
+
+static inline void _store_cv(uint8_t out[static BLAKE3_OUT_LEN], const uint32_t cv[static 8]) {
+	int i;
+	for (i = 0; i < 8; i++)
+		_store32(out + i * 4, cv[i]);
+}
+
+/* out can be cv. */
+static void _compress(const uint32_t cv[static 8], const uint8_t block[static BLAKE3_BLOCK_LEN],
+		const uint8_t block_len, const uint64_t counter, const uint8_t flags, uint32_t out[static 8]) {
+	uint32_t m[16], v[16];
+	int i;
+	for (i = 0; i < 16; i++)
+		m[i] = _load32(block + i * 4);
+
+	memcpy(v, cv, sizeof(uint32_t) * 8);
+	memcpy(v + 8, _iv, sizeof(uint32_t) * 4);
+	v[12] = (uint32_t)counter;
+	v[13] = (uint32_t)(counter >> 32);
+	v[14] = block_len;
+	v[15] = flags;
+
+	_ROUNDS(v, m);
+
+	for (i = 0; i < 8; i++)
+		out[i] = v[i] ^ v[i + 8];
+}
+
+static void _parent_cv(const uint32_t left[static 8], const uint32_t right[static 8], const uint8_t flags,
+		uint32_t out[static 8]) {
+	uint8_t block[BLAKE3_BLOCK_LEN];
+	_store_cv(block, left);
+	_store_cv(block + BLAKE3_OUT_LEN, right);
+	_compress(_iv, block, BLAKE3_BLOCK_LEN, 0, _PARENT | flags, out);
+}
+
+/* One chunk of up to BLAKE3_CHUNK_LEN bytes. flags is _ROOT if it's the
+ * only one. */
+static void _chunk_cv(const uint8_t *data, size_t len, const uint64_t counter, const uint8_t flags,
+		uint32_t out[static 8]) {
+	uint32_t cv[8];
+	memcpy(cv, _iv, sizeof(cv));
+
+	uint8_t block_flags = _CHUNK_START;
+	while (len > BLAKE3_BLOCK_LEN) {
+		_compress(cv, data, BLAKE3_BLOCK_LEN, counter, block_flags, cv);
+		block_flags = 0;
+		data += BLAKE3_BLOCK_LEN;
+		len -= BLAKE3_BLOCK_LEN;
+	}
+
+	uint8_t last[BLAKE3_BLOCK_LEN] = {0};
+	memcpy(last, data, len);
+	_compress(cv, last, len, counter, block_flags | _CHUNK_END | flags, out);
+}
+
+/* A macro rather than a function, since returning a vector from one
+ * changes the ABI depending on whether AVX is on. */
+#define _SPLAT(x) ((_u32x8){(x), (x), (x), (x), (x), (x), (x), (x)})
+
+/* BLAKE3_SIMD_DEGREE whole chunks, one per lane. */
+static void _hash8_chunks(const uint8_t *data, const uint64_t counter, uint32_t out[static BLAKE3_SIMD_DEGREE][8]) {
+	_u32x8 h[8], m[16], v[16];
+	_u32x8 counter_lo, counter_hi;
+	int i, lane, block;
+
+	for (lane = 0; lane < BLAKE3_SIMD_DEGREE; lane++) {
+		counter_lo[lane] = (uint32_t)(counter + lane);
+		counter_hi[lane] = (uint32_t)((counter + lane) >> 32);
+	}
+	for (i = 0; i < 8; i++)
+		h[i] = _SPLAT(_iv[i]);
+
+	for (block = 0; block < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; block++) {
+		/* Word i of this block, from every chunk. */
+		for (i = 0; i < 16; i++) {
+			for (lane = 0; lane < BLAKE3_SIMD_DEGREE; lane++)
+				m[i][lane] = _load32(data + lane * BLAKE3_CHUNK_LEN + block * BLAKE3_BLOCK_LEN + i * 4);
+		}
+
+		uint32_t flags = 0;
+		if (block == 0)
+			flags |= _CHUNK_START;
+		if (block == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1)
+			flags |= _CHUNK_END;
+
+		for (i = 0; i < 8; i++)
+			v[i] = h[i];
+		for (i = 0; i < 4; i++)
+			v[i + 8] = _SPLAT(_iv[i]);
+		v[12] = counter_lo;
+		v[13] = counter_hi;
+		v[14] = _SPLAT(BLAKE3_BLOCK_LEN);
+		v[15] = _SPLAT(flags);
+
+		_ROUNDS(v, m);
+
+		for (i = 0; i < 8; i++)
+			h[i] = v[i] ^ v[i + 8];
+	}
+
+	for (lane = 0; lane < BLAKE3_SIMD_DEGREE; lane++) {
+		for (i = 0; i < 8; i++)
+			out[lane][i] = h[i][lane];
+	}
+}
+
+static inline uint64_t _round_down_pow2(const uint64_t x) {
+	return 1ULL << (63 - __builtin_clzll(x));
+}
+
+/* How much of len goes in the left subtree: the biggest power of two
+ * number of chunks that still leaves something for the right. */
+static inline size_t _left_len(const size_t len) {
+	return _round_down_pow2((len - 1) / BLAKE3_CHUNK_LEN) * BLAKE3_CHUNK_LEN;
+}
+
+/* Folds n chunk chaining values into one, the same shape the tree has. */
+static void _merge_cvs(uint32_t cvs[][8], const size_t n, uint32_t out[static 8]) {
+	if (n == 1) {
+		memcpy(out, cvs[0], sizeof(uint32_t) * 8);
+		return;
+	}
+
+	const size_t left = _round_down_pow2(n - 1);
+	uint32_t left_cv[8], right_cv[8];
+	_merge_cvs(cvs, left, left_cv);
+	_merge_cvs(cvs + left, n - left, right_cv);
+	_parent_cv(left_cv, right_cv, 0, out);
+}
+
+typedef struct _subtree_job {
+	const uint8_t *data;
+	size_t len;
+	uint64_t counter;
+	unsigned int threads;
+	uint32_t cv[8];
+} _subtree_job;
+
+static void _subtree_cv(const uint8_t *data, const size_t len, const uint64_t counter,
+		const unsigned int threads, uint32_t out[static 8]);
+
+static void *_subtree_thread(void *arg) {
+	_subtree_job *job = (_subtree_job *)arg;
+	_subtree_cv(job->data, job->len, job->counter, job->threads, job->cv);
+	return NULL;
+}
+
+/* Chaining values of both halves of something bigger than a chunk. The left
+ * half gets a thread of its own if there's one to spare. */
+static void _children(const uint8_t *data, const size_t len, const uint64_t counter, const unsigned int threads,
+		uint32_t left_cv[static 8], uint32_t right_cv[static 8]) {
+	const size_t left_len = _left_len(len);
+	const uint64_t right_counter = counter + left_len / BLAKE3_CHUNK_LEN;
+
+	if (threads > 1 && len >= BLAKE3_PARALLEL_MIN) {
+		_subtree_job left = {
+			.data = data,
+			.len = left_len,
+			.counter = counter,
+			.threads = threads / 2,
+		};
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, _subtree_thread, &left) == 0) {
+			_subtree_cv(data + left_len, len - left_len, right_counter, threads - threads / 2, right_cv);
+			pthread_join(thread, NULL);
+			memcpy(left_cv, left.cv, sizeof(left.cv));
+			return;
+		}
+	}
+
+	_subtree_cv(data, left_len, counter, threads, left_cv);
+	_subtree_cv(data + left_len, len - left_len, right_counter, threads, right_cv);
+}
+
+static void _subtree_cv(const uint8_t *data, const size_t len, const uint64_t counter,
+		const unsigned int threads, uint32_t out[static 8]) {
+	if (len > BLAKE3_SIMD_DEGREE * BLAKE3_CHUNK_LEN) {
+		uint32_t left_cv[8], right_cv[8];
+		_children(data, len, counter, threads, left_cv, right_cv);
+		_parent_cv(left_cv, right_cv, 0, out);
+		return;
+	}
+
+	uint32_t cvs[BLAKE3_SIMD_DEGREE][8];
+	size_t n = 0;
+	if (len == BLAKE3_SIMD_DEGREE * BLAKE3_CHUNK_LEN) {
+		_hash8_chunks(data, counter, cvs);
+		n = BLAKE3_SIMD_DEGREE;
+	} else {
+		size_t offset;
+		for (offset = 0; offset < len; offset += BLAKE3_CHUNK_LEN, n++) {
+			const size_t chunk_len = len - offset < BLAKE3_CHUNK_LEN ? len - offset : BLAKE3_CHUNK_LEN;
+			_chunk_cv(data + offset, chunk_len, counter + n, 0, cvs[n]);
+		}
+	}
+	_merge_cvs(cvs, n, out);
+}
+
+void blake3_hash(const void *data, const size_t len, const unsigned int threads,
+		uint8_t out[static BLAKE3_OUT_LEN]) {
+	uint32_t cv[8];
+	if (len <= BLAKE3_CHUNK_LEN) {
+		_chunk_cv(data, len, 0, _ROOT, cv);
+	} else {
+		uint32_t left_cv[8], right_cv[8];
+		_children(data, len, 0, threads > 0 ? threads : 1, left_cv, right_cv);
+		_parent_cv(left_cv, right_cv, _ROOT, cv);
+	}
+	_store_cv(out, cv);
+}
+
+void blake3_init(blake3_hasher *hasher) {
+	memset(hasher, 0, sizeof(blake3_hasher));
+	memcpy(hasher->chunk_cv, _iv, sizeof(hasher->chunk_cv));
+}
+
+static inline uint8_t _start_flag(const blake3_hasher *hasher) {
+	return hasher->blocks_compressed == 0 ? _CHUNK_START : 0;
+}
+
+/* total_chunks tells us how many subtrees just got completed by this one. */
+static void _push_cv(blake3_hasher *hasher, uint32_t cv[static 8], uint64_t total_chunks) {
+	while ((total_chunks & 1) == 0) {
+		hasher->cv_stack_len--;
+		_parent_cv(hasher->cv_stack[hasher->cv_stack_len], cv, 0, cv);
+		total_chunks >>= 1;
+	}
+	memcpy(hasher->cv_stack[hasher->cv_stack_len], cv, sizeof(uint32_t) * 8);
+	hasher->cv_stack_len++;
+}
+
+void blake3_update(blake3_hasher *hasher, const void *data, size_t len) {
+	const uint8_t *in = data;
+
+	while (len > 0) {
+		/* The last block of a chunk is held back until we know whether
+		 * it's the last one overall, which needs _ROOT. */
+		if (hasher->blocks_compressed * BLAKE3_BLOCK_LEN + hasher->block_len == BLAKE3_CHUNK_LEN) {
+			uint32_t cv[8];
+			_compress(hasher->chunk_cv, hasher->block, hasher->block_len, hasher->chunk_counter,
+					_start_flag(hasher) | _CHUNK_END, cv);
+			hasher->chunk_counter++;
+			_push_cv(hasher, cv, hasher->chunk_counter);
+
+			memcpy(hasher->chunk_cv, _iv, sizeof(hasher->chunk_cv));
+			hasher->blocks_compressed = 0;
+			hasher->block_len = 0;
+		}
+
+		if (hasher->block_len == BLAKE3_BLOCK_LEN) {
+			_compress(hasher->chunk_cv, hasher->block, BLAKE3_BLOCK_LEN, hasher->chunk_counter,
+					_start_flag(hasher), hasher->chunk_cv);
+			hasher->blocks_compressed++;
+			hasher->block_len = 0;
+		}
+
+		size_t take = BLAKE3_BLOCK_LEN - hasher->block_len;
+		if (take > len)
+			take = len;
+		memcpy(hasher->block + hasher->block_len, in, take);
+		hasher->block_len += take;
+		in += take;
+		len -= take;
+	}
+}
+
+void blake3_final(const blake3_hasher *hasher, uint8_t out[static BLAKE3_OUT_LEN]) {
+	uint8_t block[BLAKE3_BLOCK_LEN] = {0};
+	memcpy(block, hasher->block, hasher->block_len);
+
+	uint32_t cv[8];
+	const uint8_t flags = _start_flag(hasher) | _CHUNK_END;
+	if (hasher->cv_stack_len == 0) {
+		_compress(hasher->chunk_cv, block, hasher->block_len, hasher->chunk_counter, flags | _ROOT, cv);
+		_store_cv(out, cv);
+		return;
+	}
+
+	_compress(hasher->chunk_cv, block, hasher->block_len, hasher->chunk_counter, flags, cv);
+	int i;
+	for (i = hasher->cv_stack_len - 1; i > 0; i--)
+		_parent_cv(hasher->cv_stack[i], cv, 0, cv);
+	_parent_cv(hasher->cv_stack[0], cv, _ROOT, cv);
+	_store_cv(out, cv);
+}
@@ -0,0 +1,130 @@
+// vim: noet ts=4 sw=4
+#include <dirent.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "async_log.h"
+#include "blobstore.h"
+#include "hashing.h"
+#include "thumbnail.h"
+#include "utils.h"
+
+/* Converts an existing flat webms/<board>/ tree into the blob store in place.
+ * Safe to re-run: anything already linked into the store is left alone.
+ */
+typedef struct migrate_stats {
+	unsigned int stored;
+	unsigned int deduped_thumbs;
+	unsigned int failed;
+} migrate_stats;
+
+static void _migrate_thumbnail(const char *webm_path, const char hash[static HASH_IMAGE_STR_SIZE],
+		migrate_stats *stats) {
+	char thumb_path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	get_thumb_path_for_webm(webm_path, thumb_path);
+
+	struct stat st = {0};
+	if (lstat(thumb_path, &st) == -1 || !S_ISREG(st.st_mode))
+		return;
+
+	char blob_path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	if (get_blob_path(hash, BLOB_THUMB_EXT, blob_path) != 0)
+		return;
+
+	struct stat blob_st = {0};
+	if (stat(blob_path, &blob_st) == 0)
+		stats->deduped_thumbs++;
+
+	if (blob_store_thumbnail(thumb_path, hash) != 0)
+		log_msg(LOG_WARN, "Could not store thumbnail %s.", thumb_path);
+}
+
+/* Originals go first so the links pointing at them have somewhere to go. */
+static void _migrate_board(const char *board_dir, const int want_links, const int dry_run,
+		migrate_stats *stats) {
+	DIR *dirstream = opendir(board_dir);
+	if (!dirstream)
+		return;
+
+	while (1) {
+		struct dirent *result = readdir(dirstream);
+		if (!result)
+			break;
+
+		if (result->d_name[0] == '.' || !endswith(result->d_name, ".webm"))
+			continue;
+
+		char *full_path = get_full_path_for_file(board_dir, result->d_name);
+		struct stat st = {0};
+		if (lstat(full_path, &st) == -1 || (S_ISLNK(st.st_mode) != want_links)) {
+			free(full_path);
+			continue;
+		}
+
+		char hash[HASH_IMAGE_STR_SIZE] = {0};
+		if (!hash_file(full_path, hash)) {
+			log_msg(LOG_ERR, "Could not hash %s.", full_path);
+			stats->failed++;
+			free(full_path);
+			continue;
+		}
+
+		if (dry_run) {
+			stats->stored++;
+		} else if (blob_store_webm(full_path, hash) == 0) {
+			stats->stored++;
+			_migrate_thumbnail(full_path, hash, stats);
+		} else {
+			stats->failed++;
+		}
+
+		free(full_path);
+	}
+
+	closedir(dirstream);
+}
+
+int main(int argc, char *argv[]) {
+	int dry_run = 0;
+	int i;
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "-n", strlen("-n")) == 0)
+			dry_run = 1;
+	}
+
+	DIR *dirstream = opendir(webm_location());
+	if (!dirstream) {
+		log_msg(LOG_ERR, "Could not open %s.", webm_location());
+		return -1;
+	}
+
+	log_msg(LOG_INFO, "Moving %s into the blob store%s.", webm_location(),
+			dry_run ? " (dry run)" : "");
+
+	migrate_stats stats = {0};
+	while (1) {
+		struct dirent *result = readdir(dirstream);
+		if (!result)
+			break;
+
+		/* Skips ., .. and the blob store itself. */
+		if (result->d_name[0] == '.')
+			continue;
+
+		char *board_dir = get_full_path_for_file(webm_location(), result->d_name);
+		struct stat st = {0};
+		if (stat(board_dir, &st) == 0 && S_ISDIR(st.st_mode)) {
+			log_msg(LOG_INFO, "Migrating /%s/.", result->d_name);
+			_migrate_board(board_dir, 0, dry_run, &stats);
+			_migrate_board(board_dir, 1, dry_run, &stats);
+		}
+		free(board_dir);
+	}
+	closedir(dirstream);
+
+	log_msg(LOG_INFO, "%u webms stored, %u duplicate thumbnails, %u failed.",
+			stats.stored, stats.deduped_thumbs, stats.failed);
+	return stats.failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,186 @@
+// vim: noet ts=4 sw=4
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "async_log.h"
+#include "blobstore.h"
+#include "metrics.h"
+#include "utils.h"
+
+int blob_store_enabled() {
+	const char *env_var = getenv("WFU_BLOB_STORE");
+	return env_var != NULL && env_var[0] != '\0' && strcmp(env_var, "0") != 0;
+}
+
+static int _ensure_dir(const char *path) {
+	if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+		log_msg(LOG_ERR, "Could not create blob directory %s.", path);
+		return -1;
+	}
+	return 0;
+}
+
+int get_blob_path(const char hash[static HASH_IMAGE_STR_SIZE], const char *ext,
+		char out[static MAX_IMAGE_FILENAME_SIZE]) {
+	if (strnlen(hash, HASH_IMAGE_STR_SIZE) < BLOB_FANOUT_WIDTH * 2)
+		return -1;
+
+	/* Absolute, same as the alias symlinks, so links work from anywhere. */
+	char *root = realpath(webm_location(), NULL);
+	if (!root) {
+		log_msg(LOG_ERR, "Could not resolve %s.", webm_location());
+		return -1;
+	}
+
+	char dir[MAX_IMAGE_FILENAME_SIZE] = {0};
+	int rc = -1;
+
+	snprintf(dir, sizeof(dir), "%s/%s", root, BLOB_DIR_NAME);
+	if (_ensure_dir(dir) != 0)
+		goto end;
+
+	/* ./webms/.blobs/AB/CD/ABCD...webm */
+	snprintf(dir, sizeof(dir), "%s/%s/%.*s", root, BLOB_DIR_NAME, BLOB_FANOUT_WIDTH, hash);
+	if (_ensure_dir(dir) != 0)
+		goto end;
+
+	snprintf(dir, sizeof(dir), "%s/%s/%.*s/%.*s", root, BLOB_DIR_NAME,
+			BLOB_FANOUT_WIDTH, hash, BLOB_FANOUT_WIDTH, hash + BLOB_FANOUT_WIDTH);
+	if (_ensure_dir(dir) != 0)
+		goto end;
+
+	const int written = snprintf(out, MAX_IMAGE_FILENAME_SIZE, "%s/%s.%s", dir, hash, ext);
+	if (written < 0 || written >= MAX_IMAGE_FILENAME_SIZE) {
+		log_msg(LOG_ERR, "Blob path for %s is too long.", hash);
+		goto end;
+	}
+
+	rc = 0;
+
+end:
+	free(root);
+	return rc;
+}
+
+int blob_link(const char *blob_path, const char *link_path) {
+	/* Build the link off to the side and rename it over, so there's never a
+	 * moment where link_path is missing. */
+	char tmp_path[PATH_MAX] = {0};
+	snprintf(tmp_path, sizeof(tmp_path), "%s.blobtmp", link_path);
+	unlink(tmp_path);
+
+	if (symlink(blob_path, tmp_path) == -1) {
+		log_msg(LOG_ERR, "Could not create symlink from '%s' to '%s'.", tmp_path, blob_path);
+		return -1;
+	}
+
+	if (rename(tmp_path, link_path) == -1) {
+		log_msg(LOG_ERR, "Could not move symlink into place at '%s'.", link_path);
+		unlink(tmp_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int _blob_store(const char *file_path, const char *blob_path, const int verify_size) {
+	struct stat st = {0};
+	if (lstat(file_path, &st) == -1) {
+		log_msg(LOG_ERR, "Could not stat '%s' for the blob store.", file_path);
+		return -1;
+	}
+
+	struct stat blob_st = {0};
+	const int have_blob = stat(blob_path, &blob_st) == 0;
+
+	if (S_ISLNK(st.st_mode)) {
+		char target[PATH_MAX] = {0};
+		const ssize_t len = readlink(file_path, target, sizeof(target) - 1);
+		if (len > 0 && strcmp(target, blob_path) == 0)
+			return 0;
+
+		/* Old style alias pointing at the original. Only relink once the
+		 * original has made it into the store. */
+		if (!have_blob) {
+			log_msg(LOG_WARN, "'%s' is a link but %s isn't stored yet.", file_path, blob_path);
+			return -1;
+		}
+
+		return blob_link(blob_path, file_path);
+	}
+
+	if (!S_ISREG(st.st_mode))
+		return -1;
+
+	metrics_cache("blob_store", have_blob);
+	if (have_blob) {
+		/* The hash only covers the start of the file, so don't trust it
+		 * alone. */
+		if (verify_size && blob_st.st_size != st.st_size) {
+			log_msg(LOG_WARN, "'%s' has the same hash as %s but a different size, keeping it.",
+					file_path, blob_path);
+			return -1;
+		}
+		log_msg(LOG_INFO, "'%s' is already stored, dropping the copy.", file_path);
+	} else if (link(file_path, blob_path) == -1) {
+		/* link() rather than rename() so two of us storing the same file
+		 * can't clobber each other. */
+		if (errno != EEXIST) {
+			log_msg(LOG_ERR, "Could not link '%s' into the blob store.", file_path);
+			return -1;
+		}
+	}
+
+	if (blob_link(blob_path, file_path) != 0)
+		return -1;
+
+	/* Keep the original timestamp on the link, same as aliases. */
+	const struct timeval times[] = {
+		{ .tv_sec = st.st_atime, .tv_usec = 0 },
+		{ .tv_sec = st.st_mtime, .tv_usec = 0 }
+	};
+	lutimes(file_path, times);
+
+	return 0;
+}
+
+int blob_store_webm(const char *file_path, const char hash[static HASH_IMAGE_STR_SIZE]) {
+	char blob_path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	if (get_blob_path(hash, BLOB_WEBM_EXT, blob_path) != 0)
+		return -1;
+
+	return _blob_store(file_path, blob_path, 1);
+}
+
+int blob_store_thumbnail(const char *thumb_path, const char webm_hash[static HASH_IMAGE_STR_SIZE]) {
+	char blob_path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	if (get_blob_path(webm_hash, BLOB_THUMB_EXT, blob_path) != 0)
+		return -1;
+
+	return _blob_store(thumb_path, blob_path, 0);
+}
+
+int get_blob_thumbnail_path(const char *file_path, char out[static MAX_IMAGE_FILENAME_SIZE]) {
+	char target[PATH_MAX] = {0};
+	const ssize_t len = readlink(file_path, target, sizeof(target) - 1);
+	if (len <= 0)
+		return -1;
+
+	const char *dir_marker = "/" BLOB_DIR_NAME "/";
+	const char *ext = strrchr(target, '.');
+	if (!strstr(target, dir_marker) || !ext || strcmp(ext + 1, BLOB_WEBM_EXT) != 0)
+		return -1;
+
+	const int written = snprintf(out, MAX_IMAGE_FILENAME_SIZE, "%.*s.%s",
+			(int)(ext - target), target, BLOB_THUMB_EXT);
+	if (written < 0 || written >= MAX_IMAGE_FILENAME_SIZE)
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,90 @@
+// vim: noet ts=4 sw=4
+#include <stdlib.h>
+
+#include "bloom.h"
+
+/* FNV-1a into splitmix64's finalizer, then double hashing for the rest. */
+static uint64_t _hash(const char *key, const size_t len) {
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)key[i];
+		hash *= 1099511628211ULL;
+	}
+
+	hash ^= hash >> 30;
+	hash *= 0xbf58476d1ce4e5b9ULL;
+	hash ^= hash >> 27;
+	hash *= 0x94d049bb133111ebULL;
+	hash ^= hash >> 31;
+	return hash;
+}
+
+bloom *bloom_new(const uint64_t capacity) {
+	uint64_t nbits = 64;
+	while (nbits < capacity * BLOOM_BITS_PER_KEY)
+		nbits <<= 1;
+
+	uint64_t *bits = calloc(nbits / 64, sizeof(uint64_t));
+	if (!bits)
+		return NULL;
+
+	bloom *filter = bloom_from_bits(bits, nbits, BLOOM_HASHES, 0);
+	if (!filter)
+		free(bits);
+	return filter;
+}
+
+bloom *bloom_from_bits(uint64_t *bits, const uint64_t nbits, const uint32_t hashes, const uint64_t count) {
+	if (nbits < 64 || (nbits & (nbits - 1)) != 0 || hashes == 0)
+		return NULL;
+
+	bloom *filter = calloc(1, sizeof(bloom));
+	if (!filter)
+		return NULL;
+
+	filter->nbits = nbits;
+	filter->hashes = hashes;
+	filter->count = count;
+	filter->bits = bits;
+	return filter;
+}
+
+void bloom_free(bloom *filter) {
+	if (!filter)
+		return;
+	free(filter->bits);
+	free(filter);
+}
+
+void bloom_add(bloom *filter, const char *key, const size_t len) {
+	const uint64_t hash = _hash(key, len);
+	const uint64_t h1 = hash, h2 = (hash >> 32) | 1;
+	const uint64_t mask = filter->nbits - 1;
+
+	uint32_t i;
+	for (i = 0; i < filter->hashes; i++) {
+		const uint64_t bit = (h1 + i * h2) & mask;
+		__atomic_fetch_or(&filter->bits[bit / 64], 1ULL << (bit % 64), __ATOMIC_RELAXED);
+	}
+	__atomic_fetch_add(&filter->count, 1, __ATOMIC_RELAXED);
+}
+
+int bloom_maybe(const bloom *filter, const char *key, const size_t len) {
+	const uint64_t hash = _hash(key, len);
+	const uint64_t h1 = hash, h2 = (hash >> 32) | 1;
+	const uint64_t mask = filter->nbits - 1;
+
+	uint32_t i;
+	for (i = 0; i < filter->hashes; i++) {
+		const uint64_t bit = (h1 + i * h2) & mask;
+		const uint64_t word = __atomic_load_n(&filter->bits[bit / 64], __ATOMIC_RELAXED);
+		if (!(word & (1ULL << (bit % 64))))
+			return 0;
+	}
+	return 1;
+}
+
+int bloom_overfull(const bloom *filter) {
+	return __atomic_load_n(&filter->count, __ATOMIC_RELAXED) * BLOOM_BITS_PER_KEY > filter->nbits;
+}
@@ -0,0 +1,193 @@
+// vim: noet ts=4 sw=4
+#include <string.h>
+
+#include "bmw256.h"
+
+/* 16 lanes of 32 bits, the whole message block or pipe at once. */
+typedef uint32_t _u32x16 __attribute__((vector_size(64)));
+
+static const uint32_t _initial_pipe[16] = {
+	0x40414243, 0x44454647, 0x48494a4b, 0x4c4d4e4f,
+	0x50515253, 0x54555657, 0x58595a5b, 0x5c5d5e5f,
+	0x60616263, 0x64656667, 0x68696a6b, 0x6c6d6e6f,
+	0x70717273, 0x74757677, 0x78797a7b, 0x7c7d7e7f,
+};
+
+static const uint32_t _final_pipe[16] = {
+	0xaaaaaaa0, 0xaaaaaaa1, 0xaaaaaaa2, 0xaaaaaaa3,
+	0xaaaaaaa4, 0xaaaaaaa5, 0xaaaaaaa6, 0xaaaaaaa7,
+	0xaaaaaaa8, 0xaaaaaaa9, 0xaaaaaaaa, 0xaaaaaaab,
+	0xaaaaaaac, 0xaaaaaaad, 0xaaaaaaae, 0xaaaaaaaf,
+};
+
+#define _ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define _S0(x) (((x) >> 1) ^ ((x) << 3) ^ _ROTL((x), 4) ^ _ROTL((x), 19))
+#define _S1(x) (((x) >> 1) ^ ((x) << 2) ^ _ROTL((x), 8) ^ _ROTL((x), 23))
+#define _S2(x) (((x) >> 2) ^ ((x) << 1) ^ _ROTL((x), 12) ^ _ROTL((x), 25))
+#define _S3(x) (((x) >> 2) ^ ((x) << 2) ^ _ROTL((x), 15) ^ _ROTL((x), 29))
+#define _S4(x) (((x) >> 1) ^ (x))
+#define _S5(x) (((x) >> 2) ^ (x))
+
+/* The message and pipe term of expansion round j (Q[j + 16]). The
+ * reference works these indices out at runtime, here they all fold away. */
+#define _ADD_ELEMENT(j) \
+	((_ROTL(M[(j) % 16], ((j) % 16) + 1) \
+	 + _ROTL(M[((j) + 3) % 16], (((j) + 3) % 16) + 1) \
+	 - _ROTL(M[((j) + 10) % 16], (((j) + 10) % 16) + 1) \
+	 + (uint32_t)(((j) + 16) * 0x05555555u)) ^ H[((j) + 7) % 16])
+
+#define _EXPAND_1(j) \
+	Q[(j) + 16] = _S1(Q[(j)]) + _S2(Q[(j) + 1]) + _S3(Q[(j) + 2]) + _S0(Q[(j) + 3]) \
+		+ _S1(Q[(j) + 4]) + _S2(Q[(j) + 5]) + _S3(Q[(j) + 6]) + _S0(Q[(j) + 7]) \
+		+ _S1(Q[(j) + 8]) + _S2(Q[(j) + 9]) + _S3(Q[(j) + 10]) + _S0(Q[(j) + 11]) \
+		+ _S1(Q[(j) + 12]) + _S2(Q[(j) + 13]) + _S3(Q[(j) + 14]) + _S0(Q[(j) + 15]) \
+		+ _ADD_ELEMENT(j)
+
+#define _EXPAND_2(j) \
+	Q[(j) + 16] = Q[(j)] + _ROTL(Q[(j) + 1], 3) + Q[(j) + 2] + _ROTL(Q[(j) + 3], 7) \
+		+ Q[(j) + 4] + _ROTL(Q[(j) + 5], 13) + Q[(j) + 6] + _ROTL(Q[(j) + 7], 16) \
+		+ Q[(j) + 8] + _ROTL(Q[(j) + 9], 19) + Q[(j) + 10] + _ROTL(Q[(j) + 11], 23) \
+		+ Q[(j) + 12] + _ROTL(Q[(j) + 13], 27) + _S4(Q[(j) + 14]) + _S5(Q[(j) + 15]) \
+		+ _ADD_ELEMENT(j)
+
+/* Compression256() from the reference, with two rounds of expand_1 and
+ * fourteen of expand_2. H is updated in place. */
+static void _compress(const uint32_t M[static 16], uint32_t H[static 16]) {
+	uint32_t W[16], Q[32];
+
+	/* f0. Every W mixes five of these, so get them all in one go. */
+	_u32x16 m, h;
+	memcpy(&m, M, sizeof(m));
+	memcpy(&h, H, sizeof(h));
+	const _u32x16 t = m ^ h;
+	uint32_t T[16];
+	memcpy(T, &t, sizeof(T));
+
+	W[ 0] = T[ 5] - T[ 7] + T[10] + T[13] + T[14];
+	W[ 1] = T[ 6] - T[ 8] + T[11] + T[14] - T[15];
+	W[ 2] = T[ 0] + T[ 7] + T[ 9] - T[12] + T[15];
+	W[ 3] = T[ 0] - T[ 1] + T[ 8] - T[10] + T[13];
+	W[ 4] = T[ 1] + T[ 2] + T[ 9] - T[11] - T[14];
+	W[ 5] = T[ 3] - T[ 2] + T[10] - T[12] + T[15];
+	W[ 6] = T[ 4] - T[ 0] - T[ 3] - T[11] + T[13];
+	W[ 7] = T[ 1] - T[ 4] - T[ 5] - T[12] - T[14];
+	W[ 8] = T[ 2] - T[ 5] - T[ 6] + T[13] - T[15];
+	W[ 9] = T[ 0] - T[ 3] + T[ 6] - T[ 7] + T[14];
+	W[10] = T[ 8] - T[ 1] - T[ 4] - T[ 7] + T[15];
+	W[11] = T[ 8] - T[ 0] - T[ 2] - T[ 5] + T[ 9];
+	W[12] = T[ 1] + T[ 3] - T[ 6] - T[ 9] + T[10];
+	W[13] = T[ 2] + T[ 4] + T[ 7] + T[10] + T[11];
+	W[14] = T[ 3] - T[ 5] + T[ 8] - T[11] - T[12];
+	W[15] = T[12] - T[ 4] - T[ 6] - T[ 9] + T[13];
+
+	Q[ 0] = _S0(W[ 0]) + H[ 1];
+	Q[ 1] = _S1(W[ 1]) + H[ 2];
+	Q[ 2] = _S2(W[ 2]) + H[ 3];
+	Q[ 3] = _S3(W[ 3]) + H[ 4];
+	Q[ 4] = _S4(W[ 4]) + H[ 5];
+	Q[ 5] = _S0(W[ 5]) + H[ 6];
+	Q[ 6] = _S1(W[ 6]) + H[ 7];
+	Q[ 7] = _S2(W[ 7]) + H[ 8];
+	Q[ 8] = _S3(W[ 8]) + H[ 9];
+	Q[ 9] = _S4(W[ 9]) + H[10];
+	Q[10] = _S0(W[10]) + H[11];
+	Q[11] = _S1(W[11]) + H[12];
+	Q[12] = _S2(W[12]) + H[13];
+	Q[13] = _S3(W[13]) + H[14];
+	Q[14] = _S4(W[14]) + H[15];
+	Q[15] = _S0(W[15]) + H[ 0];
+
+	/* f1. Each word depends on the sixteen before it, so this part stays
+	 * scalar. */
+	_EXPAND_1(0);
+	_EXPAND_1(1);
+	_EXPAND_2(2);
+	_EXPAND_2(3);
+	_EXPAND_2(4);
+	_EXPAND_2(5);
+	_EXPAND_2(6);
+	_EXPAND_2(7);
+	_EXPAND_2(8);
+	_EXPAND_2(9);
+	_EXPAND_2(10);
+	_EXPAND_2(11);
+	_EXPAND_2(12);
+	_EXPAND_2(13);
+	_EXPAND_2(14);
+	_EXPAND_2(15);
+
+	/* f2. */
+	const uint32_t XL = Q[16] ^ Q[17] ^ Q[18] ^ Q[19] ^ Q[20] ^ Q[21] ^ Q[22] ^ Q[23];
+	const uint32_t XH = XL ^ Q[24] ^ Q[25] ^ Q[26] ^ Q[27] ^ Q[28] ^ Q[29] ^ Q[30] ^ Q[31];
+
+	H[0] = ((XH << 5) ^ (Q[16] >> 5) ^ M[0]) + (XL ^ Q[24] ^ Q[0]);
+	H[1] = ((XH >> 7) ^ (Q[17] << 8) ^ M[1]) + (XL ^ Q[25] ^ Q[1]);
+	H[2] = ((XH >> 5) ^ (Q[18] << 5) ^ M[2]) + (XL ^ Q[26] ^ Q[2]);
+	H[3] = ((XH >> 1) ^ (Q[19] << 5) ^ M[3]) + (XL ^ Q[27] ^ Q[3]);
+	H[4] = ((XH >> 3) ^ Q[20] ^ M[4]) + (XL ^ Q[28] ^ Q[4]);
+	H[5] = ((XH << 6) ^ (Q[21] >> 6) ^ M[5]) + (XL ^ Q[29] ^ Q[5]);
+	H[6] = ((XH >> 4) ^ (Q[22] << 6) ^ M[6]) + (XL ^ Q[30] ^ Q[6]);
+	H[7] = ((XH >> 11) ^ (Q[23] << 2) ^ M[7]) + (XL ^ Q[31] ^ Q[7]);
+
+	H[ 8] = _ROTL(H[4],  9) + (XH ^ Q[24] ^ M[ 8]) + ((XL << 8) ^ Q[23] ^ Q[ 8]);
+	H[ 9] = _ROTL(H[5], 10) + (XH ^ Q[25] ^ M[ 9]) + ((XL >> 6) ^ Q[16] ^ Q[ 9]);
+	H[10] = _ROTL(H[6], 11) + (XH ^ Q[26] ^ M[10]) + ((XL << 6) ^ Q[17] ^ Q[10]);
+	H[11] = _ROTL(H[7], 12) + (XH ^ Q[27] ^ M[11]) + ((XL << 4) ^ Q[18] ^ Q[11]);
+	H[12] = _ROTL(H[0], 13) + (XH ^ Q[28] ^ M[12]) + ((XL >> 3) ^ Q[19] ^ Q[12]);
+	H[13] = _ROTL(H[1], 14) + (XH ^ Q[29] ^ M[13]) + ((XL >> 4) ^ Q[20] ^ Q[13]);
+	H[14] = _ROTL(H[2], 15) + (XH ^ Q[30] ^ M[14]) + ((XL >> 7) ^ Q[21] ^ Q[14]);
+	H[15] = _ROTL(H[3], 16) + (XH ^ Q[31] ^ M[15]) + ((XL >> 2) ^ Q[22] ^ Q[15]);
+}
+
+void bmw256_init(bmw256_state *state) {
+	memcpy(state->pipe, _initial_pipe, sizeof(state->pipe));
+	state->bits_processed = 0;
+}
+
+void bmw256_blocks(bmw256_state *state, const uint8_t *data, const size_t blocks) {
+	uint32_t M[16];
+	size_t i;
+	for (i = 0; i < blocks; i++) {
+		/* Host byte order, same as the reference casting the buffer. */
+		memcpy(M, data + i * BMW256_BLOCK_SIZE, sizeof(M));
+		_compress(M, state->pipe);
+	}
+	state->bits_processed += (uint64_t)blocks * BMW256_BLOCK_SIZE * 8;
+}
+
+void bmw256_final(bmw256_state *state, const uint8_t *tail, const uint64_t tail_bits,
+		uint8_t out[static BMW256_DIGEST_SIZE]) {
+	uint8_t last[BMW256_BLOCK_SIZE * 2] = {0};
+	memcpy(last, tail, (tail_bits + 7) / 8);
+
+	/* A one bit straight after the message, then zeroes, then the length
+	 * in the last 64 bits of one or two blocks. */
+	const size_t last_byte = tail_bits >> 3;
+	const int pad_one_position = 7 - (tail_bits & 0x07);
+	last[last_byte] = (last[last_byte] & (0xff << (pad_one_position + 1))) ^ (0x01 << pad_one_position);
+
+	const uint64_t total_bits = state->bits_processed + tail_bits;
+	size_t blocks = 1;
+	if (tail_bits < 448) {
+		memcpy(last + BMW256_BLOCK_SIZE - 8, &total_bits, sizeof(total_bits));
+	} else {
+		memcpy(last + BMW256_BLOCK_SIZE * 2 - 8, &total_bits, sizeof(total_bits));
+		blocks = 2;
+	}
+	bmw256_blocks(state, last, blocks);
+
+	/* The final tweak: the pipe goes through once more as the message. */
+	uint32_t final_pipe[16];
+	memcpy(final_pipe, _final_pipe, sizeof(final_pipe));
+	_compress(state->pipe, final_pipe);
+	memcpy(out, final_pipe + 8, BMW256_DIGEST_SIZE);
+}
+
+void bmw256_hash(const uint8_t *data, const uint64_t bits, uint8_t out[static BMW256_DIGEST_SIZE]) {
+	bmw256_state state;
+	bmw256_init(&state);
+
+	const size_t blocks = bits / (BMW256_BLOCK_SIZE * 8);
+	bmw256_blocks(&state, data, blocks);
+	bmw256_final(&state, data + blocks * BMW256_BLOCK_SIZE, bits - (uint64_t)blocks * BMW256_BLOCK_SIZE * 8, out);
+}
@@ -0,0 +1,235 @@
+// vim: noet ts=4 sw=4
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "async_log.h"
+#include "crawl_archive.h"
+
+struct crawl_archive {
+	/* Writing. */
+	FILE *out;
+	/* Reading. */
+	const char *map;
+	size_t map_size;
+	size_t offset;
+};
+
+static uint64_t _now_ms() {
+	struct timespec spec;
+	clock_gettime(CLOCK_REALTIME, &spec);
+	return (uint64_t)spec.tv_sec * 1000ULL + spec.tv_nsec / 1000000ULL;
+}
+
+/* How big the record at data is: 0 if it's cut short and -1 if it isn't
+ * one. */
+static ssize_t _record_size(const char *data, const size_t remaining, crawl_record_header *header) {
+	if (remaining < sizeof(*header))
+		return 0;
+	memcpy(header, data, sizeof(*header));
+
+	if (header->magic != CRAWL_RECORD_MAGIC || header->board_len >= MAX_BOARD_NAME_SIZE ||
+			(header->type != CRAWL_CATALOG && header->type != CRAWL_THREAD))
+		return -1;
+
+	const size_t record_size = sizeof(*header) + header->board_len + header->payload_len + 1;
+	return remaining < record_size ? 0 : (ssize_t)record_size;
+}
+
+/* Where the last complete record in fd ends, so a torn one from a crash
+ * doesn't end up with the next recording appended after it. -1 if it isn't
+ * an archive. */
+static ssize_t _good_size(const int fd, const size_t size) {
+	const size_t magic_len = strlen(CRAWL_ARCHIVE_MAGIC);
+	if (size < magic_len)
+		return 0;
+
+	const char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+
+	ssize_t offset = -1;
+	if (memcmp(map, CRAWL_ARCHIVE_MAGIC, magic_len) == 0) {
+		crawl_record_header header;
+		ssize_t record_size = 0;
+		offset = magic_len;
+		while ((record_size = _record_size(map + offset, size - offset, &header)) > 0)
+			offset += record_size;
+	}
+
+	munmap((void *)map, size);
+	return offset;
+}
+
+crawl_archive *crawl_archive_open_write(const char *path) {
+	crawl_archive *archive = calloc(1, sizeof(crawl_archive));
+	if (!archive)
+		return NULL;
+
+	int fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0644);
+	if (fd < 0) {
+		log_msg(LOG_ERR, "Could not open crawl archive %s for writing.", path);
+		goto error;
+	}
+
+	struct stat st = {0};
+	if (fstat(fd, &st) == -1)
+		goto error;
+
+	const ssize_t good_size = _good_size(fd, st.st_size);
+	if (good_size < 0) {
+		log_msg(LOG_ERR, "%s is not a crawl archive, not appending to it.", path);
+		goto error;
+	}
+	if (good_size < st.st_size) {
+		log_msg(LOG_WARN, "Dropping %zd bytes of torn records from the end of %s.",
+				(ssize_t)st.st_size - good_size, path);
+		if (ftruncate(fd, good_size) != 0)
+			goto error;
+	}
+
+	archive->out = fdopen(fd, "ab");
+	if (!archive->out)
+		goto error;
+	fd = -1;
+
+	if (good_size == 0) {
+		if (fwrite(CRAWL_ARCHIVE_MAGIC, strlen(CRAWL_ARCHIVE_MAGIC), 1, archive->out) != 1 ||
+				fflush(archive->out) != 0) {
+			log_msg(LOG_ERR, "Could not write crawl archive header to %s.", path);
+			goto error;
+		}
+	}
+
+	return archive;
+
+error:
+	if (fd >= 0)
+		close(fd);
+	if (archive->out)
+		fclose(archive->out);
+	free(archive);
+	return NULL;
+}
+
+crawl_archive *crawl_archive_open_read(const char *path) {
+	crawl_archive *archive = calloc(1, sizeof(crawl_archive));
+	if (!archive)
+		return NULL;
+
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		log_msg(LOG_ERR, "Could not open crawl archive %s.", path);
+		goto error;
+	}
+
+	struct stat st = {0};
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < strlen(CRAWL_ARCHIVE_MAGIC)) {
+		log_msg(LOG_ERR, "%s is too short to be a crawl archive.", path);
+		close(fd);
+		goto error;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		log_msg(LOG_ERR, "Could not map crawl archive %s.", path);
+		goto error;
+	}
+	/* Replay goes front to back exactly once. */
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	archive->map = map;
+	archive->map_size = st.st_size;
+
+	if (memcmp(archive->map, CRAWL_ARCHIVE_MAGIC, strlen(CRAWL_ARCHIVE_MAGIC)) != 0) {
+		log_msg(LOG_ERR, "%s is not a crawl archive.", path);
+		goto error;
+	}
+	archive->offset = strlen(CRAWL_ARCHIVE_MAGIC);
+
+	return archive;
+
+error:
+	crawl_archive_close(archive);
+	return NULL;
+}
+
+int crawl_archive_append(crawl_archive *archive, const CRAWL_RECORD_TYPE type,
+		const char *board, const uint64_t thread_num, const char *payload, const size_t payload_len) {
+	if (!archive || !archive->out)
+		return -1;
+
+	const size_t board_len = strnlen(board, MAX_BOARD_NAME_SIZE - 1);
+	if (payload_len > UINT32_MAX)
+		return -1;
+
+	const crawl_record_header header = {
+		.magic = CRAWL_RECORD_MAGIC,
+		.type = type,
+		.board_len = board_len,
+		.payload_len = payload_len,
+		.fetched_at_ms = _now_ms(),
+		.thread_num = thread_num,
+	};
+
+	if (fwrite(&header, sizeof(header), 1, archive->out) != 1 ||
+			fwrite(board, 1, board_len, archive->out) != board_len ||
+			fwrite(payload, 1, payload_len, archive->out) != payload_len ||
+			fputc('\0', archive->out) == EOF ||
+			fflush(archive->out) != 0) {
+		log_msg(LOG_ERR, "Could not append to crawl archive.");
+		return -1;
+	}
+
+	return 0;
+}
+
+int crawl_archive_next(crawl_archive *archive, crawl_record *out) {
+	if (!archive || !archive->map)
+		return -1;
+
+	const size_t remaining = archive->map_size - archive->offset;
+	if (remaining == 0)
+		return 0;
+
+	crawl_record_header header;
+	const ssize_t record_size = _record_size(archive->map + archive->offset, remaining, &header);
+	if (record_size < 0) {
+		log_msg(LOG_ERR, "Bad crawl archive record at offset %zu.", archive->offset);
+		return -1;
+	}
+	if (record_size == 0) {
+		log_msg(LOG_WARN, "Crawl archive ends with a partial record, stopping there.");
+		return 0;
+	}
+
+	const char *board = archive->map + archive->offset + sizeof(header);
+
+	memset(out, 0, sizeof(crawl_record));
+	out->type = header.type;
+	out->fetched_at_ms = header.fetched_at_ms;
+	out->thread_num = header.thread_num;
+	memcpy(out->board, board, header.board_len);
+	out->payload = board + header.board_len;
+	out->payload_len = header.payload_len;
+
+	archive->offset += record_size;
+	return 1;
+}
+
+void crawl_archive_close(crawl_archive *archive) {
+	if (!archive)
+		return;
+
+	if (archive->out)
+		fclose(archive->out);
+	if (archive->map)
+		munmap((void *)archive->map, archive->map_size);
+	free(archive);
+}
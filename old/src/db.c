@@ -1,5 +1,6 @@
 // vim: noet ts=4 sw=4
 #include <errno.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdio.h>
 #include <sys/socket.h>
@@ -11,30 +12,343 @@
 #include <38-moths/logging.h>
 #include <libpq-fe.h>
 
+#include "async_log.h"
 #include "db.h"
-#include "benchmark.h"
+#include "blobstore.h"
+#include "ebml.h"
+#include "hashing.h"
 #include "http.h"
+#include "known_keys.h"
 #include "models.h"
 #include "parse.h"
-#include "parson.h"
+#include "metrics.h"
+#include "probes.h"
+#include "trace.h"
 #include "utils.h"
 
+/* Set while this thread has a batch open, see db_batch_begin(). */
+static __thread PGconn *_batch_conn = NULL;
+static __thread int _batch_failed = 0;
+
 static PGconn *_get_pg_connection() {
+	if (_batch_conn)
+		return _batch_conn;
+
+	trace_span span;
+	trace_begin(&span, "db_connect");
 	PGconn *conn = PQconnectdb(DB_PG_CONNECTION_INFO);
+	trace_end(&span);
 
 	if (PQstatus(conn) != CONNECTION_OK) {
-		m38_log_msg(LOG_ERR, "Could not connect to Postgres: %s", PQerrorMessage(conn));
+		log_msg(LOG_ERR, "Could not connect to Postgres: %s", PQerrorMessage(conn));
+		metrics_db_connection(0);
+		MZBH_PROBE1(db__connect, 0);
 		return NULL;
 	}
 
+	metrics_db_connection(1);
+	MZBH_PROBE1(db__connect, 1);
 	return conn;
 }
 
 static void _finish_pg_connection(PGconn *conn) {
-	if (conn)
+	if (conn && conn != _batch_conn)
 		PQfinish(conn);
 }
 
+static int _res_ok(const PGresult *res) {
+	const ExecStatusType status = PQresultStatus(res);
+	return status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK;
+}
+
+static int _batch_exec(const char *name, const char *command) {
+	PGresult *res = PQexec(_batch_conn, command);
+	const int ok = _res_ok(res);
+	metrics_db_query(name, ok);
+	if (!ok)
+		log_msg(LOG_ERR, "%s failed: %s", command, PQerrorMessage(_batch_conn));
+	PQclear(res);
+	return ok;
+}
+
+int db_batch_begin() {
+	if (_batch_conn)
+		return -1;
+
+	PGconn *conn = _get_pg_connection();
+	if (!conn)
+		return -1;
+
+	_batch_conn = conn;
+	_batch_failed = 0;
+	if (!_batch_exec(__func__, "BEGIN")) {
+		PQfinish(conn);
+		_batch_conn = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static void _batch_end(const char *command) {
+	PGconn *conn = _batch_conn;
+	_batch_exec(command, command);
+	_batch_conn = NULL;
+	PQfinish(conn);
+}
+
+int db_batch_commit() {
+	if (!_batch_conn)
+		return -1;
+
+	if (_batch_failed) {
+		_batch_end("ROLLBACK");
+		return -1;
+	}
+
+	/* A COMMIT in an aborted transaction "succeeds" as a rollback, so the
+	 * status has to be looked at rather than just whether it errored. */
+	PGresult *res = PQexec(_batch_conn, "COMMIT");
+	const int ok = PQresultStatus(res) == PGRES_COMMAND_OK &&
+		strcmp(PQcmdStatus(res), "COMMIT") == 0;
+	metrics_db_query(__func__, ok);
+	if (!ok)
+		log_msg(LOG_ERR, "COMMIT failed: %s", PQerrorMessage(_batch_conn));
+	PQclear(res);
+
+	PGconn *conn = _batch_conn;
+	_batch_conn = NULL;
+	PQfinish(conn);
+	return ok ? 0 : -1;
+}
+
+void db_batch_rollback() {
+	if (_batch_conn)
+		_batch_end("ROLLBACK");
+}
+
+/* Every query goes through one of these, so it's timed and counted under the
+ * name of the function that ran it. */
+static PGresult *_exec_params(const char *name, PGconn *conn, const char *command,
+		int n_params, const Oid *param_types, const char * const *param_values,
+		const int *param_lengths, const int *param_formats, int result_format) {
+	trace_span span;
+	MZBH_PROBE2(query__start, name, command);
+	trace_begin(&span, name);
+	PGresult *res = PQexecParams(conn, command, n_params, param_types, param_values,
+			param_lengths, param_formats, result_format);
+	trace_end(&span);
+	const int ok = _res_ok(res);
+	MZBH_PROBE2(query__done, name, ok);
+	metrics_db_query(name, ok);
+	if (!ok && conn == _batch_conn)
+		_batch_failed = 1;
+	return res;
+}
+
+static PGresult *_exec(const char *name, PGconn *conn, const char *command) {
+	trace_span span;
+	MZBH_PROBE2(query__start, name, command);
+	trace_begin(&span, name);
+	PGresult *res = PQexec(conn, command);
+	trace_end(&span);
+	const int ok = _res_ok(res);
+	MZBH_PROBE2(query__done, name, ok);
+	metrics_db_query(name, ok);
+	if (!ok && conn == _batch_conn)
+		_batch_failed = 1;
+	return res;
+}
+
+/* First column of the first row as an id, 0 if there wasn't one. */
+static unsigned int _select_id(const char *name, PGconn *conn, const char *command,
+		int n_params, const char * const *param_values,
+		const int *param_lengths, const int *param_formats) {
+	PGresult *res = _exec_params(name, conn, command, n_params, NULL, param_values,
+			param_lengths, param_formats, 0);
+
+	unsigned int id = 0;
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
+	else if (PQntuples(res) > 0)
+		id = atol(PQgetvalue(res, 0, 0));
+
+	PQclear(res);
+	return id;
+}
+
+/* Whether to look rows up by their key strings when the 004_binary_keys.sql
+ * columns don't find them. Only rows written before that, or by something
+ * that hasn't been upgraded, need it. WFU_LEGACY_KEYS=0 turns it off. */
+static int _legacy_keys() {
+	static int legacy = -1;
+	if (legacy < 0) {
+		const char *env_var = getenv("WFU_LEGACY_KEYS");
+		legacy = !(env_var && strcmp(env_var, "0") == 0);
+	}
+
+	return legacy;
+}
+
+/* Boards are few and never change id, so each thread remembers the ones
+ * it's seen. */
+#define _MAX_BOARDS 128
+static __thread struct {
+	char name[MAX_BOARD_NAME_SIZE];
+	unsigned int id;
+} _boards[_MAX_BOARDS];
+static __thread unsigned int _boards_count = 0;
+
+/* The board's id in boards. Only the write paths pass add, lookups just
+ * SELECT and get 0 for a board nothing was ever saved under. 0 on errors. */
+static unsigned int _board_id(PGconn *conn, const char board[static MAX_BOARD_NAME_SIZE], const int add) {
+	unsigned int i;
+	for (i = 0; i < _boards_count; i++) {
+		if (strncmp(_boards[i].name, board, MAX_BOARD_NAME_SIZE) == 0)
+			return _boards[i].id;
+	}
+
+	const char *param_values[] = {board};
+	PGresult *res = _exec_params(__func__, conn, add ?
+			"WITH added AS (INSERT INTO boards (name) VALUES ($1) "
+			"ON CONFLICT DO NOTHING RETURNING id) "
+			"SELECT id, TRUE FROM added UNION ALL SELECT id, FALSE FROM boards WHERE name = $1" :
+			"SELECT id, FALSE FROM boards WHERE name = $1",
+			1, NULL, param_values, NULL, NULL, 0);
+
+	unsigned int id = 0;
+	int added = 0;
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		log_msg(LOG_ERR, "Could not get board id: %s", PQerrorMessage(conn));
+	else if (PQntuples(res) > 0) {
+		id = atol(PQgetvalue(res, 0, 0));
+		added = PQgetvalue(res, 0, 1)[0] == 't';
+	}
+	PQclear(res);
+
+	/* One added inside a batch is gone again if the batch rolls back, and a
+	 * plain lookup there can't tell whether the batch added it. */
+	const int maybe_uncommitted = conn == _batch_conn && (added || !add);
+	if (id && !maybe_uncommitted && _boards_count < _MAX_BOARDS) {
+		strncpy(_boards[_boards_count].name, board, MAX_BOARD_NAME_SIZE);
+		_boards[_boards_count].id = id;
+		_boards_count++;
+	}
+
+	return id;
+}
+
+int reindex_stage_begin() {
+	if (!_batch_conn)
+		return -1;
+
+	/* Gone again at COMMIT or ROLLBACK. */
+	PGresult *res = _exec(__func__, _batch_conn,
+			"CREATE TEMP TABLE " REINDEX_WEBMS_STAGE " ("
+			"oleg_key TEXT, alias_key TEXT, file_hash TEXT, hash_algorithm TEXT, fingerprint TEXT, "
+			"filename TEXT, board TEXT, file_path TEXT, size BIGINT, created_at DOUBLE PRECISION, "
+			"duration_ms BIGINT, width INTEGER, height INTEGER, video_codec TEXT, audio_codec TEXT, "
+			"has_audio BOOLEAN) ON COMMIT DROP; "
+			"CREATE TEMP TABLE " REINDEX_ALIASES_STAGE " ("
+			"oleg_key TEXT, webm_key TEXT, file_hash TEXT, hash_algorithm TEXT, "
+			"filename TEXT, board TEXT, file_path TEXT, created_at DOUBLE PRECISION) ON COMMIT DROP");
+	const int ok = _res_ok(res);
+	if (!ok)
+		log_msg(LOG_ERR, "Could not make staging tables: %s", PQerrorMessage(_batch_conn));
+	PQclear(res);
+
+	return ok ? 0 : -1;
+}
+
+int db_copy_rows(const char *table, const char *rows, const size_t len) {
+	if (!_batch_conn)
+		return -1;
+
+	char command[128] = {0};
+	snprintf(command, sizeof(command), "COPY %s FROM STDIN", table);
+
+	trace_span span;
+	trace_begin(&span, __func__);
+
+	/* COPY doesn't fit _exec(), it's three round trips and the first one
+	 * "succeeds" with PGRES_COPY_IN. */
+	PGresult *res = PQexec(_batch_conn, command);
+	int ok = PQresultStatus(res) == PGRES_COPY_IN;
+	PQclear(res);
+
+	if (ok) {
+		ok = PQputCopyData(_batch_conn, rows, len) == 1;
+		ok = PQputCopyEnd(_batch_conn, ok ? NULL : "Could not send rows.") == 1 && ok;
+
+		res = PQgetResult(_batch_conn);
+		ok = PQresultStatus(res) == PGRES_COMMAND_OK && ok;
+		PQclear(res);
+		while ((res = PQgetResult(_batch_conn)) != NULL)
+			PQclear(res);
+	}
+
+	trace_end(&span);
+	metrics_db_query(__func__, ok);
+	if (!ok) {
+		log_msg(LOG_ERR, "%s failed: %s", command, PQerrorMessage(_batch_conn));
+		_batch_failed = 1;
+	}
+
+	return ok ? 0 : -1;
+}
+
+/* alias_key_to_bin(), in SQL. */
+#define _ALIAS_KEY_BIN(key) \
+	"decode(substr(" key ", 6, 64), 'hex') || decode(lpad(substr(" key ", 70), 16, '0'), 'hex')"
+
+static int _reindex_insert(const char *name, const char *command, unsigned int *out_rows) {
+	PGresult *res = _exec(name, _batch_conn, command);
+	const int ok = _res_ok(res);
+	if (ok)
+		*out_rows += (unsigned int)atol(PQcmdTuples(res));
+	else
+		log_msg(LOG_ERR, "%s failed: %s", name, PQerrorMessage(_batch_conn));
+	PQclear(res);
+	return ok;
+}
+
+int reindex_merge(unsigned int *out_webms, unsigned int *out_aliases) {
+	*out_webms = 0;
+	*out_aliases = 0;
+	if (!_batch_conn)
+		return -1;
+
+	/* Webms first, the aliases need their ids. */
+	const int ok = _reindex_insert("reindex_merge_webms",
+			"INSERT INTO webms (oleg_key, file_hash, file_hash_bin, hash_algorithm, fingerprint, filename, board, "
+			"file_path, size, created_at, duration_ms, width, height, video_codec, audio_codec, has_audio) "
+			"SELECT s.oleg_key, s.file_hash, decode(s.file_hash, 'hex'), s.hash_algorithm, s.fingerprint, "
+			"s.filename, s.board, "
+			"s.file_path, s.size, to_timestamp(s.created_at), s.duration_ms, s.width, s.height, "
+			"s.video_codec, s.audio_codec, s.has_audio FROM " REINDEX_WEBMS_STAGE " AS s "
+			"WHERE NOT EXISTS (SELECT 1 FROM webms AS w WHERE w.oleg_key = s.oleg_key)",
+			out_webms) &&
+		_reindex_insert("reindex_merge_aliases",
+			"INSERT INTO webm_aliases (oleg_key, key_bin, file_hash, file_hash_bin, hash_algorithm, "
+			"filename, board, file_path, created_at, webm_id) "
+			"SELECT a.oleg_key, " _ALIAS_KEY_BIN("a.oleg_key") ", a.file_hash, decode(a.file_hash, 'hex'), "
+			"a.hash_algorithm, a.filename, a.board, a.file_path, "
+			"to_timestamp(a.created_at), w.id FROM " REINDEX_ALIASES_STAGE " AS a "
+			"JOIN webms AS w ON w.oleg_key = a.webm_key "
+			"WHERE NOT EXISTS (SELECT 1 FROM webm_aliases AS x WHERE x.oleg_key = a.oleg_key)",
+			out_aliases) &&
+		_reindex_insert("reindex_merge_displaced",
+			"INSERT INTO webm_aliases (oleg_key, key_bin, file_hash, file_hash_bin, hash_algorithm, "
+			"filename, board, file_path, created_at, webm_id) "
+			"SELECT s.alias_key, " _ALIAS_KEY_BIN("s.alias_key") ", s.file_hash, decode(s.file_hash, 'hex'), "
+			"s.hash_algorithm, s.filename, s.board, s.file_path, "
+			"to_timestamp(s.created_at), w.id FROM " REINDEX_WEBMS_STAGE " AS s "
+			"JOIN webms AS w ON w.oleg_key = s.oleg_key AND w.file_path <> s.file_path "
+			"WHERE NOT EXISTS (SELECT 1 FROM webm_aliases AS x WHERE x.oleg_key = s.alias_key)",
+			out_aliases);
+
+	return ok ? 0 : -1;
+}
+
 unsigned int get_record_count_in_table(const char *query_command) {
 	PGresult *res = NULL;
 	PGconn *conn = NULL;
@@ -44,10 +358,10 @@ unsigned int get_record_count_in_table(const char *query_command) {
 	if (!conn)
 		goto error;
 
-	res = PQexec(conn, query_command);
+	res = _exec(__func__, conn, query_command);
 
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-		m38_log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
+		log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
 		goto error;
 	}
 
@@ -73,10 +387,10 @@ static PGresult *_generic_command(const char *query_command) {
 	if (!conn)
 		goto error;
 
-	res = PQexec(conn, query_command);
+	res = _exec(__func__, conn, query_command);
 
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-		m38_log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
+		log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
 		goto error;
 	}
 
@@ -137,8 +451,12 @@ PGresult *get_posts_by_thread_id(const unsigned int id) {
 	if (!conn)
 		goto error;
 
-	res = PQexecParams(conn,
-					  "SELECT EXTRACT(EPOCH FROM p.created_at) AS created_at, p.*, w.filename AS w_filename, wa.filename AS wa_filename FROM posts AS p "
+	res = _exec_params(__func__, conn,
+					  "SELECT EXTRACT(EPOCH FROM p.created_at) AS created_at, p.*, w.filename AS w_filename, wa.filename AS wa_filename, "
+						/* GIN index on replied_to. */
+						"(SELECT count(*) FROM posts AS r WHERE r.thread_id = p.thread_id "
+						"AND r.replied_to @> ARRAY[p.fourchan_post_no::BIGINT]) AS reply_count "
+						"FROM posts AS p "
 						"JOIN threads AS t ON p.thread_id = t.id "
 						"FULL OUTER JOIN webms AS w ON w.post_id = p.id "
 						"FULL OUTER JOIN webm_aliases AS wa ON wa.post_id = p.id "
@@ -149,10 +467,10 @@ PGresult *get_posts_by_thread_id(const unsigned int id) {
 					  param_values,
 					  NULL,
 					  NULL,
-					  0);
+					  1);
 
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-		m38_log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
+		log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
 		goto error;
 	}
 
@@ -180,7 +498,7 @@ PGresult *get_aliases_by_webm_id(const unsigned int id) {
 	if (!conn)
 		goto error;
 
-	res = PQexecParams(conn,
+	res = _exec_params(__func__, conn,
 					  "SELECT EXTRACT(EPOCH FROM a.created_at) AS created_at, a.* FROM webm_aliases AS a "
 					  "WHERE a.webm_id = $1 "
 						"ORDER BY EXTRACT(EPOCH FROM a.created_at) DESC",
@@ -189,10 +507,10 @@ PGresult *get_aliases_by_webm_id(const unsigned int id) {
 					  param_values,
 					  NULL,
 					  NULL,
-					  0);
+					  1);
 
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-		m38_log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
+		log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
 		goto error;
 	}
 
@@ -223,7 +541,7 @@ PGresult *get_images_by_popularity(const unsigned int offset, const unsigned int
 
 	const char *param_values[] = {lim_buf, off_buf};
 
-	res = PQexecParams(conn,
+	res = _exec_params(__func__, conn,
 					"SELECT EXTRACT(EPOCH FROM webms.created_at) AS created_at, webms.* "
 					"FROM webms LEFT JOIN webm_aliases ON webms.id = webm_aliases.webm_id "
 					"GROUP BY webms.id "
@@ -234,10 +552,10 @@ PGresult *get_images_by_popularity(const unsigned int offset, const unsigned int
 					param_values,
 					NULL,
 					NULL,
-					0);
+					1);
 
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-		m38_log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
+		log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
 		goto error;
 	}
 
@@ -256,24 +574,49 @@ webm *get_image_by_oleg_key(const char image_hash[static HASH_ARRAY_SIZE], char
 	PGconn *conn = NULL;
 
 	create_webm_key(image_hash, out_key);
-	const char *param_values[] = {image_hash};
 
 	conn = _get_pg_connection();
 	if (!conn)
 		goto error;
 
-	res = PQexecParams(conn,
-					  "SELECT EXTRACT(EPOCH FROM created_at) AS created_at, * FROM webms WHERE file_hash = $1",
-					  1,
-					  NULL,
-					  param_values,
-					  NULL,
-					  NULL,
-					  0);
+	unsigned char hash_bin[HASH_ARRAY_SIZE] = {0};
+	if (hash_hex_to_bytes(image_hash, hash_bin)) {
+		const char *param_values[] = {(const char *)hash_bin};
+		const int param_lengths[] = {sizeof(hash_bin)};
+		const int param_formats[] = {1};
+		res = _exec_params(__func__, conn,
+						  "SELECT EXTRACT(EPOCH FROM created_at) AS created_at, * FROM webms WHERE file_hash_bin = $1",
+						  1,
+						  NULL,
+						  param_values,
+						  param_lengths,
+						  param_formats,
+						  1);
+
+		if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+			log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
+			goto error;
+		}
+	}
 
-	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-		m38_log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
-		goto error;
+	if ((!res || PQntuples(res) <= 0) && _legacy_keys()) {
+		if (res)
+			PQclear(res);
+
+		const char *param_values[] = {image_hash};
+		res = _exec_params("get_image_by_oleg_key_legacy", conn,
+						  "SELECT EXTRACT(EPOCH FROM created_at) AS created_at, * FROM webms WHERE file_hash = $1",
+						  1,
+						  NULL,
+						  param_values,
+						  NULL,
+						  NULL,
+						  1);
+
+		if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+			log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
+			goto error;
+		}
 	}
 
 	webm *deserialized = deserialize_webm_from_tuples(res, 0);
@@ -292,6 +635,72 @@ error:
 	return NULL;
 }
 
+webm *get_image_for_file(const char *file_path, char image_hash[static HASH_IMAGE_STR_SIZE],
+		HASH_ALGORITHM *algorithm, char out_key[static MAX_KEY_SIZE]) {
+	*algorithm = hash_default_algorithm();
+	webm *found = get_image_by_oleg_key(image_hash, out_key);
+	if (found || *algorithm == HASH_BMW256)
+		return found;
+
+	char legacy_hash[HASH_IMAGE_STR_SIZE] = {0};
+	if (!hash_file_with(HASH_BACKEND_BMW256, file_path, legacy_hash))
+		return NULL;
+
+	memset(out_key, '\0', MAX_KEY_SIZE);
+	found = get_image_by_oleg_key(legacy_hash, out_key);
+	if (found) {
+		memcpy(image_hash, legacy_hash, HASH_IMAGE_STR_SIZE);
+		*algorithm = HASH_BMW256;
+	}
+
+	return found;
+}
+
+int fingerprint_seen(const size_t size, const char fingerprint[static HASH_IMAGE_STR_SIZE]) {
+	PGresult *res = NULL;
+	PGconn *conn = NULL;
+	int seen = 1;
+
+	char size_buf[64] = {0};
+	snprintf(size_buf, sizeof(size_buf), "%zu", size);
+	const char *param_values[] = {size_buf, fingerprint};
+
+	conn = _get_pg_connection();
+	if (!conn)
+		goto end;
+
+	/* Rows that haven't been backfilled yet count as a match, they're
+	 * still the same size at least. */
+	res = _exec_params(__func__, conn,
+					  "SELECT 1 FROM webms WHERE size = $1 AND (fingerprint = $2 OR fingerprint IS NULL) LIMIT 1",
+					  2,
+					  NULL,
+					  param_values,
+					  NULL,
+					  NULL,
+					  0);
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
+		goto end;
+	}
+
+	seen = PQntuples(res) > 0;
+
+end:
+	if (res)
+		PQclear(res);
+	_finish_pg_connection(conn);
+	return seen;
+}
+
+static void _metadata_params(const webm_metadata *metadata, char duration_buf[static 64],
+		char width_buf[static 64], char height_buf[static 64]) {
+	snprintf(duration_buf, 64, "%"PRIu64, metadata->duration_ms);
+	snprintf(width_buf, 64, "%u", metadata->width);
+	snprintf(height_buf, 64, "%u", metadata->height);
+}
+
 unsigned int set_image(const webm *webm) {
 	char key[MAX_KEY_SIZE] = {0};
 	create_webm_key(webm->file_hash, key);
@@ -309,6 +718,18 @@ unsigned int set_image(const webm *webm) {
 	char size_buf[64] = {0};
 	snprintf(size_buf, sizeof(size_buf), "%ld", webm->size);
 
+	char duration_buf[64] = {0};
+	char width_buf[64] = {0};
+	char height_buf[64] = {0};
+	/* webm is packed, so work on an aligned copy. */
+	const webm_metadata metadata = webm->metadata;
+	_metadata_params(&metadata, duration_buf, width_buf, height_buf);
+
+	/* A webm we couldn't parse gets NULLs so the backfill tool retries it. */
+	const int has_metadata = metadata.video_codec[0] != '\0';
+
+	unsigned char hash_bin[HASH_ARRAY_SIZE] = {0};
+	const int hash_ok = hash_hex_to_bytes(webm->file_hash, hash_bin);
 	const char *param_values[] = {
 		key,
 		webm->file_hash,
@@ -316,22 +737,35 @@ unsigned int set_image(const webm *webm) {
 		webm->board,
 		webm->file_path,
 		post_id_buf,
-		size_buf
+		size_buf,
+		has_metadata ? duration_buf : NULL,
+		has_metadata ? width_buf : NULL,
+		has_metadata ? height_buf : NULL,
+		has_metadata ? metadata.video_codec : NULL,
+		has_metadata ? metadata.audio_codec : NULL,
+		has_metadata ? (metadata.has_audio ? "t" : "f") : NULL,
+		hash_algorithm_name(webm->hash_algorithm),
+		webm->fingerprint[0] != '\0' ? webm->fingerprint : NULL,
+		hash_ok ? (const char *)hash_bin : NULL
 	};
-	res = PQexecParams(conn,
+	const int param_lengths[16] = { [15] = sizeof(hash_bin) };
+	const int param_formats[16] = { [15] = 1 };
+	res = _exec_params(__func__, conn,
 					  "INSERT INTO webms (oleg_key, file_hash, filename,"
-					  "board, file_path, post_id, size)"
-					  "VALUES ($1, $2, $3, $4, $5, $6, $7) "
+					  "board, file_path, post_id, size,"
+					  "duration_ms, width, height, video_codec, audio_codec, has_audio, hash_algorithm,"
+					  "fingerprint, file_hash_bin)"
+					  "VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12, $13, $14, $15, $16) "
 					  "RETURNING id;",
-					  7,
+					  16,
 					  NULL,
 					  param_values,
-					  NULL,
-					  NULL,
+					  param_lengths,
+					  param_formats,
 					  0);
 
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-		m38_log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
+		log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
 		goto error;
 	}
 
@@ -356,24 +790,51 @@ webm_alias *get_aliased_image_with_key(const char key[static MAX_KEY_SIZE]) {
 	PGresult *res = NULL;
 	PGconn *conn = NULL;
 
-	const char *param_values[] = {key};
+	if (!known_maybe(KNOWN_ALIASES, key))
+		return NULL;
 
 	conn = _get_pg_connection();
 	if (!conn)
 		goto error;
 
-	res = PQexecParams(conn,
-					  "SELECT * FROM webm_aliases WHERE oleg_key = $1",
-					  1,
-					  NULL,
-					  param_values,
-					  NULL,
-					  NULL,
-					  0);
+	unsigned char key_bin[ALIAS_KEY_BIN_SIZE] = {0};
+	if (alias_key_to_bin(key, key_bin)) {
+		const char *param_values[] = {(const char *)key_bin};
+		const int param_lengths[] = {sizeof(key_bin)};
+		const int param_formats[] = {1};
+		res = _exec_params(__func__, conn,
+						  "SELECT * FROM webm_aliases WHERE key_bin = $1",
+						  1,
+						  NULL,
+						  param_values,
+						  param_lengths,
+						  param_formats,
+						  1);
+
+		if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+			log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
+			goto error;
+		}
+	}
 
-	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-		m38_log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
-		goto error;
+	if ((!res || PQntuples(res) <= 0) && _legacy_keys()) {
+		if (res)
+			PQclear(res);
+
+		const char *param_values[] = {key};
+		res = _exec_params("get_aliased_image_with_key_legacy", conn,
+						  "SELECT * FROM webm_aliases WHERE oleg_key = $1",
+						  1,
+						  NULL,
+						  param_values,
+						  NULL,
+						  NULL,
+						  1);
+
+		if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+			log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
+			goto error;
+		}
 	}
 
 	webm_alias *deserialized = deserialize_alias_from_tuples(res, 0);
@@ -415,6 +876,11 @@ unsigned int set_aliased_image(const webm_alias *alias) {
 	char webm_id_buf[64] = {0};
 	snprintf(webm_id_buf, sizeof(webm_id_buf), "%lu", alias->webm_id);
 
+	unsigned char hash_bin[HASH_ARRAY_SIZE] = {0};
+	const int hash_ok = hash_hex_to_bytes(alias->file_hash, hash_bin);
+	unsigned char key_bin[ALIAS_KEY_BIN_SIZE] = {0};
+	const int key_ok = alias_key_to_bin(key, key_bin);
+
 	const char *param_values[] = {
 		key,
 		alias->file_hash,
@@ -422,22 +888,27 @@ unsigned int set_aliased_image(const webm_alias *alias) {
 		alias->board,
 		alias->file_path,
 		post_id_buf,
-		webm_id_buf
+		webm_id_buf,
+		hash_algorithm_name(alias->hash_algorithm),
+		hash_ok ? (const char *)hash_bin : NULL,
+		key_ok ? (const char *)key_bin : NULL
 	};
-	res = PQexecParams(conn,
+	const int param_lengths[10] = { [8] = sizeof(hash_bin), [9] = sizeof(key_bin) };
+	const int param_formats[10] = { [8] = 1, [9] = 1 };
+	res = _exec_params(__func__, conn,
 					  "INSERT INTO webm_aliases (oleg_key, file_hash, filename,"
-					  "board, file_path, post_id, webm_id)"
-					  "VALUES ($1, $2, $3, $4, $5, $6, $7) "
+					  "board, file_path, post_id, webm_id, hash_algorithm, file_hash_bin, key_bin)"
+					  "VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10) "
 					  "RETURNING id;",
-					  7,
+					  10,
 					  NULL,
 					  param_values,
-					  NULL,
-					  NULL,
+					  param_lengths,
+					  param_formats,
 					  0);
 
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-		m38_log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
+		log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
 		goto error;
 	}
 
@@ -445,6 +916,7 @@ unsigned int set_aliased_image(const webm_alias *alias) {
 		goto error;
 
 	unsigned int id = atol(PQgetvalue(res, 0, 0));
+	known_add(KNOWN_ALIASES, key, id);
 
 	PQclear(res);
 	_finish_pg_connection(conn);
@@ -460,17 +932,18 @@ error:
 
 
 static int _insert_webm(const char *file_path, const char filename[static MAX_IMAGE_FILENAME_SIZE],
-						const char image_hash[static HASH_IMAGE_STR_SIZE], const char board[static MAX_BOARD_NAME_SIZE],
-						const unsigned int post_id) {
+						const char image_hash[static HASH_IMAGE_STR_SIZE], const HASH_ALGORITHM algorithm,
+						const char fingerprint[static HASH_IMAGE_STR_SIZE],
+						const char board[static MAX_BOARD_NAME_SIZE], const unsigned int post_id) {
 	time_t modified_time = get_file_creation_date(file_path);
 	if (modified_time == 0) {
-		m38_log_msg(LOG_ERR, "IWMT: '%s' does not exist.", file_path);
+		log_msg(LOG_ERR, "IWMT: '%s' does not exist.", file_path);
 		return 0;
 	}
 
 	size_t size = get_file_size(file_path);
 	if (size == 0) {
-		m38_log_msg(LOG_ERR, "IWFS: '%s' does not exist.", file_path);
+		log_msg(LOG_ERR, "IWFS: '%s' does not exist.", file_path);
 		return 0;
 	}
 
@@ -480,12 +953,19 @@ static int _insert_webm(const char *file_path, const char filename[static MAX_IM
 		.board = {0},
 		.created_at = modified_time,
 		.size = size,
+		.hash_algorithm = algorithm,
 		.post_id = post_id
 	};
 	memcpy(to_insert.file_hash, image_hash, sizeof(to_insert.file_hash));
 	memcpy(to_insert.file_path, file_path, sizeof(to_insert.file_path));
 	memcpy(to_insert.filename, filename, sizeof(to_insert.filename));
 	memcpy(to_insert.board, board, sizeof(to_insert.board));
+	memcpy(to_insert.fingerprint, fingerprint, sizeof(to_insert.fingerprint));
+
+	webm_metadata metadata = {0};
+	if (!parse_webm_metadata(file_path, &metadata))
+		log_msg(LOG_WARN, "Could not read webm headers for '%s'.", file_path);
+	to_insert.metadata = metadata;
 
 	return set_image(&to_insert);
 }
@@ -493,18 +973,19 @@ static int _insert_webm(const char *file_path, const char filename[static MAX_IM
 static int _insert_aliased_webm(const char *file_path,
 								const char *filename,
 								const char image_hash[static HASH_IMAGE_STR_SIZE],
+								const HASH_ALGORITHM algorithm,
 								const char board[static MAX_BOARD_NAME_SIZE],
 								const unsigned int post_id,
 								const unsigned int webm_id) {
 	time_t modified_time = get_file_creation_date(file_path);
 	if (modified_time == 0) {
-		m38_log_msg(LOG_ERR, "IAWMT: '%s' does not exist.", file_path);
+		log_msg(LOG_ERR, "IAWMT: '%s' does not exist.", file_path);
 		return 0;
 	}
 
 	size_t size = get_file_size(file_path);
 	if (size == 0) {
-		m38_log_msg(LOG_ERR, "IAWFS: '%s' does not exist.", file_path);
+		log_msg(LOG_ERR, "IAWFS: '%s' does not exist.", file_path);
 		return 0;
 	}
 
@@ -515,7 +996,8 @@ static int _insert_aliased_webm(const char *file_path,
 		.board = {0},
 		.created_at = modified_time,
 		.post_id = post_id,
-		.webm_id = webm_id
+		.webm_id = webm_id,
+		.hash_algorithm = algorithm
 	};
 
 	memcpy(to_insert.file_hash, image_hash, sizeof(to_insert.file_hash));
@@ -526,13 +1008,29 @@ static int _insert_aliased_webm(const char *file_path,
 	return set_aliased_image(&to_insert);
 }
 
+static void _set_alias_time(const char *link_path, const time_t new_stamp) {
+	/* Update timestamp on symlink to reflect what the real timestamp is (the one
+	 * on the alias). */
+	struct timeval _new_time = {
+		.tv_sec = new_stamp,
+		.tv_usec = 0
+	};
+
+	/* POSIX is fucking weird, man: */
+	const struct timeval _new_times[] = { _new_time, _new_time };
+	if (lutimes(link_path, _new_times) != 0) {
+		log_msg(LOG_WARN, "Unable to set timesteamp on new symlink.");
+		perror("Alias symlink timestamp update");
+	}
+}
+
 void modify_aliased_file(const char *file_path, const webm *_old_webm, const time_t new_stamp) {
 	char *real_fpath = NULL, *real_old_fpath = NULL;
 	real_fpath = realpath(file_path, NULL);
 	real_old_fpath = realpath(_old_webm->file_path, NULL);
 
 	if (!real_fpath || !real_old_fpath) {
-		m38_log_msg(LOG_WARN, "One or both files to be linked does not exist.");
+		log_msg(LOG_WARN, "One or both files to be linked does not exist.");
 		return;
 	}
 
@@ -540,60 +1038,70 @@ void modify_aliased_file(const char *file_path, const webm *_old_webm, const tim
 			strlen(real_fpath) : strlen(real_old_fpath);
 
 	if (strncmp(real_fpath, real_old_fpath, bigger) == 0) {
-		m38_log_msg(LOG_WARN, "Cowardly refusing to {un,sym}link the same file to itself.");
+		log_msg(LOG_WARN, "Cowardly refusing to {un,sym}link the same file to itself.");
 		goto update_time;
 	}
 
 	if (get_file_creation_date(real_fpath) == 0) {
-		m38_log_msg(LOG_WARN, "Cowardly refusing to symlink file to broken file.");
+		log_msg(LOG_WARN, "Cowardly refusing to symlink file to broken file.");
 		goto update_time;
 	}
 
-	m38_log_msg(LOG_WARN, "Unlinking and creating a symlink from '%s' to '%s'.",
+	log_msg(LOG_WARN, "Unlinking and creating a symlink from '%s' to '%s'.",
 			real_fpath, real_old_fpath);
 
 	/* Unlink new file. */
 	if (unlink(real_fpath) == -1)
-		m38_log_msg(LOG_ERR, "Could not delete '%s'.", real_fpath);
+		log_msg(LOG_ERR, "Could not delete '%s'.", real_fpath);
 
 	/* Symlink to old file. */
 	if (symlink(real_old_fpath, real_fpath) == -1)
-		m38_log_msg(LOG_ERR, "Could not create symlink from '%s' to '%s'.",
+		log_msg(LOG_ERR, "Could not create symlink from '%s' to '%s'.",
 				real_fpath, real_old_fpath);
 
 update_time: ; /* Yes the semicolon is necessary. Fucking C. */
-	/* Update timestamp on symlink to reflect what the real timestamp is (the one
-	 * on the alias). */
-	struct timeval _new_time = {
-		.tv_sec = new_stamp,
-		.tv_usec = 0
-	};
-
-	/* POSIX is fucking weird, man: */
-	const struct timeval _new_times[] = { _new_time, _new_time };
-	if (lutimes(real_fpath, _new_times) != 0) {
-		m38_log_msg(LOG_WARN, "Unable to set timesteamp on new symlink.");
-		perror("Alias symlink timestamp update");
-	}
+	_set_alias_time(real_fpath, new_stamp);
 
 	free(real_fpath);
 	free(real_old_fpath);
 }
 int add_image_to_db(const char *file_path, const char *filename, const char board[MAX_BOARD_NAME_SIZE],
 		const unsigned int post_id) {
+	/* Most new files can't match anything we have, and the fingerprint
+	 * says so without looking the full hash up (or rehashing for legacy
+	 * rows). If we can't fingerprint it we just do it the long way. */
+	size_t size = 0;
+	char fingerprint[HASH_IMAGE_STR_SIZE] = {0};
+	const int maybe_dupe = !hash_fingerprint_file(file_path, &size, fingerprint) ||
+		fingerprint_seen(size, fingerprint);
+	metrics_cache("fingerprint", !maybe_dupe);
+
+	/* New files still need this, they'll be the canonical copy. */
 	char image_hash[HASH_IMAGE_STR_SIZE] = {0};
 	if (!hash_file(file_path, image_hash)) {
-		m38_log_msg(LOG_ERR, "Could not hash '%s'.", file_path);
+		log_msg(LOG_ERR, "Could not hash '%s'.", file_path);
 		return 0;
 	}
 
+	/* Grab this before the file turns into a link to a blob that might be
+	 * older than it. */
+	const time_t new_stamp = get_file_creation_date(file_path);
+
+	/* Has to happen before the blob store, which needs the hash we keep. */
+	HASH_ALGORITHM algorithm = hash_default_algorithm();
 	char out_webm_key[MAX_KEY_SIZE] = {0};
-	webm *_old_webm = get_image_by_oleg_key(image_hash, out_webm_key);
+	webm *_old_webm = NULL;
+	if (maybe_dupe)
+		_old_webm = get_image_for_file(file_path, image_hash, &algorithm, out_webm_key);
+
+	/* Every board entry becomes a link to the one stored copy, so aliases
+	 * below don't need relinking. */
+	const int stored = blob_store_enabled() && blob_store_webm(file_path, image_hash) == 0;
 
 	if (!_old_webm) {
-		int rc = _insert_webm(file_path, filename, image_hash, board, post_id);
+		int rc = _insert_webm(file_path, filename, image_hash, algorithm, fingerprint, board, post_id);
 		if (!rc)
-			m38_log_msg(LOG_ERR, "Something went wrong inserting webm.");
+			log_msg(LOG_ERR, "Something went wrong inserting webm.");
 		return rc;
 	} else {
 		/* This is the wrong key, we're going to use a different one. */
@@ -619,10 +1127,10 @@ int add_image_to_db(const char *file_path, const char *filename, const char boar
 	 * an alias is it's filename.
 	 */
 	if (_old_alias == NULL) {
-		rc = _insert_aliased_webm(file_path, filename, image_hash, board, post_id, _old_webm->id);
-		m38_log_msg(LOG_FUN, "%s (%s) is a new alias of %s (%s).", filename, board, _old_webm->filename, _old_webm->board);
+		rc = _insert_aliased_webm(file_path, filename, image_hash, algorithm, board, post_id, _old_webm->id);
+		log_msg(LOG_FUN, "%s (%s) is a new alias of %s (%s).", filename, board, _old_webm->filename, _old_webm->board);
 	} else {
-		m38_log_msg(LOG_WARN, "%s is already marked as an alias of %s. Old alias is: '%s'",
+		log_msg(LOG_WARN, "%s is already marked as an alias of %s. Old alias is: '%s'",
 				file_path, _old_webm->filename, _old_alias->filename);
 	}
 
@@ -633,10 +1141,11 @@ int add_image_to_db(const char *file_path, const char *filename, const char boar
 	/* We don't want old alias, we want current alias here. Otherwise all
 	 * of the timestamps are going to be the same as old_alias's.
 	 */
-	if (_old_alias == NULL) {
-		time_t new_stamp = get_file_creation_date(file_path);
+	if (stored) {
+		_set_alias_time(file_path, _old_alias == NULL ? new_stamp : _old_alias->created_at);
+	} else if (_old_alias == NULL) {
 		if (new_stamp == 0) {
-			m38_log_msg(LOG_ERR, "Could not stat new alias.");
+			log_msg(LOG_ERR, "Could not stat new alias.");
 		}
 
 		modify_aliased_file(file_path, _old_webm, new_stamp);
@@ -661,17 +1170,17 @@ struct thread *get_thread_by_id(const unsigned int thread_id) {
 	snprintf(id_buf, sizeof(id_buf), "%d", thread_id);
 	const char *param_values[] = {id_buf};
 
-	res = PQexecParams(conn,
+	res = _exec_params(__func__, conn,
 					  "SELECT * FROM threads WHERE id = $1",
 					  1,
 					  NULL,
 					  param_values,
 					  NULL,
 					  NULL,
-					  0);
+					  1);
 
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-		m38_log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
+		log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
 		goto error;
 	}
 
@@ -703,17 +1212,17 @@ struct post *get_post(const unsigned int post_id) {
 	char post_id_buf[64] = {0};
 	snprintf(post_id_buf, sizeof(post_id_buf), "%d", post_id);
 	const char *param_values[] = {post_id_buf};
-	res = PQexecParams(conn,
+	res = _exec_params(__func__, conn,
 					  "SELECT * FROM posts WHERE id = $1",
 					  1,
 					  NULL,
 					  param_values,
 					  NULL,
 					  NULL,
-					  0);
+					  1);
 
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-		m38_log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
+		log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
 		goto error;
 	}
 
@@ -733,89 +1242,56 @@ error:
 	return NULL;
 }
 
-static unsigned int get_post_id_by_oleg_key(const char post_key[static MAX_KEY_SIZE]) {
-	PGresult *res = NULL;
-	PGconn *conn = NULL;
-
-	conn = _get_pg_connection();
+/* By (board_id, number) from 004_binary_keys.sql, then by key if that
+ * doesn't find it. 0 if neither does. */
+static unsigned int _get_id_by_number(const char *name, const char *by_number, const char *by_key,
+		const char board[static MAX_BOARD_NAME_SIZE], const uint64_t number,
+		const char key[static MAX_KEY_SIZE]) {
+	PGconn *conn = _get_pg_connection();
 	if (!conn)
-		goto error;
+		return 0;
 
-	const char *param_values[] = {post_key};
-	res = PQexecParams(conn,
-					  "SELECT id FROM posts WHERE oleg_key = $1",
-					  1,
-					  NULL,
-					  param_values,
-					  NULL,
-					  NULL,
-					  0);
+	unsigned int id = 0;
+	const unsigned int board_id = number ? _board_id(conn, board, 0) : 0;
+	if (board_id) {
+		char board_id_buf[32] = {0};
+		snprintf(board_id_buf, sizeof(board_id_buf), "%u", board_id);
+		char number_buf[32] = {0};
+		snprintf(number_buf, sizeof(number_buf), "%"PRIu64, number);
 
-	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-		m38_log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
-		goto error;
+		const char *param_values[] = {board_id_buf, number_buf};
+		id = _select_id(name, conn, by_number, 2, param_values, NULL, NULL);
 	}
 
-	if (PQntuples(res) <= 0)
-		goto error;
-
-	unsigned int val = atol(PQgetvalue(res, 0, 0));
-
-	PQclear(res);
-	_finish_pg_connection(conn);
-
-	return val;
-
-error:
-	if (res)
-		PQclear(res);
-	_finish_pg_connection(conn);
-	return 0;
-}
-
-static unsigned int get_thread_id_for_oleg_key(const char key[static MAX_KEY_SIZE]) {
-	PGresult *res = NULL;
-	PGconn *conn = NULL;
-
-	conn = _get_pg_connection();
-	if (!conn)
-		goto error;
-
-	const char *param_values[] = {key};
-	res = PQexecParams(conn,
-					  "SELECT id FROM threads WHERE oleg_key = $1",
-					  1,
-					  NULL,
-					  param_values,
-					  NULL,
-					  NULL,
-					  0);
+	if (!id && _legacy_keys()) {
+		char legacy_name[128] = {0};
+		snprintf(legacy_name, sizeof(legacy_name), "%s_legacy", name);
 
-	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-		m38_log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
-		goto error;
+		const char *param_values[] = {key};
+		id = _select_id(legacy_name, conn, by_key, 1, param_values, NULL, NULL);
 	}
 
-	if (PQntuples(res) <= 0)
-		goto error;
-
-	unsigned int id = atol(PQgetvalue(res, 0, 0));
-
-	PQclear(res);
 	_finish_pg_connection(conn);
-
 	return id;
-
-error:
-	if (res)
-		PQclear(res);
-	_finish_pg_connection(conn);
-	return 0;
 }
 
+static unsigned int get_post_id(const char board[static MAX_BOARD_NAME_SIZE], const uint64_t post_no,
+		const char post_key[static MAX_KEY_SIZE]) {
+	return _get_id_by_number(__func__,
+			"SELECT id FROM posts WHERE board_id = $1 AND post_no = $2",
+			"SELECT id FROM posts WHERE oleg_key = $1",
+			board, post_no, post_key);
+}
 
+static unsigned int get_thread_id(const char board[static MAX_BOARD_NAME_SIZE], const uint64_t thread_no,
+		const char thread_key[static MAX_KEY_SIZE]) {
+	return _get_id_by_number(__func__,
+			"SELECT id FROM threads WHERE board_id = $1 AND thread_no = $2",
+			"SELECT id FROM threads WHERE oleg_key = $1",
+			board, thread_no, thread_key);
+}
 
-static int _insert_thread(const thread *to_save) {
+static int _insert_thread(const thread *to_save, const uint64_t thread_no) {
 	PGresult *res = NULL;
 	PGconn *conn = NULL;
 
@@ -823,16 +1299,25 @@ static int _insert_thread(const thread *to_save) {
 	if (!conn)
 		goto error;
 
+	const unsigned int board_id = _board_id(conn, to_save->board, 1);
+	char board_id_buf[32] = {0};
+	snprintf(board_id_buf, sizeof(board_id_buf), "%u", board_id);
+
+	char thread_no_buf[32] = {0};
+	snprintf(thread_no_buf, sizeof(thread_no_buf), "%"PRIu64, thread_no);
+
 	const char *param_values[] = {
 		to_save->oleg_key,
 		to_save->board,
-		to_save->subject
+		to_save->subject,
+		board_id ? board_id_buf : NULL,
+		thread_no ? thread_no_buf : NULL
 	};
-	res = PQexecParams(conn,
-					  "INSERT INTO threads (oleg_key, board, subject)"
-					  "VALUES ($1, $2, $3) "
+	res = _exec_params(__func__, conn,
+					  "INSERT INTO threads (oleg_key, board, subject, board_id, thread_no)"
+					  "VALUES ($1, $2, $3, $4, $5) "
 					  "RETURNING id;",
-					  3,
+					  5,
 					  NULL,
 					  param_values,
 					  NULL,
@@ -840,7 +1325,7 @@ static int _insert_thread(const thread *to_save) {
 					  0);
 
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-		m38_log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
+		log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
 		goto error;
 	}
 
@@ -878,17 +1363,18 @@ static int _insert_post(const post *to_save) {
 	char fourchan_post_no[256] = {0};
 	snprintf(fourchan_post_no, sizeof(fourchan_post_no), "%lu", to_save->fourchan_post_no);
 
-	JSON_Value *thread_keys = json_value_init_array();
-	JSON_Array *thread_keys_array = json_value_get_array(thread_keys);
+	const unsigned int board_id = _board_id(conn, to_save->board, 1);
+	char board_id_buf[32] = {0};
+	snprintf(board_id_buf, sizeof(board_id_buf), "%u", board_id);
 
+	/* An array literal, {1,2,3}. At most POST_MAX_QUOTES 18 digit numbers. */
+	char replied_to[POST_MAX_QUOTES * 20 + 3] = "{";
+	size_t written = 1;
 	unsigned int i;
-	for (i = 0; i < to_save->replied_to_keys->count; i++)
-		json_array_append_string(thread_keys_array,
-				vector_get(to_save->replied_to_keys, i));
-
-	char *replied_to_json = json_serialize_to_string(thread_keys);
-
-	json_value_free(thread_keys);
+	for (i = 0; to_save->replied_to && i < to_save->replied_to->count && i < POST_MAX_QUOTES; i++)
+		written += snprintf(replied_to + written, sizeof(replied_to) - written, "%s%lu",
+				i ? "," : "", *(const uint64_t *)vector_get(to_save->replied_to, i));
+	snprintf(replied_to + written, sizeof(replied_to) - written, "}");
 
 	const char *param_values[] = {
 		to_save->oleg_key,
@@ -897,25 +1383,25 @@ static int _insert_post(const post *to_save) {
 		thread_id,
 		to_save->board,
 		to_save->body_content,
-		replied_to_json
+		replied_to,
+		board_id ? board_id_buf : NULL,
+		to_save->fourchan_post_no ? fourchan_post_no : NULL
 	};
-	res = PQexecParams(conn,
+	res = _exec_params(__func__, conn,
 					  "INSERT INTO posts "
 					  "(oleg_key, fourchan_post_id, fourchan_post_no, thread_id, board,"
-					  " body_content, replied_to_keys)"
-					  "VALUES ($1, $2, $3, $4, $5, $6, $7) "
+					  " body_content, replied_to, board_id, post_no)"
+					  "VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9) "
 					  "RETURNING id;",
-					  7,
+					  9,
 					  NULL,
 					  param_values,
 					  NULL,
 					  NULL,
 					  0);
 
-	free(replied_to_json);
-
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-		m38_log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
+		log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
 		goto error;
 	}
 
@@ -923,6 +1409,7 @@ static int _insert_post(const post *to_save) {
 		goto error;
 
 	unsigned int id = atol(PQgetvalue(res, 0, 0));
+	known_add(KNOWN_POSTS, to_save->oleg_key, id);
 
 	PQclear(res);
 	_finish_pg_connection(conn);
@@ -944,13 +1431,16 @@ unsigned int add_post_to_db(const struct post_match *p_match) {
 	char post_key[MAX_KEY_SIZE] = {0};
 	create_post_key(p_match->board, p_match->post_date, post_key);
 
-	unsigned int existing_post_id = get_post_id_by_oleg_key(post_key);
+	const uint64_t post_no = strtoull(p_match->post_no, NULL, 10);
+	/* New posts, the ones we actually want, mostly skip the lookup. */
+	unsigned int existing_post_id = known_maybe(KNOWN_POSTS, post_key) ?
+		get_post_id(p_match->board, post_no, post_key) : 0;
 	if (existing_post_id) {
 		/* We already have this post saved. */
-		m38_log_msg(LOG_WARN, "Post %s already exists.", post_key);
+		log_msg(LOG_WARN, "Post %s already exists.", post_key);
 		return existing_post_id;
 	} else {
-		m38_log_msg(LOG_INFO, "Creating post with key: %s", post_key);
+		log_msg(LOG_INFO, "Creating post with key: %s", post_key);
 	}
 
 	/* 1. Create thread key */
@@ -958,7 +1448,8 @@ unsigned int add_post_to_db(const struct post_match *p_match) {
 	create_thread_key(p_match->board, p_match->thread_number, thread_key);
 
 	/* 2. Check database for existing thread */
-	unsigned int thread_id = get_thread_id_for_oleg_key(thread_key);
+	const uint64_t thread_no = strtoull(p_match->thread_number, NULL, 10);
+	unsigned int thread_id = get_thread_id(p_match->board, thread_no, thread_key);
 	if (!thread_id) {
 		/* 3. Create it if it doesn't exist */
 		thread _new_thread = {
@@ -975,7 +1466,7 @@ unsigned int add_post_to_db(const struct post_match *p_match) {
 		strncpy(_new_thread.oleg_key, thread_key, sizeof(_new_thread.oleg_key));
 		_new_thread.subject = strdup(p_match->subject);
 
-		thread_id = _insert_thread(&_new_thread);
+		thread_id = _insert_thread(&_new_thread, thread_no);
 
 		free(_new_thread.subject);
 	}
@@ -991,24 +1482,405 @@ unsigned int add_post_to_db(const struct post_match *p_match) {
 		.fourchan_post_no = 0,
 		.fourchan_post_id = 0,
 		.body_content = NULL,
-		.replied_to_keys = vector_new(MAX_KEY_SIZE, 2),
+		.replied_to = vector_new(sizeof(uint64_t), 4),
 		.id = 0,
 		.thread_id = thread_id,
 		.created_at = 0
 	};
 
 	to_insert.fourchan_post_id = atol(p_match->post_date);
-	to_insert.fourchan_post_no = atol(p_match->post_no);
+	to_insert.fourchan_post_no = post_no;
 	strncpy(to_insert.board, p_match->board, sizeof(to_insert.board));
 	strncpy(to_insert.oleg_key, post_key, sizeof(to_insert.oleg_key));
 
-	if (p_match->body_content != NULL)
+	if (p_match->body_content != NULL) {
 		to_insert.body_content = strdup(p_match->body_content);
 
+		uint64_t quotes[POST_MAX_QUOTES] = {0};
+		const size_t num_quotes = extract_quote_links(p_match->body_content, quotes, POST_MAX_QUOTES);
+		size_t i;
+		for (i = 0; i < num_quotes; i++)
+			vector_append(to_insert.replied_to, &quotes[i], sizeof(quotes[i]));
+	}
+
 	/* 8. Save post object */
 	const unsigned int post_id = _insert_post(&to_insert);
 
 	free(to_insert.body_content);
-	vector_free(to_insert.replied_to_keys);
+	vector_free(to_insert.replied_to);
 	return post_id;
 }
+
+static PGresult *_get_keys_after(const char *name, const char *query,
+		const unsigned int after_id, const unsigned int limit) {
+	PGresult *res = NULL;
+	PGconn *conn = NULL;
+
+	char after_buf[64] = {0};
+	snprintf(after_buf, sizeof(after_buf), "%u", after_id);
+
+	char lim_buf[64] = {0};
+	snprintf(lim_buf, sizeof(lim_buf), "%u", limit);
+	const char *param_values[] = {after_buf, lim_buf};
+
+	conn = _get_pg_connection();
+	if (!conn)
+		goto error;
+
+	res = _exec_params(name, conn, query, 2, NULL, param_values, NULL, NULL, 0);
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
+		goto error;
+	}
+
+	_finish_pg_connection(conn);
+
+	return res;
+
+error:
+	if (res)
+		PQclear(res);
+	_finish_pg_connection(conn);
+	return NULL;
+}
+
+PGresult *get_post_keys_after(const unsigned int after_id, const unsigned int limit) {
+	return _get_keys_after(__func__,
+			"SELECT id, oleg_key FROM posts WHERE id > $1 ORDER BY id LIMIT $2",
+			after_id, limit);
+}
+
+PGresult *get_alias_keys_after(const unsigned int after_id, const unsigned int limit) {
+	return _get_keys_after(__func__,
+			"SELECT id, oleg_key FROM webm_aliases WHERE id > $1 ORDER BY id LIMIT $2",
+			after_id, limit);
+}
+
+PGresult *get_post_bodies_after(const unsigned int after_id, const unsigned int limit) {
+	return _get_keys_after(__func__,
+			"SELECT id, body_content FROM posts WHERE id > $1 ORDER BY id LIMIT $2",
+			after_id, limit);
+}
+
+PGresult *get_webm_filenames_after(const unsigned int after_id, const unsigned int limit) {
+	return _get_keys_after(__func__,
+			"SELECT w.id, w.filename, w.board, p.thread_id FROM webms AS w "
+			"LEFT JOIN posts AS p ON p.id = w.post_id "
+			"WHERE w.id > $1 ORDER BY w.id LIMIT $2",
+			after_id, limit);
+}
+
+PGresult *get_alias_filenames_after(const unsigned int after_id, const unsigned int limit) {
+	return _get_keys_after(__func__,
+			"SELECT wa.id, wa.filename, wa.board, p.thread_id FROM webm_aliases AS wa "
+			"LEFT JOIN posts AS p ON p.id = wa.post_id "
+			"WHERE wa.id > $1 ORDER BY wa.id LIMIT $2",
+			after_id, limit);
+}
+
+PGresult *get_webm_snapshot_rows_after(const unsigned int after_id, const unsigned int limit) {
+	return _get_keys_after(__func__,
+			"SELECT w.id, w.file_hash, w.hash_algorithm, w.filename, w.board, "
+			"EXTRACT(EPOCH FROM w.created_at)::BIGINT AS created_at, w.duration_ms, w.has_audio, "
+			"w.post_id, p.thread_id, p.fourchan_post_id, p.body_content FROM webms AS w "
+			"LEFT JOIN posts AS p ON p.id = w.post_id "
+			"WHERE w.id > $1 ORDER BY w.id LIMIT $2",
+			after_id, limit);
+}
+
+PGresult *get_alias_snapshot_rows_after(const unsigned int after_id, const unsigned int limit) {
+	return _get_keys_after(__func__,
+			"SELECT wa.id, wa.oleg_key, wa.webm_id, wa.filename, wa.board, "
+			"EXTRACT(EPOCH FROM wa.created_at)::BIGINT AS created_at, w.duration_ms, w.has_audio, "
+			"wa.post_id, p.thread_id, p.fourchan_post_id, p.body_content FROM webm_aliases AS wa "
+			"LEFT JOIN webms AS w ON w.id = wa.webm_id "
+			"LEFT JOIN posts AS p ON p.id = wa.post_id "
+			"WHERE wa.id > $1 ORDER BY wa.id LIMIT $2",
+			after_id, limit);
+}
+
+PGresult *get_posts_by_ids(const unsigned int *ids, const size_t count) {
+	PGresult *res = NULL;
+	PGconn *conn = NULL;
+
+	/* {1,2,3}, up to 10 digits each. */
+	const size_t ids_size = count * 11 + 3;
+	char *ids_buf = calloc(1, ids_size);
+	if (!ids_buf)
+		goto error;
+
+	size_t written = snprintf(ids_buf, ids_size, "{");
+	size_t i;
+	for (i = 0; i < count; i++)
+		written += snprintf(ids_buf + written, ids_size - written, "%s%u", i ? "," : "", ids[i]);
+	snprintf(ids_buf + written, ids_size - written, "}");
+	const char *param_values[] = {ids_buf};
+
+	conn = _get_pg_connection();
+	if (!conn)
+		goto error;
+
+	res = _exec_params(__func__, conn,
+					  "SELECT p.*, w.filename AS w_filename, wa.filename AS wa_filename "
+						"FROM posts AS p "
+						"LEFT JOIN webms AS w ON w.post_id = p.id "
+						"LEFT JOIN webm_aliases AS wa ON wa.post_id = p.id "
+						"WHERE p.id = ANY($1::INTEGER[])",
+					  1,
+					  NULL,
+					  param_values,
+					  NULL,
+					  NULL,
+					  1);
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
+		goto error;
+	}
+
+	free(ids_buf);
+	_finish_pg_connection(conn);
+	return res;
+
+error:
+	free(ids_buf);
+	if (res)
+		PQclear(res);
+	_finish_pg_connection(conn);
+	return NULL;
+}
+
+PGresult *get_webms_to_backfill(const unsigned int after_id, const unsigned int limit) {
+	PGresult *res = NULL;
+	PGconn *conn = NULL;
+
+	char after_buf[64] = {0};
+	snprintf(after_buf, sizeof(after_buf), "%d", after_id);
+
+	char lim_buf[64] = {0};
+	snprintf(lim_buf, sizeof(lim_buf), "%d", limit);
+	const char *param_values[] = {after_buf, lim_buf};
+
+	conn = _get_pg_connection();
+	if (!conn)
+		goto error;
+
+	res = _exec_params(__func__, conn,
+					  "SELECT id, file_path, has_audio IS NULL AS needs_metadata, "
+					  "fingerprint IS NULL AS needs_fingerprint FROM webms "
+					  "WHERE (has_audio IS NULL OR fingerprint IS NULL) AND id > $1 "
+					  "ORDER BY id LIMIT $2",
+					  2,
+					  NULL,
+					  param_values,
+					  NULL,
+					  NULL,
+					  0);
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
+		goto error;
+	}
+
+	_finish_pg_connection(conn);
+
+	return res;
+
+error:
+	if (res)
+		PQclear(res);
+	_finish_pg_connection(conn);
+	return NULL;
+}
+
+int64_t count_webms_missing_metadata(const unsigned int up_to_id) {
+	PGresult *res = NULL;
+	PGconn *conn = NULL;
+	int64_t count = -1;
+
+	char id_buf[64] = {0};
+	snprintf(id_buf, sizeof(id_buf), "%u", up_to_id);
+	const char *param_values[] = {id_buf};
+
+	conn = _get_pg_connection();
+	if (!conn)
+		goto end;
+
+	res = _exec_params(__func__, conn,
+					  "SELECT count(*) FROM webms WHERE has_audio IS NULL AND id <= $1",
+					  1,
+					  NULL,
+					  param_values,
+					  NULL,
+					  NULL,
+					  0);
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
+		goto end;
+	}
+
+	count = strtoll(PQgetvalue(res, 0, 0), NULL, 10);
+
+end:
+	if (res)
+		PQclear(res);
+	_finish_pg_connection(conn);
+	return count;
+}
+
+int update_webm_metadata(const unsigned int id, const webm_metadata *metadata) {
+	PGresult *res = NULL;
+	PGconn *conn = NULL;
+
+	char id_buf[64] = {0};
+	snprintf(id_buf, sizeof(id_buf), "%d", id);
+
+	char duration_buf[64] = {0};
+	char width_buf[64] = {0};
+	char height_buf[64] = {0};
+	_metadata_params(metadata, duration_buf, width_buf, height_buf);
+
+	const char *param_values[] = {
+		id_buf,
+		duration_buf,
+		width_buf,
+		height_buf,
+		metadata->video_codec,
+		metadata->audio_codec,
+		metadata->has_audio ? "t" : "f"
+	};
+
+	conn = _get_pg_connection();
+	if (!conn)
+		goto error;
+
+	res = _exec_params(__func__, conn,
+					  "UPDATE webms SET duration_ms = $2, width = $3, height = $4, "
+					  "video_codec = $5, audio_codec = $6, has_audio = $7 "
+					  "WHERE id = $1",
+					  7,
+					  NULL,
+					  param_values,
+					  NULL,
+					  NULL,
+					  0);
+
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		log_msg(LOG_ERR, "UPDATE failed: %s", PQerrorMessage(conn));
+		goto error;
+	}
+
+	PQclear(res);
+	_finish_pg_connection(conn);
+
+	return 1;
+
+error:
+	if (res)
+		PQclear(res);
+	_finish_pg_connection(conn);
+	return 0;
+}
+
+int update_webm_fingerprint(const unsigned int id, const char fingerprint[static HASH_IMAGE_STR_SIZE]) {
+	PGresult *res = NULL;
+	PGconn *conn = NULL;
+
+	char id_buf[64] = {0};
+	snprintf(id_buf, sizeof(id_buf), "%d", id);
+	const char *param_values[] = {id_buf, fingerprint};
+
+	conn = _get_pg_connection();
+	if (!conn)
+		goto error;
+
+	res = _exec_params(__func__, conn,
+					  "UPDATE webms SET fingerprint = $2 WHERE id = $1",
+					  2,
+					  NULL,
+					  param_values,
+					  NULL,
+					  NULL,
+					  0);
+
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		log_msg(LOG_ERR, "UPDATE failed: %s", PQerrorMessage(conn));
+		goto error;
+	}
+
+	PQclear(res);
+	_finish_pg_connection(conn);
+
+	return 1;
+
+error:
+	if (res)
+		PQclear(res);
+	_finish_pg_connection(conn);
+	return 0;
+}
+
+PGresult *get_webms_by_board_filtered(const char board[static MAX_BOARD_NAME_SIZE],
+		const uint64_t min_duration_ms, const int require_audio,
+		const unsigned int offset, const unsigned int limit) {
+	PGresult *res = NULL;
+	PGconn *conn = NULL;
+
+	char duration_buf[64] = {0};
+	snprintf(duration_buf, sizeof(duration_buf), "%"PRIu64, min_duration_ms);
+
+	char lim_buf[64] = {0};
+	snprintf(lim_buf, sizeof(lim_buf), "%d", limit);
+
+	char off_buf[64] = {0};
+	snprintf(off_buf, sizeof(off_buf), "%d", offset);
+
+	const char *param_values[] = {
+		board,
+		duration_buf,
+		require_audio ? "t" : "f",
+		lim_buf,
+		off_buf
+	};
+
+	conn = _get_pg_connection();
+	if (!conn)
+		goto error;
+
+	/* Aliases live in the board directory too, and share their canonical
+	 * webm's metadata. */
+	res = _exec_params(__func__, conn,
+					  "SELECT filename, count(*) OVER () AS total FROM ("
+					  "  SELECT w.filename, w.created_at, w.duration_ms, w.has_audio "
+					  "  FROM webms AS w WHERE w.board = $1 "
+					  "  UNION ALL "
+					  "  SELECT wa.filename, wa.created_at, w.duration_ms, w.has_audio "
+					  "  FROM webm_aliases AS wa JOIN webms AS w ON w.id = wa.webm_id WHERE wa.board = $1"
+					  ") AS x "
+					  "WHERE x.duration_ms >= $2 AND (NOT $3::boolean OR x.has_audio) "
+					  "ORDER BY x.created_at DESC "
+					  "LIMIT $4 OFFSET $5",
+					  5,
+					  NULL,
+					  param_values,
+					  NULL,
+					  NULL,
+					  0);
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		log_msg(LOG_ERR, "SELECT failed: %s", PQerrorMessage(conn));
+		goto error;
+	}
+
+	_finish_pg_connection(conn);
+
+	return res;
+
+error:
+	if (res)
+		PQclear(res);
+	_finish_pg_connection(conn);
+	return NULL;
+}
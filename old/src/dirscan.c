@@ -0,0 +1,426 @@
+// vim: noet ts=4 sw=4
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "async_log.h"
+#include "dirscan.h"
+#include "utils.h"
+
+#define DIRSCAN_STATX_MASK (STATX_TYPE | STATX_MTIME | STATX_SIZE | STATX_INO)
+
+/* What getdents64() hands back. glibc doesn't declare it for us. */
+struct _linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/* Just enough of an io_uring to push statx()es through. We talk to the
+ * kernel directly rather than pulling in liburing for one opcode. */
+typedef struct _statx_ring {
+	int fd;
+	unsigned int entries;
+
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	size_t sqes_size;
+} _statx_ring;
+
+static void _ring_close(_statx_ring *ring) {
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	if (ring->sq_ptr)
+		munmap(ring->sq_ptr, ring->sq_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	memset(ring, 0, sizeof(_statx_ring));
+	ring->fd = -1;
+}
+
+/* Returns 0 on success. Fails on kernels without io_uring, or where it's
+ * been turned off, and the caller falls back to plain statx(). */
+static int _ring_open(_statx_ring *ring) {
+	memset(ring, 0, sizeof(_statx_ring));
+	ring->fd = -1;
+
+	struct io_uring_params params = {0};
+	ring->fd = syscall(__NR_io_uring_setup, DIRSCAN_RING_ENTRIES, &params);
+	if (ring->fd < 0)
+		goto error;
+
+	ring->entries = params.sq_entries;
+	ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+	/* Newer kernels map both rings in one go. */
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		ring->sq_ptr = NULL;
+		goto error;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			ring->cq_ptr = NULL;
+			goto error;
+		}
+	}
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto error;
+	}
+
+	unsigned char *sq = ring->sq_ptr;
+	ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+
+	unsigned char *cq = ring->cq_ptr;
+	ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	return 0;
+
+error:
+	_ring_close(ring);
+	return -1;
+}
+
+static int _ring_enter(const _statx_ring *ring, const unsigned int to_submit,
+		const unsigned int min_complete, const unsigned int flags) {
+	return syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/* Where a file sits in the names vector, sorted by inode. */
+typedef struct _inode_order {
+	uint64_t ino;
+	size_t idx;
+} _inode_order;
+
+static int _compare_inodes(const void *a, const void *b) {
+	const _inode_order *_a = a;
+	const _inode_order *_b = b;
+
+	return (_a->ino > _b->ino) - (_a->ino < _b->ino);
+}
+
+/* Copies what we wanted out of a statx() into the file, or blanks its name
+ * if it's gone or isn't a regular file. Files can disappear between
+ * getdents64() and statx(), that's fine. */
+static void _apply_statx(scanned_file *file, const int rc, const struct statx *stx) {
+	if (rc < 0 || !S_ISREG(stx->stx_mode)) {
+		file->fname[0] = '\0';
+		return;
+	}
+
+	file->mtime = stx->stx_mtime.tv_sec;
+	file->size = stx->stx_size;
+	/* Was the directory entry's, which for a link isn't the file's. */
+	file->ino = stx->stx_ino;
+	file->dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+}
+
+/* Runs statx() on n files through the ring. Anything the kernel won't do
+ * for us gets done synchronously. Returns 0 on success, -1 if the ring
+ * itself broke. */
+static int _ring_statx_batch(_statx_ring *ring, const int dirfd, vector *files,
+		const _inode_order *order, const unsigned int n, struct statx *results) {
+	scanned_file *items = files->items;
+	unsigned int tail = *ring->sq_tail;
+	unsigned int i;
+	for (i = 0; i < n; i++) {
+		const unsigned int idx = tail & *ring->sq_mask;
+		struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+		memset(sqe, 0, sizeof(struct io_uring_sqe));
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = dirfd;
+		sqe->addr = (uint64_t)(uintptr_t)items[order[i].idx].fname;
+		sqe->len = DIRSCAN_STATX_MASK;
+		sqe->off = (uint64_t)(uintptr_t)&results[i];
+		sqe->statx_flags = 0;
+		sqe->user_data = i;
+
+		ring->sq_array[idx] = idx;
+		tail++;
+	}
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+	unsigned int to_submit = n;
+	while (to_submit > 0) {
+		const int submitted = _ring_enter(ring, to_submit, 0, 0);
+		if (submitted < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		to_submit -= submitted;
+	}
+
+	unsigned int reaped = 0;
+	while (reaped < n) {
+		unsigned int head = *ring->cq_head;
+		const unsigned int cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+		if (head == cq_tail) {
+			if (_ring_enter(ring, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+				return -1;
+			continue;
+		}
+
+		while (head != cq_tail) {
+			const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			const size_t which = cqe->user_data;
+			scanned_file *file = &items[order[which].idx];
+
+			int rc = cqe->res;
+			if (rc == -EINVAL || rc == -EOPNOTSUPP) {
+				/* Kernel has io_uring but not IORING_OP_STATX. */
+				rc = statx(dirfd, file->fname, 0, DIRSCAN_STATX_MASK, &results[which]);
+			}
+			_apply_statx(file, rc, &results[which]);
+
+			head++;
+			reaped++;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
+/* Every IORING_OP_STATX gets punted to the kernel's io-wq threads, so the
+ * ring only pays off when there's another core for them to run on. */
+static int _use_io_uring() {
+	const char *env_var = getenv("WFU_SCAN_IO_URING");
+	if (env_var)
+		return strcmp(env_var, "0") != 0;
+
+	return sysconf(_SC_NPROCESSORS_ONLN) > 1;
+}
+
+static void _statx_all(const int dirfd, vector *files, const _inode_order *order) {
+	struct statx results[DIRSCAN_RING_ENTRIES];
+	scanned_file *items = files->items;
+	_statx_ring ring;
+	size_t done = 0;
+
+	if (_use_io_uring() && _ring_open(&ring) == 0) {
+		const unsigned int batch = ring.entries < DIRSCAN_RING_ENTRIES ? ring.entries : DIRSCAN_RING_ENTRIES;
+		while (done < files->count) {
+			const size_t left = files->count - done;
+			const unsigned int n = left > batch ? batch : left;
+			if (_ring_statx_batch(&ring, dirfd, files, order + done, n, results) != 0) {
+				log_msg(LOG_WARN, "io_uring statx failed, finishing the scan synchronously.");
+				break;
+			}
+			done += n;
+		}
+		_ring_close(&ring);
+	}
+
+	/* No io_uring, or it gave up on us partway. */
+	for (; done < files->count; done++) {
+		scanned_file *file = &items[order[done].idx];
+		const int rc = statx(dirfd, file->fname, 0, DIRSCAN_STATX_MASK, &results[0]);
+		_apply_statx(file, rc, &results[0]);
+	}
+}
+
+vector *scan_directory(const char *dir, const char *suffix) {
+	vector *files = NULL;
+	_inode_order *order = NULL;
+	unsigned char *buf = NULL;
+
+	const int dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0)
+		return NULL;
+
+	buf = malloc(DIRSCAN_GETDENTS_SIZE);
+	files = vector_new(sizeof(scanned_file), 2048);
+	if (!buf || !files)
+		goto error;
+
+	while (1) {
+		const long nread = syscall(SYS_getdents64, dirfd, buf, DIRSCAN_GETDENTS_SIZE);
+		if (nread < 0) {
+			log_msg(LOG_ERR, "Could not read directory %s.", dir);
+			goto error;
+		}
+
+		if (nread == 0)
+			break;
+
+		long pos = 0;
+		while (pos < nread) {
+			const struct _linux_dirent64 *ent = (const struct _linux_dirent64 *)(buf + pos);
+			pos += ent->d_reclen;
+
+			/* d_type saves us a statx() on directories. Links and unknowns
+			 * still have to be looked at. */
+			if (ent->d_name[0] == '.' || ent->d_type == DT_DIR)
+				continue;
+
+			if (suffix && !endswith(ent->d_name, suffix))
+				continue;
+
+			scanned_file file = {
+				.fname = {0},
+				.mtime = 0,
+				.size = 0,
+				.ino = ent->d_ino
+			};
+			strncpy(file.fname, ent->d_name, sizeof(file.fname) - 1);
+			vector_append(files, &file, sizeof(scanned_file));
+		}
+	}
+
+	if (files->count > 0) {
+		order = malloc(files->count * sizeof(_inode_order));
+		if (!order)
+			goto error;
+
+		scanned_file *items = files->items;
+		size_t i;
+		for (i = 0; i < files->count; i++) {
+			order[i].ino = items[i].ino;
+			order[i].idx = i;
+		}
+
+		/* getdents64() comes back in hash order. Walking the inode table in
+		 * order instead turns a cold scan's reads into mostly sequential
+		 * ones. */
+		qsort(order, files->count, sizeof(_inode_order), &_compare_inodes);
+		_statx_all(dirfd, files, order);
+
+		/* Squeeze out whatever _apply_statx() threw away. */
+		size_t kept = 0;
+		for (i = 0; i < files->count; i++) {
+			if (items[i].fname[0] == '\0')
+				continue;
+			if (kept != i)
+				memcpy(&items[kept], &items[i], sizeof(scanned_file));
+			kept++;
+		}
+		files->count = kept;
+	}
+
+	free(order);
+	free(buf);
+	close(dirfd);
+	return files;
+
+error:
+	free(order);
+	if (files)
+		vector_free(files);
+	free(buf);
+	close(dirfd);
+	return NULL;
+}
+
+typedef struct _scan_work {
+	const char **dirs;
+	size_t count;
+	const char *suffix;
+	vector **out;
+	size_t next;
+	int failed;
+} _scan_work;
+
+static void *_scan_worker(void *arg) {
+	_scan_work *work = (_scan_work *)arg;
+
+	while (1) {
+		const size_t i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED);
+		if (i >= work->count)
+			break;
+
+		work->out[i] = scan_directory(work->dirs[i], work->suffix);
+		if (work->out[i] == NULL)
+			__atomic_store_n(&work->failed, 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+int scan_directories(const char *dirs[], const size_t count, const char *suffix,
+		vector *out[], const unsigned int num_threads) {
+	if (count == 0)
+		return 0;
+
+	_scan_work work = {
+		.dirs = dirs,
+		.count = count,
+		.suffix = suffix,
+		.out = out,
+		.next = 0,
+		.failed = 0
+	};
+
+	const unsigned int to_start = num_threads == 0 ? 1 : (num_threads > count ? count : num_threads);
+	pthread_t *threads = calloc(to_start, sizeof(pthread_t));
+	if (!threads)
+		return -1;
+
+	/* Whatever we couldn't start threads for, we do ourselves. */
+	unsigned int started = 0;
+	for (started = 0; started < to_start; started++) {
+		if (pthread_create(&threads[started], NULL, _scan_worker, &work) != 0)
+			break;
+	}
+
+	_scan_worker(&work);
+
+	unsigned int i;
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	return work.failed ? -1 : 0;
+}
@@ -7,21 +7,55 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 
 #include <curl/curl.h>
 #include <38-moths/38-moths.h>
 
+#include "async_log.h"
+#include "blobstore.h"
+#include "crawl_archive.h"
 #include "db.h"
 #include "http.h"
+#include "journal.h"
+#include "known_keys.h"
+#include "meta_snapshot.h"
+#include "metrics.h"
 #include "models.h"
 #include "parse.h"
+#include "probes.h"
 #include "stack.h"
+#include "text_index.h"
+#include "thumbnail.h"
+#include "trace.h"
 #include "utils.h"
 
 const char *BOARDS[] = {"a", "b", "fit", "g", "gif", "e", "h", "o", "n", "r", "s", "sci", "soc", "v", "wsg"};
 
+/* Where the API and the images live. Overridden with WFU_API_HOST and
+ * WFU_CDN_HOST to point us at scripts/mock_4chan.py. */
+const char API_HOST_DEFAULT[] = "http://a.4cdn.org";
+const char CDN_HOST_DEFAULT[] = "https://i.4cdn.org";
+
+static const char *_host(const char *env_name, const char *fallback) {
+	const char *env_var = getenv(env_name);
+	return env_var ? env_var : fallback;
+}
+
+/* Set with -r, every catalog and thread we fetch gets appended here. */
+static crawl_archive *_recording = NULL;
+/* Set with WFU_INGEST_JOURNAL, posts and images go here rather than straight
+ * into Postgres. */
+static ingest_journal *_journal = NULL;
+
+static void _record(const CRAWL_RECORD_TYPE type, const char *board, const uint64_t thread_num,
+		const char *json) {
+	if (_recording && crawl_archive_append(_recording, type, board, thread_num, json, strlen(json)) != 0)
+		log_msg(LOG_WARN, "Could not record %s to the crawl archive.", board);
+}
+
 struct MemoryStruct {
 	char *memory;
 	size_t size;
@@ -39,7 +73,7 @@ static size_t write_memory_callback(void *contents, size_t size,
 
 	mem->memory = realloc(mem->memory, mem->size + realsize + 1);
 	if(mem->memory == NULL) {
-		m38_log_msg(LOG_ERR, "Not enough memory (realloc returned NULL)");
+		log_msg(LOG_ERR, "Not enough memory (realloc returned NULL)");
 		return 0;
 	}
 
@@ -59,11 +93,16 @@ static int get_file(const char *url, FILE *out_file) {
 	curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_file_callback);
 	curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)out_file);
 	curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+	curl_easy_setopt(curl_handle, CURLOPT_FAILONERROR, 1L);
+
+	trace_span span;
+	trace_begin(&span, "fetch_file");
 	res = curl_easy_perform(curl_handle);
+	trace_end(&span);
 
 	if (res != CURLE_OK) {
 		const char *err = curl_easy_strerror(res);
-		m38_log_msg(LOG_WARN, "Could not receive chunked HTTP from board: %s", err);
+		log_msg(LOG_WARN, "Could not receive chunked HTTP from board: %s", err);
 		curl_easy_cleanup(curl_handle);
 		return 1;
 	}
@@ -85,11 +124,17 @@ char *get_json(const char *url) {
 	curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_memory_callback);
 	curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&chunk);
 	curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+	/* Otherwise a 404 or 500 page gets handed to the JSON parser. */
+	curl_easy_setopt(curl_handle, CURLOPT_FAILONERROR, 1L);
+
+	trace_span span;
+	trace_begin(&span, "fetch_json");
 	res = curl_easy_perform(curl_handle);
+	trace_end(&span);
 
 	if (res != CURLE_OK) {
 		const char *err = curl_easy_strerror(res);
-		m38_log_msg(LOG_WARN, "Could not receive chunked HTTP from board: %s", err);
+		log_msg(LOG_WARN, "Could not receive chunked HTTP from board: %s", err);
 		free(chunk.memory);
 		curl_easy_cleanup(curl_handle);
 		return NULL;
@@ -99,26 +144,63 @@ char *get_json(const char *url) {
 	return chunk.memory;
 }
 
-static ol_stack *build_thread_index() {
-	ol_stack *images_to_download = NULL;
+/* Pushes everything in a thread we don't already have onto the queue. */
+static void _queue_thread_posts(ol_stack **images_to_download, const char *thread_json,
+		const thread_match *match) {
+	ol_stack *thread_matches = parse_thread_json(thread_json, match);
+	while (thread_matches->next != NULL) {
+		post_match *p_match = (post_match *)spop(&thread_matches);
+
+		char fname[MAX_IMAGE_FILENAME_SIZE] = {0};
+		int should_skip = get_non_colliding_image_file_path(fname, p_match);
+
+		/* We already have that file. */
+		if (should_skip) {
+			free(p_match->body_content);
+			free(p_match);
+			continue;
+		}
 
+		/* Check if we have an existing alias for this file. */
+		char key[MAX_KEY_SIZE] = {0};
+		webm_alias *existing = get_aliased_image_by_oleg_key(fname, key);
+		if (existing) {
+			log_msg(LOG_INFO, "Found alias for '%s', skipping.", fname);
+			free(p_match->body_content);
+			free(p_match);
+			free(existing);
+			continue;
+		}
+
+		spush(images_to_download, p_match);
+	}
+	free(thread_matches);
+}
+
+static ol_stack *_new_queue() {
+	ol_stack *queue = malloc(sizeof(ol_stack));
+	queue->next = NULL;
+	queue->data = NULL;
+	return queue;
+}
+
+static ol_stack *build_thread_index() {
 	/* This is where we'll queue up images to be downloaded. */
-	images_to_download = malloc(sizeof(ol_stack));
-	images_to_download->next = NULL;
-	images_to_download->data = NULL;
+	ol_stack *images_to_download = _new_queue();
 
 	unsigned int i;
 	for (i = 0; i < (sizeof(BOARDS)/sizeof(BOARDS[0])); i++) {
 		const char *current_board = BOARDS[i];
 
-		char buf[128] = {0};
-		snprintf(buf, sizeof(buf), "http://a.4cdn.org/%s/catalog.json", current_board);
+		char buf[256] = {0};
+		snprintf(buf, sizeof(buf), "%s/%s/catalog.json", _host("WFU_API_HOST", API_HOST_DEFAULT), current_board);
 		char *all_json = get_json(buf);
 		if (all_json == NULL) {
-			m38_log_msg(LOG_WARN, "Could not receive HTTP from board for /%s/.", current_board);
+			log_msg(LOG_WARN, "Could not receive HTTP from board for /%s/.", current_board);
 			free(all_json);
 			continue;
 		}
+		_record(CRAWL_CATALOG, current_board, 0, all_json);
 
 		ol_stack *matches = parse_catalog_json(all_json, current_board);
 
@@ -127,48 +209,24 @@ static ol_stack *build_thread_index() {
 			thread_match *match = (thread_match*) spop(&matches);
 			ensure_directory_for_board(match->board);
 
-			m38_log_msg(LOG_INFO, "/%s/ - Requesting thread %i...", current_board, match->thread_num);
+			log_msg(LOG_INFO, "/%s/ - Requesting thread %"PRIu64"...", current_board, match->thread_num);
 
-			char templated_req[128] = {0};
+			char templated_req[256] = {0};
 
-			snprintf(templated_req, sizeof(templated_req), "http://a.4cdn.org/%s/thread/%"PRIu64".json",
-					match->board, match->thread_num);
+			snprintf(templated_req, sizeof(templated_req), "%s/%s/thread/%"PRIu64".json",
+					_host("WFU_API_HOST", API_HOST_DEFAULT), match->board, match->thread_num);
 
 			char *thread_json = get_json(templated_req);
+			metrics_downloader_thread_fetched(thread_json != NULL);
 			if (thread_json == NULL) {
-				m38_log_msg(LOG_WARN, "Could not receive chunked HTTP for thread. continuing.");
+				log_msg(LOG_WARN, "Could not receive chunked HTTP for thread. continuing.");
 				free(match);
 				continue;
 			}
 
-			ol_stack *thread_matches = parse_thread_json(thread_json, match);
-			while (thread_matches->next != NULL) {
-				post_match *p_match = (post_match *)spop(&thread_matches);
-
-				char fname[MAX_IMAGE_FILENAME_SIZE] = {0};
-				int should_skip = get_non_colliding_image_file_path(fname, p_match);
-
-				/* We already have that file. */
-				if (should_skip) {
-					free(p_match->body_content);
-					free(p_match);
-					continue;
-				}
-
-				/* Check if we have an existing alias for this file. */
-				char key[MAX_KEY_SIZE] = {0};
-				webm_alias *existing = get_aliased_image_by_oleg_key(fname, key);
-				if (existing) {
-					m38_log_msg(LOG_INFO, "Found alias for '%s', skipping.", fname);
-					free(p_match->body_content);
-					free(p_match);
-					free(existing);
-					continue;
-				}
-
-				spush(&images_to_download, p_match);
-			}
-			free(thread_matches);
+			_record(CRAWL_THREAD, match->board, match->thread_num, thread_json);
+
+			_queue_thread_posts(&images_to_download, thread_json, match);
 			free(thread_json);
 
 			free(match);
@@ -181,8 +239,29 @@ static ol_stack *build_thread_index() {
 	return images_to_download;
 }
 
-int download_image(const post_match *p_match, const unsigned int post_id) {
-	FILE *thumb_file = NULL;
+/* Returns the post's ID, or its place in the journal. 0 if it didn't work. */
+static uint64_t _save_post(const post_match *p_match) {
+	if (_journal)
+		return journal_append_post(_journal, p_match);
+	return add_post_to_db(p_match);
+}
+
+/* Returns 1 if the image was saved, or journaled. */
+static int _save_image(const char *file_path, const char *filename, const post_match *p_match,
+		const uint64_t post_ref) {
+	if (_journal)
+		return journal_append_image(_journal, p_match, post_ref, file_path, filename) == 0;
+	return add_image_to_db(file_path, filename, p_match->board, (unsigned int)post_ref);
+}
+
+/* So the next get_non_colliding_image_file_path() for it does the stat(). */
+static void _remember_file(const post_match *p_match, const char *fname_plus_extension) {
+	char key[MAX_IMAGE_FILENAME_SIZE] = {0};
+	snprintf(key, sizeof(key), "%s/%s", p_match->board, fname_plus_extension);
+	known_add(KNOWN_FILES, key, 0);
+}
+
+int download_image(const post_match *p_match, const uint64_t post_ref) {
 	FILE *image_file = NULL;
 
 	if (!p_match->should_download_image)
@@ -199,116 +278,342 @@ int download_image(const post_match *p_match, const unsigned int post_id) {
 	ensure_thumb_directory(p_match);
 	get_thumb_filename(thumb_filename, p_match);
 
-	m38_log_msg(LOG_INFO, "Downloading %s%.*s...", p_match->filename, 5, p_match->file_ext);
-
-	thumb_file = fopen(thumb_filename, "wb");
-	if (!thumb_file || ferror(thumb_file)) {
-		m38_log_msg(LOG_ERR, "Could not open thumbnail file: %s", thumb_filename);
-		perror(NULL);
-		goto error;
-	}
-
-	/* Build and send the thumbnail request. */
-	char templated_req[512] = {0};
-	snprintf(templated_req, sizeof(templated_req), "https://t.4cdn.org/%s/%ss.jpg",
-			p_match->board, p_match->post_date);
-	int rc = get_file(templated_req, thumb_file);
-	fclose(thumb_file);
-
-	if (rc) {
-		m38_log_msg(LOG_ERR, "Could not write thumbnail file.");
-		goto error;
-	}
+	log_msg(LOG_INFO, "Downloading %s%.*s...", p_match->filename, 5, p_match->file_ext);
+	MZBH_PROBE2(download__start, p_match->board, image_filename);
 
 	image_file = fopen(image_filename, "wb");
 	if (!image_file || ferror(image_file)) {
-		m38_log_msg(LOG_ERR, "Could not open image file: %s", image_filename);
+		log_msg(LOG_ERR, "Could not open image file: %s", image_filename);
 		perror(NULL);
 		goto error;
 	}
 
 	/* Build and send the image request. */
 	char image_request[512] = {0};
-	snprintf(image_request, sizeof(image_request), "https://i.4cdn.org/%s/%s%.*s",
-			p_match->board, p_match->post_date, (int)sizeof(p_match->file_ext), p_match->file_ext);
-	rc = get_file(image_request, image_file);
+	snprintf(image_request, sizeof(image_request), "%s/%s/%s%.*s",
+			_host("WFU_CDN_HOST", CDN_HOST_DEFAULT), p_match->board,
+			p_match->post_date, (int)sizeof(p_match->file_ext), p_match->file_ext);
+	int rc = get_file(image_request, image_file);
 	fclose(image_file);
+	image_file = NULL;
 
 	if (rc) {
-		m38_log_msg(LOG_ERR, "Could not write image file.");
+		log_msg(LOG_ERR, "Could not write image file.");
 		goto error;
 	}
 
+	/* Before it goes into the blob store and possibly becomes a link. */
+	const size_t downloaded = get_file_size(image_filename);
+	MZBH_PROBE3(download__done, p_match->board, image_filename, downloaded);
+	metrics_downloader_file_downloaded(1, downloaded);
+
 	char fname_plus_extension[MAX_IMAGE_FILENAME_SIZE] = {0};
 	get_non_colliding_image_filename(fname_plus_extension, p_match);
 
+	_remember_file(p_match, fname_plus_extension);
+
 	/* image_filename is the full path, fname_plus_extension is the file name. */
-	int added = add_image_to_db(image_filename, fname_plus_extension, p_match->board, post_id);
+	int added = _save_image(image_filename, fname_plus_extension, p_match, post_ref);
 	if (!added) {
-		m38_log_msg(LOG_WARN, "Could not add image to database. Continuing...");
+		log_msg(LOG_WARN, "Could not add image to database. Continuing...");
+	}
+
+	/* If the webm went into the blob store, so does its thumbnail. Duplicates
+	 * share one, and since thumbnailing skips existing files only the first
+	 * copy pays for it. */
+	char thumb_blob[MAX_IMAGE_FILENAME_SIZE] = {0};
+	const char *thumb_out = thumb_filename;
+	if (get_blob_thumbnail_path(image_filename, thumb_blob) == 0 &&
+			blob_link(thumb_blob, thumb_filename) == 0)
+		thumb_out = thumb_blob;
+
+	/* Thumbnails are made locally rather than fetched from t.4cdn.org. If the
+	 * pool is backed up we do it ourselves, which slows the crawl down to
+	 * whatever pace the thumbnailers can manage. */
+	if (thumbnail_enqueue(image_filename, thumb_out) != 0) {
+		if (!create_thumbnail_for_webm(image_filename, thumb_out))
+			log_msg(LOG_WARN, "Could not create thumbnail for %s.", image_filename);
 	}
 
 	/* Don't need the post match anymore: */
 
-	m38_log_msg(LOG_INFO, "Downloaded %s%.*s...", p_match->filename, 5, p_match->file_ext);
+	log_msg(LOG_INFO, "Downloaded %s%.*s...", p_match->filename, 5, p_match->file_ext);
 
 end:
 	return 1;
 
 error:
-	if (thumb_file != NULL)
-		fclose(thumb_file);
-
 	if (image_file != NULL)
 		fclose(image_file);
+	MZBH_PROBE3(download__done, p_match->board, image_filename, 0);
+	metrics_downloader_file_downloaded(0, 0);
 	return 0;
 }
 
-int download_images() {
+/* Stands in for download_image() when replaying. The body is a few bytes
+ * unique to the post, so every file hashes differently and nothing turns
+ * into an alias that wouldn't have anyway. No thumbnails, there's nothing to
+ * thumbnail. */
+static int _replay_image(const post_match *p_match, const uint64_t post_ref) {
+	if (!p_match->should_download_image)
+		return 1;
+
+	char image_filename[MAX_IMAGE_FILENAME_SIZE] = {0};
+	if (get_non_colliding_image_file_path(image_filename, p_match))
+		return 1;
+
+	FILE *image_file = fopen(image_filename, "wb");
+	if (!image_file) {
+		log_msg(LOG_ERR, "Could not open image file: %s", image_filename);
+		metrics_downloader_file_downloaded(0, 0);
+		return 0;
+	}
+	const int written = fprintf(image_file, "%s %s %s %s\n", p_match->board, p_match->thread_number,
+			p_match->post_no, p_match->post_date);
+	fclose(image_file);
+	metrics_downloader_file_downloaded(written > 0, written > 0 ? written : 0);
+
+	char fname_plus_extension[MAX_IMAGE_FILENAME_SIZE] = {0};
+	get_non_colliding_image_filename(fname_plus_extension, p_match);
+	_remember_file(p_match, fname_plus_extension);
+
+	if (!_save_image(image_filename, fname_plus_extension, p_match, post_ref))
+		log_msg(LOG_WARN, "Could not add image to database. Continuing...");
+
+	return 1;
+}
+
+/* Empties the queue into the DB, fetching each file with get_image. */
+static void _ingest_queue(ol_stack *images_to_download,
+		int (*get_image)(const post_match *p_match, const uint64_t post_ref)) {
+	while (images_to_download->next != NULL) {
+		post_match *p_match = (post_match *)spop(&images_to_download);
+
+		const uint64_t post_ref = _save_post(p_match);
+		if (!post_ref)
+			log_msg(LOG_ERR, "Could not add post %s to database.", p_match->post_date);
+
+		if (!get_image(p_match, post_ref))
+			log_msg(LOG_ERR, "Could not download image.");
+
+
+		free(p_match->body_content);
+		free(p_match);
+	}
+
+	free(images_to_download);
+}
+
+static void _ensure_webms_dir() {
 	struct stat st = {0};
 	if (stat(webm_location(), &st) == -1) {
-		m38_log_msg(LOG_WARN, "Creating webms directory %s.", webm_location());
+		log_msg(LOG_WARN, "Creating webms directory %s.", webm_location());
 		mkdir(webm_location(), 0755);
 	}
+}
+
+int download_images() {
+	_ensure_webms_dir();
+	metrics_downloader_pass_started();
 
 	ol_stack *images_to_download = NULL;
 	images_to_download = build_thread_index();
 	if (images_to_download == NULL) {
-		m38_log_msg(LOG_WARN, "No images to download.");
+		log_msg(LOG_WARN, "No images to download.");
 		return -1;
 	}
 
 	/* Now actually download the images. */
-	while (images_to_download->next != NULL) {
-		post_match *p_match = (post_match *)spop(&images_to_download);
+	_ingest_queue(images_to_download, download_image);
 
-		unsigned int post_id = add_post_to_db(p_match);
-		if (!post_id)
-			m38_log_msg(LOG_ERR, "Could not add post %s to database.", p_match->post_date);
+	thumbnail_pool_drain();
+	log_msg(LOG_INFO, "Downloaded all images.");
+	known_keys_save();
+	/* Anything still in the journal gets picked up next time. */
+	text_index_update();
+	meta_snapshot_update();
 
-		if (!download_image(p_match, post_id))
-			m38_log_msg(LOG_ERR, "Could not download image.");
+	return 0;
+}
 
+/* Runs a recorded crawl back through the same parse and ingest path as
+ * download_images(), minus the network and thumbnails. Catalogs get parsed
+ * (and thrown away) since a real pass would parse them too. */
+static int replay_archive(const char *path) {
+	crawl_archive *archive = crawl_archive_open_read(path);
+	if (!archive)
+		return -1;
 
-		free(p_match->body_content);
-		free(p_match);
+	_ensure_webms_dir();
+	metrics_downloader_pass_started();
+
+	crawl_record record;
+	uint64_t first_ms = 0, last_ms = 0;
+	int rc;
+	while ((rc = crawl_archive_next(archive, &record)) == 1) {
+		if (!first_ms)
+			first_ms = record.fetched_at_ms;
+		last_ms = record.fetched_at_ms;
+
+		if (record.type == CRAWL_CATALOG) {
+			ol_stack *matches = parse_catalog_json(record.payload, record.board);
+			while (matches->next != NULL)
+				free((thread_match *)spop(&matches));
+			free(matches);
+			continue;
+		}
+
+		thread_match match = {
+			.thread_num = record.thread_num
+		};
+		strncpy(match.board, record.board, sizeof(match.board) - 1);
+		ensure_directory_for_board(match.board);
+		metrics_downloader_thread_fetched(1);
+
+		ol_stack *images_to_download = _new_queue();
+		_queue_thread_posts(&images_to_download, record.payload, &match);
+		_ingest_queue(images_to_download, _replay_image);
 	}
+	crawl_archive_close(archive);
+	known_keys_save();
+	text_index_update();
+	meta_snapshot_update();
 
-	free(images_to_download);
-	m38_log_msg(LOG_INFO, "Downloaded all images.");
+	log_msg(LOG_INFO, "Replayed %s, recorded over %.1f minutes.", path, (last_ms - first_ms) / 60000.0);
+	return rc < 0 ? -1 : 0;
+}
 
-	return 0;
+
+/* One line scripts/crawl_bench.sh can pick apart. */
+static void _log_pass_summary(const double seconds) {
+	const downloader_progress *progress = metrics_downloader_attach();
+	uint64_t connections = 0, queries = 0;
+	metrics_db_totals(&connections, &queries);
+	/* Files the fingerprint showed were new, and ones it couldn't. */
+	uint64_t fingerprint_new = 0, fingerprint_maybe = 0;
+	metrics_cache_totals("fingerprint", &fingerprint_new, &fingerprint_maybe);
+
+	struct rusage usage = {0};
+	getrusage(RUSAGE_SELF, &usage);
+
+	log_msg(LOG_INFO, "Pass summary: seconds=%.3f threads=%"PRIu64" files=%"PRIu64" bytes=%"PRIu64
+			" errors=%"PRIu64" queries=%"PRIu64" connections=%"PRIu64" max_rss_kb=%ld"
+			" fingerprint_new=%"PRIu64" fingerprint_maybe=%"PRIu64,
+			seconds,
+			progress ? progress->threads_fetched : 0,
+			progress ? progress->files_downloaded : 0,
+			progress ? progress->bytes_downloaded : 0,
+			progress ? progress->download_errors + progress->thread_fetch_errors : 0,
+			queries, connections, usage.ru_maxrss, fingerprint_new, fingerprint_maybe);
 }
 
+/* Applies everything journaled so far, for when we're about to exit.
+ * Returns 0 if that was all of it. */
+static int _drain_journal() {
+	if (!_journal)
+		return 0;
+
+	journal_stop_applier(_journal);
+	journal_sync(_journal);
+
+	int applied;
+	while ((applied = journal_apply(_journal, JOURNAL_APPLY_BATCH)) > 0)
+		metrics_downloader_journal(journal_pending_bytes(_journal), applied);
+
+	if (applied < 0) {
+		log_msg(LOG_WARN, "Could not apply the ingest journal, %"PRIu64" bytes left for next time.",
+				journal_pending_bytes(_journal));
+		return -1;
+	}
+	return 0;
+}
 
 int main(int argc, char *argv[]) {
-	UNUSED(argc);
-	UNUSED(argv);
+	int once = 0;
+	int apply_only = 0;
+	const char *record_path = NULL;
+	const char *replay_path = NULL;
+	int i;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-o") == 0) {
+			once = 1;
+		} else if (strcmp(argv[i], "-a") == 0) {
+			apply_only = 1;
+		} else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			record_path = argv[++i];
+		} else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+			replay_path = argv[++i];
+		} else {
+			log_msg(LOG_ERR, "Usage: %s [-o] [-a] [-r archive | -p archive]", argv[0]);
+			return -1;
+		}
+	}
+
+	log_start();
+	log_msg(LOG_INFO, "Downloader started.");
+	metrics_downloader_attach();
+
+	/* Everything still works without them, just with more stat()s and
+	 * queries. */
+	_ensure_webms_dir();
+	known_keys_load();
+
+	const char *journal_path = getenv("WFU_INGEST_JOURNAL");
+	if (journal_path && journal_path[0] != '\0') {
+		_journal = journal_open(journal_path);
+		if (!_journal)
+			return -1;
+	}
+
+	/* -a applies whatever is journaled and exits. */
+	if (apply_only) {
+		if (!_journal) {
+			log_msg(LOG_ERR, "-a needs WFU_INGEST_JOURNAL.");
+			return -1;
+		}
+		const int rc = _drain_journal();
+		journal_close(_journal);
+		return rc;
+	}
+
+	if (_journal && journal_start_applier(_journal) != 0)
+		return -1;
+
+	/* -p replays a recorded crawl as fast as the DB will take it, then exits. */
+	if (replay_path) {
+		const uint64_t started = trace_now_ns();
+		int rc = replay_archive(replay_path);
+		if (_drain_journal() != 0)
+			rc = -1;
+		_log_pass_summary((trace_now_ns() - started) / 1.0e9);
+		journal_close(_journal);
+		return rc;
+	}
+
+	if (record_path) {
+		_recording = crawl_archive_open_write(record_path);
+		if (!_recording)
+			return -1;
+	}
+
+	if (thumbnail_pool_start(thumbnail_default_threads()) != 0)
+		return -1;
+
+	/* -o does a single pass and exits, for benchmarking. */
+	if (once) {
+		const uint64_t started = trace_now_ns();
+		int rc = download_images();
+		if (_drain_journal() != 0)
+			rc = -1;
+		_log_pass_summary((trace_now_ns() - started) / 1.0e9);
+		crawl_archive_close(_recording);
+		journal_close(_journal);
+		return rc;
+	}
 
-	m38_log_msg(LOG_INFO, "Downloader started.");
 	while (1) {
 		if (download_images() != 0) {
-			m38_log_msg(LOG_WARN, "Something went wrong while downloading images.");
+			log_msg(LOG_WARN, "Something went wrong while downloading images.");
 		}
 		sleep(1200); /* 20 Minutes */
 	}
@@ -0,0 +1,252 @@
+// vim: noet ts=4 sw=4
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "async_log.h"
+#include "ebml.h"
+
+/* The handful of Matroska element IDs we care about. IDs keep their length
+ * marker bits, which is how they're written in the spec. */
+#define EBML_ID_HEADER        0x1A45DFA3
+#define EBML_ID_DOCTYPE       0x4282
+#define EBML_ID_SEGMENT       0x18538067
+#define EBML_ID_INFO          0x1549A966
+#define EBML_ID_TIMECODESCALE 0x2AD7B1
+#define EBML_ID_DURATION      0x4489
+#define EBML_ID_TRACKS        0x1654AE6B
+#define EBML_ID_TRACKENTRY    0xAE
+#define EBML_ID_TRACKTYPE     0x83
+#define EBML_ID_CODECID       0x86
+#define EBML_ID_VIDEO         0xE0
+#define EBML_ID_PIXELWIDTH    0xB0
+#define EBML_ID_PIXELHEIGHT   0xBA
+#define EBML_ID_CLUSTER       0x1F43B675
+
+#define EBML_TRACK_VIDEO 1
+#define EBML_TRACK_AUDIO 2
+
+#define EBML_UNKNOWN_SIZE UINT64_MAX
+
+typedef struct _ebml_state {
+	uint64_t timecode_scale;
+	double duration;
+	int done;
+
+	/* The track we're currently inside of. */
+	uint64_t track_type;
+	char codec[EBML_MAX_CODEC_SIZE];
+	unsigned int width;
+	unsigned int height;
+} _ebml_state;
+
+/* Reads a variable length integer at buf[*pos]. IDs keep their marker bit,
+ * sizes don't. Returns 0 if we ran out of buffer or it's malformed. */
+static int _read_vint(const unsigned char *buf, const size_t len, size_t *pos,
+		const int keep_marker, uint64_t *out) {
+	if (*pos >= len)
+		return 0;
+
+	const unsigned char first = buf[*pos];
+	unsigned int width = 1;
+	while (width <= 8 && !(first & (0x80 >> (width - 1))))
+		width++;
+
+	if (width > 8 || *pos + width > len)
+		return 0;
+
+	uint64_t value = keep_marker ? first : first & (0xFF >> width);
+	int all_ones = value == (uint64_t)(0xFF >> width);
+
+	unsigned int i;
+	for (i = 1; i < width; i++) {
+		value = (value << 8) | buf[*pos + i];
+		all_ones = all_ones && buf[*pos + i] == 0xFF;
+	}
+
+	*pos += width;
+	*out = (!keep_marker && all_ones) ? EBML_UNKNOWN_SIZE : value;
+	return 1;
+}
+
+static uint64_t _read_uint(const unsigned char *buf, const size_t size) {
+	uint64_t value = 0;
+	size_t i;
+	for (i = 0; i < size && i < 8; i++)
+		value = (value << 8) | buf[i];
+	return value;
+}
+
+static double _read_float(const unsigned char *buf, const size_t size) {
+	const uint64_t bits = _read_uint(buf, size);
+
+	if (size == 4) {
+		const uint32_t bits32 = bits;
+		float f;
+		memcpy(&f, &bits32, sizeof(f));
+		return f;
+	} else if (size == 8) {
+		double d;
+		memcpy(&d, &bits, sizeof(d));
+		return d;
+	}
+
+	return 0;
+}
+
+static void _copy_string(char *dest, const size_t dest_size, const unsigned char *src, const size_t size) {
+	const size_t to_copy = size < dest_size - 1 ? size : dest_size - 1;
+	memcpy(dest, src, to_copy);
+	dest[to_copy] = '\0';
+}
+
+static void _finish_track(_ebml_state *state, webm_metadata *out) {
+	if (state->track_type == EBML_TRACK_VIDEO && out->video_codec[0] == '\0') {
+		memcpy(out->video_codec, state->codec, sizeof(out->video_codec));
+		out->width = state->width;
+		out->height = state->height;
+	} else if (state->track_type == EBML_TRACK_AUDIO && !out->has_audio) {
+		memcpy(out->audio_codec, state->codec, sizeof(out->audio_codec));
+		out->has_audio = 1;
+	}
+}
+
+static void _parse_level(const unsigned char *buf, const size_t len, size_t pos, const size_t end,
+		_ebml_state *state, webm_metadata *out) {
+	while (pos < end && !state->done) {
+		uint64_t id = 0, size = 0;
+		if (!_read_vint(buf, len, &pos, 1, &id) || !_read_vint(buf, len, &pos, 0, &size) || pos > end)
+			return;
+
+		/* Masters we descend into. Segment is allowed to have an unknown
+		 * size, and any of them may run off the end of what we read. */
+		if (id == EBML_ID_SEGMENT || id == EBML_ID_INFO || id == EBML_ID_TRACKS ||
+				id == EBML_ID_TRACKENTRY || id == EBML_ID_VIDEO) {
+			const size_t child_end = (size == EBML_UNKNOWN_SIZE || size > end - pos) ? end : pos + size;
+
+			if (id == EBML_ID_TRACKENTRY) {
+				state->track_type = 0;
+				state->width = 0;
+				state->height = 0;
+				memset(state->codec, 0, sizeof(state->codec));
+			}
+
+			_parse_level(buf, len, pos, child_end, state, out);
+
+			if (id == EBML_ID_TRACKENTRY)
+				_finish_track(state, out);
+
+			pos = child_end;
+			continue;
+		}
+
+		/* Media data starts here, and everything we want comes before it. */
+		if (id == EBML_ID_CLUSTER) {
+			state->done = 1;
+			return;
+		}
+
+		if (size == EBML_UNKNOWN_SIZE || size > end - pos)
+			return;
+
+		const unsigned char *data = buf + pos;
+		switch (id) {
+			case EBML_ID_TIMECODESCALE:
+				state->timecode_scale = _read_uint(data, size);
+				break;
+			case EBML_ID_DURATION:
+				state->duration = _read_float(data, size);
+				break;
+			case EBML_ID_TRACKTYPE:
+				state->track_type = _read_uint(data, size);
+				break;
+			case EBML_ID_CODECID:
+				_copy_string(state->codec, sizeof(state->codec), data, size);
+				break;
+			case EBML_ID_PIXELWIDTH:
+				state->width = _read_uint(data, size);
+				break;
+			case EBML_ID_PIXELHEIGHT:
+				state->height = _read_uint(data, size);
+				break;
+			default:
+				break;
+		}
+
+		pos += size;
+	}
+}
+
+int parse_webm_metadata_buf(const unsigned char *buf, const size_t len, webm_metadata *out) {
+	memset(out, 0, sizeof(webm_metadata));
+
+	size_t pos = 0;
+	uint64_t id = 0, size = 0;
+	if (!_read_vint(buf, len, &pos, 1, &id) || id != EBML_ID_HEADER)
+		return 0;
+
+	if (!_read_vint(buf, len, &pos, 0, &size) || size == EBML_UNKNOWN_SIZE || size > len - pos)
+		return 0;
+
+	/* Make sure this is actually something Matroska-shaped. */
+	const size_t header_end = pos + size;
+	int doctype_ok = 0;
+	while (pos < header_end) {
+		uint64_t child_id = 0, child_size = 0;
+		if (!_read_vint(buf, len, &pos, 1, &child_id) || !_read_vint(buf, len, &pos, 0, &child_size) ||
+				child_size == EBML_UNKNOWN_SIZE || child_size > header_end - pos)
+			return 0;
+
+		if (child_id == EBML_ID_DOCTYPE) {
+			char doctype[16] = {0};
+			_copy_string(doctype, sizeof(doctype), buf + pos, child_size);
+			doctype_ok = strcmp(doctype, "webm") == 0 || strcmp(doctype, "matroska") == 0;
+		}
+		pos += child_size;
+	}
+
+	if (!doctype_ok)
+		return 0;
+
+	_ebml_state state = {
+		.timecode_scale = 1000000, /* Default is milliseconds. */
+		.duration = 0,
+		.done = 0
+	};
+	_parse_level(buf, len, pos, len, &state, out);
+
+	/* Duration is in units of TimecodeScale nanoseconds. */
+	if (state.duration > 0)
+		out->duration_ms = (uint64_t)(state.duration * (double)state.timecode_scale / 1000000.0);
+
+	return 1;
+}
+
+int parse_webm_metadata(const char *file_path, webm_metadata *out) {
+	const int fd = open(file_path, O_RDONLY);
+	if (fd < 0) {
+		log_msg(LOG_ERR, "Could not open '%s' for metadata.", file_path);
+		return 0;
+	}
+
+	unsigned char *buf = malloc(EBML_READ_SIZE);
+	if (!buf) {
+		close(fd);
+		return 0;
+	}
+
+	size_t len = 0;
+	while (len < EBML_READ_SIZE) {
+		const ssize_t rd = read(fd, buf + len, EBML_READ_SIZE - len);
+		if (rd <= 0)
+			break;
+		len += rd;
+	}
+	close(fd);
+
+	const int rc = parse_webm_metadata_buf(buf, len, out);
+	free(buf);
+
+	return rc;
+}
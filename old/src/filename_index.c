@@ -0,0 +1,604 @@
+// vim: noet ts=4 sw=4
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "async_log.h"
+#include "db.h"
+#include "filename_index.h"
+#include "utils.h"
+
+typedef struct _entry {
+	/* Into _index.names, NUL terminated. */
+	uint32_t name;
+	uint32_t id;
+	uint32_t thread_id;
+	uint16_t name_len;
+	uint8_t board;
+	uint8_t is_alias;
+} _entry;
+
+/* Entries a trigram shows up in, ascending. */
+typedef struct _postings {
+	/* 0 if the slot's empty, no trigram of ours has a NUL in it. */
+	uint32_t trigram;
+	uint32_t count;
+	uint32_t cap;
+	uint32_t *entries;
+} _postings;
+
+typedef struct __attribute__((__packed__)) _saved_header {
+	char magic[sizeof(FILENAME_INDEX_MAGIC) - 1];
+	uint64_t watermarks[2];
+	uint32_t boards;
+	uint32_t entries;
+	uint64_t names_len;
+} _saved_header;
+
+typedef struct __attribute__((__packed__)) _saved_entry {
+	uint32_t id;
+	uint32_t thread_id;
+	uint16_t name_len;
+	uint8_t board;
+	uint8_t is_alias;
+} _saved_entry;
+
+static struct {
+	pthread_rwlock_t lock;
+	_entry *entries;
+	size_t count;
+	size_t cap;
+	char *names;
+	size_t names_len;
+	size_t names_cap;
+	_postings *slots;
+	/* Always a power of two. */
+	size_t slots_cap;
+	size_t slots_used;
+	char boards[FILENAME_INDEX_MAX_BOARDS][MAX_BOARD_NAME_SIZE];
+	unsigned int num_boards;
+	/* Highest webms.id and webm_aliases.id we've caught up to. */
+	uint64_t watermarks[2];
+	int warned_full;
+} _index = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+static pthread_mutex_t _refresh_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void _path(char out[static MAX_IMAGE_FILENAME_SIZE]) {
+	snprintf(out, MAX_IMAGE_FILENAME_SIZE, "%s/%s", webm_location(), FILENAME_INDEX_FILE);
+}
+
+/* Lowercased, with the entities filenames get stored with decoded. Returns
+ * the length. */
+static size_t _normalize(const char *src, const size_t len, char out[static MAX_IMAGE_FILENAME_SIZE]) {
+	static const struct { const char *entity; char c; } entities[] = {
+		{"&#039;", '\''}, {"&amp;", '&'}, {"&quot;", '"'}, {"&lt;", '<'}, {"&gt;", '>'}
+	};
+
+	size_t i = 0, n = 0;
+	while (i < len && n < MAX_IMAGE_FILENAME_SIZE - 1) {
+		if (src[i] == '&') {
+			size_t e;
+			for (e = 0; e < sizeof(entities) / sizeof(entities[0]); e++) {
+				const size_t elen = strlen(entities[e].entity);
+				if (elen <= len - i && strncmp(src + i, entities[e].entity, elen) == 0)
+					break;
+			}
+			if (e < sizeof(entities) / sizeof(entities[0])) {
+				out[n++] = entities[e].c;
+				i += strlen(entities[e].entity);
+				continue;
+			}
+		}
+
+		char c = src[i++];
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		out[n++] = c;
+	}
+	out[n] = '\0';
+	return n;
+}
+
+static uint32_t _trigram(const char *p) {
+	return ((uint32_t)(unsigned char)p[0] << 16) | ((uint32_t)(unsigned char)p[1] << 8) | (unsigned char)p[2];
+}
+
+static int _trigram_cmp(const void *a, const void *b) {
+	const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Distinct trigrams of an already normalized name, sorted. */
+static size_t _trigrams(const char *name, const size_t len, uint32_t out[static MAX_IMAGE_FILENAME_SIZE]) {
+	if (len < 3)
+		return 0;
+
+	size_t count = 0, i;
+	for (i = 0; i + 3 <= len; i++)
+		out[count++] = _trigram(name + i);
+	qsort(out, count, sizeof(uint32_t), _trigram_cmp);
+
+	size_t unique = 0;
+	for (i = 0; i < count; i++) {
+		if (unique == 0 || out[unique - 1] != out[i])
+			out[unique++] = out[i];
+	}
+	return unique;
+}
+
+static uint64_t _slot_hash(const uint32_t trigram) {
+	return (trigram * 0x9E3779B97F4A7C15ULL) >> 20;
+}
+
+static const _postings *_find_postings(const uint32_t trigram) {
+	if (!_index.slots_cap)
+		return NULL;
+
+	size_t i = _slot_hash(trigram) & (_index.slots_cap - 1);
+	while (_index.slots[i].trigram) {
+		if (_index.slots[i].trigram == trigram)
+			return &_index.slots[i];
+		i = (i + 1) & (_index.slots_cap - 1);
+	}
+	return NULL;
+}
+
+static _postings *_get_postings(const uint32_t trigram) {
+	if ((_index.slots_used + 1) * 4 > _index.slots_cap * 3) {
+		const size_t cap = _index.slots_cap ? _index.slots_cap * 2 : 8192;
+		_postings *slots = calloc(cap, sizeof(_postings));
+		if (!slots)
+			return NULL;
+
+		size_t i;
+		for (i = 0; i < _index.slots_cap; i++) {
+			if (!_index.slots[i].trigram)
+				continue;
+			size_t j = _slot_hash(_index.slots[i].trigram) & (cap - 1);
+			while (slots[j].trigram)
+				j = (j + 1) & (cap - 1);
+			slots[j] = _index.slots[i];
+		}
+		free(_index.slots);
+		_index.slots = slots;
+		_index.slots_cap = cap;
+	}
+
+	size_t i = _slot_hash(trigram) & (_index.slots_cap - 1);
+	while (_index.slots[i].trigram) {
+		if (_index.slots[i].trigram == trigram)
+			return &_index.slots[i];
+		i = (i + 1) & (_index.slots_cap - 1);
+	}
+
+	_index.slots[i].trigram = trigram;
+	_index.slots_used++;
+	return &_index.slots[i];
+}
+
+static int _board_index(const char *board) {
+	unsigned int i;
+	for (i = 0; i < _index.num_boards; i++) {
+		if (strncmp(_index.boards[i], board, MAX_BOARD_NAME_SIZE) == 0)
+			return i;
+	}
+	if (_index.num_boards == FILENAME_INDEX_MAX_BOARDS)
+		return -1;
+
+	strncpy(_index.boards[_index.num_boards], board, MAX_BOARD_NAME_SIZE - 1);
+	return _index.num_boards++;
+}
+
+/* With the write lock held. */
+static int _add_locked(const int is_alias, const unsigned int id, const char *filename,
+		const char *board, const unsigned int thread_id) {
+	const size_t len = strnlen(filename, MAX_IMAGE_FILENAME_SIZE - 1);
+	if (_index.count >= FILENAME_INDEX_MAX_ENTRIES) {
+		if (!_index.warned_full)
+			log_msg(LOG_WARN, "Filename index is full, new filenames won't be searchable.");
+		_index.warned_full = 1;
+		return -1;
+	}
+
+	const int board_idx = _board_index(board ? board : "");
+	if (board_idx < 0)
+		return -1;
+
+	if (_index.count == _index.cap) {
+		const size_t cap = _index.cap ? _index.cap * 2 : 4096;
+		_entry *entries = realloc(_index.entries, cap * sizeof(_entry));
+		if (!entries)
+			return -1;
+		_index.entries = entries;
+		_index.cap = cap;
+	}
+	if (_index.names_len + len + 1 > _index.names_cap) {
+		size_t cap = _index.names_cap ? _index.names_cap * 2 : 65536;
+		while (cap < _index.names_len + len + 1)
+			cap *= 2;
+		char *names = realloc(_index.names, cap);
+		if (!names)
+			return -1;
+		_index.names = names;
+		_index.names_cap = cap;
+	}
+
+	const uint32_t entry_idx = _index.count;
+	char normalized[MAX_IMAGE_FILENAME_SIZE] = {0};
+	uint32_t trigrams[MAX_IMAGE_FILENAME_SIZE];
+	const size_t ntrigrams = _trigrams(normalized, _normalize(filename, len, normalized), trigrams);
+	size_t i;
+	for (i = 0; i < ntrigrams; i++) {
+		_postings *postings = _get_postings(trigrams[i]);
+		if (!postings)
+			return -1;
+		if (postings->count == postings->cap) {
+			const uint32_t cap = postings->cap ? postings->cap * 2 : 4;
+			uint32_t *entries = realloc(postings->entries, cap * sizeof(uint32_t));
+			if (!entries)
+				return -1;
+			postings->entries = entries;
+			postings->cap = cap;
+		}
+		postings->entries[postings->count++] = entry_idx;
+	}
+
+	memcpy(_index.names + _index.names_len, filename, len);
+	_index.names[_index.names_len + len] = '\0';
+	_index.entries[_index.count++] = (_entry){
+		.name = _index.names_len,
+		.id = id,
+		.thread_id = thread_id,
+		.name_len = len,
+		.board = board_idx,
+		.is_alias = is_alias ? 1 : 0
+	};
+	_index.names_len += len + 1;
+	return 0;
+}
+
+int filename_index_add(const int is_alias, const unsigned int id, const char *filename,
+		const char *board, const unsigned int thread_id) {
+	pthread_rwlock_wrlock(&_index.lock);
+	const int rc = _add_locked(is_alias, id, filename, board, thread_id);
+	pthread_rwlock_unlock(&_index.lock);
+	return rc;
+}
+
+void filename_index_clear() {
+	pthread_rwlock_wrlock(&_index.lock);
+	size_t i;
+	for (i = 0; i < _index.slots_cap; i++)
+		free(_index.slots[i].entries);
+	free(_index.slots);
+	free(_index.entries);
+	free(_index.names);
+	_index.slots = NULL;
+	_index.entries = NULL;
+	_index.names = NULL;
+	_index.count = _index.cap = 0;
+	_index.names_len = _index.names_cap = 0;
+	_index.slots_cap = _index.slots_used = 0;
+	_index.num_boards = 0;
+	_index.watermarks[0] = _index.watermarks[1] = 0;
+	_index.warned_full = 0;
+	pthread_rwlock_unlock(&_index.lock);
+}
+
+/* Catching up */
+
+/* One page of (id, filename, board, thread_id) rows. Returns how many there
+ * were, or -1. */
+static int _refresh_page(const int is_alias) {
+	pthread_rwlock_rdlock(&_index.lock);
+	const uint64_t watermark = _index.watermarks[is_alias];
+	pthread_rwlock_unlock(&_index.lock);
+
+	PGresult *res = is_alias ? get_alias_filenames_after(watermark, FILENAME_INDEX_PAGE) :
+		get_webm_filenames_after(watermark, FILENAME_INDEX_PAGE);
+	if (!res)
+		return -1;
+
+	const int rows = PQntuples(res);
+	int i;
+	pthread_rwlock_wrlock(&_index.lock);
+	for (i = 0; i < rows; i++) {
+		const unsigned int id = strtoul(PQgetvalue(res, i, 0), NULL, 10);
+		_add_locked(is_alias, id, PQgetvalue(res, i, 1), PQgetvalue(res, i, 2),
+				strtoul(PQgetvalue(res, i, 3), NULL, 10));
+		_index.watermarks[is_alias] = id;
+	}
+	pthread_rwlock_unlock(&_index.lock);
+	PQclear(res);
+	return rows;
+}
+
+int filename_index_refresh() {
+	pthread_mutex_lock(&_refresh_lock);
+	int added = 0;
+	int is_alias;
+	for (is_alias = 0; is_alias < 2; is_alias++) {
+		int rows;
+		while ((rows = _refresh_page(is_alias)) > 0) {
+			added += rows;
+			if (rows < FILENAME_INDEX_PAGE)
+				break;
+		}
+		if (rows < 0) {
+			added = -1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&_refresh_lock);
+	return added;
+}
+
+/* Snapshots */
+
+int filename_index_save() {
+	char path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	char tmp_path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	_path(path);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	FILE *f = fopen(tmp_path, "wb");
+	if (!f) {
+		log_msg(LOG_WARN, "Could not save the filename index to %s.", tmp_path);
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&_index.lock);
+	_saved_header header = {
+		.watermarks = { _index.watermarks[0], _index.watermarks[1] },
+		.boards = _index.num_boards,
+		.entries = _index.count,
+		.names_len = _index.names_len
+	};
+	memcpy(header.magic, FILENAME_INDEX_MAGIC, sizeof(header.magic));
+
+	int ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+		(header.boards == 0 || fwrite(_index.boards, MAX_BOARD_NAME_SIZE, header.boards, f) == header.boards);
+	size_t i;
+	for (i = 0; ok && i < _index.count; i++) {
+		const _entry *entry = &_index.entries[i];
+		const _saved_entry saved = {
+			.id = entry->id,
+			.thread_id = entry->thread_id,
+			.name_len = entry->name_len,
+			.board = entry->board,
+			.is_alias = entry->is_alias
+		};
+		ok = fwrite(&saved, sizeof(saved), 1, f) == 1;
+	}
+	ok = ok && (_index.names_len == 0 || fwrite(_index.names, _index.names_len, 1, f) == 1);
+	pthread_rwlock_unlock(&_index.lock);
+
+	if (fclose(f) != 0 || !ok || rename(tmp_path, path) != 0) {
+		log_msg(LOG_WARN, "Could not save the filename index to %s.", path);
+		unlink(tmp_path);
+		return -1;
+	}
+	return 0;
+}
+
+int filename_index_load() {
+	char path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	_path(path);
+
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return -1;
+
+	_saved_entry *entries = NULL;
+	char *names = NULL;
+	char (*boards)[MAX_BOARD_NAME_SIZE] = NULL;
+
+	_saved_header header = {0};
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+			memcmp(header.magic, FILENAME_INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+			header.boards > FILENAME_INDEX_MAX_BOARDS || header.entries > FILENAME_INDEX_MAX_ENTRIES)
+		goto error;
+
+	boards = calloc(header.boards + 1, MAX_BOARD_NAME_SIZE);
+	entries = calloc(header.entries + 1, sizeof(_saved_entry));
+	names = malloc(header.names_len + 1);
+	if (!boards || !entries || !names ||
+			(header.boards && fread(boards, MAX_BOARD_NAME_SIZE, header.boards, f) != header.boards) ||
+			(header.entries && fread(entries, sizeof(_saved_entry), header.entries, f) != header.entries) ||
+			(header.names_len && fread(names, header.names_len, 1, f) != 1))
+		goto error;
+
+	pthread_rwlock_wrlock(&_index.lock);
+	size_t offset = 0;
+	uint32_t i;
+	for (i = 0; i < header.entries; i++) {
+		const _saved_entry *saved = &entries[i];
+		if (offset + saved->name_len + 1 > header.names_len || saved->board >= header.boards)
+			break;
+		boards[saved->board][MAX_BOARD_NAME_SIZE - 1] = '\0';
+		names[offset + saved->name_len] = '\0';
+		_add_locked(saved->is_alias, saved->id, names + offset, boards[saved->board], saved->thread_id);
+		offset += saved->name_len + 1;
+	}
+	_index.watermarks[0] = header.watermarks[0];
+	_index.watermarks[1] = header.watermarks[1];
+	pthread_rwlock_unlock(&_index.lock);
+
+	if (i < header.entries) {
+		/* Half of one is worse than none, since we'd never catch up on the rest. */
+		filename_index_clear();
+		goto error;
+	}
+
+	free(boards);
+	free(entries);
+	free(names);
+	fclose(f);
+	return header.entries;
+
+error:
+	log_msg(LOG_WARN, "%s isn't a filename index, starting over.", path);
+	free(boards);
+	free(entries);
+	free(names);
+	fclose(f);
+	return -1;
+}
+
+static void *_refresher(void *arg) {
+	(void)arg;
+
+	const int saved = filename_index_load();
+	const int added = filename_index_refresh();
+	if (added > 0 || saved < 0)
+		filename_index_save();
+	log_msg(LOG_INFO, "Filename index loaded, %d from the snapshot and %d from the DB.",
+			saved > 0 ? saved : 0, added > 0 ? added : 0);
+
+	while (1) {
+		sleep(FILENAME_INDEX_REFRESH_SECS);
+		if (filename_index_refresh() < 0)
+			log_msg(LOG_WARN, "Could not catch the filename index up.");
+	}
+	return NULL;
+}
+
+int filename_index_start() {
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, _refresher, NULL) != 0)
+		return -1;
+	pthread_detach(thread);
+	return 0;
+}
+
+/* Searching */
+
+typedef struct _ranked {
+	uint32_t entry;
+	/* 0 for a prefix, 1 for the start of a word, 2 for anywhere. */
+	uint8_t tier;
+} _ranked;
+
+static int _better(const _ranked *a, const _ranked *b) {
+	if (a->tier != b->tier)
+		return a->tier < b->tier;
+	const uint16_t a_len = _index.entries[a->entry].name_len, b_len = _index.entries[b->entry].name_len;
+	if (a_len != b_len)
+		return a_len < b_len;
+	return a->entry > b->entry;
+}
+
+/* Entries only get smaller as we go, so each list keeps a cursor (everything
+ * at or past it is bigger) that only moves down. It gallops, since a rare
+ * trigram's entries can be a long way apart in a common one's list. */
+static int _has_entry(const _postings *postings, size_t *cursor, const uint32_t entry) {
+	const uint32_t *entries = postings->entries;
+	size_t hi = *cursor, lo = hi, step = 1;
+	while (lo > 0 && entries[lo - 1] > entry) {
+		hi = lo - 1;
+		lo = lo > step ? lo - step : 0;
+		step *= 2;
+	}
+
+	/* The first one bigger than entry is somewhere in [lo, hi]. */
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (entries[mid] > entry)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	*cursor = lo;
+	return lo > 0 && entries[lo - 1] == entry;
+}
+
+static int _by_count(const void *a, const void *b) {
+	const _postings *const *x = a, *const *y = b;
+	return (*x)->count < (*y)->count ? -1 : (*x)->count > (*y)->count;
+}
+
+size_t filename_index_search(const char *query, filename_hit *out, const size_t max) {
+	if (!query || max == 0)
+		return 0;
+
+	char needle[MAX_IMAGE_FILENAME_SIZE] = {0};
+	const size_t needle_len = _normalize(query, strlen(query), needle);
+	if (needle_len < FILENAME_SEARCH_MIN_QUERY)
+		return 0;
+
+	uint32_t trigrams[MAX_IMAGE_FILENAME_SIZE];
+	const size_t ntrigrams = _trigrams(needle, needle_len, trigrams);
+
+	const size_t max_ranked = max < FILENAME_SEARCH_MAX_RESULTS ? max : FILENAME_SEARCH_MAX_RESULTS;
+	_ranked ranked[FILENAME_SEARCH_MAX_RESULTS];
+	size_t found = 0;
+
+	pthread_rwlock_rdlock(&_index.lock);
+
+	const _postings *lists[MAX_IMAGE_FILENAME_SIZE];
+	size_t cursors[MAX_IMAGE_FILENAME_SIZE];
+	size_t i;
+	for (i = 0; i < ntrigrams; i++) {
+		lists[i] = _find_postings(trigrams[i]);
+		if (!lists[i])
+			goto end;
+	}
+	/* Walk the shortest, newest first, and check the rest have it. */
+	qsort(lists, ntrigrams, sizeof(lists[0]), _by_count);
+	for (i = 0; i < ntrigrams; i++)
+		cursors[i] = lists[i]->count;
+
+	size_t examined = 0;
+	size_t c = lists[0]->count;
+	while (c-- > 0 && examined++ < FILENAME_SEARCH_MAX_CANDIDATES) {
+		const uint32_t entry_idx = lists[0]->entries[c];
+		for (i = 1; i < ntrigrams && _has_entry(lists[i], &cursors[i], entry_idx); i++)
+			;
+		if (i < ntrigrams)
+			continue;
+
+		/* Having every trigram doesn't mean having them in order. */
+		const _entry *entry = &_index.entries[entry_idx];
+		char name[MAX_IMAGE_FILENAME_SIZE];
+		const size_t name_len = _normalize(_index.names + entry->name, entry->name_len, name);
+		const char *at = memmem(name, name_len, needle, needle_len);
+		if (!at)
+			continue;
+
+		const char before = at == name ? 0 : at[-1];
+		const _ranked candidate = {
+			.entry = entry_idx,
+			.tier = at == name ? 0 :
+				(before >= 'a' && before <= 'z') || (before >= '0' && before <= '9') ? 2 : 1
+		};
+		if (found == max_ranked && !_better(&candidate, &ranked[found - 1]))
+			continue;
+
+		size_t j = found < max_ranked ? found++ : found - 1;
+		while (j > 0 && _better(&candidate, &ranked[j - 1])) {
+			ranked[j] = ranked[j - 1];
+			j--;
+		}
+		ranked[j] = candidate;
+	}
+
+	for (i = 0; i < found; i++) {
+		const _entry *entry = &_index.entries[ranked[i].entry];
+		filename_hit *hit = &out[i];
+		memset(hit, 0, sizeof(*hit));
+		memcpy(hit->filename, _index.names + entry->name, entry->name_len);
+		strncpy(hit->board, _index.boards[entry->board], sizeof(hit->board) - 1);
+		hit->id = entry->id;
+		hit->thread_id = entry->thread_id;
+		hit->is_alias = entry->is_alias;
+	}
+
+end:
+	pthread_rwlock_unlock(&_index.lock);
+	return found;
+}
@@ -0,0 +1,401 @@
+// vim: noet ts=4 sw=4
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "async_log.h"
+#include "blake3.h"
+#include "bmw256.h"
+#include "hashing.h"
+#include "probes.h"
+#include "sha3api_ref.h"
+#include "trace.h"
+
+/* Both algorithms are fed in blocks this big while streaming. */
+#define _STREAM_BLOCK 64
+
+typedef union _hash_state {
+	hashState ref;
+	bmw256_state bmw;
+	blake3_hasher blake3;
+} _hash_state;
+
+typedef struct _backend {
+	const char *name;
+	HASH_ALGORITHM algorithm;
+
+	void (*init)(_hash_state *state);
+	/* Whole _STREAM_BLOCKs only. */
+	int (*update)(_hash_state *state, const unsigned char *data, const size_t len);
+	/* Less than a block, which may end partway into a byte. */
+	int (*final)(_hash_state *state, const unsigned char *tail, const uint64_t tail_bits,
+			unsigned char out[static HASH_ARRAY_SIZE]);
+	/* All at once, for when the whole thing is in memory. */
+	int (*hash)(const unsigned char *data, const uint64_t bits, unsigned char out[static HASH_ARRAY_SIZE]);
+} _backend;
+
+static void _ref_init(_hash_state *state) {
+	Init(&state->ref, IMAGE_HASH_SIZE);
+}
+
+static int _ref_update(_hash_state *state, const unsigned char *data, const size_t len) {
+	return Update(&state->ref, data, (DataLength)len * 8) == SUCCESS;
+}
+
+static int _ref_final(_hash_state *state, const unsigned char *tail, const uint64_t tail_bits,
+		unsigned char out[static HASH_ARRAY_SIZE]) {
+	return Update(&state->ref, tail, tail_bits) == SUCCESS && Final(&state->ref, out) == SUCCESS;
+}
+
+static int _ref_hash(const unsigned char *data, const uint64_t bits, unsigned char out[static HASH_ARRAY_SIZE]) {
+	return Hash(IMAGE_HASH_SIZE, data, bits, out) == SUCCESS;
+}
+
+static void _bmw_init(_hash_state *state) {
+	bmw256_init(&state->bmw);
+}
+
+static int _bmw_update(_hash_state *state, const unsigned char *data, const size_t len) {
+	bmw256_blocks(&state->bmw, data, len / BMW256_BLOCK_SIZE);
+	return 1;
+}
+
+static int _bmw_final(_hash_state *state, const unsigned char *tail, const uint64_t tail_bits,
+		unsigned char out[static HASH_ARRAY_SIZE]) {
+	bmw256_final(&state->bmw, tail, tail_bits, out);
+	return 1;
+}
+
+static int _bmw_hash(const unsigned char *data, const uint64_t bits, unsigned char out[static HASH_ARRAY_SIZE]) {
+	bmw256_hash(data, bits, out);
+	return 1;
+}
+
+static void _blake3_init(_hash_state *state) {
+	blake3_init(&state->blake3);
+}
+
+static int _blake3_update(_hash_state *state, const unsigned char *data, const size_t len) {
+	blake3_update(&state->blake3, data, len);
+	return 1;
+}
+
+static int _blake3_final(_hash_state *state, const unsigned char *tail, const uint64_t tail_bits,
+		unsigned char out[static HASH_ARRAY_SIZE]) {
+	blake3_update(&state->blake3, tail, tail_bits / 8);
+	blake3_final(&state->blake3, out);
+	return 1;
+}
+
+static int _blake3_hash(const unsigned char *data, const uint64_t bits, unsigned char out[static HASH_ARRAY_SIZE]) {
+	blake3_hash(data, bits / 8, hash_threads(), out);
+	return 1;
+}
+
+static const _backend _backends[HASH_BACKENDS] = {
+	[HASH_BACKEND_BMW256_REF] = {"bmw256-ref", HASH_BMW256, _ref_init, _ref_update, _ref_final, _ref_hash},
+	[HASH_BACKEND_BMW256] = {"bmw256", HASH_BMW256, _bmw_init, _bmw_update, _bmw_final, _bmw_hash},
+	[HASH_BACKEND_BLAKE3] = {"blake3", HASH_BLAKE3, _blake3_init, _blake3_update, _blake3_final, _blake3_hash},
+};
+
+static const char *_algorithm_names[HASH_ALGORITHMS] = {
+	[HASH_BMW256] = "bmw256",
+	[HASH_BLAKE3] = "blake3",
+};
+
+/* How many bits of a size byte file the digest covers. For bmw256 that's
+ * the historical accident described in hashing.h. */
+static uint64_t _message_bits(const HASH_ALGORITHM algorithm, const size_t size) {
+	return algorithm == HASH_BMW256 ? (uint64_t)size : (uint64_t)size * 8;
+}
+
+const char *hash_algorithm_name(const HASH_ALGORITHM algorithm) {
+	return algorithm < HASH_ALGORITHMS ? _algorithm_names[algorithm] : "unknown";
+}
+
+HASH_ALGORITHM hash_algorithm_from_name(const char *name) {
+	int i;
+	for (i = 0; i < HASH_ALGORITHMS; i++) {
+		if (name && strcmp(name, _algorithm_names[i]) == 0)
+			return i;
+	}
+	return HASH_ALGORITHMS;
+}
+
+const char *hash_backend_name(const HASH_BACKEND backend) {
+	return backend < HASH_BACKENDS ? _backends[backend].name : "unknown";
+}
+
+HASH_BACKEND hash_backend_from_name(const char *name) {
+	int i;
+	for (i = 0; i < HASH_BACKENDS; i++) {
+		if (name && strcmp(name, _backends[i].name) == 0)
+			return i;
+	}
+	return HASH_BACKENDS;
+}
+
+HASH_ALGORITHM hash_backend_algorithm(const HASH_BACKEND backend) {
+	return _backends[backend].algorithm;
+}
+
+HASH_BACKEND hash_default_backend() {
+	static int backend = -1;
+	if (backend < 0) {
+		const char *env_var = getenv("WFU_HASH_BACKEND");
+		HASH_BACKEND from_env = hash_backend_from_name(env_var);
+		if (env_var && from_env == HASH_BACKENDS)
+			log_msg(LOG_WARN, "Unknown WFU_HASH_BACKEND '%s', using bmw256.", env_var);
+		backend = from_env == HASH_BACKENDS ? HASH_BACKEND_BMW256 : from_env;
+	}
+
+	return backend;
+}
+
+HASH_ALGORITHM hash_default_algorithm() {
+	return hash_backend_algorithm(hash_default_backend());
+}
+
+unsigned int hash_threads() {
+	static unsigned int threads = 0;
+	if (threads == 0) {
+		const char *env_var = getenv("WFU_HASH_THREADS");
+		long wanted = env_var ? strtol(env_var, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+		if (wanted < 1)
+			wanted = 1;
+		if (!env_var && wanted > HASH_MAX_THREADS)
+			wanted = HASH_MAX_THREADS;
+		threads = wanted;
+	}
+
+	return threads;
+}
+
+void hash_bytes_to_hex(const unsigned char hash[static HASH_ARRAY_SIZE], char outbuf[static HASH_IMAGE_STR_SIZE]) {
+	int j = 0;
+	for (j = 0; j < HASH_ARRAY_SIZE; j++)
+		sprintf(outbuf + (j * 2), "%02X", hash[j]);
+}
+
+static int _nibble(const char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+int hash_hex_to_bytes(const char *hex, unsigned char out[static HASH_ARRAY_SIZE]) {
+	int j = 0;
+	for (j = 0; j < HASH_ARRAY_SIZE; j++) {
+		const int hi = _nibble(hex[j * 2]);
+		if (hi < 0)
+			return 0;
+		const int lo = _nibble(hex[j * 2 + 1]);
+		if (lo < 0)
+			return 0;
+		out[j] = (hi << 4) | lo;
+	}
+
+	return hex[HASH_ARRAY_SIZE * 2] == '\0';
+}
+
+int hash_string_with(const HASH_BACKEND backend, const unsigned char *string, const size_t siz,
+		char outbuf[static HASH_IMAGE_STR_SIZE]) {
+	unsigned char hash[HASH_ARRAY_SIZE] = {0};
+	const _backend *b = &_backends[backend];
+
+	if (!b->hash(string, _message_bits(b->algorithm, siz), hash))
+		return 0;
+
+	hash_bytes_to_hex(hash, outbuf);
+	return 1;
+}
+
+int hash_string(const unsigned char *string, const size_t siz, char outbuf[static HASH_IMAGE_STR_SIZE]) {
+	return hash_string_with(hash_default_backend(), string, siz, outbuf);
+}
+
+int hash_file_with(const HASH_BACKEND backend, const char *file_path, char outbuf[static HASH_IMAGE_STR_SIZE]) {
+	unsigned char *data_ptr = NULL;
+	trace_span span;
+	MZBH_PROBE1(hash__start, file_path);
+	trace_begin(&span, "hash_file");
+
+	struct stat st = {0};
+	int fd = open(file_path, O_RDONLY);
+	if (fd < 0) {
+		log_msg(LOG_ERR, "Could not open file for hashing.");
+		perror("hash_file");
+		goto error;
+	}
+
+	if (fstat(fd, &st) == -1)
+		goto error;
+
+	/* Can't map nothing. */
+	if (st.st_size > 0) {
+		data_ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data_ptr == MAP_FAILED) {
+			data_ptr = NULL;
+			goto error;
+		}
+		/* The fast backends go through it front to back at memory speed. */
+		madvise(data_ptr, st.st_size, MADV_SEQUENTIAL);
+	}
+
+	int rc = hash_string_with(backend, data_ptr, st.st_size, outbuf);
+
+	if (data_ptr != NULL)
+		munmap(data_ptr, st.st_size);
+	close(fd);
+
+	trace_end(&span);
+	MZBH_PROBE3(hash__done, file_path, st.st_size, rc);
+	return rc;
+
+error:
+	if (data_ptr != NULL)
+		munmap(data_ptr, st.st_size);
+	if (fd >= 0)
+		close(fd);
+	errno = 0;
+	trace_end(&span);
+	MZBH_PROBE3(hash__done, file_path, st.st_size, 0);
+	return 0;
+}
+
+int hash_file(const char *file_path, char outbuf[static HASH_IMAGE_STR_SIZE]) {
+	return hash_file_with(hash_default_backend(), file_path, outbuf);
+}
+
+int hash_fingerprint_file(const char *file_path, size_t *out_size, char outbuf[static HASH_IMAGE_STR_SIZE]) {
+	unsigned char hash[HASH_ARRAY_SIZE] = {0};
+	unsigned char *samples = NULL;
+	int rc = 0;
+
+	const int fd = open(file_path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	struct stat st = {0};
+	if (fstat(fd, &st) == -1)
+		goto end;
+
+	const size_t size = st.st_size;
+	/* bmw256 only covers the first eighth, and files that only differ after
+	 * that get the same hash. Sampling past it would call those different. */
+	const size_t covered = size / 8;
+	const size_t offsets[] = {0, covered / 2 - HASH_FINGERPRINT_SAMPLE / 2, covered - HASH_FINGERPRINT_SAMPLE};
+	const size_t sampled = covered > sizeof(offsets) / sizeof(offsets[0]) * HASH_FINGERPRINT_SAMPLE ?
+		sizeof(offsets) / sizeof(offsets[0]) * HASH_FINGERPRINT_SAMPLE : covered;
+
+	/* The size goes in too, it's free and the samples can't tell files that
+	 * only differ in length apart. */
+	samples = malloc(sampled + sizeof(uint64_t));
+	if (!samples)
+		goto end;
+
+	if (sampled < covered) {
+		unsigned int i;
+		for (i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+			unsigned char *to = samples + i * HASH_FINGERPRINT_SAMPLE;
+			if (pread(fd, to, HASH_FINGERPRINT_SAMPLE, offsets[i]) != HASH_FINGERPRINT_SAMPLE)
+				goto end;
+		}
+	} else if (sampled > 0 && pread(fd, samples, sampled, 0) != (ssize_t)sampled) {
+		goto end;
+	}
+
+	const uint64_t size64 = size;
+	memcpy(samples + sampled, &size64, sizeof(size64));
+	blake3_hash(samples, sampled + sizeof(size64), 1, hash);
+
+	hash_bytes_to_hex(hash, outbuf);
+	*out_size = size;
+	rc = 1;
+
+end:
+	free(samples);
+	close(fd);
+	return rc;
+}
+
+/* Feeds whole blocks as soon as we know they fall inside the part of the
+ * file the digest covers, which for bmw256 is only the first eighth. */
+struct hash_stream {
+	const _backend *backend;
+	_hash_state state;
+	size_t hashed; /* Bytes handed to update() so far. */
+};
+
+struct hash_stream *hash_stream_new() {
+	struct hash_stream *stream = calloc(1, sizeof(struct hash_stream));
+	if (!stream)
+		return NULL;
+
+	stream->backend = &_backends[hash_default_backend()];
+	stream->backend->init(&stream->state);
+
+	return stream;
+}
+
+static int _hash_stream_feed(struct hash_stream *stream, const int fd, const size_t until) {
+	unsigned char buf[_STREAM_BLOCK * 256];
+
+	while (stream->hashed < until) {
+		size_t to_read = until - stream->hashed;
+		if (to_read > sizeof(buf))
+			to_read = sizeof(buf);
+
+		const ssize_t rd = pread(fd, buf, to_read, stream->hashed);
+		if (rd <= 0 || (size_t)rd % _STREAM_BLOCK != 0)
+			return 0;
+
+		if (!stream->backend->update(&stream->state, buf, rd))
+			return 0;
+		stream->hashed += rd;
+	}
+
+	return 1;
+}
+
+int hash_stream_update_from_fd(struct hash_stream *stream, const int fd, const size_t available) {
+	/* Only whole blocks, so nothing's ever left over between calls. */
+	const size_t covered = _message_bits(stream->backend->algorithm, available) / 8;
+	return _hash_stream_feed(stream, fd, covered - (covered % _STREAM_BLOCK));
+}
+
+int hash_stream_finish(struct hash_stream *stream, const int fd, const size_t total,
+		char outbuf[static HASH_IMAGE_STR_SIZE]) {
+	unsigned char hash[HASH_ARRAY_SIZE] = {0};
+	unsigned char tail[_STREAM_BLOCK + 1] = {0};
+	int rc = 0;
+
+	if (!hash_stream_update_from_fd(stream, fd, total))
+		goto end;
+
+	/* Whatever is left is less than a block, and may end on a partial byte. */
+	const uint64_t tail_bits = _message_bits(stream->backend->algorithm, total) - (stream->hashed * 8);
+	const size_t tail_bytes = (tail_bits + 7) / 8;
+	if (tail_bytes > 0 && pread(fd, tail, tail_bytes, stream->hashed) != (ssize_t)tail_bytes)
+		goto end;
+
+	if (!stream->backend->final(&stream->state, tail, tail_bits, hash))
+		goto end;
+
+	hash_bytes_to_hex(hash, outbuf);
+	rc = 1;
+
+end:
+	free(stream);
+	return rc;
+}
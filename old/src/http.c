@@ -4,6 +4,7 @@
 #endif
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <netdb.h>
 #include <stdlib.h>
@@ -17,58 +18,101 @@
 
 #include <curl/curl.h>
 
-#include <38-moths/logging.h>
-
+#include "async_log.h"
+#include "hashing.h"
 #include "utils.h"
 #include "http.h"
 #include "parse.h"
 #include "models.h"
+#include "trace.h"
+
+struct _webm_download {
+	int fd;
+	size_t written;
+	struct hash_stream *stream;
+};
+
+static size_t _write_webm_data(void *ptr, size_t size, size_t nmemb, void *userp) {
+	struct _webm_download *dl = (struct _webm_download *)userp;
+	const size_t realsize = size * nmemb;
+
+	size_t done = 0;
+	while (done < realsize) {
+		const ssize_t wr = write(dl->fd, (char *)ptr + done, realsize - done);
+		if (wr <= 0)
+			return 0;
+		done += wr;
+	}
+	dl->written += realsize;
 
-static size_t _write_webm_data(void *ptr, size_t size, size_t nmemb, void *stream) {
-	size_t written = fwrite(ptr, size, nmemb, (FILE *)stream);
-	return written;
+	/* Hash whatever we already know is part of the final digest while the
+	 * rest of the file is still on the wire. */
+	if (dl->stream && !hash_stream_update_from_fd(dl->stream, dl->fd, dl->written))
+		return 0;
+
+	return realsize;
 }
 
 size_t download_sent_webm_url(const char *url, const char filename[static MAX_IMAGE_FILENAME_SIZE],
-							  char outpath[static MAX_IMAGE_FILENAME_SIZE]) {
+							  char outpath[static MAX_IMAGE_FILENAME_SIZE],
+							  char *out_hash) {
 	/* TODO: Get the filename. */
 	const char uploads_dir[] = "./user_uploaded";
-	size_t written = 0;
-	FILE *new_webm = NULL;
 
 	struct stat st = {0};
 	if (stat(uploads_dir, &st) == -1) {
-		m38_log_msg(LOG_WARN, "Creating user uploaded directory %s.", uploads_dir);
+		log_msg(LOG_WARN, "Creating user uploaded directory %s.", uploads_dir);
 		mkdir(uploads_dir, 0755);
 	}
 
 	snprintf(outpath, MAX_IMAGE_FILENAME_SIZE, "%s/%s", uploads_dir, filename);
 
+	struct _webm_download dl = {
+		.fd = open(outpath, O_CREAT | O_TRUNC | O_RDWR, 0644),
+		.written = 0,
+		.stream = out_hash ? hash_stream_new() : NULL
+	};
+
+	if (dl.fd < 0 || (out_hash && !dl.stream)) {
+		log_msg(LOG_ERR, "Could not open '%s' for download.", outpath);
+		if (dl.fd >= 0)
+			close(dl.fd);
+		free(dl.stream);
+		return 0;
+	}
+
 	CURL *curl_handle = curl_easy_init();
 	curl_easy_setopt(curl_handle, CURLOPT_URL, url);
 	curl_easy_setopt(curl_handle, CURLOPT_NOPROGRESS, 1L);
 	curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, _write_webm_data);
+	curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, &dl);
+
+	long http_code = 0;
+	trace_span span;
+	trace_begin(&span, "fetch_search_upload");
+	const CURLcode res = curl_easy_perform(curl_handle);
+	trace_end(&span);
+	curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &http_code);
+	curl_easy_cleanup(curl_handle);
 
-	new_webm = fopen(outpath, "wb");
-	if (new_webm) {
-		curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, new_webm);
-		uint64_t http_code = 0;
-		curl_easy_perform(curl_handle);
-		curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &http_code);
-
-		if (http_code == 200) {
-			fseek(new_webm, 0L, SEEK_END);
-			written = ftell(new_webm);
-		} else {
-			written = 0;
-			unlink(outpath);
-		}
+	if (res != CURLE_OK || http_code != 200 || dl.written == 0) {
+		log_msg(LOG_WARN, "Could not download '%s' (HTTP %li).", url, http_code);
+		free(dl.stream);
+		goto error;
+	}
 
-		fclose(new_webm);
+	if (out_hash && !hash_stream_finish(dl.stream, dl.fd, dl.written, out_hash)) {
+		log_msg(LOG_ERR, "Could not hash '%s'.", outpath);
+		goto error;
 	}
 
-	curl_easy_cleanup(curl_handle);
-	return written;
+	close(dl.fd);
+	return dl.written;
+
+error:
+	unlink(outpath);
+	close(dl.fd);
+	return 0;
 }
 
 char *receive_chunked_http(const int request_fd) {
@@ -111,20 +155,20 @@ char *receive_chunked_http(const int request_fd) {
 
 		int recvd = recv(request_fd, raw_buf + old_offset, count, 0);
 		if (recvd != count) {
-			m38_log_msg(LOG_WARN, "Could not receive entire message.");
+			log_msg(LOG_WARN, "Could not receive entire message.");
 		}
 	}
 	/* printf("Full message is %s\n.", raw_buf); */
 	/* Check for a 200: */
 	if (raw_buf == NULL || strstr(raw_buf, "200") == NULL) {
-		m38_log_msg(LOG_WARN, "Chunked: Could not find 200 return code in response.");
+		log_msg(LOG_WARN, "Chunked: Could not find 200 return code in response.");
 		goto error;
 	}
 
 	/* 4Chan throws us data as chunk-encoded HTTP. Rad. */
 	char *header_end = strstr(raw_buf, "\r\n\r\n");
 	if (header_end == NULL) {
-		m38_log_msg(LOG_ERR, "Could not find end of header in initial chunk.");
+		log_msg(LOG_ERR, "Could not find end of header in initial chunk.");
 		goto error;
 	}
 	char *cursor_pos = header_end  + (sizeof(char) * 4);
@@ -137,7 +181,7 @@ char *receive_chunked_http(const int request_fd) {
 		char *chunk_size_start = cursor_pos;
 		char *chunk_size_end = strstr(chunk_size_start, "\r\n");
 		if (chunk_size_end == NULL) {
-			m38_log_msg(LOG_ERR, "Could not find '\r\n' in chunk.");
+			log_msg(LOG_ERR, "Could not find '\r\n' in chunk.");
 			goto error;
 		}
 		const int chunk_size_end_oft = chunk_size_end - chunk_size_start;
@@ -148,7 +192,7 @@ char *receive_chunked_http(const int request_fd) {
 		const long chunk_size = strtol(chunk_size_start, NULL, 16);
 
 		if ((chunk_size == LONG_MIN || chunk_size == LONG_MAX) && errno == ERANGE) {
-			m38_log_msg(LOG_ERR, "Could not parse out chunk size.");
+			log_msg(LOG_ERR, "Could not parse out chunk size.");
 			goto error;
 		}
 
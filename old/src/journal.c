@@ -0,0 +1,536 @@
+// vim: noet ts=4 sw=4
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "async_log.h"
+#include "db.h"
+#include "journal.h"
+#include "metrics.h"
+
+struct ingest_journal {
+	int fd;
+	char checkpoint_path[PATH_MAX];
+
+	/* Covers everything from here to next_seq. */
+	pthread_mutex_t lock;
+	char buffer[JOURNAL_BUFFER_SIZE];
+	size_t buffered;
+	/* Bytes handed to write(), and how many of those are known to be on
+	 * disk. Only the latter get applied. */
+	uint64_t written_size;
+	uint64_t synced_size;
+	uint64_t next_seq;
+
+	/* One applier at a time, whether that's the thread or journal_apply()
+	 * being called directly. Covers the rest. */
+	pthread_mutex_t apply_lock;
+	uint64_t checkpoint;
+	/* The post applied last, so the image right after it doesn't have to
+	 * look it up again. */
+	uint64_t last_post_seq;
+	unsigned int last_post_id;
+
+	pthread_t applier;
+	int applier_running;
+};
+
+/* Images carry their post along, minus the body, in case it has to be
+ * looked up again. */
+typedef struct journal_image {
+	post_match post;
+	uint64_t post_seq;
+	char file_path[MAX_IMAGE_FILENAME_SIZE];
+	char filename[MAX_IMAGE_FILENAME_SIZE];
+} journal_image;
+
+/* FNV-1a, only here to catch torn writes. */
+static uint32_t _checksum(const unsigned char *data, const size_t len) {
+	uint32_t hash = 2166136261u;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static int _write_all(const int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		const ssize_t written = write(fd, buf, len);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return -1;
+		buf += written;
+		len -= written;
+	}
+	return 0;
+}
+
+static int _write_checkpoint(ingest_journal *journal, const uint64_t offset) {
+	char tmp_path[PATH_MAX] = {0};
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", journal->checkpoint_path);
+
+	const int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+
+	char buf[32] = {0};
+	const int len = snprintf(buf, sizeof(buf), "%"PRIu64"\n", offset);
+	if (_write_all(fd, buf, len) != 0 || fdatasync(fd) != 0) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	if (rename(tmp_path, journal->checkpoint_path) != 0)
+		return -1;
+
+	journal->checkpoint = offset;
+	return 0;
+}
+
+static uint64_t _read_checkpoint(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return 0;
+
+	uint64_t offset = 0;
+	if (fscanf(f, "%"SCNu64, &offset) != 1)
+		offset = 0;
+	fclose(f);
+	return offset;
+}
+
+/* Whatever's in the buffer goes to the kernel. Needs the lock. */
+static int _flush_locked(ingest_journal *journal) {
+	if (journal->buffered == 0)
+		return 0;
+
+	if (_write_all(journal->fd, journal->buffer, journal->buffered) != 0) {
+		log_msg(LOG_ERR, "Could not write to the ingest journal.");
+		return -1;
+	}
+	journal->written_size += journal->buffered;
+	journal->buffered = 0;
+	return 0;
+}
+
+static uint64_t _append(ingest_journal *journal, const JOURNAL_ENTRY_TYPE type,
+		const void *fixed, const size_t fixed_len, const char *extra, const size_t extra_len) {
+	const size_t len = sizeof(journal_header) + fixed_len + extra_len;
+	char *record = malloc(len);
+	if (!record)
+		return 0;
+
+	journal_header *header = (journal_header *)record;
+	header->magic = JOURNAL_MAGIC;
+	header->type = type;
+	header->len = fixed_len + extra_len;
+	memcpy(record + sizeof(journal_header), fixed, fixed_len);
+	if (extra_len)
+		memcpy(record + sizeof(journal_header) + fixed_len, extra, extra_len);
+	header->checksum = _checksum((unsigned char *)record + sizeof(journal_header), header->len);
+
+	uint64_t seq = 0;
+	pthread_mutex_lock(&journal->lock);
+	header->seq = journal->next_seq;
+
+	if (journal->buffered + len > sizeof(journal->buffer) && _flush_locked(journal) != 0)
+		goto end;
+
+	if (len > sizeof(journal->buffer)) {
+		if (_write_all(journal->fd, record, len) != 0) {
+			log_msg(LOG_ERR, "Could not write to the ingest journal.");
+			goto end;
+		}
+		journal->written_size += len;
+	} else {
+		memcpy(journal->buffer + journal->buffered, record, len);
+		journal->buffered += len;
+	}
+	seq = journal->next_seq++;
+
+end:
+	pthread_mutex_unlock(&journal->lock);
+	free(record);
+	return seq;
+}
+
+uint64_t journal_append_post(ingest_journal *journal, const post_match *p_match) {
+	post_match fixed = *p_match;
+	fixed.body_content = NULL;
+	const size_t body_len = p_match->body_content ? strlen(p_match->body_content) : 0;
+	return _append(journal, JOURNAL_POST, &fixed, sizeof(fixed), p_match->body_content, body_len);
+}
+
+int journal_append_image(ingest_journal *journal, const post_match *p_match, const uint64_t post_seq,
+		const char *file_path, const char *filename) {
+	journal_image image = {
+		.post = *p_match,
+		.post_seq = post_seq,
+	};
+	image.post.body_content = NULL;
+	strncpy(image.file_path, file_path, sizeof(image.file_path) - 1);
+	strncpy(image.filename, filename, sizeof(image.filename) - 1);
+	return _append(journal, JOURNAL_IMAGE, &image, sizeof(image), NULL, 0) ? 0 : -1;
+}
+
+int journal_sync(ingest_journal *journal) {
+	pthread_mutex_lock(&journal->lock);
+	const int rc = _flush_locked(journal);
+	const uint64_t written = journal->written_size;
+	pthread_mutex_unlock(&journal->lock);
+
+	if (rc != 0)
+		return -1;
+
+	/* Outside the lock, appends can carry on while the disk catches up. */
+	if (fdatasync(journal->fd) != 0) {
+		log_msg(LOG_ERR, "Could not sync the ingest journal.");
+		return -1;
+	}
+
+	pthread_mutex_lock(&journal->lock);
+	if (written > journal->synced_size)
+		journal->synced_size = written;
+	pthread_mutex_unlock(&journal->lock);
+	return 0;
+}
+
+/* Same as journal_read(), but up to limit rather than what's synced. */
+static int _read_entry(const int fd, const uint64_t offset, const uint64_t limit,
+		journal_entry *out, uint64_t *next_offset) {
+	journal_header header;
+	if (offset + sizeof(header) > limit)
+		return 0;
+	if (pread(fd, &header, sizeof(header), offset) != sizeof(header))
+		return -1;
+	if (header.magic != JOURNAL_MAGIC)
+		return -1;
+	if (offset + sizeof(header) + header.len > limit)
+		return 0;
+
+	char *payload = malloc(header.len);
+	if (!payload)
+		return -1;
+
+	int rc = -1;
+	if (pread(fd, payload, header.len, offset + sizeof(header)) != (ssize_t)header.len)
+		goto end;
+	if (_checksum((unsigned char *)payload, header.len) != header.checksum)
+		goto end;
+
+	memset(out, 0, sizeof(journal_entry));
+	out->type = header.type;
+	out->seq = header.seq;
+
+	if (header.type == JOURNAL_POST && header.len >= sizeof(post_match)) {
+		memcpy(&out->post, payload, sizeof(post_match));
+		out->post.body_content = NULL;
+
+		const size_t body_len = header.len - sizeof(post_match);
+		if (body_len > 0) {
+			out->post.body_content = calloc(1, body_len + 1);
+			if (!out->post.body_content)
+				goto end;
+			memcpy(out->post.body_content, payload + sizeof(post_match), body_len);
+		}
+	} else if (header.type == JOURNAL_IMAGE && header.len == sizeof(journal_image)) {
+		journal_image image;
+		memcpy(&image, payload, sizeof(image));
+		out->post = image.post;
+		out->post.body_content = NULL;
+		out->post_seq = image.post_seq;
+		memcpy(out->file_path, image.file_path, sizeof(out->file_path));
+		memcpy(out->filename, image.filename, sizeof(out->filename));
+		out->file_path[sizeof(out->file_path) - 1] = '\0';
+		out->filename[sizeof(out->filename) - 1] = '\0';
+	} else {
+		goto end;
+	}
+
+	*next_offset = offset + sizeof(header) + header.len;
+	rc = 1;
+
+end:
+	free(payload);
+	return rc;
+}
+
+int journal_read(ingest_journal *journal, const uint64_t offset, journal_entry *out, uint64_t *next_offset) {
+	pthread_mutex_lock(&journal->lock);
+	const uint64_t limit = journal->synced_size;
+	pthread_mutex_unlock(&journal->lock);
+
+	return _read_entry(journal->fd, offset, limit, out, next_offset);
+}
+
+void journal_entry_free(journal_entry *entry) {
+	free(entry->post.body_content);
+	entry->post.body_content = NULL;
+}
+
+ingest_journal *journal_open(const char *path) {
+	ingest_journal *journal = calloc(1, sizeof(ingest_journal));
+	if (!journal)
+		return NULL;
+
+	pthread_mutex_init(&journal->lock, NULL);
+	pthread_mutex_init(&journal->apply_lock, NULL);
+	snprintf(journal->checkpoint_path, sizeof(journal->checkpoint_path), "%s.checkpoint", path);
+
+	journal->fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0644);
+	if (journal->fd < 0) {
+		log_msg(LOG_ERR, "Could not open ingest journal %s.", path);
+		goto error;
+	}
+
+	struct stat st = {0};
+	if (fstat(journal->fd, &st) != 0)
+		goto error;
+
+	/* Walk what's there to find the last good entry and the next sequence
+	 * number. Anything after that is a write we crashed in the middle of. */
+	uint64_t offset = 0, next = 0;
+	journal_entry entry;
+	journal->next_seq = 1;
+	while (_read_entry(journal->fd, offset, st.st_size, &entry, &next) == 1) {
+		journal->next_seq = entry.seq + 1;
+		journal_entry_free(&entry);
+		offset = next;
+	}
+
+	if (offset < (uint64_t)st.st_size) {
+		log_msg(LOG_WARN, "Dropping %"PRIu64" bytes of torn writes from the end of %s.",
+				(uint64_t)st.st_size - offset, path);
+		if (ftruncate(journal->fd, offset) != 0)
+			goto error;
+	}
+	journal->written_size = journal->synced_size = offset;
+
+	journal->checkpoint = _read_checkpoint(journal->checkpoint_path);
+	if (journal->checkpoint > offset)
+		journal->checkpoint = offset;
+
+	if (journal->checkpoint < offset)
+		log_msg(LOG_INFO, "Ingest journal %s has %"PRIu64" bytes left to apply.",
+				path, offset - journal->checkpoint);
+
+	return journal;
+
+error:
+	if (journal->fd >= 0)
+		close(journal->fd);
+	free(journal);
+	return NULL;
+}
+
+void journal_close(ingest_journal *journal) {
+	if (!journal)
+		return;
+
+	journal_sync(journal);
+	close(journal->fd);
+	pthread_mutex_destroy(&journal->lock);
+	pthread_mutex_destroy(&journal->apply_lock);
+	free(journal);
+}
+
+uint64_t journal_pending_bytes(ingest_journal *journal) {
+	pthread_mutex_lock(&journal->lock);
+	const uint64_t synced = journal->synced_size;
+	pthread_mutex_unlock(&journal->lock);
+
+	pthread_mutex_lock(&journal->apply_lock);
+	const uint64_t checkpoint = journal->checkpoint;
+	pthread_mutex_unlock(&journal->apply_lock);
+
+	return synced > checkpoint ? synced - checkpoint : 0;
+}
+
+/* Returns 1 if it went in. */
+static int _apply_entry(ingest_journal *journal, const journal_entry *entry) {
+	if (entry->type == JOURNAL_POST) {
+		const unsigned int post_id = add_post_to_db(&entry->post);
+		if (!post_id)
+			return 0;
+		journal->last_post_seq = entry->seq;
+		journal->last_post_id = post_id;
+		return 1;
+	}
+
+	/* add_post_to_db() hands back the existing ID for posts it's seen. */
+	const unsigned int post_id = entry->post_seq == journal->last_post_seq ?
+		journal->last_post_id : add_post_to_db(&entry->post);
+	return add_image_to_db(entry->file_path, entry->filename, entry->post.board, post_id) != 0;
+}
+
+/* Once the applier has caught up, start the file over so it doesn't grow
+ * forever. The checkpoint goes first: crash between the two and we apply
+ * everything again, which is harmless, rather than skip what comes next. */
+static void _truncate_if_applied(ingest_journal *journal) {
+	pthread_mutex_lock(&journal->lock);
+	if (journal->checkpoint > 0 && journal->buffered == 0 &&
+			journal->checkpoint == journal->written_size &&
+			journal->checkpoint == journal->synced_size) {
+		if (_write_checkpoint(journal, 0) == 0 && ftruncate(journal->fd, 0) == 0)
+			journal->written_size = journal->synced_size = 0;
+	}
+	pthread_mutex_unlock(&journal->lock);
+}
+
+static int _db_is_up() {
+	if (db_batch_begin() != 0)
+		return 0;
+	db_batch_rollback();
+	return 1;
+}
+
+int journal_apply(ingest_journal *journal, const unsigned int max_entries) {
+	pthread_mutex_lock(&journal->apply_lock);
+
+	const uint64_t start = journal->checkpoint;
+	uint64_t offset = start, next = 0;
+	unsigned int applied = 0;
+	journal_entry entry;
+	int rc = 0, ok = 1, lost = 0;
+
+	/* Only look for the DB if there's something to give it. A bad entry
+	 * right at the checkpoint is reported below like any other. */
+	rc = journal_read(journal, offset, &entry, &next);
+	if (rc == 0) {
+		_truncate_if_applied(journal);
+		goto end;
+	}
+	if (rc == 1) {
+		journal_entry_free(&entry);
+		if (db_batch_begin() != 0) {
+			rc = -1;
+			goto end;
+		}
+	}
+
+	while (rc == 1 && applied < max_entries && (rc = journal_read(journal, offset, &entry, &next)) == 1) {
+		ok = _apply_entry(journal, &entry);
+		journal_entry_free(&entry);
+		if (!ok)
+			break;
+		offset = next;
+		applied++;
+	}
+
+	if (rc < 0) {
+		log_msg(LOG_ERR, "Ingest journal is corrupt at offset %"PRIu64", not applying past it.", offset);
+		db_batch_rollback();
+		goto end;
+	}
+
+	if (ok && db_batch_commit() == 0) {
+		rc = applied;
+		if (_write_checkpoint(journal, offset) != 0)
+			log_msg(LOG_ERR, "Could not save the ingest journal checkpoint.");
+		goto end;
+	}
+	db_batch_rollback();
+	journal->last_post_seq = 0;
+
+	/* Something in the batch failed. If that's because the DB is gone, try
+	 * again later. Otherwise go through it one at a time, outside of a
+	 * transaction, so one bad entry gets logged and skipped like it would've
+	 * been without the journal instead of holding everything else up. */
+	if (!_db_is_up()) {
+		rc = -1;
+		goto end;
+	}
+
+	log_msg(LOG_WARN, "Ingest journal batch failed, applying it one entry at a time.");
+	applied = 0;
+	offset = start;
+	while (applied < max_entries && journal_read(journal, offset, &entry, &next) == 1) {
+		if (!_apply_entry(journal, &entry)) {
+			/* The DB can go away halfway through too, and skipping everything
+			 * after that would lose it for good. Only skip what it turned
+			 * down while it was there. */
+			if (!_db_is_up()) {
+				log_msg(LOG_WARN, "Lost the DB applying journal entry %"PRIu64", stopping there.", entry.seq);
+				journal_entry_free(&entry);
+				lost = 1;
+				break;
+			}
+			log_msg(LOG_ERR, "Could not apply journal entry %"PRIu64" (%s/%s), skipping it.",
+					entry.seq, entry.post.board, entry.post.post_date);
+		}
+		journal_entry_free(&entry);
+		offset = next;
+		applied++;
+	}
+
+	rc = lost && applied == 0 ? -1 : (int)applied;
+	if (offset > start && _write_checkpoint(journal, offset) != 0)
+		log_msg(LOG_ERR, "Could not save the ingest journal checkpoint.");
+
+end:
+	pthread_mutex_unlock(&journal->apply_lock);
+	return rc;
+}
+
+static void *_applier(void *arg) {
+	ingest_journal *journal = arg;
+	const struct timespec tick = {
+		.tv_sec = 0,
+		.tv_nsec = JOURNAL_SYNC_MS * 1000000L
+	};
+	time_t next_attempt = 0;
+	unsigned int backoff = 1;
+
+	while (__atomic_load_n(&journal->applier_running, __ATOMIC_ACQUIRE)) {
+		/* Keep syncing while the DB is away, that's the whole point. */
+		journal_sync(journal);
+
+		int applied = 0;
+		if (time(NULL) >= next_attempt) {
+			applied = journal_apply(journal, JOURNAL_APPLY_BATCH);
+			if (applied < 0) {
+				log_msg(LOG_WARN, "Could not apply the ingest journal, trying again in %us.", backoff);
+				next_attempt = time(NULL) + backoff;
+				backoff = backoff * 2 > JOURNAL_MAX_BACKOFF_S ? JOURNAL_MAX_BACKOFF_S : backoff * 2;
+			} else {
+				backoff = 1;
+			}
+		}
+		metrics_downloader_journal(journal_pending_bytes(journal), applied > 0 ? applied : 0);
+
+		if (applied < JOURNAL_APPLY_BATCH)
+			nanosleep(&tick, NULL);
+	}
+
+	return NULL;
+}
+
+int journal_start_applier(ingest_journal *journal) {
+	__atomic_store_n(&journal->applier_running, 1, __ATOMIC_RELEASE);
+	if (pthread_create(&journal->applier, NULL, _applier, journal) != 0) {
+		log_msg(LOG_ERR, "Could not start the ingest journal applier.");
+		journal->applier_running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+void journal_stop_applier(ingest_journal *journal) {
+	if (!__atomic_load_n(&journal->applier_running, __ATOMIC_ACQUIRE))
+		return;
+
+	__atomic_store_n(&journal->applier_running, 0, __ATOMIC_RELEASE);
+	pthread_join(journal->applier, NULL);
+}
@@ -0,0 +1,290 @@
+// vim: noet ts=4 sw=4
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <38-moths/vector.h>
+
+#include "async_log.h"
+#include "bloom.h"
+#include "db.h"
+#include "dirscan.h"
+#include "known_keys.h"
+#include "metrics.h"
+#include "utils.h"
+
+typedef struct __attribute__((__packed__)) _saved_filter {
+	uint8_t present;
+	uint32_t hashes;
+	uint64_t nbits;
+	uint64_t count;
+	uint64_t watermark;
+} _saved_filter;
+
+static bloom *_filters[KNOWN_KINDS] = {0};
+/* Highest row ID folded into the DB filters. */
+static uint64_t _watermarks[KNOWN_KINDS] = {0};
+static known_keys_source _sources[KNOWN_KINDS] = {0};
+
+/* Cache names for /api/metrics. A hit is a lookup we got to skip. */
+static const char *_names[KNOWN_KINDS] = {"known_posts", "known_aliases", "known_files"};
+
+static void _path(char out[static MAX_IMAGE_FILENAME_SIZE]) {
+	snprintf(out, MAX_IMAGE_FILENAME_SIZE, "%s/%s", webm_location(), KNOWN_KEYS_FILE);
+}
+
+int known_maybe(const KNOWN_KIND kind, const char *key) {
+	const bloom *filter = __atomic_load_n(&_filters[kind], __ATOMIC_ACQUIRE);
+	if (!filter)
+		return 1;
+
+	const int maybe = bloom_maybe(filter, key, strlen(key));
+	metrics_cache(_names[kind], !maybe);
+	return maybe;
+}
+
+void known_add(const KNOWN_KIND kind, const char *key, const uint64_t row_id) {
+	bloom *filter = __atomic_load_n(&_filters[kind], __ATOMIC_ACQUIRE);
+	if (!filter)
+		return;
+
+	bloom_add(filter, key, strlen(key));
+	/* So the next save doesn't have us fetching it all again on load. */
+	uint64_t watermark = __atomic_load_n(&_watermarks[kind], __ATOMIC_RELAXED);
+	while (row_id > watermark && !__atomic_compare_exchange_n(&_watermarks[kind], &watermark, row_id,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+uint64_t known_keys_watermark(const KNOWN_KIND kind) {
+	return __atomic_load_n(&_watermarks[kind], __ATOMIC_RELAXED);
+}
+
+void known_keys_set_source(const KNOWN_KIND kind, known_keys_source source) {
+	_sources[kind] = source;
+}
+
+void known_keys_unload() {
+	int i;
+	for (i = 0; i < KNOWN_KINDS; i++) {
+		bloom_free(__atomic_exchange_n(&_filters[i], NULL, __ATOMIC_ACQ_REL));
+		__atomic_store_n(&_watermarks[i], 0, __ATOMIC_RELAXED);
+	}
+}
+
+/* Reads whatever's saved into filters. Returns when it was saved, or 0. */
+static time_t _read_saved(bloom *filters[static KNOWN_KINDS], uint64_t watermarks[static KNOWN_KINDS]) {
+	char path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	_path(path);
+
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return 0;
+
+	char magic[sizeof(KNOWN_KEYS_MAGIC) - 1] = {0};
+	uint64_t saved_at = 0;
+	_saved_filter saved[KNOWN_KINDS];
+
+	if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, KNOWN_KEYS_MAGIC, sizeof(magic)) != 0 ||
+			fread(&saved_at, sizeof(saved_at), 1, f) != 1 ||
+			fread(saved, sizeof(saved), 1, f) != 1) {
+		log_msg(LOG_WARN, "%s isn't a known keys file, starting over.", path);
+		goto error;
+	}
+
+	int i;
+	for (i = 0; i < KNOWN_KINDS; i++) {
+		if (!saved[i].present)
+			continue;
+
+		uint64_t *bits = malloc(saved[i].nbits / 8);
+		if (!bits || fread(bits, saved[i].nbits / 8, 1, f) != 1) {
+			free(bits);
+			goto error;
+		}
+
+		filters[i] = bloom_from_bits(bits, saved[i].nbits, saved[i].hashes, saved[i].count);
+		if (!filters[i]) {
+			free(bits);
+			goto error;
+		}
+		watermarks[i] = saved[i].watermark;
+	}
+
+	fclose(f);
+	return saved_at;
+
+error:
+	fclose(f);
+	for (i = 0; i < KNOWN_KINDS; i++) {
+		bloom_free(filters[i]);
+		filters[i] = NULL;
+		watermarks[i] = 0;
+	}
+	return 0;
+}
+
+/* Folds in every row past the watermark. Returns 0 if we got all of them. */
+static int _catch_up(const KNOWN_KIND kind, bloom *filter, uint64_t *watermark) {
+	known_keys_source get_keys = _sources[kind] ? _sources[kind] :
+		kind == KNOWN_POSTS ? get_post_keys_after : get_alias_keys_after;
+
+	while (1) {
+		PGresult *res = get_keys(*watermark, KNOWN_KEYS_PAGE);
+		if (!res)
+			return -1;
+
+		const int rows = PQntuples(res);
+		int i;
+		for (i = 0; i < rows; i++) {
+			const char *key = PQgetvalue(res, i, 1);
+			bloom_add(filter, key, strlen(key));
+		}
+		if (rows > 0)
+			*watermark = strtoull(PQgetvalue(res, rows - 1, 0), NULL, 10);
+		PQclear(res);
+
+		if (rows < KNOWN_KEYS_PAGE)
+			return 0;
+	}
+}
+
+/* Adds board/file for every webm under each board directory changed at or
+ * after since (all of them, if since is 0). */
+static int _scan_files(bloom *filter, const time_t since) {
+	DIR *dir = opendir(webm_location());
+	if (!dir)
+		return -1;
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+
+		char board_dir[MAX_IMAGE_FILENAME_SIZE] = {0};
+		snprintf(board_dir, sizeof(board_dir), "%s/%s", webm_location(), entry->d_name);
+
+		struct stat st = {0};
+		if (stat(board_dir, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_mtime < since)
+			continue;
+
+		vector *files = scan_directory(board_dir, ".webm");
+		if (!files)
+			continue;
+
+		unsigned int i;
+		for (i = 0; i < files->count; i++) {
+			const scanned_file *file = vector_get(files, i);
+			char key[MAX_IMAGE_FILENAME_SIZE] = {0};
+			snprintf(key, sizeof(key), "%s/%s", entry->d_name, file->fname);
+			bloom_add(filter, key, strlen(key));
+		}
+		vector_free(files);
+	}
+	closedir(dir);
+	return 0;
+}
+
+static int _bring_up_to_date(const KNOWN_KIND kind, bloom *filter, uint64_t *watermark, const time_t saved_at) {
+	if (kind == KNOWN_FILES)
+		return _scan_files(filter, saved_at);
+	return _catch_up(kind, filter, watermark);
+}
+
+/* Brings the saved filter up to date, or builds a new one if there wasn't
+ * one or it's got too full to be much use. Returns NULL if neither worked. */
+static bloom *_load_filter(const KNOWN_KIND kind, bloom *filter, uint64_t *watermark, const time_t saved_at) {
+	if (filter && saved_at && _bring_up_to_date(kind, filter, watermark, saved_at) == 0 &&
+			!bloom_overfull(filter))
+		return filter;
+
+	uint64_t capacity = KNOWN_KEYS_MIN_CAPACITY;
+	if (filter && filter->count * 2 > capacity)
+		capacity = filter->count * 2;
+	bloom_free(filter);
+
+	*watermark = 0;
+	filter = bloom_new(capacity);
+	if (!filter || _bring_up_to_date(kind, filter, watermark, 0) != 0) {
+		log_msg(LOG_WARN, "Could not load %s, every lookup will be a maybe.", _names[kind]);
+		bloom_free(filter);
+		return NULL;
+	}
+	return filter;
+}
+
+int known_keys_load() {
+	known_keys_unload();
+
+	/* Built up off to the side and only then published, so nobody trusts
+	 * one that's still missing keys. */
+	bloom *filters[KNOWN_KINDS] = {0};
+	uint64_t watermarks[KNOWN_KINDS] = {0};
+	const time_t saved_at = _read_saved(filters, watermarks);
+
+	int usable = 0;
+	int i;
+	for (i = 0; i < KNOWN_KINDS; i++) {
+		filters[i] = _load_filter(i, filters[i], &watermarks[i], saved_at);
+		if (!filters[i])
+			continue;
+
+		usable++;
+		__atomic_store_n(&_watermarks[i], watermarks[i], __ATOMIC_RELAXED);
+		__atomic_store_n(&_filters[i], filters[i], __ATOMIC_RELEASE);
+		log_msg(LOG_INFO, "Loaded %s, %"PRIu64" keys in %"PRIu64"KB.", _names[i],
+				filters[i]->count, filters[i]->nbits / 8 / 1024);
+	}
+
+	return usable;
+}
+
+int known_keys_save() {
+	char path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	char tmp_path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	_path(path);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	FILE *f = fopen(tmp_path, "wb");
+	if (!f) {
+		log_msg(LOG_WARN, "Could not save known keys to %s.", tmp_path);
+		return -1;
+	}
+
+	/* Anything written to a board after this gets rescanned next time. */
+	const uint64_t saved_at = time(NULL);
+	_saved_filter saved[KNOWN_KINDS] = {0};
+	bloom *filters[KNOWN_KINDS] = {0};
+
+	int i;
+	for (i = 0; i < KNOWN_KINDS; i++) {
+		filters[i] = __atomic_load_n(&_filters[i], __ATOMIC_ACQUIRE);
+		if (!filters[i])
+			continue;
+		saved[i].present = 1;
+		saved[i].hashes = filters[i]->hashes;
+		saved[i].nbits = filters[i]->nbits;
+		saved[i].count = __atomic_load_n(&filters[i]->count, __ATOMIC_RELAXED);
+		saved[i].watermark = __atomic_load_n(&_watermarks[i], __ATOMIC_RELAXED);
+	}
+
+	int ok = fwrite(KNOWN_KEYS_MAGIC, strlen(KNOWN_KEYS_MAGIC), 1, f) == 1 &&
+		fwrite(&saved_at, sizeof(saved_at), 1, f) == 1 &&
+		fwrite(saved, sizeof(saved), 1, f) == 1;
+	for (i = 0; ok && i < KNOWN_KINDS; i++) {
+		if (filters[i])
+			ok = fwrite(filters[i]->bits, filters[i]->nbits / 8, 1, f) == 1;
+	}
+
+	if (fclose(f) != 0 || !ok || rename(tmp_path, path) != 0) {
+		log_msg(LOG_WARN, "Could not save known keys to %s.", path);
+		unlink(tmp_path);
+		return -1;
+	}
+	return 0;
+}
@@ -14,12 +14,20 @@
 
 #include <38-moths/38-moths.h>
 
+#include "async_log.h"
 #include "db.h"
+#include "filename_index.h"
 #include "http.h"
+#include "meta_snapshot.h"
+#include "metrics.h"
 #include "models.h"
 #include "parse.h"
+#include "probes.h"
+#include "search_jobs.h"
 #include "server.h"
 #include "stack.h"
+#include "thumbnail.h"
+#include "trace.h"
 #include "utils.h"
 
 int main_sock_fd = 0;
@@ -30,21 +38,72 @@ void term(int signum) {
 	exit(1);
 }
 
+/* Wraps a route handler so every request to it is traced and counted under
+ * its name. */
+#define TRACED_HANDLER(handler) \
+	static int handler##_traced(const m38_http_request *request, m38_http_response *response) { \
+		trace_span span; \
+		MZBH_PROBE2(route__start, #handler, request->resource); \
+		trace_begin(&span, #handler); \
+		const int rc = handler(request, response); \
+		trace_end(&span); \
+		MZBH_PROBE3(route__done, #handler, rc, response->outsize); \
+		metrics_route_request(#handler, rc, response->outsize); \
+		return rc; \
+	}
+
+TRACED_HANDLER(robots_handler)
+TRACED_HANDLER(favicon_handler)
+TRACED_HANDLER(user_thumbs_static_handler)
+TRACED_HANDLER(static_handler)
+TRACED_HANDLER(url_search_handler)
+TRACED_HANDLER(search_job_handler)
+TRACED_HANDLER(search_job_wait_handler)
+TRACED_HANDLER(text_search_handler)
+TRACED_HANDLER(filename_search_handler)
+TRACED_HANDLER(admin_trace_handler)
+TRACED_HANDLER(admin_index_handler)
+TRACED_HANDLER(board_handler)
+TRACED_HANDLER(paged_board_handler)
+TRACED_HANDLER(filtered_board_handler)
+TRACED_HANDLER(webm_handler)
+TRACED_HANDLER(board_static_handler)
+TRACED_HANDLER(by_alias_handler)
+TRACED_HANDLER(by_thread_handler)
+TRACED_HANDLER(newest_handler)
+TRACED_HANDLER(paged_newest_handler)
+TRACED_HANDLER(newest_json_handler)
+TRACED_HANDLER(paged_newest_json_handler)
+TRACED_HANDLER(api_index_stats)
+TRACED_HANDLER(metrics_handler)
+TRACED_HANDLER(index_handler)
+
 static const m38_route all_routes[] = {
-	{"GET", "robots_txt", "^/robots.txt$", 0, &robots_handler, &m38_mmap_cleanup},
-	{"GET", "favicon_ico", "^/favicon.ico$", 0, &favicon_handler, &m38_mmap_cleanup},
-	{"GET", "generic_static", "^/static/[a-zA-Z0-9/_-]*\\.[a-zA-Z]*$", 0, &static_handler, &m38_mmap_cleanup},
-	{"GET", "user_uploaded_thumbs", "^/static/user_thumbs/[a-zA-Z0-9/_-]*\\.[a-zA-Z]*$", 0, &user_thumbs_static_handler, &m38_mmap_cleanup},
-	{"POST", "search_by_url", "^/search/url.json$", 0, &url_search_handler, &m38_heap_cleanup},
-	{"GET", "admin_index", "^/admin", 0, &admin_index_handler, &m38_heap_cleanup},
-	{"GET", "board_handler_no_num", "^/chug/([a-zA-Z]*)$", 1, &board_handler, &m38_heap_cleanup},
-	{"GET", "paged_board_handler", "^/chug/([a-zA-Z]*)/([0-9]*)$", 2, &paged_board_handler, &m38_heap_cleanup},
-	{"GET", "webm_handler", "^/slurp/([a-zA-Z]*)/((.*)(.webm|.jpg))$", 2, &webm_handler, &m38_heap_cleanup},
-	{"GET", "board_static_handler", "^/chug/([a-zA-Z]*)/((.*)(.webm|.jpg))$", 2, &board_static_handler, &m38_mmap_cleanup},
-	{"GET", "by_alias_handler", "^/by/alias/([0-9]*)$", 1, &by_alias_handler, &m38_heap_cleanup},
-	{"GET", "by_thread_handler", "^/by/thread/([A-Z]*[a-z]*[0-9]*)$", 1, &by_thread_handler, &m38_heap_cleanup},
-	{"GET", "api_index_stats", "^/api/index_stats$", 1, &api_index_stats, &m38_heap_cleanup},
-	{"GET", "root_handler", "^/$", 0, &index_handler, &m38_heap_cleanup},
+	{"GET", "robots_txt", "^/robots.txt$", 0, &robots_handler_traced, &m38_mmap_cleanup},
+	{"GET", "favicon_ico", "^/favicon.ico$", 0, &favicon_handler_traced, &m38_mmap_cleanup},
+	{"GET", "user_uploaded_thumbs", "^/static/user_thumbs/[a-zA-Z0-9/_-]*\\.[a-zA-Z]*$", 0, &user_thumbs_static_handler_traced, &m38_mmap_cleanup},
+	{"GET", "generic_static", "^/static/[a-zA-Z0-9/_-]*\\.[a-zA-Z]*$", 0, &static_handler_traced, &m38_mmap_cleanup},
+	{"POST", "search_by_url", "^/search/url.json$", 0, &url_search_handler_traced, &m38_heap_cleanup},
+	{"GET", "search_job", "^/search/job/([0-9]*).json$", 1, &search_job_handler_traced, &m38_heap_cleanup},
+	{"GET", "search_job_wait", "^/search/job/([0-9]*)/wait.json$", 1, &search_job_wait_handler_traced, &m38_heap_cleanup},
+	{"GET", "search_filename", "^/search/filename.json\\?q=([^&]*)", 1, &filename_search_handler_traced, &m38_heap_cleanup},
+	{"GET", "search_text", "^/search/text.json\\?q=([^&]*)", 1, &text_search_handler_traced, &m38_heap_cleanup},
+	{"GET", "admin_trace", "^/admin/trace.json$", 0, &admin_trace_handler_traced, &m38_heap_cleanup},
+	{"GET", "admin_index", "^/admin", 0, &admin_index_handler_traced, &m38_heap_cleanup},
+	{"GET", "board_handler_no_num", "^/chug/([a-zA-Z]*)$", 1, &board_handler_traced, &m38_heap_cleanup},
+	{"GET", "paged_board_handler", "^/chug/([a-zA-Z]*)/([0-9]*)$", 2, &paged_board_handler_traced, &m38_heap_cleanup},
+	{"GET", "filtered_board_handler", "^/chug/([a-zA-Z]*)/(long|audio)/([0-9]*)$", 3, &filtered_board_handler_traced, &m38_heap_cleanup},
+	{"GET", "webm_handler", "^/slurp/([a-zA-Z]*)/((.*)(.webm|.jpg))$", 2, &webm_handler_traced, &m38_heap_cleanup},
+	{"GET", "board_static_handler", "^/chug/([a-zA-Z]*)/((.*)(.webm|.jpg))$", 2, &board_static_handler_traced, &m38_mmap_cleanup},
+	{"GET", "by_alias_handler", "^/by/alias/([0-9]*)$", 1, &by_alias_handler_traced, &m38_heap_cleanup},
+	{"GET", "by_thread_handler", "^/by/thread/([A-Z]*[a-z]*[0-9]*)$", 1, &by_thread_handler_traced, &m38_heap_cleanup},
+	{"GET", "newest_handler", "^/newest$", 0, &newest_handler_traced, &m38_heap_cleanup},
+	{"GET", "paged_newest_handler", "^/newest/([0-9]+-[aw][0-9]+)$", 1, &paged_newest_handler_traced, &m38_heap_cleanup},
+	{"GET", "newest_json", "^/newest.json$", 0, &newest_json_handler_traced, &m38_heap_cleanup},
+	{"GET", "paged_newest_json", "^/newest.json\\?after=([^&]*)$", 1, &paged_newest_json_handler_traced, &m38_heap_cleanup},
+	{"GET", "api_index_stats", "^/api/index_stats$", 1, &api_index_stats_traced, &m38_heap_cleanup},
+	{"GET", "api_metrics", "^/api/metrics$", 0, &metrics_handler_traced, &m38_heap_cleanup},
+	{"GET", "root_handler", "^/$", 0, &index_handler_traced, &m38_heap_cleanup},
 };
 
 static m38_app app = {
@@ -62,8 +121,10 @@ int main(int argc, char *argv[]) {
 	signal(SIGCHLD, SIG_IGN);
 
 	curl_global_init(CURL_GLOBAL_ALL);
+	log_start();
 
 	int num_threads = DEFAULT_NUM_THREADS;
+	int num_search_threads = SEARCH_JOB_NUM_THREADS;
 	int i;
 	for (i = 1; i < argc; i++) {
 		const char *cur_arg = argv[i];
@@ -71,21 +132,50 @@ int main(int argc, char *argv[]) {
 			if ((i + 1) < argc) {
 				num_threads = strtol(argv[++i], NULL, 10);
 				if (num_threads <= 0) {
-					m38_log_msg(LOG_ERR, "Thread count must be at least 1.");
+					log_msg(LOG_ERR, "Thread count must be at least 1.");
 					return -1;
 				}
 			} else {
-				m38_log_msg(LOG_ERR, "Not enough arguments to -t.");
+				log_msg(LOG_ERR, "Not enough arguments to -t.");
+				return -1;
+			}
+		} else if (strncmp(cur_arg, "-j", strlen("-j")) == 0) {
+			if ((i + 1) < argc) {
+				num_search_threads = strtol(argv[++i], NULL, 10);
+				if (num_search_threads <= 0) {
+					log_msg(LOG_ERR, "Search worker count must be at least 1.");
+					return -1;
+				}
+			} else {
+				log_msg(LOG_ERR, "Not enough arguments to -j.");
 				return -1;
 			}
 		}
 	}
 
+	if (thumbnail_pool_start(thumbnail_default_threads()) != 0) {
+		log_msg(LOG_ERR, "Could not start thumbnail workers.");
+		return -1;
+	}
+
+	if (search_jobs_start(num_search_threads) != 0) {
+		log_msg(LOG_ERR, "Could not start search workers.");
+		return -1;
+	}
+
+	/* Filename searches just come up short until it's loaded. */
+	if (filename_index_start() != 0)
+		log_msg(LOG_WARN, "Could not start loading the filename index.");
+
+	/* Everything goes to the DB until the downloader has written one. */
+	if (meta_snapshot_open() != 0)
+		log_msg(LOG_WARN, "No metadata snapshot yet.");
+
 	int rc = 0;
 	app.num_threads = num_threads;
 	if ((rc = m38_http_serve(&app)) != 0) {
 		term(SIGTERM);
-		m38_log_msg(LOG_ERR, "Could not start HTTP service.");
+		log_msg(LOG_ERR, "Could not start HTTP service.");
 		return rc;
 	}
 	return 0;
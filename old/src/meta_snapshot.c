@@ -0,0 +1,1182 @@
+// vim: noet ts=4 sw=4
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "async_log.h"
+#include "db.h"
+#include "ebml.h"
+#include "hashing.h"
+#include "meta_snapshot.h"
+#include "models.h"
+#include "pg_fields.h"
+#include "utils.h"
+
+/* A string offset for when there isn't one. */
+#define _NO_STRING UINT64_MAX
+
+typedef struct __attribute__((__packed__)) _saved_header {
+	char magic[sizeof(META_SNAPSHOT_MAGIC) - 1];
+	uint32_t version;
+	uint32_t is_delta;
+	/* For a delta, the generation of the snapshot it goes on top of. */
+	uint64_t generation;
+	/* Highest IDs in here, or in the snapshot underneath for a delta without
+	 * any. */
+	uint64_t webm_watermark;
+	uint64_t alias_watermark;
+	/* Webms in here the backfill tool hadn't read the metadata of yet. */
+	uint64_t missing_metadata;
+	uint64_t webms;
+	uint64_t aliases;
+	uint64_t posts;
+	uint64_t adjacent;
+	uint64_t boards;
+	uint64_t entries;
+	/* Bytes of NUL terminated strings, at the very end. */
+	uint64_t strings;
+} _saved_header;
+
+typedef struct __attribute__((__packed__)) _saved_webm {
+	unsigned char hash[HASH_ARRAY_SIZE];
+	uint32_t id;
+	uint32_t post_id;
+	int64_t created_at;
+	uint64_t filename;
+	char board[MAX_BOARD_NAME_SIZE];
+	/* A HASH_ALGORITHM. */
+	uint8_t hash_algorithm;
+} _saved_webm;
+
+typedef struct __attribute__((__packed__)) _saved_alias {
+	unsigned char key[ALIAS_KEY_BIN_SIZE];
+	uint32_t id;
+	uint32_t webm_id;
+	uint32_t post_id;
+	int64_t created_at;
+	uint64_t filename;
+	char board[MAX_BOARD_NAME_SIZE];
+} _saved_alias;
+
+typedef struct __attribute__((__packed__)) _saved_post {
+	uint32_t id;
+	uint32_t thread_id;
+	uint64_t fourchan_post_id;
+	uint64_t body;
+} _saved_post;
+
+/* One of webm_id's aliases. Sorted by webm_id, then newest first. */
+typedef struct __attribute__((__packed__)) _saved_adjacent {
+	uint32_t webm_id;
+	/* Into the aliases. */
+	uint32_t alias;
+	int64_t created_at;
+} _saved_adjacent;
+
+typedef struct __attribute__((__packed__)) _saved_board {
+	char name[MAX_BOARD_NAME_SIZE];
+	/* Its entries, newest first. */
+	uint64_t first;
+	uint64_t count;
+	/* How many of them the board's long and audio pages show, so those
+	 * don't have to walk every entry to say how many pages there are. */
+	uint64_t long_count;
+	uint64_t audio_count;
+} _saved_board;
+
+/* A webm or alias on a board. Aliases get their webm's duration and audio. */
+typedef struct __attribute__((__packed__)) _saved_entry {
+	int64_t created_at;
+	uint64_t duration_ms;
+	uint64_t filename;
+	uint32_t id;
+	uint8_t is_alias;
+	uint8_t has_audio;
+} _saved_entry;
+
+/* Where an entry goes in its board: newest first, then aliases before webms
+ * and higher IDs first, so every entry has a place of its own to page from. */
+typedef struct _entry_key {
+	int64_t created_at;
+	uint32_t is_alias;
+	uint32_t id;
+} _entry_key;
+
+typedef struct _mapping {
+	void *base;
+	size_t size;
+	const _saved_header *header;
+	const _saved_webm *webms;
+	const _saved_alias *aliases;
+	const _saved_post *posts;
+	const _saved_adjacent *adjacent;
+	const _saved_board *boards;
+	const _saved_entry *entries;
+	const char *strings;
+	/* What was mapped, so we know when it's been replaced. */
+	ino_t ino;
+	time_t mtime;
+} _mapping;
+
+/* What the server reads. */
+static _mapping _snapshot = {0};
+static _mapping _delta = {0};
+static pthread_rwlock_t _lock = PTHREAD_RWLOCK_INITIALIZER;
+static time_t _checked_at = 0;
+
+static void _path(const char *name, char out[static MAX_IMAGE_FILENAME_SIZE]) {
+	snprintf(out, MAX_IMAGE_FILENAME_SIZE, "%s/%s", webm_location(), name);
+}
+
+/* Mapping */
+
+static void _unmap(_mapping *mapping) {
+	if (mapping->base)
+		munmap(mapping->base, mapping->size);
+	memset(mapping, 0, sizeof(*mapping));
+}
+
+static int _header_ok(const _saved_header *header, const int is_delta) {
+	return memcmp(header->magic, META_SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 &&
+		header->version == META_SNAPSHOT_VERSION && header->is_delta == (uint32_t)is_delta;
+}
+
+/* Returns 0 if everything header says is there fits in size. */
+static int _sections(const _saved_header *header, const size_t size, _mapping *mapping) {
+	const struct {
+		uint64_t count;
+		size_t item_size;
+		const void **out;
+	} sections[] = {
+		{ header->webms, sizeof(_saved_webm), (const void **)&mapping->webms },
+		{ header->aliases, sizeof(_saved_alias), (const void **)&mapping->aliases },
+		{ header->posts, sizeof(_saved_post), (const void **)&mapping->posts },
+		{ header->adjacent, sizeof(_saved_adjacent), (const void **)&mapping->adjacent },
+		{ header->boards, sizeof(_saved_board), (const void **)&mapping->boards },
+		{ header->entries, sizeof(_saved_entry), (const void **)&mapping->entries },
+		{ header->strings, 1, (const void **)&mapping->strings }
+	};
+
+	size_t offset = sizeof(_saved_header);
+	size_t i;
+	for (i = 0; i < sizeof(sections) / sizeof(sections[0]); i++) {
+		if (sections[i].count > (size - offset) / sections[i].item_size)
+			return -1;
+		*sections[i].out = (const char *)mapping->base + offset;
+		offset += sections[i].count * sections[i].item_size;
+	}
+	return offset == size ? 0 : -1;
+}
+
+/* The indexes in it point somewhere real. */
+static int _indexes_ok(const _mapping *mapping) {
+	const _saved_header *header = mapping->header;
+	if (header->strings > 0 && mapping->strings[header->strings - 1] != '\0')
+		return 0;
+
+	uint64_t i;
+	for (i = 0; i < header->adjacent; i++) {
+		if (mapping->adjacent[i].alias >= header->aliases)
+			return 0;
+	}
+	for (i = 0; i < header->boards; i++) {
+		if (mapping->boards[i].first > header->entries ||
+				mapping->boards[i].count > header->entries - mapping->boards[i].first ||
+				mapping->boards[i].long_count > mapping->boards[i].count ||
+				mapping->boards[i].audio_count > mapping->boards[i].count)
+			return 0;
+	}
+	return 1;
+}
+
+/* Returns 0 if there's a usable file at path in mapping now. */
+static int _map(const char *path, const int is_delta, _mapping *mapping) {
+	memset(mapping, 0, sizeof(*mapping));
+
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	struct stat st = {0};
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(_saved_header)) {
+		close(fd);
+		return -1;
+	}
+
+	void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return -1;
+
+	mapping->base = base;
+	mapping->size = st.st_size;
+	mapping->header = base;
+	mapping->ino = st.st_ino;
+	mapping->mtime = st.st_mtime;
+	if (!_header_ok(mapping->header, is_delta) || _sections(mapping->header, st.st_size, mapping) != 0 ||
+			!_indexes_ok(mapping)) {
+		log_msg(LOG_WARN, "%s isn't a metadata snapshot we can read.", path);
+		_unmap(mapping);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Remaps current if the file behind it has changed or gone away. */
+static void _remap(const char *name, const int is_delta, _mapping *current) {
+	char path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	_path(name, path);
+
+	struct stat st = {0};
+	const int exists = stat(path, &st) == 0;
+
+	pthread_rwlock_rdlock(&_lock);
+	const int stale = exists ? current->ino != st.st_ino || current->mtime != st.st_mtime ||
+		current->size != (size_t)st.st_size : current->base != NULL;
+	pthread_rwlock_unlock(&_lock);
+	if (!stale)
+		return;
+
+	_mapping fresh = {0};
+	if (exists && _map(path, is_delta, &fresh) != 0)
+		return;
+
+	pthread_rwlock_wrlock(&_lock);
+	_unmap(current);
+	*current = fresh;
+	pthread_rwlock_unlock(&_lock);
+}
+
+/* Only looks at the files every so often, so most lookups don't touch
+ * anything but memory. */
+static void _refresh(const int force) {
+	const time_t now = time(NULL);
+	if (!force && now - __atomic_load_n(&_checked_at, __ATOMIC_ACQUIRE) < META_SNAPSHOT_CHECK_SECS)
+		return;
+	__atomic_store_n(&_checked_at, now, __ATOMIC_RELEASE);
+
+	_remap(META_SNAPSHOT_FILE, 0, &_snapshot);
+	_remap(META_SNAPSHOT_DELTA_FILE, 1, &_delta);
+}
+
+/* What to look in, newest first. Call with the lock held. */
+static int _segments(const _mapping *out[static 2]) {
+	int count = 0;
+	if (_snapshot.header && _delta.header && _delta.header->generation == _snapshot.header->generation)
+		out[count++] = &_delta;
+	if (_snapshot.header)
+		out[count++] = &_snapshot;
+	return count;
+}
+
+static _entry_key _key_of(const _saved_entry *entry) {
+	const _entry_key key = { .created_at = entry->created_at, .is_alias = entry->is_alias, .id = entry->id };
+	return key;
+}
+
+/* Less than 0 if a comes before b. */
+static int _key_cmp(const _entry_key *a, const _entry_key *b) {
+	if (a->created_at != b->created_at)
+		return a->created_at > b->created_at ? -1 : 1;
+	if (a->is_alias != b->is_alias)
+		return a->is_alias > b->is_alias ? -1 : 1;
+	return a->id > b->id ? -1 : a->id < b->id;
+}
+
+static const char *_str(const _mapping *mapping, const uint64_t offset) {
+	return offset < mapping->header->strings ? mapping->strings + offset : "";
+}
+
+static const _saved_webm *_find_webm(const _mapping *mapping, const unsigned char hash[static HASH_ARRAY_SIZE]) {
+	size_t lo = 0, hi = mapping->header->webms;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		const int cmp = memcmp(mapping->webms[mid].hash, hash, HASH_ARRAY_SIZE);
+		if (cmp == 0)
+			return &mapping->webms[mid];
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+static const _saved_alias *_find_alias(const _mapping *mapping, const unsigned char key[static ALIAS_KEY_BIN_SIZE]) {
+	size_t lo = 0, hi = mapping->header->aliases;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		const int cmp = memcmp(mapping->aliases[mid].key, key, ALIAS_KEY_BIN_SIZE);
+		if (cmp == 0)
+			return &mapping->aliases[mid];
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+static const _saved_post *_find_post(const _mapping *mapping, const uint32_t id) {
+	size_t lo = 0, hi = mapping->header->posts;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (mapping->posts[mid].id == id)
+			return &mapping->posts[mid];
+		if (mapping->posts[mid].id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+/* The first of webm_id's aliases, or where it would be. */
+static size_t _first_adjacent(const _mapping *mapping, const uint32_t webm_id) {
+	size_t lo = 0, hi = mapping->header->adjacent;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (mapping->adjacent[mid].webm_id < webm_id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static const _saved_board *_find_board(const _mapping *mapping, const char name[static MAX_BOARD_NAME_SIZE]) {
+	size_t lo = 0, hi = mapping->header->boards;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		const int cmp = memcmp(mapping->boards[mid].name, name, MAX_BOARD_NAME_SIZE);
+		if (cmp == 0)
+			return &mapping->boards[mid];
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+/* Looking things up */
+
+int meta_snapshot_open() {
+	_refresh(1);
+
+	pthread_rwlock_rdlock(&_lock);
+	const int ok = _snapshot.header != NULL;
+	pthread_rwlock_unlock(&_lock);
+	return ok ? 0 : -1;
+}
+
+void meta_snapshot_close() {
+	pthread_rwlock_wrlock(&_lock);
+	_unmap(&_snapshot);
+	_unmap(&_delta);
+	__atomic_store_n(&_checked_at, 0, __ATOMIC_RELEASE);
+	pthread_rwlock_unlock(&_lock);
+}
+
+webm *meta_snapshot_get_webm(const char image_hash[static HASH_IMAGE_STR_SIZE]) {
+	unsigned char hash[HASH_ARRAY_SIZE] = {0};
+	if (!hash_hex_to_bytes(image_hash, hash))
+		return NULL;
+
+	_refresh(0);
+
+	webm *found = NULL;
+	pthread_rwlock_rdlock(&_lock);
+	const _mapping *segments[2];
+	const int count = _segments(segments);
+	int i;
+	for (i = 0; i < count; i++) {
+		const _saved_webm *saved = _find_webm(segments[i], hash);
+		if (!saved)
+			continue;
+
+		found = calloc(1, sizeof(webm));
+		if (!found)
+			break;
+		found->id = saved->id;
+		hash_bytes_to_hex(saved->hash, found->file_hash);
+		strncpy(found->filename, _str(segments[i], saved->filename), sizeof(found->filename) - 1);
+		strncpy(found->board, saved->board, sizeof(found->board) - 1);
+		found->post_id = saved->post_id;
+		found->created_at = saved->created_at;
+		found->hash_algorithm = saved->hash_algorithm;
+		break;
+	}
+	pthread_rwlock_unlock(&_lock);
+	return found;
+}
+
+webm_alias *meta_snapshot_get_alias(const char file_path[static MAX_IMAGE_FILENAME_SIZE]) {
+	char key[MAX_KEY_SIZE] = {0};
+	create_alias_key(file_path, key);
+	unsigned char key_bin[ALIAS_KEY_BIN_SIZE] = {0};
+	if (!alias_key_to_bin(key, key_bin))
+		return NULL;
+
+	_refresh(0);
+
+	webm_alias *found = NULL;
+	pthread_rwlock_rdlock(&_lock);
+	const _mapping *segments[2];
+	const int count = _segments(segments);
+	int i;
+	for (i = 0; i < count; i++) {
+		const _saved_alias *saved = _find_alias(segments[i], key_bin);
+		if (!saved)
+			continue;
+
+		found = calloc(1, sizeof(webm_alias));
+		if (!found)
+			break;
+		found->id = saved->id;
+		strncpy(found->filename, _str(segments[i], saved->filename), sizeof(found->filename) - 1);
+		strncpy(found->board, saved->board, sizeof(found->board) - 1);
+		strncpy(found->file_path, file_path, sizeof(found->file_path) - 1);
+		found->post_id = saved->post_id;
+		found->webm_id = saved->webm_id;
+		found->created_at = saved->created_at;
+		break;
+	}
+	pthread_rwlock_unlock(&_lock);
+	return found;
+}
+
+post *meta_snapshot_get_post(const unsigned int id) {
+	_refresh(0);
+
+	post *found = NULL;
+	pthread_rwlock_rdlock(&_lock);
+	const _mapping *segments[2];
+	const int count = _segments(segments);
+	int i;
+	for (i = 0; i < count; i++) {
+		const _saved_post *saved = _find_post(segments[i], id);
+		if (!saved)
+			continue;
+
+		found = calloc(1, sizeof(post));
+		if (!found)
+			break;
+		found->id = saved->id;
+		found->thread_id = saved->thread_id;
+		found->fourchan_post_id = saved->fourchan_post_id;
+		found->body_content = saved->body == _NO_STRING ? NULL : strdup(_str(segments[i], saved->body));
+		found->replied_to = vector_new(sizeof(uint64_t), 1);
+		break;
+	}
+	pthread_rwlock_unlock(&_lock);
+	return found;
+}
+
+int meta_snapshot_get_aliases(const unsigned int webm_id, vector *out) {
+	_refresh(0);
+
+	pthread_rwlock_rdlock(&_lock);
+	const _mapping *segments[2];
+	const int count = _segments(segments);
+	/* The newest one knows about every webm the older one does. */
+	int found = count > 0 && webm_id <= segments[0]->header->webm_watermark ? 0 : -1;
+	int i;
+	for (i = 0; i < count && found >= 0; i++) {
+		const _mapping *mapping = segments[i];
+		size_t a;
+		for (a = _first_adjacent(mapping, webm_id);
+				a < mapping->header->adjacent && mapping->adjacent[a].webm_id == webm_id; a++) {
+			const _saved_alias *saved = &mapping->aliases[mapping->adjacent[a].alias];
+			webm_alias alias;
+			memset(&alias, 0, sizeof(alias));
+			alias.id = saved->id;
+			strncpy(alias.filename, _str(mapping, saved->filename), sizeof(alias.filename) - 1);
+			strncpy(alias.board, saved->board, sizeof(alias.board) - 1);
+			alias.post_id = saved->post_id;
+			alias.webm_id = saved->webm_id;
+			alias.created_at = saved->created_at;
+			vector_append(out, &alias, sizeof(alias));
+			found++;
+		}
+	}
+	pthread_rwlock_unlock(&_lock);
+	return found;
+}
+
+/* How many of board's entries pass the filter, or -1 if it isn't one we keep
+ * count of. */
+static int64_t _board_count(const _saved_board *board, const uint64_t min_duration_ms, const int require_audio) {
+	if (min_duration_ms == 0)
+		return require_audio ? board->audio_count : board->count;
+	if (min_duration_ms == WEBM_LONG_DURATION_MS && !require_audio)
+		return board->long_count;
+	return -1;
+}
+
+int meta_snapshot_board_page(const char *board,
+		const uint64_t min_duration_ms, const int require_audio,
+		const unsigned int offset, const unsigned int limit, vector *out) {
+	char name[MAX_BOARD_NAME_SIZE] = {0};
+	strncpy(name, board, sizeof(name) - 1);
+
+	_refresh(0);
+
+	pthread_rwlock_rdlock(&_lock);
+	const _mapping *segments[2];
+	const int count = _segments(segments);
+	const _saved_board *boards[2] = {0};
+	size_t at[2] = {0};
+	int i;
+	int total = -1;
+	/* What the saved counts add up to, if they cover this filter. */
+	int64_t counted = 0;
+	for (i = 0; i < count; i++) {
+		boards[i] = _find_board(segments[i], name);
+		if (!boards[i])
+			continue;
+		total = 0;
+		const int64_t board_count = _board_count(boards[i], min_duration_ms, require_audio);
+		counted = counted >= 0 && board_count >= 0 ? counted + board_count : -1;
+	}
+
+	/* Both lists are newest first, so merge them. With the total already
+	 * known that only has to go as far as the end of the page. */
+	while (total >= 0 && (counted < 0 || (uint64_t)total < (uint64_t)offset + limit)) {
+		const _saved_entry *entry = NULL;
+		_entry_key entry_key = {0};
+		int from = -1;
+		for (i = 0; i < count; i++) {
+			if (!boards[i] || at[i] >= boards[i]->count)
+				continue;
+			const _saved_entry *next = &segments[i]->entries[boards[i]->first + at[i]];
+			const _entry_key next_key = _key_of(next);
+			if (!entry || _key_cmp(&next_key, &entry_key) < 0) {
+				entry_key = next_key;
+				entry = next;
+				from = i;
+			}
+		}
+		if (!entry)
+			break;
+		at[from]++;
+
+		if (entry->duration_ms < min_duration_ms || (require_audio && !entry->has_audio))
+			continue;
+		if ((unsigned int)total >= offset && (unsigned int)total - offset < limit) {
+			char filename[MAX_IMAGE_FILENAME_SIZE] = {0};
+			strncpy(filename, _str(segments[from], entry->filename), sizeof(filename) - 1);
+			vector_append(out, filename, sizeof(filename));
+		}
+		total++;
+	}
+	pthread_rwlock_unlock(&_lock);
+	return total >= 0 && counted >= 0 ? counted : total;
+}
+
+/* Merging every board */
+
+/* One board's entries in one file, from at on. */
+typedef struct _merge_list {
+	const _mapping *mapping;
+	const _saved_board *board;
+	size_t at;
+} _merge_list;
+
+static const _saved_entry *_list_entry(const _merge_list *list) {
+	return &list->mapping->entries[list->board->first + list->at];
+}
+
+static int _list_before(const _merge_list *a, const _merge_list *b) {
+	const _entry_key x = _key_of(_list_entry(a)), y = _key_of(_list_entry(b));
+	return _key_cmp(&x, &y) < 0;
+}
+
+/* A heap with the list whose next entry is the newest on top. */
+static void _sift_down(_merge_list *heap, const size_t count, size_t i) {
+	while (1) {
+		const size_t left = i * 2 + 1, right = left + 1;
+		size_t first = i;
+		if (left < count && _list_before(&heap[left], &heap[first]))
+			first = left;
+		if (right < count && _list_before(&heap[right], &heap[first]))
+			first = right;
+		if (first == i)
+			return;
+
+		const _merge_list swap = heap[i];
+		heap[i] = heap[first];
+		heap[first] = swap;
+		i = first;
+	}
+}
+
+/* Where the first entry after key is. */
+static size_t _seek(const _mapping *mapping, const _saved_board *board, const _entry_key *after) {
+	size_t lo = 0, hi = board->count;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		const _entry_key key = _key_of(&mapping->entries[board->first + mid]);
+		if (_key_cmp(&key, after) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int _parse_cursor(const char *cursor, _entry_key *key) {
+	char *end = NULL;
+	key->created_at = strtoll(cursor, &end, 10);
+	if (end == cursor || end[0] != '-' || (end[1] != 'w' && end[1] != 'a'))
+		return -1;
+	key->is_alias = end[1] == 'a';
+
+	const char *id = end + 2;
+	key->id = strtoul(id, &end, 10);
+	return end == id || *end != '\0' ? -1 : 0;
+}
+
+void meta_snapshot_cursor(const newest_hit *hit, char out[static META_SNAPSHOT_CURSOR_SIZE]) {
+	snprintf(out, META_SNAPSHOT_CURSOR_SIZE, "%lld-%c%u",
+			(long long)hit->created_at, hit->is_alias ? 'a' : 'w', hit->id);
+}
+
+int meta_snapshot_newest(const char *cursor, newest_hit *out, const size_t max) {
+	_entry_key after = {0};
+	const int paged = cursor && cursor[0];
+	if (paged && _parse_cursor(cursor, &after) != 0)
+		return -1;
+
+	_refresh(0);
+
+	pthread_rwlock_rdlock(&_lock);
+	const _mapping *segments[2];
+	const int count = _segments(segments);
+	size_t boards = 0;
+	int i;
+	for (i = 0; i < count; i++)
+		boards += segments[i]->header->boards;
+
+	_merge_list *heap = malloc((boards + 1) * sizeof(_merge_list));
+	size_t lists = 0, found = 0;
+	for (i = 0; heap && i < count; i++) {
+		uint64_t b;
+		for (b = 0; b < segments[i]->header->boards; b++) {
+			_merge_list list = { .mapping = segments[i], .board = &segments[i]->boards[b], .at = 0 };
+			if (paged)
+				list.at = _seek(list.mapping, list.board, &after);
+			if (list.at < list.board->count)
+				heap[lists++] = list;
+		}
+	}
+
+	size_t j;
+	for (j = lists / 2; j-- > 0;)
+		_sift_down(heap, lists, j);
+
+	while (lists > 0 && found < max) {
+		_merge_list *top = &heap[0];
+		const _saved_entry *entry = _list_entry(top);
+		newest_hit *hit = &out[found++];
+		memset(hit, 0, sizeof(*hit));
+		strncpy(hit->filename, _str(top->mapping, entry->filename), sizeof(hit->filename) - 1);
+		strncpy(hit->board, top->board->name, sizeof(hit->board) - 1);
+		hit->id = entry->id;
+		hit->is_alias = entry->is_alias;
+		hit->created_at = entry->created_at;
+
+		if (++top->at == top->board->count)
+			heap[0] = heap[--lists];
+		_sift_down(heap, lists, 0);
+	}
+	pthread_rwlock_unlock(&_lock);
+
+	free(heap);
+	return found;
+}
+
+/* Building */
+
+/* An entry before it's been sorted into its board. */
+typedef struct _board_entry {
+	char board[MAX_BOARD_NAME_SIZE];
+	_saved_entry saved;
+} _board_entry;
+
+typedef struct _builder {
+	_saved_webm *webms;
+	size_t webms_count, webms_cap;
+	_saved_alias *aliases;
+	size_t aliases_count, aliases_cap;
+	_saved_post *posts;
+	size_t posts_count, posts_cap;
+	_board_entry *entries;
+	size_t entries_count, entries_cap;
+	char *strings;
+	size_t strings_len, strings_cap;
+	/* Every row taken, even ones without a usable hash or key. */
+	size_t rows;
+	size_t missing_metadata;
+	uint64_t webm_watermark;
+	uint64_t alias_watermark;
+} _builder;
+
+static void _builder_free(_builder *b) {
+	free(b->webms);
+	free(b->aliases);
+	free(b->posts);
+	free(b->entries);
+	free(b->strings);
+	memset(b, 0, sizeof(*b));
+}
+
+/* Makes room for one more after count. Returns the (maybe moved) items, or
+ * NULL if it couldn't. */
+static void *_reserve(void *items, size_t *cap, const size_t count, const size_t item_size) {
+	if (count < *cap)
+		return items;
+
+	const size_t grown = *cap ? *cap * 2 : 1024;
+	void *moved = realloc(items, grown * item_size);
+	if (moved)
+		*cap = grown;
+	return moved;
+}
+
+static int _intern(_builder *b, const char *str, uint64_t *out) {
+	const size_t len = strlen(str) + 1;
+	if (b->strings_len + len > b->strings_cap) {
+		size_t cap = b->strings_cap ? b->strings_cap : 64 * 1024;
+		while (b->strings_len + len > cap)
+			cap *= 2;
+		char *grown = realloc(b->strings, cap);
+		if (!grown)
+			return -1;
+		b->strings = grown;
+		b->strings_cap = cap;
+	}
+
+	memcpy(b->strings + b->strings_len, str, len);
+	*out = b->strings_len;
+	b->strings_len += len;
+	return 0;
+}
+
+typedef struct _row_cols {
+	pg_col id, filename, board, created_at, duration_ms, has_audio;
+	pg_col post_id, thread_id, fourchan_post_id, body_content;
+	/* Webms */
+	pg_col file_hash, hash_algorithm;
+	/* Aliases */
+	pg_col oleg_key, webm_id;
+} _row_cols;
+
+static void _row_cols_init(_row_cols *cols, const PGresult *res) {
+	cols->id = pg_col_lookup(res, "id");
+	cols->filename = pg_col_lookup(res, "filename");
+	cols->board = pg_col_lookup(res, "board");
+	cols->created_at = pg_col_lookup(res, "created_at");
+	cols->duration_ms = pg_col_lookup(res, "duration_ms");
+	cols->has_audio = pg_col_lookup(res, "has_audio");
+	cols->post_id = pg_col_lookup(res, "post_id");
+	cols->thread_id = pg_col_lookup(res, "thread_id");
+	cols->fourchan_post_id = pg_col_lookup(res, "fourchan_post_id");
+	cols->body_content = pg_col_lookup(res, "body_content");
+	cols->file_hash = pg_col_lookup(res, "file_hash");
+	cols->hash_algorithm = pg_col_lookup(res, "hash_algorithm");
+	cols->oleg_key = pg_col_lookup(res, "oleg_key");
+	cols->webm_id = pg_col_lookup(res, "webm_id");
+}
+
+static const char *_row_str(const PGresult *res, const int row, const pg_col col) {
+	const char *value = pg_get_str(res, row, col);
+	return value ? value : "";
+}
+
+/* The post and board entry that go with every webm and alias. */
+static int _builder_add_common(_builder *b, const PGresult *res, const int row, const _row_cols *cols,
+		const uint32_t id, const int is_alias, const uint64_t filename) {
+	/* thread_id is only NULL if the post isn't there. */
+	if (!pg_isnull(res, row, cols->thread_id)) {
+		_saved_post *posts = _reserve(b->posts, &b->posts_cap, b->posts_count, sizeof(_saved_post));
+		if (!posts)
+			return -1;
+		b->posts = posts;
+
+		_saved_post *saved = &b->posts[b->posts_count];
+		saved->id = pg_get_int(res, row, cols->post_id);
+		saved->thread_id = pg_get_int(res, row, cols->thread_id);
+		saved->fourchan_post_id = pg_get_int(res, row, cols->fourchan_post_id);
+		saved->body = _NO_STRING;
+		uint64_t body = 0;
+		if (!pg_isnull(res, row, cols->body_content)) {
+			if (_intern(b, pg_get_str(res, row, cols->body_content), &body) != 0)
+				return -1;
+			saved->body = body;
+		}
+		b->posts_count++;
+	}
+
+	_board_entry *entries = _reserve(b->entries, &b->entries_cap, b->entries_count, sizeof(_board_entry));
+	if (!entries)
+		return -1;
+	b->entries = entries;
+
+	_board_entry *entry = &b->entries[b->entries_count++];
+	memset(entry, 0, sizeof(*entry));
+	strncpy(entry->board, _row_str(res, row, cols->board), sizeof(entry->board) - 1);
+	entry->saved.created_at = pg_get_int(res, row, cols->created_at);
+	entry->saved.duration_ms = pg_get_int(res, row, cols->duration_ms);
+	entry->saved.filename = filename;
+	entry->saved.id = id;
+	entry->saved.is_alias = is_alias;
+	entry->saved.has_audio = pg_get_bool(res, row, cols->has_audio);
+	b->rows++;
+	return 0;
+}
+
+/* Rows in ID order, skipping any at or under the watermark. */
+static int _builder_add_webms(_builder *b, const PGresult *res) {
+	_row_cols cols;
+	_row_cols_init(&cols, res);
+
+	const int rows = PQntuples(res);
+	int i;
+	for (i = 0; i < rows; i++) {
+		const uint64_t id = pg_get_int(res, i, cols.id);
+		if (id <= b->webm_watermark)
+			continue;
+
+		uint64_t filename = 0;
+		if (_intern(b, _row_str(res, i, cols.filename), &filename) != 0)
+			return -1;
+
+		/* Without a hash it can't be looked up, but it's still on its board. */
+		unsigned char hash[HASH_ARRAY_SIZE] = {0};
+		if (hash_hex_to_bytes(_row_str(res, i, cols.file_hash), hash)) {
+			_saved_webm *webms = _reserve(b->webms, &b->webms_cap, b->webms_count, sizeof(_saved_webm));
+			if (!webms)
+				return -1;
+			b->webms = webms;
+
+			_saved_webm *saved = &b->webms[b->webms_count++];
+			memset(saved, 0, sizeof(*saved));
+			memcpy(saved->hash, hash, sizeof(hash));
+			saved->id = id;
+			saved->post_id = pg_get_int(res, i, cols.post_id);
+			saved->created_at = pg_get_int(res, i, cols.created_at);
+			saved->filename = filename;
+			strncpy(saved->board, _row_str(res, i, cols.board), sizeof(saved->board) - 1);
+			/* Rows from before 002_hash_algorithm.sql are bmw256. */
+			const HASH_ALGORITHM algorithm = hash_algorithm_from_name(_row_str(res, i, cols.hash_algorithm));
+			saved->hash_algorithm = algorithm == HASH_ALGORITHMS ? HASH_BMW256 : algorithm;
+		}
+
+		if (_builder_add_common(b, res, i, &cols, id, 0, filename) != 0)
+			return -1;
+		if (pg_isnull(res, i, cols.has_audio))
+			b->missing_metadata++;
+		b->webm_watermark = id;
+	}
+	return 0;
+}
+
+static int _builder_add_aliases(_builder *b, const PGresult *res) {
+	_row_cols cols;
+	_row_cols_init(&cols, res);
+
+	const int rows = PQntuples(res);
+	int i;
+	for (i = 0; i < rows; i++) {
+		const uint64_t id = pg_get_int(res, i, cols.id);
+		if (id <= b->alias_watermark)
+			continue;
+
+		uint64_t filename = 0;
+		if (_intern(b, _row_str(res, i, cols.filename), &filename) != 0)
+			return -1;
+
+		_saved_alias *aliases = _reserve(b->aliases, &b->aliases_cap, b->aliases_count, sizeof(_saved_alias));
+		if (!aliases)
+			return -1;
+		b->aliases = aliases;
+
+		/* Legacy keys stay all zeroes, which nothing looks up. It's still
+		 * one of its webm's aliases though. */
+		char key[MAX_KEY_SIZE] = {0};
+		strncpy(key, _row_str(res, i, cols.oleg_key), sizeof(key) - 1);
+		_saved_alias *saved = &b->aliases[b->aliases_count++];
+		memset(saved, 0, sizeof(*saved));
+		if (!alias_key_to_bin(key, saved->key))
+			memset(saved->key, 0, sizeof(saved->key));
+		saved->id = id;
+		saved->webm_id = pg_get_int(res, i, cols.webm_id);
+		saved->post_id = pg_get_int(res, i, cols.post_id);
+		saved->created_at = pg_get_int(res, i, cols.created_at);
+		saved->filename = filename;
+		strncpy(saved->board, _row_str(res, i, cols.board), sizeof(saved->board) - 1);
+
+		if (_builder_add_common(b, res, i, &cols, id, 1, filename) != 0)
+			return -1;
+		b->alias_watermark = id;
+	}
+	return 0;
+}
+
+/* Takes rows from the DB until there aren't any more. Returns 1 if it
+ * stopped because it had more than limit (0 for no limit), -1 if it couldn't
+ * get them. */
+static int _builder_fill(_builder *b, const size_t limit) {
+	int table;
+	for (table = 0; table < 2; table++) {
+		while (1) {
+			PGresult *res = table == 0 ?
+				get_webm_snapshot_rows_after(b->webm_watermark, META_SNAPSHOT_PAGE) :
+				get_alias_snapshot_rows_after(b->alias_watermark, META_SNAPSHOT_PAGE);
+			if (!res)
+				return -1;
+
+			const int rows = PQntuples(res);
+			const int rc = table == 0 ? _builder_add_webms(b, res) : _builder_add_aliases(b, res);
+			PQclear(res);
+			if (rc != 0)
+				return -1;
+			if (limit && b->rows > limit)
+				return 1;
+			if (rows < META_SNAPSHOT_PAGE)
+				break;
+		}
+	}
+	return 0;
+}
+
+static int _webm_cmp(const void *a, const void *b) {
+	const _saved_webm *x = a, *y = b;
+	return memcmp(x->hash, y->hash, HASH_ARRAY_SIZE);
+}
+
+static int _alias_cmp(const void *a, const void *b) {
+	const _saved_alias *x = a, *y = b;
+	return memcmp(x->key, y->key, ALIAS_KEY_BIN_SIZE);
+}
+
+static int _post_cmp(const void *a, const void *b) {
+	const _saved_post *x = a, *y = b;
+	return x->id < y->id ? -1 : x->id > y->id;
+}
+
+static int _adjacent_cmp(const void *a, const void *b) {
+	const _saved_adjacent *x = a, *y = b;
+	if (x->webm_id != y->webm_id)
+		return x->webm_id < y->webm_id ? -1 : 1;
+	return x->created_at > y->created_at ? -1 : x->created_at < y->created_at;
+}
+
+static int _entry_cmp(const void *a, const void *b) {
+	const _board_entry *x = a, *y = b;
+	const int cmp = memcmp(x->board, y->board, MAX_BOARD_NAME_SIZE);
+	if (cmp != 0)
+		return cmp;
+	const _entry_key first = _key_of(&x->saved), second = _key_of(&y->saved);
+	return _key_cmp(&first, &second);
+}
+
+static int _builder_write(_builder *b, const char *path, const int is_delta, const uint64_t generation) {
+	char tmp_path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	int ok = 0;
+	FILE *f = NULL;
+	_saved_adjacent *adjacent = calloc(b->aliases_count + 1, sizeof(_saved_adjacent));
+	_saved_board *boards = calloc(b->entries_count + 1, sizeof(_saved_board));
+	if (!adjacent || !boards)
+		goto end;
+
+	qsort(b->webms, b->webms_count, sizeof(_saved_webm), _webm_cmp);
+	qsort(b->aliases, b->aliases_count, sizeof(_saved_alias), _alias_cmp);
+	qsort(b->entries, b->entries_count, sizeof(_board_entry), _entry_cmp);
+
+	/* A post with more than one file only needs to be in here once. */
+	qsort(b->posts, b->posts_count, sizeof(_saved_post), _post_cmp);
+	size_t posts = 0, i;
+	for (i = 0; i < b->posts_count; i++) {
+		if (posts == 0 || b->posts[posts - 1].id != b->posts[i].id)
+			b->posts[posts++] = b->posts[i];
+	}
+	b->posts_count = posts;
+
+	for (i = 0; i < b->aliases_count; i++) {
+		adjacent[i].webm_id = b->aliases[i].webm_id;
+		adjacent[i].alias = i;
+		adjacent[i].created_at = b->aliases[i].created_at;
+	}
+	qsort(adjacent, b->aliases_count, sizeof(_saved_adjacent), _adjacent_cmp);
+
+	size_t nboards = 0;
+	for (i = 0; i < b->entries_count; i++) {
+		if (nboards == 0 || memcmp(boards[nboards - 1].name, b->entries[i].board, MAX_BOARD_NAME_SIZE) != 0) {
+			memcpy(boards[nboards].name, b->entries[i].board, MAX_BOARD_NAME_SIZE);
+			boards[nboards].first = i;
+			boards[nboards++].count = 0;
+		}
+		_saved_board *board = &boards[nboards - 1];
+		board->count++;
+		board->long_count += b->entries[i].saved.duration_ms >= WEBM_LONG_DURATION_MS;
+		board->audio_count += b->entries[i].saved.has_audio != 0;
+	}
+
+	_saved_header header = {
+		.version = META_SNAPSHOT_VERSION,
+		.is_delta = is_delta,
+		.generation = generation,
+		.webm_watermark = b->webm_watermark,
+		.alias_watermark = b->alias_watermark,
+		.missing_metadata = b->missing_metadata,
+		.webms = b->webms_count,
+		.aliases = b->aliases_count,
+		.posts = b->posts_count,
+		.adjacent = b->aliases_count,
+		.boards = nboards,
+		.entries = b->entries_count,
+		.strings = b->strings_len
+	};
+	memcpy(header.magic, META_SNAPSHOT_MAGIC, sizeof(header.magic));
+
+	f = fopen(tmp_path, "wb");
+	if (!f)
+		goto end;
+
+	ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+		fwrite(b->webms, sizeof(_saved_webm), b->webms_count, f) == b->webms_count &&
+		fwrite(b->aliases, sizeof(_saved_alias), b->aliases_count, f) == b->aliases_count &&
+		fwrite(b->posts, sizeof(_saved_post), b->posts_count, f) == b->posts_count &&
+		fwrite(adjacent, sizeof(_saved_adjacent), b->aliases_count, f) == b->aliases_count &&
+		fwrite(boards, sizeof(_saved_board), nboards, f) == nboards;
+	for (i = 0; ok && i < b->entries_count; i++)
+		ok = fwrite(&b->entries[i].saved, sizeof(_saved_entry), 1, f) == 1;
+	ok = ok && fwrite(b->strings, 1, b->strings_len, f) == b->strings_len;
+
+end:
+	if (f && fclose(f) != 0)
+		ok = 0;
+	if (f && (!ok || rename(tmp_path, path) != 0)) {
+		ok = 0;
+		unlink(tmp_path);
+	}
+	if (!ok)
+		log_msg(LOG_WARN, "Could not write the metadata snapshot to %s.", path);
+	free(adjacent);
+	free(boards);
+	return ok ? 0 : -1;
+}
+
+/* Returns 0 if there's a file we can read at path. */
+static int _read_header(const char *path, const int is_delta, _saved_header *header) {
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return -1;
+
+	const int ok = fread(header, sizeof(*header), 1, f) == 1 && _header_ok(header, is_delta);
+	fclose(f);
+	return ok ? 0 : -1;
+}
+
+/* A new snapshot makes the old delta useless. */
+static int _write_snapshot(_builder *b, const uint64_t generation) {
+	char path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	_path(META_SNAPSHOT_FILE, path);
+	if (_builder_write(b, path, 0, generation) != 0)
+		return -1;
+
+	_path(META_SNAPSHOT_DELTA_FILE, path);
+	unlink(path);
+	return 0;
+}
+
+static int _write_delta(_builder *b, const uint64_t generation) {
+	char path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	_path(META_SNAPSHOT_DELTA_FILE, path);
+	return _builder_write(b, path, 1, generation);
+}
+
+int meta_snapshot_write(const PGresult *webms, const PGresult *aliases, const int is_delta) {
+	char path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	_path(META_SNAPSHOT_FILE, path);
+
+	_saved_header current = {0};
+	const int have_snapshot = _read_header(path, 0, &current) == 0;
+	if (is_delta && !have_snapshot)
+		return -1;
+
+	_builder b = {0};
+	if (is_delta) {
+		b.webm_watermark = current.webm_watermark;
+		b.alias_watermark = current.alias_watermark;
+	}
+
+	int rc = _builder_add_webms(&b, webms) == 0 && _builder_add_aliases(&b, aliases) == 0 ? 0 : -1;
+	if (rc == 0)
+		rc = is_delta ? _write_delta(&b, current.generation) :
+			_write_snapshot(&b, have_snapshot ? current.generation + 1 : 1);
+
+	_builder_free(&b);
+	return rc;
+}
+
+/* Whether the backfill tool has filled in any of the metadata current and b
+ * are missing. Rows only ever get added to the delta, so the way to get those
+ * in is a new snapshot. */
+static int _backfilled_since(const _saved_header *current, const _builder *b) {
+	const int64_t missing = count_webms_missing_metadata(b->webm_watermark);
+	return missing >= 0 && (uint64_t)missing < current->missing_metadata + b->missing_metadata;
+}
+
+int meta_snapshot_update() {
+	char path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	_path(META_SNAPSHOT_FILE, path);
+
+	_saved_header current = {0};
+	const int have_snapshot = _read_header(path, 0, &current) == 0;
+
+	_builder b = {0};
+	int rc = 1;
+	if (have_snapshot) {
+		b.webm_watermark = current.webm_watermark;
+		b.alias_watermark = current.alias_watermark;
+		rc = _builder_fill(&b, META_SNAPSHOT_MAX_DELTA);
+		if (rc == 0 && _backfilled_since(&current, &b)) {
+			log_msg(LOG_INFO, "Webms in the metadata snapshot have been backfilled since, rebuilding it.");
+			rc = 1;
+		}
+	}
+
+	if (rc == 0) {
+		/* Nothing new since the delta that's there already. */
+		_saved_header delta = {0};
+		_path(META_SNAPSHOT_DELTA_FILE, path);
+		if (b.rows > 0 && (_read_header(path, 1, &delta) != 0 || delta.generation != current.generation ||
+				delta.webm_watermark != b.webm_watermark || delta.alias_watermark != b.alias_watermark))
+			rc = _write_delta(&b, current.generation);
+	} else if (rc == 1) {
+		/* Too much for a delta or out of date, so start over. */
+		_builder_free(&b);
+		rc = _builder_fill(&b, 0);
+		if (rc == 0)
+			rc = _write_snapshot(&b, have_snapshot ? current.generation + 1 : 1);
+		if (rc == 0)
+			log_msg(LOG_INFO, "Metadata snapshot is up to webm %"PRIu64" and alias %"PRIu64".",
+					b.webm_watermark, b.alias_watermark);
+	}
+
+	_builder_free(&b);
+	return rc;
+}
@@ -0,0 +1,494 @@
+// vim: noet ts=4 sw=4
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "async_log.h"
+#include "metrics.h"
+#include "probes.h"
+#include "trace.h"
+
+/* One of these per kind of thing we count. Names are only ever appended, so
+ * recorders find theirs without the lock once it's been seen. */
+#define _MAX_VALUES 6
+
+typedef struct _counter_set {
+	const char *names[METRICS_MAX_NAMES];
+	uint64_t values[METRICS_MAX_NAMES][_MAX_VALUES];
+	unsigned int count;
+} _counter_set;
+
+/* Route values are requests by status class (1xx-5xx), then bytes. */
+#define _ROUTE_BYTES 5
+/* Query and cache values. */
+#define _QUERY_CALLS 0
+#define _QUERY_ERRORS 1
+#define _CACHE_HITS 0
+#define _CACHE_MISSES 1
+
+static _counter_set _routes = {0};
+static _counter_set _queries = {0};
+static _counter_set _caches = {0};
+static uint64_t _db_connections = 0;
+static uint64_t _db_connection_errors = 0;
+static pthread_mutex_t _names_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bucket bounds we hand to Prometheus, in seconds. */
+static const double _le_bounds[] = {
+	0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+	0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+static downloader_progress *_downloader = NULL;
+static const downloader_progress *_downloader_ro = NULL;
+static pthread_mutex_t _downloader_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t *_values_for(_counter_set *set, const char *name) {
+	const unsigned int count = __atomic_load_n(&set->count, __ATOMIC_ACQUIRE);
+	unsigned int i;
+	for (i = 0; i < count; i++) {
+		if (set->names[i] == name)
+			return set->values[i];
+	}
+
+	uint64_t *values = NULL;
+	pthread_mutex_lock(&_names_lock);
+	for (i = 0; i < set->count; i++) {
+		if (strcmp(set->names[i], name) == 0) {
+			values = set->values[i];
+			goto end;
+		}
+	}
+
+	if (set->count < METRICS_MAX_NAMES) {
+		values = set->values[set->count];
+		set->names[set->count] = name;
+		__atomic_store_n(&set->count, set->count + 1, __ATOMIC_RELEASE);
+	}
+
+end:
+	pthread_mutex_unlock(&_names_lock);
+	return values;
+}
+
+static void _add(uint64_t *counter, const uint64_t amount) {
+	__atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+static uint64_t _load(const uint64_t *counter) {
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void metrics_route_request(const char *name, const int status, const size_t bytes) {
+	uint64_t *values = _values_for(&_routes, name);
+	if (!values)
+		return;
+
+	int class = status / 100 - 1;
+	if (class < 0 || class > 4)
+		class = 4;
+
+	_add(&values[class], 1);
+	_add(&values[_ROUTE_BYTES], bytes);
+}
+
+void metrics_db_connection(const int ok) {
+	_add(ok ? &_db_connections : &_db_connection_errors, 1);
+}
+
+void metrics_db_query(const char *name, const int ok) {
+	uint64_t *values = _values_for(&_queries, name);
+	if (!values)
+		return;
+
+	_add(&values[_QUERY_CALLS], 1);
+	if (!ok)
+		_add(&values[_QUERY_ERRORS], 1);
+}
+
+void metrics_cache(const char *name, const int hit) {
+	MZBH_PROBE2(cache, name, hit);
+	uint64_t *values = _values_for(&_caches, name);
+	if (values)
+		_add(&values[hit ? _CACHE_HITS : _CACHE_MISSES], 1);
+}
+
+void metrics_cache_totals(const char *name, uint64_t *hits, uint64_t *misses) {
+	const uint64_t *values = _values_for(&_caches, name);
+	*hits = values ? _load(&values[_CACHE_HITS]) : 0;
+	*misses = values ? _load(&values[_CACHE_MISSES]) : 0;
+}
+
+void metrics_db_totals(uint64_t *connections, uint64_t *queries) {
+	*connections = _load(&_db_connections);
+	*queries = 0;
+
+	const unsigned int count = __atomic_load_n(&_queries.count, __ATOMIC_ACQUIRE);
+	unsigned int i;
+	for (i = 0; i < count; i++)
+		*queries += _load(&_queries.values[i][_QUERY_CALLS]);
+}
+
+downloader_progress *metrics_downloader_attach() {
+	pthread_mutex_lock(&_downloader_lock);
+	if (_downloader)
+		goto end;
+
+	const int fd = shm_open(METRICS_DOWNLOADER_SHM, O_CREAT | O_RDWR, 0644);
+	if (fd < 0) {
+		log_msg(LOG_WARN, "Could not open %s, progress won't be exported.", METRICS_DOWNLOADER_SHM);
+		goto end;
+	}
+
+	if (ftruncate(fd, sizeof(downloader_progress)) == -1) {
+		log_msg(LOG_WARN, "Could not size %s.", METRICS_DOWNLOADER_SHM);
+		close(fd);
+		goto end;
+	}
+
+	downloader_progress *progress = mmap(NULL, sizeof(downloader_progress),
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (progress == MAP_FAILED)
+		goto end;
+
+	/* Counters start over with the process, like everything else here. */
+	memset(progress, 0, sizeof(downloader_progress));
+	progress->pid = getpid();
+	progress->last_update = time(NULL);
+	__atomic_store_n(&progress->magic, METRICS_DOWNLOADER_MAGIC, __ATOMIC_RELEASE);
+	_downloader = progress;
+
+end:
+	pthread_mutex_unlock(&_downloader_lock);
+	return _downloader;
+}
+
+static void _touch(downloader_progress *progress) {
+	__atomic_store_n(&progress->last_update, (uint64_t)time(NULL), __ATOMIC_RELAXED);
+}
+
+void metrics_downloader_pass_started() {
+	downloader_progress *progress = metrics_downloader_attach();
+	if (!progress)
+		return;
+
+	_add(&progress->passes, 1);
+	__atomic_store_n(&progress->pass_bytes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&progress->pass_started_at, (uint64_t)time(NULL), __ATOMIC_RELAXED);
+	_touch(progress);
+}
+
+void metrics_downloader_thread_fetched(const int ok) {
+	downloader_progress *progress = metrics_downloader_attach();
+	if (!progress)
+		return;
+
+	_add(ok ? &progress->threads_fetched : &progress->thread_fetch_errors, 1);
+	_touch(progress);
+}
+
+void metrics_downloader_file_downloaded(const int ok, const size_t bytes) {
+	downloader_progress *progress = metrics_downloader_attach();
+	if (!progress)
+		return;
+
+	if (ok) {
+		_add(&progress->files_downloaded, 1);
+		_add(&progress->bytes_downloaded, bytes);
+		_add(&progress->pass_bytes, bytes);
+	} else {
+		_add(&progress->download_errors, 1);
+	}
+	_touch(progress);
+}
+
+void metrics_downloader_journal(const uint64_t pending_bytes, const uint64_t applied) {
+	downloader_progress *progress = metrics_downloader_attach();
+	if (!progress)
+		return;
+
+	__atomic_store_n(&progress->journal_pending_bytes, pending_bytes, __ATOMIC_RELAXED);
+	_add(&progress->journal_applied, applied);
+}
+
+/* Server side. The downloader might not have started yet, so keep trying
+ * until the segment shows up. */
+static const downloader_progress *_downloader_progress() {
+	pthread_mutex_lock(&_downloader_lock);
+	if (_downloader_ro || _downloader)
+		goto end;
+
+	const int fd = shm_open(METRICS_DOWNLOADER_SHM, O_RDONLY, 0);
+	if (fd < 0)
+		goto end;
+
+	const downloader_progress *mapped = mmap(NULL, sizeof(downloader_progress),
+			PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapped != MAP_FAILED)
+		_downloader_ro = mapped;
+
+end:
+	pthread_mutex_unlock(&_downloader_lock);
+	const downloader_progress *progress = _downloader ? _downloader : _downloader_ro;
+	if (progress && __atomic_load_n(&progress->magic, __ATOMIC_ACQUIRE) != METRICS_DOWNLOADER_MAGIC)
+		return NULL;
+	return progress;
+}
+
+static void _write_label(FILE *out, const char *value) {
+	const char *c;
+	for (c = value; *c != '\0'; c++) {
+		if (*c == '\\' || *c == '"')
+			fputc('\\', out);
+		if (*c == '\n')
+			fputs("\\n", out);
+		else
+			fputc(*c, out);
+	}
+}
+
+static int _span_id_by_name(const char *name, unsigned int *out) {
+	const unsigned int count = trace_span_count();
+	unsigned int i;
+	for (i = 0; i < count; i++) {
+		if (strcmp(trace_span_name(i), name) == 0) {
+			*out = i;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int _in_set(_counter_set *set, const char *name) {
+	const unsigned int count = __atomic_load_n(&set->count, __ATOMIC_ACQUIRE);
+	unsigned int i;
+	for (i = 0; i < count; i++) {
+		if (strcmp(set->names[i], name) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* Turns one of our log-linear histograms into cumulative le buckets. A trace
+ * bucket counts towards a bound once its upper edge is under it, so counts
+ * can lag by up to one trace bucket (12.5%). */
+static void _write_histogram(FILE *out, const char *metric, const char *label, const char *name,
+		const unsigned int span_id) {
+	trace_histogram *hist = calloc(1, sizeof(trace_histogram));
+	if (!hist)
+		return;
+	trace_merge_histogram(span_id, hist);
+
+	unsigned int bucket = 0;
+	uint64_t cumulative = 0;
+	size_t i;
+	for (i = 0; i < sizeof(_le_bounds)/sizeof(_le_bounds[0]); i++) {
+		const uint64_t bound_ns = _le_bounds[i] * 1000000000.0;
+		while (bucket < TRACE_HIST_BUCKETS && trace_bucket_upper_ns(bucket) <= bound_ns)
+			cumulative += hist->buckets[bucket++];
+
+		fprintf(out, "%s_bucket{%s=\"", metric, label);
+		_write_label(out, name);
+		fprintf(out, "\",le=\"%g\"} %"PRIu64"\n", _le_bounds[i], cumulative);
+	}
+
+	fprintf(out, "%s_bucket{%s=\"", metric, label);
+	_write_label(out, name);
+	fprintf(out, "\",le=\"+Inf\"} %"PRIu64"\n", hist->count);
+
+	fprintf(out, "%s_sum{%s=\"", metric, label);
+	_write_label(out, name);
+	fprintf(out, "\"} %.9f\n", hist->sum_ns / 1000000000.0);
+
+	fprintf(out, "%s_count{%s=\"", metric, label);
+	_write_label(out, name);
+	fprintf(out, "\"} %"PRIu64"\n", hist->count);
+
+	free(hist);
+}
+
+static void _write_set_histograms(FILE *out, _counter_set *set, const char *metric, const char *label) {
+	const unsigned int count = __atomic_load_n(&set->count, __ATOMIC_ACQUIRE);
+	unsigned int i, span_id;
+	for (i = 0; i < count; i++) {
+		if (_span_id_by_name(set->names[i], &span_id))
+			_write_histogram(out, metric, label, set->names[i], span_id);
+	}
+}
+
+static void _write_routes(FILE *out) {
+	static const char *classes[] = {"1xx", "2xx", "3xx", "4xx", "5xx"};
+	const unsigned int count = __atomic_load_n(&_routes.count, __ATOMIC_ACQUIRE);
+	unsigned int i, j;
+
+	fputs("# HELP mzbh_http_requests_total Requests handled, by route and status class.\n", out);
+	fputs("# TYPE mzbh_http_requests_total counter\n", out);
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < sizeof(classes)/sizeof(classes[0]); j++) {
+			fputs("mzbh_http_requests_total{route=\"", out);
+			_write_label(out, _routes.names[i]);
+			fprintf(out, "\",code=\"%s\"} %"PRIu64"\n", classes[j], _load(&_routes.values[i][j]));
+		}
+	}
+
+	fputs("# HELP mzbh_http_response_bytes_total Response bytes handed back, by route.\n", out);
+	fputs("# TYPE mzbh_http_response_bytes_total counter\n", out);
+	for (i = 0; i < count; i++) {
+		fputs("mzbh_http_response_bytes_total{route=\"", out);
+		_write_label(out, _routes.names[i]);
+		fprintf(out, "\"} %"PRIu64"\n", _load(&_routes.values[i][_ROUTE_BYTES]));
+	}
+
+	fputs("# HELP mzbh_http_request_duration_seconds Time spent in route handlers.\n", out);
+	fputs("# TYPE mzbh_http_request_duration_seconds histogram\n", out);
+	_write_set_histograms(out, &_routes, "mzbh_http_request_duration_seconds", "route");
+}
+
+static void _write_db(FILE *out) {
+	const unsigned int count = __atomic_load_n(&_queries.count, __ATOMIC_ACQUIRE);
+	unsigned int i;
+
+	fputs("# HELP mzbh_db_connections_total Postgres connections opened.\n", out);
+	fputs("# TYPE mzbh_db_connections_total counter\n", out);
+	fprintf(out, "mzbh_db_connections_total %"PRIu64"\n", _load(&_db_connections));
+	fputs("# HELP mzbh_db_connection_errors_total Postgres connections that failed.\n", out);
+	fputs("# TYPE mzbh_db_connection_errors_total counter\n", out);
+	fprintf(out, "mzbh_db_connection_errors_total %"PRIu64"\n", _load(&_db_connection_errors));
+
+	fputs("# HELP mzbh_db_queries_total Queries run, by the function that ran them.\n", out);
+	fputs("# TYPE mzbh_db_queries_total counter\n", out);
+	for (i = 0; i < count; i++) {
+		fputs("mzbh_db_queries_total{query=\"", out);
+		_write_label(out, _queries.names[i]);
+		fprintf(out, "\"} %"PRIu64"\n", _load(&_queries.values[i][_QUERY_CALLS]));
+	}
+
+	fputs("# HELP mzbh_db_query_errors_total Queries that didn't come back OK.\n", out);
+	fputs("# TYPE mzbh_db_query_errors_total counter\n", out);
+	for (i = 0; i < count; i++) {
+		fputs("mzbh_db_query_errors_total{query=\"", out);
+		_write_label(out, _queries.names[i]);
+		fprintf(out, "\"} %"PRIu64"\n", _load(&_queries.values[i][_QUERY_ERRORS]));
+	}
+
+	fputs("# HELP mzbh_db_query_duration_seconds Time spent waiting on queries.\n", out);
+	fputs("# TYPE mzbh_db_query_duration_seconds histogram\n", out);
+	_write_set_histograms(out, &_queries, "mzbh_db_query_duration_seconds", "query");
+}
+
+static void _write_caches(FILE *out) {
+	const unsigned int count = __atomic_load_n(&_caches.count, __ATOMIC_ACQUIRE);
+	unsigned int i;
+
+	fputs("# HELP mzbh_cache_requests_total Cache lookups, by cache and result.\n", out);
+	fputs("# TYPE mzbh_cache_requests_total counter\n", out);
+	for (i = 0; i < count; i++) {
+		fputs("mzbh_cache_requests_total{cache=\"", out);
+		_write_label(out, _caches.names[i]);
+		fprintf(out, "\",result=\"hit\"} %"PRIu64"\n", _load(&_caches.values[i][_CACHE_HITS]));
+		fputs("mzbh_cache_requests_total{cache=\"", out);
+		_write_label(out, _caches.names[i]);
+		fprintf(out, "\",result=\"miss\"} %"PRIu64"\n", _load(&_caches.values[i][_CACHE_MISSES]));
+	}
+
+	fputs("# HELP mzbh_cache_hit_ratio Hits over lookups since start.\n", out);
+	fputs("# TYPE mzbh_cache_hit_ratio gauge\n", out);
+	for (i = 0; i < count; i++) {
+		const uint64_t hits = _load(&_caches.values[i][_CACHE_HITS]);
+		const uint64_t total = hits + _load(&_caches.values[i][_CACHE_MISSES]);
+		fputs("mzbh_cache_hit_ratio{cache=\"", out);
+		_write_label(out, _caches.names[i]);
+		fprintf(out, "\"} %g\n", total ? (double)hits / total : 0.0);
+	}
+}
+
+/* Everything traced that isn't a route or a query: hashing, templates,
+ * fetches and so on. */
+static void _write_other_spans(FILE *out) {
+	fputs("# HELP mzbh_span_duration_seconds Time spent in other traced spans.\n", out);
+	fputs("# TYPE mzbh_span_duration_seconds histogram\n", out);
+
+	const unsigned int count = trace_span_count();
+	unsigned int i;
+	for (i = 0; i < count; i++) {
+		const char *name = trace_span_name(i);
+		if (!_in_set(&_routes, name) && !_in_set(&_queries, name))
+			_write_histogram(out, "mzbh_span_duration_seconds", "span", name, i);
+	}
+}
+
+#define _WRITE_SINGLE(out, metric, type, help, value) \
+	fprintf(out, "# HELP " metric " " help "\n# TYPE " metric " " type "\n" metric " %"PRIu64"\n", (uint64_t)(value))
+
+static void _write_logging(FILE *out) {
+	_WRITE_SINGLE(out, "mzbh_log_dropped_total", "counter",
+			"Log messages dropped because a thread's ring was full.", log_dropped_total());
+	_WRITE_SINGLE(out, "mzbh_log_sampled_total", "counter",
+			"Log messages skipped by per call site sampling.", log_sampled_total());
+}
+
+static void _write_downloader(FILE *out) {
+	const downloader_progress *progress = _downloader_progress();
+	const int up = progress && (progress->pid == getpid() || kill(progress->pid, 0) == 0);
+
+	_WRITE_SINGLE(out, "mzbh_downloader_up", "gauge", "Whether the downloader is running.", up);
+	if (!progress)
+		return;
+
+	const uint64_t started = __atomic_load_n(&progress->pass_started_at, __ATOMIC_RELAXED);
+	const uint64_t last_update = __atomic_load_n(&progress->last_update, __ATOMIC_RELAXED);
+	const uint64_t pass_bytes = __atomic_load_n(&progress->pass_bytes, __ATOMIC_RELAXED);
+	/* Anything done within the first second counts as a second's worth. */
+	const uint64_t elapsed = last_update > started ? last_update - started : 1;
+
+	_WRITE_SINGLE(out, "mzbh_downloader_passes_total", "counter",
+			"Crawl passes started.", _load(&progress->passes));
+	_WRITE_SINGLE(out, "mzbh_downloader_threads_fetched_total", "counter",
+			"Thread JSON fetched.", _load(&progress->threads_fetched));
+	_WRITE_SINGLE(out, "mzbh_downloader_thread_fetch_errors_total", "counter",
+			"Thread JSON fetches that failed.", _load(&progress->thread_fetch_errors));
+	_WRITE_SINGLE(out, "mzbh_downloader_files_downloaded_total", "counter",
+			"Webms downloaded.", _load(&progress->files_downloaded));
+	_WRITE_SINGLE(out, "mzbh_downloader_download_errors_total", "counter",
+			"Webm downloads that failed.", _load(&progress->download_errors));
+	_WRITE_SINGLE(out, "mzbh_downloader_bytes_total", "counter",
+			"Webm bytes downloaded.", _load(&progress->bytes_downloaded));
+	_WRITE_SINGLE(out, "mzbh_downloader_journal_pending_bytes", "gauge",
+			"Ingest journal bytes not in Postgres yet.", _load(&progress->journal_pending_bytes));
+	_WRITE_SINGLE(out, "mzbh_downloader_journal_applied_total", "counter",
+			"Ingest journal entries applied to Postgres.", _load(&progress->journal_applied));
+	_WRITE_SINGLE(out, "mzbh_downloader_last_update_seconds", "gauge",
+			"When the downloader last did anything, in unix time.", last_update);
+
+	fputs("# HELP mzbh_downloader_bytes_per_second Download rate over the current pass.\n", out);
+	fputs("# TYPE mzbh_downloader_bytes_per_second gauge\n", out);
+	fprintf(out, "mzbh_downloader_bytes_per_second %g\n", (double)pass_bytes / elapsed);
+}
+
+char *metrics_render(size_t *out_len) {
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *out = open_memstream(&buf, &len);
+	if (!out)
+		return NULL;
+
+	_write_routes(out);
+	_write_db(out);
+	_write_caches(out);
+	_write_other_spans(out);
+	_write_logging(out);
+	_write_downloader(out);
+
+	fclose(out);
+	*out_len = len;
+	return buf;
+}
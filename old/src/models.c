@@ -1,176 +1,302 @@
 // vim: noet ts=4 sw=4
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
-#include <38-moths/logging.h>
-
+#include "async_log.h"
 #include "db.h"
+#include "hashing.h"
 #include "models.h"
 #include "parson.h"
+#include "pg_fields.h"
 #include "utils.h"
 
 void create_webm_key(const char file_hash[static HASH_IMAGE_STR_SIZE], char outbuf[static MAX_KEY_SIZE]) {
 	snprintf(outbuf, MAX_KEY_SIZE, "%s%s", WEBM_NMSPC, file_hash);
 }
 
+/* Rows from before 002_hash_algorithm.sql, or queries that don't select it,
+ * are bmw256. */
+static HASH_ALGORITHM _hash_algorithm_from_name(const char *name) {
+	if (!name)
+		return HASH_BMW256;
+
+	const HASH_ALGORITHM algorithm = hash_algorithm_from_name(name);
+	return algorithm == HASH_ALGORITHMS ? HASH_BMW256 : algorithm;
+}
+
+/* Once 004_binary_keys.sql's old text column goes only file_hash_bin will be
+ * left, which is the raw bytes in a binary result and \x and lowercase hex in
+ * a text one. */
+static void _file_hash_from_cols(const PGresult *res, const int idx, const char *file_hash,
+		const pg_col bin_col, char outbuf[static HASH_IMAGE_STR_SIZE]) {
+	if (file_hash) {
+		strncpy(outbuf, file_hash, HASH_IMAGE_STR_SIZE);
+		return;
+	}
+
+	if (pg_isnull(res, idx, bin_col))
+		return;
+
+	const char *value = PQgetvalue(res, idx, bin_col.num);
+	unsigned char hash[HASH_ARRAY_SIZE] = {0};
+	if (bin_col.binary) {
+		if (PQgetlength(res, idx, bin_col.num) != HASH_ARRAY_SIZE)
+			return;
+		memcpy(hash, value, sizeof(hash));
+	} else if (strncmp(value, "\\x", 2) != 0 || !hash_hex_to_bytes(value + 2, hash)) {
+		return;
+	}
+
+	hash_bytes_to_hex(hash, outbuf);
+}
+
+static void _copy_str(char *outbuf, const char *value, const size_t size) {
+	if (value)
+		strncpy(outbuf, value, size);
+}
+
+void webm_cols_init(webm_cols *cols, const PGresult *res) {
+	cols->id = pg_col_lookup(res, "id");
+	cols->file_hash = pg_col_lookup(res, "file_hash");
+	cols->file_hash_bin = pg_col_lookup(res, "file_hash_bin");
+	cols->filename = pg_col_lookup(res, "filename");
+	cols->board = pg_col_lookup(res, "board");
+	cols->file_path = pg_col_lookup(res, "file_path");
+	cols->post_id = pg_col_lookup(res, "post_id");
+	cols->created_at = pg_col_lookup(res, "created_at");
+	cols->size = pg_col_lookup(res, "size");
+	cols->hash_algorithm = pg_col_lookup(res, "hash_algorithm");
+	cols->fingerprint = pg_col_lookup(res, "fingerprint");
+	cols->duration_ms = pg_col_lookup(res, "duration_ms");
+	cols->width = pg_col_lookup(res, "width");
+	cols->height = pg_col_lookup(res, "height");
+	cols->video_codec = pg_col_lookup(res, "video_codec");
+	cols->audio_codec = pg_col_lookup(res, "audio_codec");
+	cols->has_audio = pg_col_lookup(res, "has_audio");
+}
+
+void webm_row_get(webm_row *row, const webm_cols *cols, const PGresult *res, const int idx) {
+	row->id = pg_get_int(res, idx, cols->id);
+	row->post_id = pg_get_int(res, idx, cols->post_id);
+	row->size = pg_get_int(res, idx, cols->size);
+	row->created_at = pg_get_int(res, idx, cols->created_at);
+	row->hash_algorithm = _hash_algorithm_from_name(pg_get_str(res, idx, cols->hash_algorithm));
+	row->file_hash = pg_get_str(res, idx, cols->file_hash);
+	row->filename = pg_get_str(res, idx, cols->filename);
+	row->board = pg_get_str(res, idx, cols->board);
+	row->file_path = pg_get_str(res, idx, cols->file_path);
+	row->fingerprint = pg_get_str(res, idx, cols->fingerprint);
+
+	/* Older rows may not have been backfilled yet. */
+	row->has_metadata = !pg_isnull(res, idx, cols->has_audio);
+	row->duration_ms = pg_get_int(res, idx, cols->duration_ms);
+	row->width = pg_get_int(res, idx, cols->width);
+	row->height = pg_get_int(res, idx, cols->height);
+	row->has_audio = pg_get_bool(res, idx, cols->has_audio);
+	row->video_codec = pg_get_str(res, idx, cols->video_codec);
+	row->audio_codec = pg_get_str(res, idx, cols->audio_codec);
+}
+
 webm *deserialize_webm_from_tuples(const PGresult *res, const unsigned int i) {
 	if (!res)
 		return NULL;
 
 	if (PQntuples(res) <= 0) {
-		m38_log_msg(LOG_WARN, "No tuples in PG result for webm_from_tuples.");
+		log_msg(LOG_WARN, "No tuples in PG result for webm_from_tuples.");
 		return NULL;
 	}
 
-	webm *to_return = calloc(1, sizeof(webm));
+	webm_cols cols;
+	webm_cols_init(&cols, res);
+	webm_row row;
+	webm_row_get(&row, &cols, res, i);
 
-	const int file_hash_col = PQfnumber(res, "file_hash");
-	const int filename_col = PQfnumber(res, "filename");
-	const int board_col = PQfnumber(res, "board");
-	const int file_path_col = PQfnumber(res, "file_path");
-	const int size_col = PQfnumber(res, "size");
-	const int post_id_col = PQfnumber(res, "post_id");
-	const int id_col = PQfnumber(res, "id");
-	const int created_at_col = PQfnumber(res, "created_at");
-
-	strncpy(to_return->file_hash, PQgetvalue(res, i, file_hash_col), sizeof(to_return->file_hash));
-	strncpy(to_return->file_path, PQgetvalue(res, i, file_path_col), sizeof(to_return->file_path));
-	strncpy(to_return->filename, PQgetvalue(res, i, filename_col), sizeof(to_return->filename));
-	strncpy(to_return->board, PQgetvalue(res, i, board_col), sizeof(to_return->board));
-	to_return->size = (size_t)atol(PQgetvalue(res, i, size_col));
-	to_return->post_id = (unsigned int)atol(PQgetvalue(res, i, post_id_col));
-	to_return->created_at = (time_t)atol(PQgetvalue(res, i, created_at_col));
-	to_return->id = (unsigned int)atol(PQgetvalue(res, i, id_col));
+	webm *to_return = calloc(1, sizeof(webm));
 
+	_file_hash_from_cols(res, i, row.file_hash, cols.file_hash_bin, to_return->file_hash);
+	_copy_str(to_return->file_path, row.file_path, sizeof(to_return->file_path));
+	_copy_str(to_return->filename, row.filename, sizeof(to_return->filename));
+	_copy_str(to_return->board, row.board, sizeof(to_return->board));
+	_copy_str(to_return->fingerprint, row.fingerprint, sizeof(to_return->fingerprint) - 1);
+	to_return->size = row.size;
+	to_return->post_id = row.post_id;
+	to_return->created_at = row.created_at;
+	to_return->id = row.id;
+	to_return->hash_algorithm = row.hash_algorithm;
+
+	if (row.has_metadata) {
+		webm_metadata metadata = {0};
+		metadata.duration_ms = row.duration_ms;
+		metadata.width = row.width;
+		metadata.height = row.height;
+		_copy_str(metadata.video_codec, row.video_codec, sizeof(metadata.video_codec) - 1);
+		_copy_str(metadata.audio_codec, row.audio_codec, sizeof(metadata.audio_codec) - 1);
+		metadata.has_audio = row.has_audio;
+		to_return->metadata = metadata;
+	}
 
 	return to_return;
 }
 
+void webm_alias_cols_init(webm_alias_cols *cols, const PGresult *res) {
+	cols->id = pg_col_lookup(res, "id");
+	cols->file_hash = pg_col_lookup(res, "file_hash");
+	cols->file_hash_bin = pg_col_lookup(res, "file_hash_bin");
+	cols->filename = pg_col_lookup(res, "filename");
+	cols->board = pg_col_lookup(res, "board");
+	cols->file_path = pg_col_lookup(res, "file_path");
+	cols->post_id = pg_col_lookup(res, "post_id");
+	cols->webm_id = pg_col_lookup(res, "webm_id");
+	cols->created_at = pg_col_lookup(res, "created_at");
+	cols->hash_algorithm = pg_col_lookup(res, "hash_algorithm");
+}
+
+void webm_alias_row_get(webm_alias_row *row, const webm_alias_cols *cols, const PGresult *res, const int idx) {
+	row->id = pg_get_int(res, idx, cols->id);
+	row->post_id = pg_get_int(res, idx, cols->post_id);
+	row->webm_id = pg_get_int(res, idx, cols->webm_id);
+	row->created_at = pg_get_int(res, idx, cols->created_at);
+	row->hash_algorithm = _hash_algorithm_from_name(pg_get_str(res, idx, cols->hash_algorithm));
+	row->file_hash = pg_get_str(res, idx, cols->file_hash);
+	row->filename = pg_get_str(res, idx, cols->filename);
+	row->board = pg_get_str(res, idx, cols->board);
+	row->file_path = pg_get_str(res, idx, cols->file_path);
+}
+
 webm_alias *deserialize_alias_from_tuples(const PGresult *res, const unsigned int idx) {
 	if (!res)
 		return NULL;
 
 	if (PQntuples(res) <= 0) {
-		//m38_log_msg(LOG_WARN, "No tuples in PG result for alias_from_tuples.");
+		//log_msg(LOG_WARN, "No tuples in PG result for alias_from_tuples.");
 		return NULL;
 	}
 
+	webm_alias_cols cols;
+	webm_alias_cols_init(&cols, res);
+	webm_alias_row row;
+	webm_alias_row_get(&row, &cols, res, idx);
+
 	webm_alias *to_return = calloc(1, sizeof(webm));
 
-	const int file_hash_col = PQfnumber(res, "file_hash");
-	const int filename_col = PQfnumber(res, "filename");
-	const int board_col = PQfnumber(res, "board");
-	const int file_path_col = PQfnumber(res, "file_path");
-	const int post_id_col = PQfnumber(res, "post_id");
-	const int id_col = PQfnumber(res, "id");
-	const int webm_id_col = PQfnumber(res, "webm_id");
-	const int created_at_col = PQfnumber(res, "created_at");
-
-	strncpy(to_return->file_hash, PQgetvalue(res, idx, file_hash_col), sizeof(to_return->file_hash));
-	strncpy(to_return->file_path, PQgetvalue(res, idx, file_path_col), sizeof(to_return->file_path));
-	strncpy(to_return->filename, PQgetvalue(res, idx, filename_col), sizeof(to_return->filename));
-	strncpy(to_return->board, PQgetvalue(res, idx, board_col), sizeof(to_return->board));
-	to_return->post_id = (unsigned int)atol(PQgetvalue(res, idx, post_id_col));
-	to_return->webm_id = (unsigned int)atol(PQgetvalue(res, idx, webm_id_col));
-	to_return->created_at = (time_t)atol(PQgetvalue(res, idx, created_at_col));
-	to_return->id = (unsigned int)atol(PQgetvalue(res, idx, id_col));
+	_file_hash_from_cols(res, idx, row.file_hash, cols.file_hash_bin, to_return->file_hash);
+	_copy_str(to_return->file_path, row.file_path, sizeof(to_return->file_path));
+	_copy_str(to_return->filename, row.filename, sizeof(to_return->filename));
+	_copy_str(to_return->board, row.board, sizeof(to_return->board));
+	to_return->post_id = row.post_id;
+	to_return->webm_id = row.webm_id;
+	to_return->created_at = row.created_at;
+	to_return->id = row.id;
+	to_return->hash_algorithm = row.hash_algorithm;
 
 	return to_return;
 }
 
+void post_cols_init(post_cols *cols, const PGresult *res) {
+	cols->id = pg_col_lookup(res, "id");
+	cols->oleg_key = pg_col_lookup(res, "oleg_key");
+	cols->fourchan_post_id = pg_col_lookup(res, "fourchan_post_id");
+	cols->fourchan_post_no = pg_col_lookup(res, "fourchan_post_no");
+	cols->thread_id = pg_col_lookup(res, "thread_id");
+	cols->board = pg_col_lookup(res, "board");
+	cols->body_content = pg_col_lookup(res, "body_content");
+	cols->replied_to = pg_col_lookup(res, "replied_to");
+	cols->created_at = pg_col_lookup(res, "created_at");
+}
+
+void post_row_get(post_row *row, const post_cols *cols, const PGresult *res, const int idx) {
+	row->id = pg_get_int(res, idx, cols->id);
+	row->thread_id = pg_get_int(res, idx, cols->thread_id);
+	row->fourchan_post_id = pg_get_int(res, idx, cols->fourchan_post_id);
+	row->fourchan_post_no = pg_get_int(res, idx, cols->fourchan_post_no);
+	row->created_at = pg_get_int(res, idx, cols->created_at);
+	row->oleg_key = pg_get_str(res, idx, cols->oleg_key);
+	row->board = pg_get_str(res, idx, cols->board);
+	row->body_content = pg_get_str(res, idx, cols->body_content);
+	row->replied_to_count = pg_get_int_array(res, idx, cols->replied_to, NULL, 0);
+}
 
 post *deserialize_post_from_tuples(const PGresult *res, const unsigned int idx) {
 	if (!res)
 		return NULL;
 
 	if (PQntuples(res) <= 0) {
-		m38_log_msg(LOG_WARN, "No tuples in PG result for post_from_tuples.");
+		log_msg(LOG_WARN, "No tuples in PG result for post_from_tuples.");
 		return NULL;
 	}
 
+	post_cols cols;
+	post_cols_init(&cols, res);
+	post_row row;
+	post_row_get(&row, &cols, res, idx);
+
 	struct post *to_return = calloc(1, sizeof(struct post));
 
-	const int fourchan_post_id_col = PQfnumber(res, "fourchan_post_id");
-	const int fourchan_post_no_col = PQfnumber(res, "fourchan_post_no");
-	const int id_col = PQfnumber(res, "id");
-	const int oleg_key_col = PQfnumber(res, "oleg_key");
-	const int thread_id_col = PQfnumber(res, "thread_id");
-	const int board_col = PQfnumber(res, "board");
-	const int body_col = PQfnumber(res, "body_content");
-	const int replied_to_keys_col = PQfnumber(res, "replied_to_keys");
-	const int created_at_col = PQfnumber(res, "created_at");
-
-	to_return->fourchan_post_id = atol(PQgetvalue(res, idx, fourchan_post_id_col));
-	to_return->fourchan_post_no = atol(PQgetvalue(res, idx, fourchan_post_no_col));
-	to_return->thread_id = atol(PQgetvalue(res, idx, thread_id_col));
-	to_return->id = atol(PQgetvalue(res, idx, id_col));
-	to_return->created_at = (time_t)atol(PQgetvalue(res, idx, created_at_col));
-
-	strncpy(to_return->oleg_key, PQgetvalue(res, idx, oleg_key_col), sizeof(to_return->oleg_key));
-	strncpy(to_return->board, PQgetvalue(res, idx, board_col), sizeof(to_return->board));
-
-	const char *b_content = PQgetvalue(res, idx, body_col);
-	if (b_content) {
-		to_return->body_content = strdup(b_content);
-	} else {
-		to_return->body_content = NULL;
-	}
+	to_return->fourchan_post_id = row.fourchan_post_id;
+	to_return->fourchan_post_no = row.fourchan_post_no;
+	to_return->thread_id = row.thread_id;
+	to_return->id = row.id;
+	to_return->created_at = row.created_at;
 
-	const char *r_content = PQgetvalue(res, idx, replied_to_keys_col);
-	if (r_content) {
-		/* TODO: When I have more than one hand, extract this into a function that does
-		 * vector -> json and vice versa.
-		 */
-		JSON_Value *serialized = json_parse_string(r_content);
-		JSON_Array *replied_to_keys_array = json_value_get_array(serialized);
-
-		const size_t num_keys  = json_array_get_count(replied_to_keys_array);
-		to_return->replied_to_keys = vector_new(MAX_KEY_SIZE, num_keys);
-
-		unsigned int i;
-		for (i = 0; i < num_keys; i++) {
-			const char *key = json_array_get_string(replied_to_keys_array, i);
-			vector_append(to_return->replied_to_keys, key, strlen(key));
-		}
+	_copy_str(to_return->oleg_key, row.oleg_key, sizeof(to_return->oleg_key));
+	_copy_str(to_return->board, row.board, sizeof(to_return->board));
+
+	to_return->body_content = row.body_content ? strdup(row.body_content) : NULL;
 
-		json_value_free(serialized);
-	} else
-		to_return->replied_to_keys = NULL;
+	to_return->replied_to = vector_new(sizeof(uint64_t), row.replied_to_count);
+	int64_t replied_to[POST_MAX_QUOTES] = {0};
+	const size_t num_quotes = pg_get_int_array(res, idx, cols.replied_to, replied_to, POST_MAX_QUOTES);
+
+	unsigned int i;
+	for (i = 0; i < num_quotes && i < POST_MAX_QUOTES; i++) {
+		const uint64_t post_no = replied_to[i];
+		vector_append(to_return->replied_to, &post_no, sizeof(post_no));
+	}
 
 	return to_return;
 }
 
+void thread_cols_init(thread_cols *cols, const PGresult *res) {
+	cols->id = pg_col_lookup(res, "id");
+	cols->oleg_key = pg_col_lookup(res, "oleg_key");
+	cols->board = pg_col_lookup(res, "board");
+	cols->subject = pg_col_lookup(res, "subject");
+	cols->created_at = pg_col_lookup(res, "created_at");
+}
+
+void thread_row_get(thread_row *row, const thread_cols *cols, const PGresult *res, const int idx) {
+	row->id = pg_get_int(res, idx, cols->id);
+	row->created_at = pg_get_int(res, idx, cols->created_at);
+	row->oleg_key = pg_get_str(res, idx, cols->oleg_key);
+	row->board = pg_get_str(res, idx, cols->board);
+	row->subject = pg_get_str(res, idx, cols->subject);
+}
+
 thread *deserialize_thread_from_tuples(const PGresult *res, const unsigned int idx) {
 	if (!res)
 		return NULL;
 
 	if (PQntuples(res) <= 0) {
-		m38_log_msg(LOG_WARN, "No tuples in PG result for thread_from_tuples.");
+		log_msg(LOG_WARN, "No tuples in PG result for thread_from_tuples.");
 		return NULL;
 	}
 
-	thread *to_return = calloc(1, sizeof(struct thread));
-
-	const int oleg_key_col = PQfnumber(res, "oleg_key");
-	const int board_col = PQfnumber(res, "board");
-	const int id_col = PQfnumber(res, "id");
-	const int created_at_col = PQfnumber(res, "created_at");
-	const int subject_col = PQfnumber(res, "replied_to_keys");
+	thread_cols cols;
+	thread_cols_init(&cols, res);
+	thread_row row;
+	thread_row_get(&row, &cols, res, idx);
 
-	to_return->id = atol(PQgetvalue(res, idx, id_col));
-	to_return->created_at = (time_t)atol(PQgetvalue(res, idx, created_at_col));
+	thread *to_return = calloc(1, sizeof(struct thread));
 
-	strncpy(to_return->oleg_key, PQgetvalue(res, idx, oleg_key_col), sizeof(to_return->oleg_key));
-	strncpy(to_return->board, PQgetvalue(res, idx, board_col), sizeof(to_return->board));
+	to_return->id = row.id;
+	to_return->created_at = row.created_at;
 
-	const char *b_content = PQgetvalue(res, idx, subject_col);
-	if (b_content) {
-		to_return->subject = strdup(b_content);
-	} else {
-		to_return->subject = NULL;
-	}
+	_copy_str(to_return->oleg_key, row.oleg_key, sizeof(to_return->oleg_key));
+	_copy_str(to_return->board, row.board, sizeof(to_return->board));
+	to_return->subject = row.subject ? strdup(row.subject) : NULL;
 
 	return to_return;
 }
@@ -187,6 +313,7 @@ char *serialize_webm(const webm *to_serialize) {
 	/* json_object_set_boolean(root_object, "is_alias", (int)to_serialize->is_alias); */
 
 	json_object_set_string(root_object, "file_hash", to_serialize->file_hash);
+	json_object_set_string(root_object, "hash_algorithm", hash_algorithm_name(to_serialize->hash_algorithm));
 	json_object_set_string(root_object, "filename", to_serialize->filename);
 	json_object_set_string(root_object, "board", to_serialize->board);
 	json_object_set_string(root_object, "file_path", to_serialize->file_path);
@@ -225,7 +352,8 @@ unsigned int post_count() {
 void create_alias_key(const char file_path[static MAX_IMAGE_FILENAME_SIZE], char outbuf[static MAX_KEY_SIZE]) {
 	/* MORE HASHES IS MORE POWER */
 	char str_hash[HASH_IMAGE_STR_SIZE] = {0};
-	hash_string((unsigned char *)file_path, strnlen(file_path, MAX_IMAGE_FILENAME_SIZE), str_hash);
+	/* Keys have to stay put whatever files are being hashed with. */
+	hash_string_with(HASH_BACKEND_BMW256, (unsigned char *)file_path, strnlen(file_path, MAX_IMAGE_FILENAME_SIZE), str_hash);
 
 	char second_hash[HASH_IMAGE_STR_SIZE] = {0};
 	hash_string_fnv1a((unsigned char *)file_path, strnlen(file_path, MAX_IMAGE_FILENAME_SIZE), second_hash);
@@ -233,6 +361,30 @@ void create_alias_key(const char file_path[static MAX_IMAGE_FILENAME_SIZE], char
 	snprintf(outbuf, MAX_KEY_SIZE, "%s%s%s", ALIAS_NMSPC, str_hash, second_hash);
 }
 
+int alias_key_to_bin(const char key[static MAX_KEY_SIZE], unsigned char out[static ALIAS_KEY_BIN_SIZE]) {
+	const size_t nmspc_len = strlen(ALIAS_NMSPC);
+	if (strncmp(key, ALIAS_NMSPC, nmspc_len) != 0)
+		return 0;
+
+	char str_hash[HASH_IMAGE_STR_SIZE] = {0};
+	memcpy(str_hash, key + nmspc_len, HASH_IMAGE_STR_SIZE - 1);
+	if (!hash_hex_to_bytes(str_hash, out))
+		return 0;
+
+	/* The fnv1a half isn't zero-padded. */
+	const char *second_hash = key + nmspc_len + HASH_IMAGE_STR_SIZE - 1;
+	const size_t second_len = strnlen(second_hash, 17);
+	if (second_len == 0 || second_len > 16 || strspn(second_hash, "0123456789ABCDEF") != second_len)
+		return 0;
+
+	const uint64_t fnv = strtoull(second_hash, NULL, 16);
+	int j = 0;
+	for (j = 0; j < 8; j++)
+		out[HASH_ARRAY_SIZE + j] = fnv >> (56 - j * 8);
+
+	return 1;
+}
+
 char *serialize_alias(const webm_alias *to_serialize) {
 	if (!to_serialize)
 		return NULL;
@@ -243,6 +395,7 @@ char *serialize_alias(const webm_alias *to_serialize) {
 	char *serialized_string = NULL;
 
 	json_object_set_string(root_object, "file_hash", to_serialize->file_hash);
+	json_object_set_string(root_object, "hash_algorithm", hash_algorithm_name(to_serialize->hash_algorithm));
 	json_object_set_string(root_object, "filename", to_serialize->filename);
 	json_object_set_string(root_object, "board", to_serialize->board);
 	json_object_set_string(root_object, "file_path", to_serialize->file_path);
@@ -340,6 +493,46 @@ thread *deserialize_thread(const char *json) {
 	return to_return;
 }
 
+size_t extract_quote_links(const char *body_content, uint64_t *out, const size_t max) {
+	size_t found = 0;
+	if (!body_content)
+		return 0;
+
+	/* 4chan sends >> as &gt;&gt;, but that's not a given. */
+	const char *cursor = body_content;
+	while (found < max && (cursor = strpbrk(cursor, "&>")) != NULL) {
+		if (strncmp(cursor, "&gt;&gt;", strlen("&gt;&gt;")) == 0) {
+			cursor += strlen("&gt;&gt;");
+		} else if (cursor[0] == '>' && cursor[1] == '>' && cursor[2] != '>') {
+			/* The last two of a run, so <br>>>123 works. */
+			cursor += 2;
+		} else {
+			cursor++;
+			continue;
+		}
+
+		/* >>>/g/ and the like aren't replies. */
+		if (*cursor < '0' || *cursor > '9')
+			continue;
+
+		uint64_t post_no = 0;
+		int digits = 0;
+		for (; *cursor >= '0' && *cursor <= '9'; cursor++, digits++)
+			post_no = post_no * 10 + (*cursor - '0');
+		/* Too big to be a post number, or to fit in a BIGINT. */
+		if (digits > 18)
+			continue;
+
+		size_t i;
+		for (i = 0; i < found && out[i] != post_no; i++)
+			;
+		if (i == found)
+			out[found++] = post_no;
+	}
+
+	return found;
+}
+
 void create_post_key(const char board[static MAX_BOARD_NAME_SIZE], const char *post_id,
 	char outbuf[static MAX_KEY_SIZE]) {
 	snprintf(outbuf, MAX_KEY_SIZE, "%s%s%s", POST_NMSPC, board, post_id);
@@ -367,15 +560,15 @@ char *serialize_post(const post *to_serialize) {
 	if (to_serialize->body_content)
 		json_object_set_string(root_object, "body_content", to_serialize->body_content);
 
-	JSON_Value *thread_keys = json_value_init_array();
-	JSON_Array *thread_keys_array = json_value_get_array(thread_keys);
+	JSON_Value *replied_to = json_value_init_array();
+	JSON_Array *replied_to_array = json_value_get_array(replied_to);
 
 	unsigned int i;
-	for (i = 0; i < to_serialize->replied_to_keys->count; i++)
-		json_array_append_string(thread_keys_array,
-				vector_get(to_serialize->replied_to_keys, i));
+	for (i = 0; to_serialize->replied_to && i < to_serialize->replied_to->count; i++)
+		json_array_append_number(replied_to_array,
+				*(const uint64_t *)vector_get(to_serialize->replied_to, i));
 
-	json_object_set_value(root_object, "replied_to_keys", thread_keys);
+	json_object_set_value(root_object, "replied_to", replied_to);
 
 	serialized_string = json_serialize_to_string(root_value);
 
@@ -412,15 +605,15 @@ post *deserialize_post(const char *json) {
 		to_return->body_content = NULL;
 	}
 
-	JSON_Array *post_keys_array = json_object_get_array(post_object, "replied_to_keys");
+	JSON_Array *replied_to_array = json_object_get_array(post_object, "replied_to");
 
-	const size_t num_keys  = json_array_get_count(post_keys_array);
-	to_return->replied_to_keys = vector_new(MAX_KEY_SIZE, num_keys);
+	const size_t num_quotes = json_array_get_count(replied_to_array);
+	to_return->replied_to = vector_new(sizeof(uint64_t), num_quotes);
 
 	unsigned int i;
-	for (i = 0; i < num_keys; i++) {
-		const char *key = json_array_get_string(post_keys_array, i);
-		vector_append(to_return->replied_to_keys, key, strlen(key));
+	for (i = 0; i < num_quotes; i++) {
+		const uint64_t post_no = json_array_get_number(replied_to_array, i);
+		vector_append(to_return->replied_to, &post_no, sizeof(post_no));
 	}
 
 	json_value_free(serialized);
@@ -5,17 +5,19 @@
 #include <stdlib.h>
 #include <stdint.h>
 
-#include <38-moths/logging.h>
-
+#include "async_log.h"
 #include "parse.h"
+#include "probes.h"
 #include "parson.h"
 #include "models.h"
 
 ol_stack *parse_catalog_json(const char *all_json, const char board[MAX_BOARD_NAME_SIZE]) {
+	unsigned int found = 0;
+	MZBH_PROBE1(parse__catalog__start, board);
 	JSON_Value *catalog = json_parse_string(all_json);
 
 	if (json_value_get_type(catalog) != JSONArray)
-		m38_log_msg(LOG_WARN, "Well, the root isn't a JSONArray.");
+		log_msg(LOG_WARN, "Well, the root isn't a JSONArray.");
 
 	ol_stack *matches = NULL;
 	matches = calloc(1, sizeof(ol_stack));
@@ -26,7 +28,7 @@ ol_stack *parse_catalog_json(const char *all_json, const char board[MAX_BOARD_NA
 	const int page_count = json_array_get_count(all_objects);
 	for (i = 0; i < page_count; i++) {
 		JSON_Object *obj = json_array_get_object(all_objects, i);
-		m38_log_msg(LOG_INFO, "/%s/ - Checking Page: %lu/%i", board, (long)json_object_get_number(obj, "page"), page_count);
+		log_msg(LOG_INFO, "/%s/ - Checking Page: %lu/%i", board, (long)json_object_get_number(obj, "page"), page_count);
 
 		JSON_Array *threads = json_object_get_array(obj, "threads");
 		unsigned int j;
@@ -44,7 +46,7 @@ ol_stack *parse_catalog_json(const char *all_json, const char board[MAX_BOARD_NA
 				JSON_Object *thread_reply = json_array_get_object(thread_replies, k);
 				const char *file_ext_reply = json_object_get_string(thread_reply, "ext");
 				if (file_ext_reply != NULL && strstr(file_ext_reply, "webm")) {
-					m38_log_msg(LOG_INFO, "/%s/ - Found webm in reply. Adding to threads to look through.", board);
+					log_msg(LOG_INFO, "/%s/ - Found webm in reply. Adding to threads to look through.", board);
 					found_webm_in_reply = 1;
 					break;
 				}
@@ -54,22 +56,26 @@ ol_stack *parse_catalog_json(const char *all_json, const char board[MAX_BOARD_NA
 				(file_ext != NULL && strstr(file_ext, "webm")) ||
 				(post != NULL && strcasestr(post, "webm")) ||
 				(post != NULL && strcasestr(post, "gif"))) {
-				m38_log_msg(LOG_INFO, "/%s/ - Thread %i may have some webm. Ext: %s", board, thread_num, file_ext);
+				log_msg(LOG_INFO, "/%s/ - Thread %"PRIu64" may have some webm. Ext: %s", board, thread_num, file_ext);
 
 				thread_match *match = malloc(sizeof(thread_match));
 				match->thread_num = thread_num;
 				strncpy(match->board, board, MAX_BOARD_NAME_SIZE - 1);
 
 				spush(&matches, match);
+				found++;
 			}
 		}
 	}
 
 	json_value_free(catalog);
+	MZBH_PROBE2(parse__catalog__done, board, found);
 	return matches;
 }
 
 ol_stack *parse_thread_json(const char *all_json, const thread_match *match) {
+	unsigned int found = 0;
+	MZBH_PROBE2(parse__thread__start, match->board, match->thread_num);
 	JSON_Value *thread_raw = json_parse_string(all_json);
 	JSON_Object *root = json_value_get_object(thread_raw);
 
@@ -126,11 +132,13 @@ ol_stack *parse_thread_json(const char *all_json, const thread_match *match) {
 
 		/* We download the whole thread, but we only download certain files. */
 		if (strstr(file_ext, "webm")) {
-			m38_log_msg(LOG_INFO, "/%s/ Hit: (%"PRIu64") %s%s.", match->board, _tim, filename, file_ext);
+			log_msg(LOG_INFO, "/%s/ Hit: (%"PRIu64") %s%s.", match->board, _tim, filename, file_ext);
 			p_match->should_download_image = 1;
+			found++;
 		}
 	}
 
 	json_value_free(thread_raw);
+	MZBH_PROBE3(parse__thread__done, match->board, match->thread_num, found);
 	return matches;
 }
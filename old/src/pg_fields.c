@@ -0,0 +1,198 @@
+// vim: noet ts=4 sw=4
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pg_fields.h"
+
+/* From catalog/pg_type.h, which isn't something clients get. */
+#define _BOOLOID 16
+#define _INT8OID 20
+#define _INT2OID 21
+#define _INT4OID 23
+#define _OIDOID 26
+#define _JSONBOID 3802
+#define _FLOAT8OID 701
+#define _TIMESTAMPOID 1114
+#define _TIMESTAMPTZOID 1184
+#define _NUMERICOID 1700
+
+/* Binary timestamps count microseconds from 2000-01-01. */
+#define _PG_EPOCH_OFFSET 946684800LL
+
+#define _NUMERIC_NEG 0x4000
+#define _NUMERIC_NAN 0xC000
+
+pg_col pg_col_lookup(const PGresult *res, const char *name) {
+	pg_col col = { .num = -1, .type = 0, .binary = 0 };
+	if (!res)
+		return col;
+
+	col.num = PQfnumber(res, name);
+	if (col.num >= 0) {
+		col.type = PQftype(res, col.num);
+		col.binary = PQfformat(res, col.num) == 1;
+	}
+
+	return col;
+}
+
+int pg_isnull(const PGresult *res, const int row, const pg_col col) {
+	return col.num < 0 || PQgetisnull(res, row, col.num);
+}
+
+static uint16_t _be16(const char *p) {
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return be16toh(v);
+}
+
+static uint32_t _be32(const char *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return be32toh(v);
+}
+
+static uint64_t _be64(const char *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return be64toh(v);
+}
+
+/* ndigits, weight, sign and dscale, then ndigits base 10000 digits with the
+ * first one worth 10000^weight. We only want the whole part. */
+static int64_t _numeric(const char *p, const int len) {
+	if (len < 8)
+		return 0;
+
+	const int ndigits = (int16_t)_be16(p);
+	const int weight = (int16_t)_be16(p + 2);
+	const uint16_t sign = _be16(p + 4);
+	if (sign == _NUMERIC_NAN || len < 8 + ndigits * 2)
+		return 0;
+
+	int64_t value = 0;
+	int i;
+	for (i = 0; i <= weight; i++)
+		value = value * 10000 + (i < ndigits ? (int16_t)_be16(p + 8 + i * 2) : 0);
+
+	return sign == _NUMERIC_NEG ? -value : value;
+}
+
+int64_t pg_get_int(const PGresult *res, const int row, const pg_col col) {
+	if (pg_isnull(res, row, col))
+		return 0;
+
+	const char *value = PQgetvalue(res, row, col.num);
+	if (!col.binary)
+		return strtoll(value, NULL, 10);
+
+	const int len = PQgetlength(res, row, col.num);
+	switch (col.type) {
+		case _INT2OID:
+			return len == 2 ? (int16_t)_be16(value) : 0;
+		case _INT4OID:
+			return len == 4 ? (int32_t)_be32(value) : 0;
+		case _OIDOID:
+			return len == 4 ? _be32(value) : 0;
+		case _INT8OID:
+			return len == 8 ? (int64_t)_be64(value) : 0;
+		case _FLOAT8OID: {
+			if (len != 8)
+				return 0;
+			const uint64_t bits = _be64(value);
+			double d;
+			memcpy(&d, &bits, sizeof(d));
+			return (int64_t)d;
+		}
+		case _TIMESTAMPOID:
+		case _TIMESTAMPTZOID:
+			return len == 8 ? (int64_t)_be64(value) / 1000000 + _PG_EPOCH_OFFSET : 0;
+		case _NUMERICOID:
+			return _numeric(value, len);
+		default:
+			return 0;
+	}
+}
+
+int pg_get_bool(const PGresult *res, const int row, const pg_col col) {
+	if (pg_isnull(res, row, col))
+		return 0;
+
+	const char *value = PQgetvalue(res, row, col.num);
+	if (col.binary && col.type == _BOOLOID)
+		return value[0] != 0;
+	return value[0] == 't';
+}
+
+const char *pg_get_str(const PGresult *res, const int row, const pg_col col) {
+	if (pg_isnull(res, row, col))
+		return NULL;
+
+	/* libpq NUL terminates binary values too. */
+	const char *value = PQgetvalue(res, row, col.num);
+	if (col.binary && col.type == _JSONBOID)
+		return PQgetlength(res, row, col.num) > 0 ? value + 1 : value; /* Version byte. */
+	return value;
+}
+
+/* Elements are int32 lengths (-1 for NULL) each followed by the value. */
+static int64_t _array_elem(const char *p, const int len, const Oid type) {
+	if (type == _INT8OID && len == 8)
+		return (int64_t)_be64(p);
+	if (type == _INT4OID && len == 4)
+		return (int32_t)_be32(p);
+	if (type == _INT2OID && len == 2)
+		return (int16_t)_be16(p);
+	return 0;
+}
+
+size_t pg_get_int_array(const PGresult *res, const int row, const pg_col col, int64_t *out, const size_t max) {
+	if (pg_isnull(res, row, col))
+		return 0;
+
+	const char *value = PQgetvalue(res, row, col.num);
+	size_t count = 0;
+
+	if (!col.binary) {
+		/* {1,2,NULL,3} */
+		const char *cursor = value[0] == '{' ? value + 1 : value;
+		while (*cursor && *cursor != '}') {
+			char *end = NULL;
+			const int64_t elem = strtoll(cursor, &end, 10);
+			if (count < max)
+				out[count] = elem;
+			count++;
+			cursor = strchr(end, ',');
+			if (!cursor)
+				break;
+			cursor++;
+		}
+		return count;
+	}
+
+	/* ndim, has nulls, element type, then a size and lower bound per
+	 * dimension. An empty array has no dimensions at all. */
+	const int len = PQgetlength(res, row, col.num);
+	if (len < 20 || (int32_t)_be32(value) != 1)
+		return 0;
+
+	const Oid elem_type = _be32(value + 8);
+	const int32_t elems = (int32_t)_be32(value + 12);
+	int offset = 20;
+	int32_t i;
+	for (i = 0; i < elems && offset + 4 <= len; i++) {
+		const int32_t elem_len = (int32_t)_be32(value + offset);
+		offset += 4;
+		if (elem_len > 0 && offset + elem_len > len)
+			break;
+
+		if (count < max)
+			out[count] = elem_len > 0 ? _array_elem(value + offset, elem_len, elem_type) : 0;
+		count++;
+		if (elem_len > 0)
+			offset += elem_len;
+	}
+
+	return count;
+}
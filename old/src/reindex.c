@@ -0,0 +1,791 @@
+// vim: noet ts=4 sw=4
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <38-moths/vector.h>
+
+#include "async_log.h"
+#include "db.h"
+#include "dirscan.h"
+#include "ebml.h"
+#include "hashing.h"
+#include "models.h"
+#include "utils.h"
+
+/* Rebuilds webms and webm_aliases from what's on disk, for after a migration
+ * or losing the DB. Every webm under WFU_WEBMS_DIR is hashed by a pool of
+ * threads that steal from each other when they run dry, which copy is the
+ * original and which are aliases is worked out in memory, and the lot goes
+ * into Postgres with COPY in one transaction.
+ *
+ * Hashes are appended to a checkpoint file as they're made, so a run that
+ * dies (or a load that fails) picks up where it left off. It's removed once
+ * everything is in.
+ */
+#define REINDEX_CHECKPOINT ".reindex_checkpoint"
+/* Files being read at once. Enough to keep an SSD busy without turning a
+ * spinning disk into a seek benchmark. */
+#define REINDEX_DEFAULT_IO 4
+/* COPY data goes over in pieces about this big. */
+#define REINDEX_COPY_CHUNK (4 * 1024 * 1024)
+#define REINDEX_PROGRESS_SECONDS 5
+/* Checkpoint lines written between flushes. */
+#define REINDEX_FLUSH_EVERY 64
+
+typedef struct reindex_file {
+	char board[MAX_BOARD_NAME_SIZE];
+	char fname[MAX_IMAGE_FILENAME_SIZE];
+	size_t size;
+	time_t mtime; /* Of whatever it points at. */
+	uint64_t ino;
+	uint64_t dev;
+	/* Files that are the same inode (links into the blob store, mostly) are
+	 * only hashed once, by this one. */
+	size_t leader;
+
+	/* Filled in by the workers, or the checkpoint. */
+	int is_link;
+	time_t created_at; /* Of the link itself, see _set_alias_time(). */
+	int hashed;
+	HASH_ALGORITHM hash_algorithm;
+	char file_hash[HASH_IMAGE_STR_SIZE];
+	char fingerprint[HASH_IMAGE_STR_SIZE];
+	int has_metadata;
+	webm_metadata metadata;
+} reindex_file;
+
+/* A worker's share of the pending list, [next, end). The owner takes from the
+ * front, thieves take half from the back. */
+typedef struct _queue {
+	pthread_mutex_t lock;
+	size_t next;
+	size_t end;
+} _queue;
+
+typedef struct reindex_pool {
+	reindex_file *files;
+	const size_t *pending;
+	_queue *queues;
+	unsigned int num_threads;
+	sem_t io_slots;
+
+	FILE *checkpoint;
+	pthread_mutex_t checkpoint_lock;
+	unsigned int unflushed;
+
+	uint64_t files_done;
+	uint64_t bytes_done;
+	uint64_t failed;
+} reindex_pool;
+
+static double _now() {
+	struct timespec spec;
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+	return spec.tv_sec + spec.tv_nsec / 1.0e9;
+}
+
+static void _file_path(const reindex_file *file, char out[static MAX_IMAGE_FILENAME_SIZE]) {
+	snprintf(out, MAX_IMAGE_FILENAME_SIZE, "%s/%s/%s", webm_location(), file->board, file->fname);
+}
+
+static int _by_name(const void *a, const void *b) {
+	const reindex_file *x = a, *y = b;
+	const int board = strcmp(x->board, y->board);
+	return board != 0 ? board : strcmp(x->fname, y->fname);
+}
+
+/* Sorting the pending list by inode keeps the reads roughly in disk order
+ * too, which is most of what readahead can do for us. */
+static const reindex_file *_sort_files = NULL;
+static int _by_inode(const void *a, const void *b) {
+	const reindex_file *x = &_sort_files[*(const size_t *)a], *y = &_sort_files[*(const size_t *)b];
+	if (x->ino != y->ino)
+		return x->ino < y->ino ? -1 : 1;
+	if (x->dev != y->dev)
+		return x->dev < y->dev ? -1 : 1;
+	return *(const size_t *)a < *(const size_t *)b ? -1 : 1;
+}
+
+/* Same file first, then originals ahead of links, then oldest first. */
+static int _by_hash(const void *a, const void *b) {
+	const reindex_file *x = &_sort_files[*(const size_t *)a], *y = &_sort_files[*(const size_t *)b];
+	const int hash = strcmp(x->file_hash, y->file_hash);
+	if (hash != 0)
+		return hash;
+	if (x->is_link != y->is_link)
+		return x->is_link - y->is_link;
+	if (x->created_at != y->created_at)
+		return x->created_at < y->created_at ? -1 : 1;
+	return _by_name(x, y);
+}
+
+/* Everything under webm_location() that looks like a board. */
+static vector *_scan_boards(const unsigned int num_threads) {
+	DIR *dirstream = opendir(webm_location());
+	if (!dirstream) {
+		log_msg(LOG_ERR, "Could not open %s.", webm_location());
+		return NULL;
+	}
+
+	char (*boards)[MAX_BOARD_NAME_SIZE] = NULL;
+	const char **dirs = NULL;
+	vector **scanned = NULL;
+	vector *files = NULL;
+	size_t count = 0, cap = 0, i;
+
+	struct dirent *result = NULL;
+	while ((result = readdir(dirstream)) != NULL) {
+		/* Skips ., .. and the blob store. */
+		if (result->d_name[0] == '.' || strlen(result->d_name) >= MAX_BOARD_NAME_SIZE)
+			continue;
+
+		char *board_dir = get_full_path_for_file(webm_location(), result->d_name);
+		struct stat st = {0};
+		if (stat(board_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+			free(board_dir);
+			continue;
+		}
+
+		if (count == cap) {
+			cap = cap ? cap * 2 : 64;
+			char (*more_boards)[MAX_BOARD_NAME_SIZE] = realloc(boards, cap * sizeof(*boards));
+			if (more_boards)
+				boards = more_boards;
+			const char **more_dirs = realloc(dirs, cap * sizeof(*dirs));
+			if (more_dirs)
+				dirs = more_dirs;
+			if (!more_boards || !more_dirs) {
+				log_msg(LOG_ERR, "Could not grow the board list past %zu boards.", count);
+				free(board_dir);
+				closedir(dirstream);
+				goto end;
+			}
+		}
+
+		memset(boards[count], 0, sizeof(boards[count]));
+		strncpy(boards[count], result->d_name, MAX_BOARD_NAME_SIZE - 1);
+		dirs[count++] = board_dir;
+	}
+	closedir(dirstream);
+
+	scanned = calloc(count + 1, sizeof(vector *));
+	files = vector_new(sizeof(reindex_file), 1024);
+	if (!scanned || !files) {
+		if (files)
+			vector_free(files);
+		files = NULL;
+		goto end;
+	}
+
+	if (scan_directories(dirs, count, ".webm", scanned, num_threads) != 0)
+		log_msg(LOG_WARN, "Could not scan every board, carrying on with what we got.");
+
+	for (i = 0; i < count; i++) {
+		if (!scanned[i])
+			continue;
+
+		unsigned int j;
+		for (j = 0; j < scanned[i]->count; j++) {
+			const scanned_file *found = vector_get(scanned[i], j);
+			reindex_file file = {
+				.size = found->size,
+				.mtime = found->mtime,
+				.ino = found->ino,
+				.dev = found->dev
+			};
+			strncpy(file.board, boards[i], sizeof(file.board) - 1);
+			strncpy(file.fname, found->fname, sizeof(file.fname) - 1);
+			vector_append(files, &file, sizeof(file));
+		}
+		vector_free(scanned[i]);
+	}
+
+end:
+	for (i = 0; i < count; i++)
+		free((char *)dirs[i]);
+	free(scanned);
+	free(boards);
+	free(dirs);
+	return files;
+}
+
+/* Fills in whatever the checkpoint already knows about. Lines are written
+ * whole, so a run that died mid-write leaves at worst one without a newline,
+ * which is skipped. So are lines hashed with something other than the
+ * default algorithm, since copies only group together in _by_hash() if
+ * they're all hashed the same way. Returns how many files it covered.
+ */
+static size_t _read_checkpoint(const char *path, reindex_file *files, const size_t count) {
+	FILE *checkpoint = fopen(path, "r");
+	if (!checkpoint)
+		return 0;
+
+	size_t restored = 0;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t read = 0;
+	while ((read = getline(&line, &line_size, checkpoint)) > 0) {
+		if (line[read - 1] != '\n')
+			break;
+		line[read - 1] = '\0';
+
+		char *fields[16] = {0};
+		char *cursor = line;
+		unsigned int num_fields = 0;
+		while (num_fields < 16 && cursor)
+			fields[num_fields++] = strsep(&cursor, "\t");
+		if (num_fields != 16 || cursor)
+			continue;
+
+		reindex_file key = {0};
+		strncpy(key.board, fields[0], sizeof(key.board) - 1);
+		strncpy(key.fname, fields[1], sizeof(key.fname) - 1);
+		reindex_file *file = bsearch(&key, files, count, sizeof(reindex_file), _by_name);
+
+		/* Changed since, or gone. */
+		if (!file || file->size != strtoull(fields[2], NULL, 10) || file->mtime != atol(fields[3]))
+			continue;
+
+		const HASH_ALGORITHM algorithm = hash_algorithm_from_name(fields[6]);
+		if (algorithm != hash_default_algorithm() || strlen(fields[7]) != HASH_IMAGE_STR_SIZE - 1)
+			continue;
+
+		file->created_at = atol(fields[4]);
+		file->is_link = atoi(fields[5]);
+		file->hash_algorithm = algorithm;
+		strncpy(file->file_hash, fields[7], sizeof(file->file_hash) - 1);
+		strncpy(file->fingerprint, fields[8], sizeof(file->fingerprint) - 1);
+		file->has_metadata = atoi(fields[9]);
+		file->metadata.duration_ms = strtoull(fields[10], NULL, 10);
+		file->metadata.width = atoi(fields[11]);
+		file->metadata.height = atoi(fields[12]);
+		strncpy(file->metadata.video_codec, fields[13], sizeof(file->metadata.video_codec) - 1);
+		strncpy(file->metadata.audio_codec, fields[14], sizeof(file->metadata.audio_codec) - 1);
+		file->metadata.has_audio = atoi(fields[15]);
+		if (!file->hashed) {
+			file->hashed = 1;
+			restored++;
+		}
+	}
+
+	free(line);
+	fclose(checkpoint);
+	return restored;
+}
+
+static void _write_checkpoint(reindex_pool *pool, const reindex_file *file) {
+	/* Names we couldn't read back just get hashed again next time. */
+	if (!pool->checkpoint || strpbrk(file->fname, "\t\n") || strpbrk(file->board, "\t\n"))
+		return;
+
+	pthread_mutex_lock(&pool->checkpoint_lock);
+	fprintf(pool->checkpoint, "%s\t%s\t%zu\t%ld\t%ld\t%d\t%s\t%s\t%s\t%d\t%"PRIu64"\t%u\t%u\t%s\t%s\t%d\n",
+			file->board, file->fname, file->size, (long)file->mtime, (long)file->created_at,
+			file->is_link, hash_algorithm_name(file->hash_algorithm), file->file_hash,
+			file->fingerprint, file->has_metadata, file->metadata.duration_ms,
+			file->metadata.width, file->metadata.height, file->metadata.video_codec,
+			file->metadata.audio_codec, file->metadata.has_audio);
+	if (++pool->unflushed >= REINDEX_FLUSH_EVERY) {
+		fflush(pool->checkpoint);
+		pool->unflushed = 0;
+	}
+	pthread_mutex_unlock(&pool->checkpoint_lock);
+}
+
+static void _advise(const char *path, const int advice) {
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	posix_fadvise(fd, 0, 0, advice);
+	close(fd);
+}
+
+/* Takes the next file off the front of our own queue, or failing that half of
+ * whatever's left at the back of somebody else's. Sets peek to the one after
+ * it (or SIZE_MAX) so it can be read ahead. Returns 0 when there's nothing
+ * left anywhere.
+ */
+static int _take(reindex_pool *pool, const unsigned int self, size_t *out, size_t *peek) {
+	_queue *own = &pool->queues[self];
+
+	pthread_mutex_lock(&own->lock);
+	if (own->next < own->end) {
+		*out = own->next++;
+		*peek = own->next < own->end ? own->next : SIZE_MAX;
+		pthread_mutex_unlock(&own->lock);
+		return 1;
+	}
+	pthread_mutex_unlock(&own->lock);
+
+	unsigned int i;
+	for (i = 1; i < pool->num_threads; i++) {
+		_queue *victim = &pool->queues[(self + i) % pool->num_threads];
+
+		pthread_mutex_lock(&victim->lock);
+		const size_t remaining = victim->end - victim->next;
+		const size_t start = victim->end - (remaining + 1) / 2;
+		const size_t end = victim->end;
+		if (remaining > 0)
+			victim->end = start;
+		pthread_mutex_unlock(&victim->lock);
+
+		if (remaining == 0)
+			continue;
+
+		pthread_mutex_lock(&own->lock);
+		own->next = start + 1;
+		own->end = end;
+		pthread_mutex_unlock(&own->lock);
+
+		*out = start;
+		*peek = start + 1 < end ? start + 1 : SIZE_MAX;
+		return 1;
+	}
+
+	return 0;
+}
+
+static void _reindex_file(reindex_pool *pool, const size_t index) {
+	reindex_file *file = &pool->files[index];
+	char path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	_file_path(file, path);
+
+	struct stat st = {0};
+	if (lstat(path, &st) == 0) {
+		file->is_link = S_ISLNK(st.st_mode);
+		file->created_at = st.st_mtime;
+	}
+
+	/* Its leader does the hashing, we get a copy afterwards. */
+	if (file->leader != index)
+		goto done;
+
+	sem_wait(&pool->io_slots);
+	size_t size = 0;
+	int ok = hash_file(path, file->file_hash) && hash_fingerprint_file(path, &size, file->fingerprint);
+	/* Only reads the start, which is in the page cache by now. */
+	file->has_metadata = ok && parse_webm_metadata(path, &file->metadata);
+	sem_post(&pool->io_slots);
+
+	/* We won't be back, so don't push anything more useful out. */
+	_advise(path, POSIX_FADV_DONTNEED);
+
+	if (!ok) {
+		log_msg(LOG_WARN, "Could not hash %s.", path);
+		__atomic_fetch_add(&pool->failed, 1, __ATOMIC_RELAXED);
+		goto done;
+	}
+
+	file->hash_algorithm = hash_default_algorithm();
+	file->hashed = 1;
+	_write_checkpoint(pool, file);
+	__atomic_fetch_add(&pool->bytes_done, file->size, __ATOMIC_RELAXED);
+
+done:
+	__atomic_fetch_add(&pool->files_done, 1, __ATOMIC_RELAXED);
+}
+
+static void *_reindex_worker(void *arg) {
+	reindex_pool *pool = ((void **)arg)[0];
+	const unsigned int self = (unsigned int)(uintptr_t)((void **)arg)[1];
+
+	size_t pos = 0, peek = SIZE_MAX;
+	while (_take(pool, self, &pos, &peek)) {
+		/* Start reading the next one in while we hash this one. */
+		if (peek != SIZE_MAX && pool->files[pool->pending[peek]].leader == pool->pending[peek]) {
+			char next_path[MAX_IMAGE_FILENAME_SIZE] = {0};
+			_file_path(&pool->files[pool->pending[peek]], next_path);
+			_advise(next_path, POSIX_FADV_WILLNEED);
+		}
+
+		_reindex_file(pool, pool->pending[pos]);
+	}
+
+	return NULL;
+}
+
+static void _log_progress(const reindex_pool *pool, const size_t total, const double started) {
+	const double elapsed = _now() - started;
+	const uint64_t files = __atomic_load_n(&pool->files_done, __ATOMIC_RELAXED);
+	const uint64_t bytes = __atomic_load_n(&pool->bytes_done, __ATOMIC_RELAXED);
+	log_msg(LOG_INFO, "%"PRIu64"/%zu files, %.1f files/s, %.1f MB/s.", files, total,
+			elapsed > 0 ? files / elapsed : 0.0, elapsed > 0 ? bytes / elapsed / 1048576.0 : 0.0);
+}
+
+/* Hashes everything in pending. Returns how many of them failed. */
+static uint64_t _hash_pending(reindex_file *files, const size_t *pending, const size_t num_pending,
+		const unsigned int num_threads, const unsigned int io_slots, FILE *checkpoint) {
+	reindex_pool pool = {
+		.files = files,
+		.pending = pending,
+		.num_threads = num_threads,
+		.checkpoint = checkpoint,
+		.checkpoint_lock = PTHREAD_MUTEX_INITIALIZER
+	};
+	sem_init(&pool.io_slots, 0, io_slots);
+
+	pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+	void *(*args)[2] = calloc(num_threads, sizeof(*args));
+	pool.queues = calloc(num_threads, sizeof(_queue));
+	if (!threads || !args || !pool.queues) {
+		free(threads);
+		free(args);
+		free(pool.queues);
+		return num_pending;
+	}
+
+	/* Contiguous shares to start with, stealing evens it out. */
+	unsigned int i;
+	for (i = 0; i < num_threads; i++) {
+		pthread_mutex_init(&pool.queues[i].lock, NULL);
+		pool.queues[i].next = num_pending * i / num_threads;
+		pool.queues[i].end = num_pending * (i + 1) / num_threads;
+	}
+
+	const double started = _now();
+	unsigned int started_threads = 0;
+	for (i = 0; i < num_threads; i++) {
+		args[i][0] = &pool;
+		args[i][1] = (void *)(uintptr_t)i;
+		if (pthread_create(&threads[i], NULL, _reindex_worker, args[i]) != 0)
+			break;
+		started_threads++;
+	}
+
+	/* Anyone who didn't start gets robbed by the rest. If nobody did, we do
+	 * it all ourselves. */
+	if (started_threads == 0) {
+		args[0][0] = &pool;
+		args[0][1] = 0;
+		_reindex_worker(args[0]);
+	}
+
+	double last_log = started;
+	while (__atomic_load_n(&pool.files_done, __ATOMIC_RELAXED) < num_pending && started_threads > 0) {
+		usleep(100 * 1000);
+		if (_now() - last_log >= REINDEX_PROGRESS_SECONDS) {
+			_log_progress(&pool, num_pending, started);
+			last_log = _now();
+		}
+	}
+
+	for (i = 0; i < started_threads; i++)
+		pthread_join(threads[i], NULL);
+	_log_progress(&pool, num_pending, started);
+
+	if (checkpoint)
+		fflush(checkpoint);
+	sem_destroy(&pool.io_slots);
+	free(threads);
+	free(args);
+	free(pool.queues);
+	return pool.failed;
+}
+
+/* Growing buffer of COPY rows, sent off whenever it gets big. */
+typedef struct _copy_buf {
+	const char *table;
+	char *data;
+	size_t len;
+	size_t cap;
+	int failed;
+	int dry_run;
+} _copy_buf;
+
+static void _copy_flush(_copy_buf *buf) {
+	if (buf->len > 0 && !buf->dry_run && !buf->failed && db_copy_rows(buf->table, buf->data, buf->len) != 0)
+		buf->failed = 1;
+	buf->len = 0;
+}
+
+static void _copy_reserve(_copy_buf *buf, const size_t more) {
+	if (buf->len + more <= buf->cap)
+		return;
+
+	size_t cap = buf->cap ? buf->cap : REINDEX_COPY_CHUNK;
+	while (cap < buf->len + more)
+		cap *= 2;
+	char *data = realloc(buf->data, cap);
+	if (!data) {
+		buf->failed = 1;
+		buf->len = 0;
+		return;
+	}
+	buf->data = data;
+	buf->cap = cap;
+}
+
+/* One column, escaped for COPY text format. NULL is \N. */
+static void _copy_field(_copy_buf *buf, const char *value, const int last) {
+	const size_t len = value ? strlen(value) : 0;
+	_copy_reserve(buf, len * 2 + 3);
+	if (buf->failed)
+		return;
+
+	if (!value) {
+		memcpy(buf->data + buf->len, "\\N", 2);
+		buf->len += 2;
+	}
+
+	size_t i;
+	for (i = 0; i < len; i++) {
+		const char c = value[i];
+		const char escaped = c == '\\' ? '\\' : c == '\t' ? 't' : c == '\n' ? 'n' : c == '\r' ? 'r' : '\0';
+		if (escaped) {
+			buf->data[buf->len++] = '\\';
+			buf->data[buf->len++] = escaped;
+		} else {
+			buf->data[buf->len++] = c;
+		}
+	}
+	buf->data[buf->len++] = last ? '\n' : '\t';
+
+	if (last && buf->len >= REINDEX_COPY_CHUNK)
+		_copy_flush(buf);
+}
+
+static void _copy_webm(_copy_buf *buf, const reindex_file *file) {
+	char file_path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	_file_path(file, file_path);
+
+	char webm_key[MAX_KEY_SIZE] = {0}, alias_key[MAX_KEY_SIZE] = {0};
+	create_webm_key(file->file_hash, webm_key);
+	create_alias_key(file_path, alias_key);
+
+	char size_buf[32] = {0}, created_buf[32] = {0};
+	char duration_buf[32] = {0}, width_buf[32] = {0}, height_buf[32] = {0};
+	snprintf(size_buf, sizeof(size_buf), "%zu", file->size);
+	snprintf(created_buf, sizeof(created_buf), "%ld", (long)file->created_at);
+	snprintf(duration_buf, sizeof(duration_buf), "%"PRIu64, file->metadata.duration_ms);
+	snprintf(width_buf, sizeof(width_buf), "%u", file->metadata.width);
+	snprintf(height_buf, sizeof(height_buf), "%u", file->metadata.height);
+
+	/* Same as set_image(): NULLs for a webm we couldn't parse, so the
+	 * backfill tool has another go. */
+	const int meta = file->has_metadata && file->metadata.video_codec[0] != '\0';
+	_copy_field(buf, webm_key, 0);
+	_copy_field(buf, alias_key, 0);
+	_copy_field(buf, file->file_hash, 0);
+	_copy_field(buf, hash_algorithm_name(file->hash_algorithm), 0);
+	_copy_field(buf, file->fingerprint[0] ? file->fingerprint : NULL, 0);
+	_copy_field(buf, file->fname, 0);
+	_copy_field(buf, file->board, 0);
+	_copy_field(buf, file_path, 0);
+	_copy_field(buf, size_buf, 0);
+	_copy_field(buf, created_buf, 0);
+	_copy_field(buf, meta ? duration_buf : NULL, 0);
+	_copy_field(buf, meta ? width_buf : NULL, 0);
+	_copy_field(buf, meta ? height_buf : NULL, 0);
+	_copy_field(buf, meta ? file->metadata.video_codec : NULL, 0);
+	_copy_field(buf, meta ? file->metadata.audio_codec : NULL, 0);
+	_copy_field(buf, meta ? (file->metadata.has_audio ? "t" : "f") : NULL, 1);
+}
+
+static void _copy_alias(_copy_buf *buf, const reindex_file *file) {
+	char file_path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	_file_path(file, file_path);
+
+	char webm_key[MAX_KEY_SIZE] = {0}, alias_key[MAX_KEY_SIZE] = {0};
+	create_webm_key(file->file_hash, webm_key);
+	create_alias_key(file_path, alias_key);
+
+	char created_buf[32] = {0};
+	snprintf(created_buf, sizeof(created_buf), "%ld", (long)file->created_at);
+
+	_copy_field(buf, alias_key, 0);
+	_copy_field(buf, webm_key, 0);
+	_copy_field(buf, file->file_hash, 0);
+	_copy_field(buf, hash_algorithm_name(file->hash_algorithm), 0);
+	_copy_field(buf, file->fname, 0);
+	_copy_field(buf, file->board, 0);
+	_copy_field(buf, file_path, 0);
+	_copy_field(buf, created_buf, 1);
+}
+
+/* Works out originals and aliases and sends them to Postgres. Returns 0 if
+ * it all went in. */
+static int _load(const reindex_file *files, const size_t count, const int dry_run,
+		unsigned int *out_webms, unsigned int *out_aliases) {
+	size_t *order = malloc(count * sizeof(size_t));
+	if (!order && count > 0)
+		return -1;
+
+	size_t num_hashed = 0, i;
+	for (i = 0; i < count; i++) {
+		if (files[i].hashed)
+			order[num_hashed++] = i;
+	}
+
+	_sort_files = files;
+	qsort(order, num_hashed, sizeof(size_t), _by_hash);
+
+	_copy_buf webms = { .table = REINDEX_WEBMS_STAGE, .dry_run = dry_run };
+	_copy_buf aliases = { .table = REINDEX_ALIASES_STAGE, .dry_run = dry_run };
+
+	int rc = -1;
+	if (!dry_run && (db_batch_begin() != 0 || reindex_stage_begin() != 0))
+		goto end;
+
+	*out_webms = 0;
+	*out_aliases = 0;
+	for (i = 0; i < num_hashed; i++) {
+		const reindex_file *file = &files[order[i]];
+		const int original = i == 0 || strcmp(files[order[i - 1]].file_hash, file->file_hash) != 0;
+		if (original) {
+			_copy_webm(&webms, file);
+			(*out_webms)++;
+		} else {
+			_copy_alias(&aliases, file);
+			(*out_aliases)++;
+		}
+	}
+	_copy_flush(&webms);
+	_copy_flush(&aliases);
+
+	if (dry_run) {
+		rc = webms.failed || aliases.failed ? -1 : 0;
+		goto end;
+	}
+
+	if (webms.failed || aliases.failed || reindex_merge(out_webms, out_aliases) != 0) {
+		db_batch_rollback();
+		goto end;
+	}
+
+	rc = db_batch_commit();
+
+end:
+	free(webms.data);
+	free(aliases.data);
+	free(order);
+	return rc;
+}
+
+int main(int argc, char *argv[]) {
+	long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads <= 0)
+		num_threads = 1;
+	long io_slots = REINDEX_DEFAULT_IO;
+	int dry_run = 0;
+	const char *checkpoint_path = NULL;
+
+	int i;
+	for (i = 1; i < argc; i++) {
+		const char *cur_arg = argv[i];
+		if (strcmp(cur_arg, "-n") == 0) {
+			dry_run = 1;
+		} else if ((strcmp(cur_arg, "-t") == 0 || strcmp(cur_arg, "-j") == 0 ||
+					strcmp(cur_arg, "-c") == 0) && (i + 1) < argc) {
+			const char *value = argv[++i];
+			if (cur_arg[1] == 'c')
+				checkpoint_path = value;
+			else if (cur_arg[1] == 't')
+				num_threads = strtol(value, NULL, 10);
+			else
+				io_slots = strtol(value, NULL, 10);
+		} else {
+			log_msg(LOG_ERR, "Usage: %s [-t threads] [-j files read at once] [-c checkpoint] [-n]", argv[0]);
+			return -1;
+		}
+	}
+
+	if (num_threads <= 0 || io_slots <= 0) {
+		log_msg(LOG_ERR, "Thread and I/O counts must be at least 1.");
+		return -1;
+	}
+
+	char default_checkpoint[MAX_IMAGE_FILENAME_SIZE] = {0};
+	if (!checkpoint_path) {
+		snprintf(default_checkpoint, sizeof(default_checkpoint), "%s/%s", webm_location(), REINDEX_CHECKPOINT);
+		checkpoint_path = default_checkpoint;
+	}
+
+	const double started = _now();
+	vector *scanned = _scan_boards(num_threads);
+	if (!scanned)
+		return -1;
+
+	const size_t count = scanned->count;
+	reindex_file *files = count > 0 ? (reindex_file *)vector_get(scanned, 0) : NULL;
+	qsort(files, count, sizeof(reindex_file), _by_name);
+	log_msg(LOG_INFO, "Found %zu webms in %.1fs.", count, _now() - started);
+
+	/* Everything leads itself, until we find it shares an inode. */
+	int rc = -1;
+	uint64_t failed = 0;
+	size_t *pending = malloc((count + 1) * sizeof(size_t));
+	if (!pending) {
+		log_msg(LOG_ERR, "Could not allocate the pending list for %zu webms.", count);
+		goto end;
+	}
+
+	size_t j;
+	for (j = 0; j < count; j++)
+		pending[j] = j;
+	_sort_files = files;
+	qsort(pending, count, sizeof(size_t), _by_inode);
+	for (j = 0; j < count; j++) {
+		const reindex_file *prev = j > 0 ? &files[pending[j - 1]] : NULL;
+		reindex_file *file = &files[pending[j]];
+		file->leader = prev && prev->ino == file->ino && prev->dev == file->dev ? prev->leader : pending[j];
+	}
+
+	const size_t restored = _read_checkpoint(checkpoint_path, files, count);
+	if (restored > 0)
+		log_msg(LOG_INFO, "%zu webms already hashed according to %s.", restored, checkpoint_path);
+
+	size_t num_pending = 0;
+	for (j = 0; j < count; j++) {
+		if (!files[pending[j]].hashed)
+			pending[num_pending++] = pending[j];
+	}
+
+	FILE *checkpoint = fopen(checkpoint_path, "a");
+	if (!checkpoint)
+		log_msg(LOG_WARN, "Could not open %s, this run can't be resumed.", checkpoint_path);
+
+	log_msg(LOG_INFO, "Hashing %zu webms with %ld threads, %ld reading at once.", num_pending,
+			num_threads, io_slots);
+	failed = _hash_pending(files, pending, num_pending, num_threads, io_slots, checkpoint);
+	if (checkpoint)
+		fclose(checkpoint);
+
+	/* The other names for files we only hashed once. */
+	for (j = 0; j < count; j++) {
+		reindex_file *file = &files[j];
+		const reindex_file *leader = &files[file->leader];
+		if (file->hashed || !leader->hashed)
+			continue;
+
+		file->hashed = 1;
+		file->hash_algorithm = leader->hash_algorithm;
+		memcpy(file->file_hash, leader->file_hash, sizeof(file->file_hash));
+		memcpy(file->fingerprint, leader->fingerprint, sizeof(file->fingerprint));
+		file->has_metadata = leader->has_metadata;
+		file->metadata = leader->metadata;
+	}
+
+	unsigned int num_webms = 0, num_aliases = 0;
+	rc = _load(files, count, dry_run, &num_webms, &num_aliases);
+	if (rc == 0 && !dry_run)
+		unlink(checkpoint_path);
+
+	log_msg(rc == 0 ? LOG_INFO : LOG_ERR, "%s: %u webms and %u aliases %s, %"PRIu64" failed, %.1fs in all.",
+			rc == 0 ? "Done" : "Could not load into Postgres", num_webms, num_aliases,
+			dry_run ? "found" : "added", failed, _now() - started);
+
+end:
+	free(pending);
+	vector_free(scanned);
+	return rc == 0 && failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,234 @@
+// vim: noet ts=4 sw=4
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "async_log.h"
+#include "dirscan.h"
+#include "utils.h"
+
+/* Times a cold index of a synthetic board tree, the old readdir() + stat()
+ * way and with scan_directories(). Caches are dropped before each run when
+ * we're allowed to (and -w wasn't given), otherwise the numbers are warm and
+ * we say so. WFU_SCAN_IO_URING=0/1 picks the statx() path.
+ */
+#define BENCH_DEFAULT_FILES 500000
+#define BENCH_DEFAULT_BOARDS 15
+
+static double _now_ms() {
+	struct timespec spec;
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+	return spec.tv_sec * 1000.0 + spec.tv_nsec / 1.0e6;
+}
+
+static int _drop_caches(const int warm) {
+	if (warm)
+		return 0;
+
+	sync();
+	const int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (fd < 0)
+		return 0;
+
+	const int ok = write(fd, "3\n", 2) == 2;
+	close(fd);
+	return ok;
+}
+
+static int _make_tree(const char *root, const unsigned int num_boards, const unsigned int num_files) {
+	mkdir(root, 0755);
+
+	unsigned int i;
+	for (i = 0; i < num_boards; i++) {
+		char board_dir[MAX_IMAGE_FILENAME_SIZE] = {0};
+		snprintf(board_dir, sizeof(board_dir), "%s/board%u", root, i);
+		mkdir(board_dir, 0755);
+	}
+
+	for (i = 0; i < num_files; i++) {
+		char path[MAX_IMAGE_FILENAME_SIZE] = {0};
+		snprintf(path, sizeof(path), "%s/board%u/%u_%u.webm", root, i % num_boards, i * 7 + 1, i);
+
+		const int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd < 0)
+			continue;
+
+		/* A few bytes so sizes aren't all zero. */
+		if (write(fd, path, i % 64) < 0) {
+			close(fd);
+			return -1;
+		}
+		close(fd);
+	}
+
+	return 0;
+}
+
+static void _remove_tree(const char *root, const unsigned int num_boards) {
+	unsigned int i;
+	for (i = 0; i < num_boards; i++) {
+		char board_dir[MAX_IMAGE_FILENAME_SIZE] = {0};
+		snprintf(board_dir, sizeof(board_dir), "%s/board%u", root, i);
+
+		DIR *dirstream = opendir(board_dir);
+		if (!dirstream)
+			continue;
+
+		struct dirent *result = NULL;
+		while ((result = readdir(dirstream)) != NULL) {
+			if (result->d_name[0] == '.')
+				continue;
+			char *full_path = get_full_path_for_file(board_dir, result->d_name);
+			unlink(full_path);
+			free(full_path);
+		}
+		closedir(dirstream);
+		rmdir(board_dir);
+	}
+	rmdir(root);
+}
+
+/* What the board handler used to do for every directory. */
+static size_t _naive_scan(const char *dirs[], const unsigned int count) {
+	size_t found = 0;
+	unsigned int i;
+	for (i = 0; i < count; i++) {
+		DIR *dirstream = opendir(dirs[i]);
+		if (!dirstream)
+			continue;
+
+		vector *webm_vec = vector_new(sizeof(scanned_file), 2048);
+		struct dirent *result = NULL;
+		while ((result = readdir(dirstream)) != NULL) {
+			if (result->d_name[0] == '.' || !endswith(result->d_name, ".webm"))
+				continue;
+
+			struct stat st = {0};
+			char *full_path = get_full_path_for_file(dirs[i], result->d_name);
+			if (stat(full_path, &st) == -1) {
+				free(full_path);
+				continue;
+			}
+
+			scanned_file new = {
+				.fname = {0},
+				.mtime = st.st_mtime,
+				.size = st.st_size
+			};
+			strncpy(new.fname, result->d_name, sizeof(new.fname));
+			vector_append(webm_vec, &new, sizeof(scanned_file));
+			free(full_path);
+		}
+		closedir(dirstream);
+
+		found += webm_vec->count;
+		vector_free(webm_vec);
+	}
+
+	return found;
+}
+
+static size_t _fast_scan(const char *dirs[], const unsigned int count, const unsigned int threads) {
+	vector **out = calloc(count, sizeof(vector *));
+	scan_directories(dirs, count, ".webm", out, threads);
+
+	size_t found = 0;
+	unsigned int i;
+	for (i = 0; i < count; i++) {
+		if (out[i]) {
+			found += out[i]->count;
+			vector_free(out[i]);
+		}
+	}
+	free(out);
+
+	return found;
+}
+
+static void _report(const char *name, const double ms, const size_t found, const int cold) {
+	printf("%-24s %10.1f ms %12.0f files/s %10zu files%s\n", name, ms,
+			ms > 0 ? found / (ms / 1000.0) : 0.0, found, cold ? "" : " (warm)");
+}
+
+int main(int argc, char *argv[]) {
+	const char *root = "/tmp/mzbh_scan_bench";
+	unsigned int num_files = BENCH_DEFAULT_FILES;
+	unsigned int num_boards = BENCH_DEFAULT_BOARDS;
+	unsigned int num_threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	int keep = 0;
+	int warm = 0;
+
+	int i;
+	for (i = 1; i < argc; i++) {
+		const char *cur_arg = argv[i];
+		if (strncmp(cur_arg, "-d", strlen("-d")) == 0 && (i + 1) < argc) {
+			root = argv[++i];
+		} else if (strncmp(cur_arg, "-n", strlen("-n")) == 0 && (i + 1) < argc) {
+			num_files = strtol(argv[++i], NULL, 10);
+		} else if (strncmp(cur_arg, "-b", strlen("-b")) == 0 && (i + 1) < argc) {
+			num_boards = strtol(argv[++i], NULL, 10);
+		} else if (strncmp(cur_arg, "-t", strlen("-t")) == 0 && (i + 1) < argc) {
+			num_threads = strtol(argv[++i], NULL, 10);
+		} else if (strncmp(cur_arg, "-k", strlen("-k")) == 0) {
+			keep = 1;
+		} else if (strncmp(cur_arg, "-w", strlen("-w")) == 0) {
+			warm = 1;
+		} else {
+			fprintf(stderr, "Usage: %s [-d dir] [-n files] [-b boards] [-t threads] [-k] [-w]\n", argv[0]);
+			return -1;
+		}
+	}
+
+	if (num_boards == 0 || num_threads == 0) {
+		log_msg(LOG_ERR, "Need at least one board and one thread.");
+		return -1;
+	}
+
+	log_msg(LOG_INFO, "Creating %u files across %u boards in %s.", num_files, num_boards, root);
+	if (_make_tree(root, num_boards, num_files) != 0) {
+		log_msg(LOG_ERR, "Could not create the test tree.");
+		return -1;
+	}
+
+	char (*paths)[MAX_IMAGE_FILENAME_SIZE] = calloc(num_boards, MAX_IMAGE_FILENAME_SIZE);
+	const char **dirs = calloc(num_boards, sizeof(char *));
+	unsigned int b;
+	for (b = 0; b < num_boards; b++) {
+		snprintf(paths[b], MAX_IMAGE_FILENAME_SIZE, "%s/board%u", root, b);
+		dirs[b] = paths[b];
+	}
+
+	double start = 0;
+	size_t found = 0;
+	int cold = 0;
+
+	cold = _drop_caches(warm);
+	start = _now_ms();
+	found = _naive_scan(dirs, num_boards);
+	_report("readdir+stat", _now_ms() - start, found, cold);
+
+	cold = _drop_caches(warm);
+	start = _now_ms();
+	found = _fast_scan(dirs, num_boards, 1);
+	_report("scan_directories x1", _now_ms() - start, found, cold);
+
+	char name[32] = {0};
+	snprintf(name, sizeof(name), "scan_directories x%u", num_threads);
+	cold = _drop_caches(warm);
+	start = _now_ms();
+	found = _fast_scan(dirs, num_boards, num_threads);
+	_report(name, _now_ms() - start, found, cold);
+
+	if (!keep)
+		_remove_tree(root, num_boards);
+
+	free(dirs);
+	free(paths);
+	return 0;
+}
@@ -0,0 +1,289 @@
+// vim: noet ts=4 sw=4
+#ifdef __clang__
+	#pragma clang diagnostic ignored "-Wmissing-field-initializers"
+#endif
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "async_log.h"
+#include "db.h"
+#include "hashing.h"
+#include "http.h"
+#include "metrics.h"
+#include "models.h"
+#include "search_jobs.h"
+#include "thumbnail.h"
+#include "utils.h"
+
+/* Every job lives in this table from submission until it expires. Workers and
+ * HTTP threads share it under _jobs_lock; _jobs_queued wakes workers and
+ * _jobs_finished wakes long-polling requests.
+ */
+static search_job _jobs[SEARCH_JOB_MAX];
+static uint64_t _next_job_id = 1;
+static pthread_mutex_t _jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _jobs_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t _jobs_finished = PTHREAD_COND_INITIALIZER;
+
+const char *search_job_state_name(const search_job_state state) {
+	switch (state) {
+		case SEARCH_JOB_QUEUED:
+			return "queued";
+		case SEARCH_JOB_RUNNING:
+			return "running";
+		case SEARCH_JOB_DONE:
+			return "done";
+		case SEARCH_JOB_FAILED:
+			return "failed";
+		default:
+			return "unknown";
+	}
+}
+
+static void _release_job(search_job *job) {
+	free(job->post_content);
+	memset(job, 0, sizeof(search_job));
+}
+
+/* Must be called with _jobs_lock held. */
+static search_job *_find_job(const uint64_t id) {
+	unsigned int i;
+	for (i = 0; i < SEARCH_JOB_MAX; i++) {
+		if (_jobs[i].state != SEARCH_JOB_FREE && _jobs[i].id == id)
+			return &_jobs[i];
+	}
+
+	return NULL;
+}
+
+/* Must be called with _jobs_lock held. Reaps expired jobs as it goes. */
+static search_job *_find_free_slot(const time_t now) {
+	search_job *free_slot = NULL;
+
+	unsigned int i;
+	for (i = 0; i < SEARCH_JOB_MAX; i++) {
+		search_job *job = &_jobs[i];
+		if ((job->state == SEARCH_JOB_DONE || job->state == SEARCH_JOB_FAILED) &&
+				now - job->finished_at > SEARCH_JOB_EXPIRY)
+			_release_job(job);
+
+		if (job->state == SEARCH_JOB_FREE && free_slot == NULL)
+			free_slot = job;
+	}
+
+	return free_slot;
+}
+
+/* Must be called with _jobs_lock held. Oldest queued job first. */
+static search_job *_next_queued_job() {
+	search_job *oldest = NULL;
+
+	unsigned int i;
+	for (i = 0; i < SEARCH_JOB_MAX; i++) {
+		search_job *job = &_jobs[i];
+		if (job->state == SEARCH_JOB_QUEUED && (oldest == NULL || job->id < oldest->id))
+			oldest = job;
+	}
+
+	return oldest;
+}
+
+search_job_rc search_job_submit(const char *client, const char *url, uint64_t *out_id) {
+	if (!url || strnlen(url, SEARCH_JOB_MAX_URL_SIZE) >= SEARCH_JOB_MAX_URL_SIZE ||
+			strrchr(url, '/') == NULL)
+		return SEARCH_JOB_ERR_BAD_URL;
+
+	search_job_rc rc = SEARCH_JOB_OK;
+	pthread_mutex_lock(&_jobs_lock);
+
+	unsigned int i, outstanding = 0;
+	for (i = 0; i < SEARCH_JOB_MAX; i++) {
+		const search_job *job = &_jobs[i];
+		if ((job->state == SEARCH_JOB_QUEUED || job->state == SEARCH_JOB_RUNNING) &&
+				strncmp(job->client, client, sizeof(job->client)) == 0)
+			outstanding++;
+	}
+
+	if (outstanding >= SEARCH_JOB_MAX_PER_CLIENT) {
+		rc = SEARCH_JOB_ERR_CLIENT_LIMIT;
+		goto end;
+	}
+
+	search_job *job = _find_free_slot(time(NULL));
+	if (!job) {
+		rc = SEARCH_JOB_ERR_FULL;
+		goto end;
+	}
+
+	job->id = _next_job_id++;
+	job->state = SEARCH_JOB_QUEUED;
+	strncpy(job->client, client, sizeof(job->client) - 1);
+	strncpy(job->url, url, sizeof(job->url) - 1);
+	*out_id = job->id;
+
+	pthread_cond_signal(&_jobs_queued);
+
+end:
+	pthread_mutex_unlock(&_jobs_lock);
+	return rc;
+}
+
+int search_job_get(const uint64_t id, const unsigned int timeout, search_job *out) {
+	struct timespec deadline = {0};
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout;
+
+	pthread_mutex_lock(&_jobs_lock);
+
+	search_job *job = _find_job(id);
+	while (job && timeout > 0 &&
+			(job->state == SEARCH_JOB_QUEUED || job->state == SEARCH_JOB_RUNNING)) {
+		if (pthread_cond_timedwait(&_jobs_finished, &_jobs_lock, &deadline) == ETIMEDOUT)
+			break;
+		/* The slot may have been reaped and reused while we slept. */
+		job = _find_job(id);
+	}
+
+	if (!job) {
+		pthread_mutex_unlock(&_jobs_lock);
+		return -1;
+	}
+
+	memcpy(out, job, sizeof(search_job));
+	if (job->post_content)
+		out->post_content = strdup(job->post_content);
+
+	pthread_mutex_unlock(&_jobs_lock);
+	return 0;
+}
+
+void search_job_snapshot_free(search_job *snapshot) {
+	free(snapshot->post_content);
+	snapshot->post_content = NULL;
+}
+
+/* Does the actual work for a job. Runs without the lock held, writing only
+ * into result, which is copied back into the table afterwards. */
+static void _run_job(const search_job *job, search_job *result) {
+	const char *filename = strrchr(job->url, '/');
+
+	char filename_to_write[MAX_IMAGE_FILENAME_SIZE] = {0};
+	char out_filepath[MAX_IMAGE_FILENAME_SIZE] = {0};
+	snprintf(filename_to_write, sizeof(filename_to_write), "%"PRIu64"_%s", job->id, filename + sizeof(char));
+
+	/* The full hash is worked out while the file downloads, so a possible
+	 * dupe doesn't have to read it back off disk. */
+	char image_hash[HASH_IMAGE_STR_SIZE] = {0};
+	const size_t new_webm_size = download_sent_webm_url(job->url, filename_to_write, out_filepath, image_hash);
+	if (new_webm_size == 0) {
+		result->state = SEARCH_JOB_FAILED;
+		strncpy(result->error, "Could not download webm.", sizeof(result->error) - 1);
+		return;
+	}
+
+	/* Thumbnailing happens in the background, it'll be there by the time
+	 * anybody looks at it. */
+	char thumb_path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	get_thumb_path_for_webm(out_filepath, thumb_path);
+	if (thumbnail_enqueue(out_filepath, thumb_path) == 0)
+		strncpy(result->upload_thumbnail, strrchr(thumb_path, '/') + 1, sizeof(result->upload_thumbnail) - 1);
+
+	/* Only bother hashing all of it if something we have could match. */
+	size_t size = 0;
+	char fingerprint[HASH_IMAGE_STR_SIZE] = {0};
+	const int maybe_dupe = !hash_fingerprint_file(out_filepath, &size, fingerprint) ||
+		fingerprint_seen(size, fingerprint);
+	metrics_cache("fingerprint", !maybe_dupe);
+
+	webm *_webm = NULL;
+	if (maybe_dupe) {
+		char webm_key[MAX_KEY_SIZE] = {0};
+		HASH_ALGORITHM algorithm = HASH_BMW256;
+		_webm = get_image_for_file(out_filepath, image_hash, &algorithm, webm_key);
+	}
+
+	char alias_key[MAX_KEY_SIZE] = {0};
+	webm_alias *_alias = get_aliased_image_by_oleg_key(out_filepath, alias_key);
+
+	result->state = SEARCH_JOB_DONE;
+	if (_webm) {
+		result->found = 1;
+		strncpy(result->filename, _webm->filename, sizeof(result->filename) - 1);
+		strncpy(result->board, _webm->board, sizeof(result->board) - 1);
+
+		post *_post = get_post(_webm->post_id);
+		if (_post) {
+			result->thread_id = _post->thread_id;
+			result->post_id = _post->fourchan_post_id;
+			result->post_content = _post->body_content;
+			vector_free(_post->replied_to);
+		}
+		free(_post);
+	} else if (_alias) {
+		result->found = 1;
+		result->is_alias = 1;
+		strncpy(result->filename, _alias->filename, sizeof(result->filename) - 1);
+		strncpy(result->board, _alias->board, sizeof(result->board) - 1);
+	}
+
+	free(_webm);
+	free(_alias);
+}
+
+static void *_search_worker(void *arg) {
+	UNUSED(arg);
+
+	while (1) {
+		pthread_mutex_lock(&_jobs_lock);
+		search_job *job = NULL;
+		while ((job = _next_queued_job()) == NULL)
+			pthread_cond_wait(&_jobs_queued, &_jobs_lock);
+
+		job->state = SEARCH_JOB_RUNNING;
+		const search_job to_run = *job;
+		pthread_mutex_unlock(&_jobs_lock);
+
+		log_msg(LOG_INFO, "Running search job %"PRIu64" for %s.", to_run.id, to_run.url);
+
+		search_job result = {0};
+		_run_job(&to_run, &result);
+
+		pthread_mutex_lock(&_jobs_lock);
+		/* Nothing reaps running jobs, so the slot is still ours. */
+		job->state = result.state;
+		job->found = result.found;
+		job->is_alias = result.is_alias;
+		job->thread_id = result.thread_id;
+		job->post_id = result.post_id;
+		job->post_content = result.post_content;
+		job->finished_at = time(NULL);
+		memcpy(job->filename, result.filename, sizeof(job->filename));
+		memcpy(job->board, result.board, sizeof(job->board));
+		memcpy(job->error, result.error, sizeof(job->error));
+		memcpy(job->upload_thumbnail, result.upload_thumbnail, sizeof(job->upload_thumbnail));
+		pthread_cond_broadcast(&_jobs_finished);
+		pthread_mutex_unlock(&_jobs_lock);
+	}
+
+	return NULL;
+}
+
+int search_jobs_start(const unsigned int num_threads) {
+	unsigned int i;
+	for (i = 0; i < num_threads; i++) {
+		pthread_t worker;
+		if (pthread_create(&worker, NULL, _search_worker, NULL) != 0) {
+			log_msg(LOG_ERR, "Could not start search worker %u.", i);
+			return -1;
+		}
+		pthread_detach(worker);
+	}
+
+	log_msg(LOG_INFO, "Started %u search workers.", num_threads);
+	return 0;
+}
@@ -26,13 +26,20 @@
 #include <38-moths/38-moths.h>
 
 #include "db.h"
+#include "dirscan.h"
+#include "filename_index.h"
+#include "hashing.h"
 #include "http.h"
+#include "meta_snapshot.h"
+#include "metrics.h"
 #include "parse.h"
 #include "parson.h"
 #include "models.h"
+#include "search_jobs.h"
 #include "server.h"
+#include "text_index.h"
+#include "trace.h"
 
-#define RESULTS_PER_PAGE 160
 #define OFFSET_FOR_PAGE(x) x * RESULTS_PER_PAGE
 
 static char *pretty_date(const char *argument) {
@@ -65,7 +72,7 @@ error:
 	return buf;
 }
 
-static char *thumbnail_for_image(const char *argument) {
+char *thumbnail_for_image(const char *argument) {
 	const size_t arg_len = strlen(argument);
 	const size_t stop_at = arg_len - strlen("webm");
 
@@ -79,54 +86,33 @@ static char *thumbnail_for_image(const char *argument) {
 	return to_return;
 }
 
+/* Template paths are literals, so they double as span names. */
+static int _render_file(greshunkel_ctext *ctext, const char *file_path, m38_http_response *response) {
+	trace_span span;
+	trace_begin(&span, file_path);
+	const int rc = m38_render_file(ctext, file_path, response);
+	trace_end(&span);
+	return rc;
+}
+
 static inline int alphabetical_cmp(const void *a, const void *b) {
 	return strncmp((char *)a, (char *)b, MAX_IMAGE_FILENAME_SIZE);
 }
 
 static inline int compare_dates(const void *a, const void *b) {
-	const struct file_and_time *_a = a;
-	const struct file_and_time *_b = b;
+	const scanned_file *_a = a;
+	const scanned_file *_b = b;
 
-	return _b->ctime - _a->ctime;
+	return (_b->mtime > _a->mtime) - (_b->mtime < _a->mtime);
 }
 
 static int _add_webms_in_dir_by_date(greshunkel_var *loop, const char *dir,
 		const unsigned int offset, const unsigned int limit) {
-	/* Check to make sure the directory actually exists. */
-	struct stat dir_st = {0};
-	if (stat(dir, &dir_st) == -1)
+	vector *webm_vec = scan_directory(dir, ".webm");
+	if (!webm_vec)
 		return 0;
 
-	DIR *dirstream = opendir(dir);
-	unsigned int total = 0;
-	vector *webm_vec = vector_new(sizeof(struct file_and_time), 2048);
-
-	while (1) {
-		struct dirent *result = readdir(dirstream);
-		if (!result)
-			break;
-
-		if (result->d_name[0] != '.' && endswith(result->d_name, ".webm")) {
-			struct stat st = {0};
-			char *full_path = get_full_path_for_file(dir, result->d_name);
-			if (stat(full_path, &st) == -1) {
-				m38_log_msg(LOG_ERR, "Could not stat file: %s", result->d_name);
-				free(full_path);
-				continue;
-			}
-
-			struct file_and_time new = {
-				.fname = {0},
-				.ctime = st.st_mtime
-			};
-			strncpy(new.fname, result->d_name, sizeof(new.fname));
-			vector_append(webm_vec, &new, sizeof(struct file_and_time));
-			free(full_path);
-			total++;
-		}
-	}
-	closedir(dirstream);
-
+	const unsigned int total = webm_vec->count;
 	if (webm_vec->count <= 0) {
 		vector_free(webm_vec);
 		return 0;
@@ -142,7 +128,7 @@ static int _add_webms_in_dir_by_date(greshunkel_var *loop, const char *dir,
 			can_add = 1;
 
 		if (can_add) {
-			const struct file_and_time *x = vector_get(webm_vec, i);
+			const scanned_file *x = vector_get(webm_vec, i);
 			gshkl_add_string_to_loop(loop, x->fname);
 		}
 	}
@@ -151,6 +137,40 @@ static int _add_webms_in_dir_by_date(greshunkel_var *loop, const char *dir,
 	return total;
 }
 
+/* Same as above, but filtered on container metadata, so it has to come from
+ * the snapshot or the DB instead of the directory. */
+static int _add_filtered_webms_by_date(greshunkel_var *loop, const char board[static MAX_BOARD_NAME_SIZE],
+		const uint64_t min_duration_ms, const int require_audio,
+		const unsigned int offset, const unsigned int limit) {
+	vector *filenames = vector_new(MAX_IMAGE_FILENAME_SIZE, limit ? limit : 1);
+	if (filenames) {
+		const int total = meta_snapshot_board_page(board, min_duration_ms, require_audio, offset, limit, filenames);
+		unsigned int i;
+		for (i = 0; total >= 0 && i < filenames->count; i++)
+			gshkl_add_string_to_loop(loop, vector_get(filenames, i));
+		vector_free(filenames);
+		if (total >= 0)
+			return total;
+	}
+
+	PGresult *res = get_webms_by_board_filtered(board, min_duration_ms, require_audio, offset, limit);
+	if (!res)
+		return 0;
+
+	int total = 0;
+	const int filename_col = PQfnumber(res, "filename");
+	const int rows = PQntuples(res);
+	int i;
+	for (i = 0; i < rows; i++)
+		gshkl_add_string_to_loop(loop, PQgetvalue(res, i, filename_col));
+
+	if (rows > 0)
+		total = atoi(PQgetvalue(res, 0, PQfnumber(res, "total")));
+
+	PQclear(res);
+	return total;
+}
+
 static int _add_files_in_dir_to_arr(greshunkel_var *loop, const char *dir) {
 	vector *alphabetical_vec = vector_new(MAX_IMAGE_FILENAME_SIZE, 16);
 
@@ -191,8 +211,8 @@ int static_handler(const m38_http_request *request, m38_http_response *response)
 }
 
 int user_thumbs_static_handler(const m38_http_request *request, m38_http_response *response) {
-	/* Remove the leading slash: */
-	const char *file_path = request->resource + sizeof(char);
+	/* Everything after /static/user_thumbs/ */
+	const char *file_path = request->resource + strlen("/static/user_thumbs/");
 	char buf[256] = {0};
 	snprintf(buf, sizeof(buf), "./user_uploaded/t/%s", file_path);
 	return m38_mmap_file(buf, response);
@@ -204,7 +224,7 @@ static void get_current_board(char current_board[static MAX_BOARD_NAME_SIZE], co
 	strncpy(current_board, request->resource + request->matches[1].rm_so, bgr);
 }
 
-static void get_webm_from_board(char file_name_decoded[static MAX_IMAGE_FILENAME_SIZE], const m38_http_request *request) {
+void get_webm_from_board(char file_name_decoded[static MAX_IMAGE_FILENAME_SIZE], const m38_http_request *request) {
 	char file_name[MAX_IMAGE_FILENAME_SIZE] = {0};
 	char file_name_decoded_first_pass[MAX_IMAGE_FILENAME_SIZE] = {0};
 	const size_t file_name_len = request->matches[2].rm_eo - request->matches[2].rm_so;
@@ -268,124 +288,346 @@ int index_handler(const m38_http_request *request, m38_http_response *response)
 
 	greshunkel_var boards = gshkl_add_array(ctext, "BOARDS");
 	_add_files_in_dir_to_arr(&boards, webm_location());
-	return m38_render_file(ctext, "./templates/index.html", response);
+	return _render_file(ctext, "./templates/index.html", response);
 }
 
 static int _api_failure(m38_http_response *response, greshunkel_ctext *ctext, const char *error) {
 	gshkl_add_string(ctext, "SUCCESS", "false");
 	gshkl_add_string(ctext, "ERROR", error);
 	gshkl_add_string(ctext, "DATA", "{}");
-	return m38_render_file(ctext, "./templates/response.json", response);
+	return _render_file(ctext, "./templates/response.json", response);
 }
 
-int url_search_handler(const m38_http_request *request, m38_http_response *response) {
-	greshunkel_ctext *ctext = gshkl_init_context();
-	gshkl_add_filter(ctext, "pretty_date", &pretty_date, &gshkl_filter_cleanup);
-	gshkl_add_filter(ctext, "thumbnail_for_image", &thumbnail_for_image, &gshkl_filter_cleanup);
+static const char *_search_client(const m38_http_request *request, char client[static SEARCH_JOB_MAX_CLIENT_SIZE]) {
+	/* We sit behind a proxy, so this is the only idea we have of who is asking. */
+	char *forwarded_for = m38_get_header_value_request(request, "X-Forwarded-For");
+	if (forwarded_for) {
+		const size_t len = strcspn(forwarded_for, ",");
+		strncpy(client, forwarded_for, len < SEARCH_JOB_MAX_CLIENT_SIZE ? len : SEARCH_JOB_MAX_CLIENT_SIZE - 1);
+		free(forwarded_for);
+	} else {
+		strncpy(client, "anonymous", SEARCH_JOB_MAX_CLIENT_SIZE - 1);
+	}
 
-	/* All boards */
-	greshunkel_var boards = gshkl_add_array(ctext, "BOARDS");
-	_add_files_in_dir_to_arr(&boards, webm_location());
+	return client;
+}
+
+static int _render_search_job(const search_job *job, m38_http_response *response) {
+	JSON_Value *root_value = json_value_init_object();
+	JSON_Object *root_object = json_value_get_object(root_value);
+
+	JSON_Value *_data = json_value_init_object();
+	JSON_Object *data = json_value_get_object(_data);
+
+	JSON_Value *_results = json_value_init_array();
+	JSON_Array *results = json_value_get_array(_results);
+
+	json_object_set_number(data, "job_id", job->id);
+	json_object_set_string(data, "state", search_job_state_name(job->state));
+
+	if (job->state == SEARCH_JOB_DONE && job->found) {
+		JSON_Value *_result = json_value_init_object();
+		JSON_Object *result = json_value_get_object(_result);
+
+		char *thumbnail = thumbnail_for_image(job->filename);
+		json_object_set_string(result, "filename", job->filename);
+		json_object_set_string(result, "thumbnail", thumbnail);
+		json_object_set_string(result, "board", job->board);
+		json_object_set_boolean(result, "is_alias", job->is_alias);
+		json_object_set_number(result, "thread_id", job->thread_id);
+		json_object_set_number(result, "post_id", job->post_id);
+		json_object_set_string(result, "post_content", job->post_content ? job->post_content : "...");
+		free(thumbnail);
+
+		json_array_append_value(results, _result);
+	}
+
+	json_object_set_value(data, "results", _results);
+
+	if (strnlen(job->upload_thumbnail, sizeof(job->upload_thumbnail)) > 0) {
+		char upload_thumbnail[MAX_IMAGE_FILENAME_SIZE + 32] = {0};
+		snprintf(upload_thumbnail, sizeof(upload_thumbnail), "/static/user_thumbs/%s", job->upload_thumbnail);
+		json_object_set_string(data, "upload_thumbnail", upload_thumbnail);
+	}
 
+	json_object_set_boolean(root_object, "success", job->state != SEARCH_JOB_FAILED);
+	if (job->state == SEARCH_JOB_FAILED)
+		json_object_set_string(root_object, "error", job->error);
+	else
+		json_object_set_null(root_object, "error");
+	json_object_set_value(root_object, "data", _data);
+
+	char *out = json_serialize_to_string(root_value);
+	json_value_free(root_value);
+
+	return m38_return_raw_buffer(out, strlen(out), response);
+}
+
+int url_search_handler(const m38_http_request *request, m38_http_response *response) {
 	const unsigned char *full_body = request->full_body;
 	JSON_Value *body_string = json_parse_string((const char *)full_body);
 	if (!body_string)
-		return _api_failure(response, ctext, "Could not parse JSON object.");
+		return _api_failure(response, gshkl_init_context(), "Could not parse JSON object.");
 
 	JSON_Object *webm_url_object = json_value_get_object(body_string);
 	if (!webm_url_object) {
 		json_value_free(body_string);
-		return _api_failure(response, ctext, "Could not get object from JSON.");
+		return _api_failure(response, gshkl_init_context(), "Could not get object from JSON.");
 	}
 
 	const char *webm_url = json_object_get_string(webm_url_object, "webm_url");
 
 	if (!webm_url) {
 		json_value_free(body_string);
-		return _api_failure(response, ctext, "'webm_url' is a required key.");
+		return _api_failure(response, gshkl_init_context(), "'webm_url' is a required key.");
 	}
 
-	/* Download the file. */
-	const char *filename = strrchr(webm_url, '/');
-	if (filename == NULL) {
-		json_value_free(body_string);
-		return _api_failure(response, ctext, "Bogus filename in URL.");
+	/* Downloading and hashing happens on the search workers, so all we do
+	 * here is queue it up and hand back something to poll. */
+	char client[SEARCH_JOB_MAX_CLIENT_SIZE] = {0};
+	uint64_t job_id = 0;
+	const search_job_rc rc = search_job_submit(_search_client(request, client), webm_url, &job_id);
+	json_value_free(body_string);
+
+	switch (rc) {
+		case SEARCH_JOB_OK:
+			break;
+		case SEARCH_JOB_ERR_BAD_URL:
+			return _api_failure(response, gshkl_init_context(), "Bogus filename in URL.");
+		case SEARCH_JOB_ERR_CLIENT_LIMIT:
+			return _api_failure(response, gshkl_init_context(), "Too many searches in flight, wait for one to finish.");
+		case SEARCH_JOB_ERR_FULL:
+		default:
+			return _api_failure(response, gshkl_init_context(), "Search queue is full, try again later.");
 	}
 
-	char filename_to_write[MAX_IMAGE_FILENAME_SIZE] = {0};
-	char out_filepath[MAX_IMAGE_FILENAME_SIZE] = {0};
-	snprintf(filename_to_write, sizeof(filename_to_write), "%i_%s", rand(), filename + sizeof(char));
+	const search_job queued = {
+		.id = job_id,
+		.state = SEARCH_JOB_QUEUED
+	};
+	return _render_search_job(&queued, response);
+}
 
-	const size_t new_webm_size = download_sent_webm_url(webm_url, filename_to_write, out_filepath);
-	json_value_free(body_string);
+static int _search_job_handler(const m38_http_request *request, m38_http_response *response,
+		const unsigned int timeout) {
+	const uint64_t job_id = strtoull(request->resource + request->matches[1].rm_so, NULL, 10);
 
-	if (new_webm_size == 0)
-		return _api_failure(response, ctext, "Could not download webm.");
+	search_job job = {0};
+	if (search_job_get(job_id, timeout, &job) != 0)
+		return 404;
 
-	/* Hash the file. */
-	char image_hash[HASH_IMAGE_STR_SIZE] = {0};
-	char webm_key[MAX_KEY_SIZE] = {0};
-	hash_file(out_filepath, image_hash);
-	webm *_webm = get_image_by_oleg_key(image_hash, webm_key);
+	const int rc = _render_search_job(&job, response);
+	search_job_snapshot_free(&job);
+	return rc;
+}
 
-	char alias_key[MAX_KEY_SIZE] = {0};
-	webm_alias *_alias = get_aliased_image_by_oleg_key(out_filepath, alias_key);
+int search_job_handler(const m38_http_request *request, m38_http_response *response) {
+	return _search_job_handler(request, response, 0);
+}
 
-	greshunkel_var results = gshkl_add_array(ctext, "RESULTS");
+int search_job_wait_handler(const m38_http_request *request, m38_http_response *response) {
+	return _search_job_handler(request, response, SEARCH_JOB_LONG_POLL);
+}
 
-	/* This code is fucking terrible. */
-	int found = 0;
-	if (_webm) {
-		found = 1;
+/* The search's 'q', with form encoded +s as spaces. Returns how long it was
+ * in the URL, or -1 if that's max_len or more. */
+static int _search_query(const m38_http_request *request, char query[static TEXT_SEARCH_MAX_QUERY],
+		const size_t max_len) {
+	const char *raw = request->resource + request->matches[1].rm_so;
+	const size_t raw_len = request->matches[1].rm_eo - request->matches[1].rm_so;
+	if (raw_len >= max_len || raw_len >= TEXT_SEARCH_MAX_QUERY)
+		return -1;
+
+	char plus_decoded[TEXT_SEARCH_MAX_QUERY] = {0};
+	size_t i;
+	for (i = 0; i < raw_len; i++)
+		plus_decoded[i] = raw[i] == '+' ? ' ' : raw[i];
+	memset(query, 0, TEXT_SEARCH_MAX_QUERY);
+	url_decode(plus_decoded, raw_len, query);
+	return raw_len;
+}
 
-		greshunkel_ctext *result = gshkl_init_context();
-		gshkl_add_string(result, "thumbnail", _webm->filename);
-		gshkl_add_string(result, "filename", _webm->filename);
-		post *_post = get_post(_webm->post_id);
-		if (_post) {
-			gshkl_add_int(result, "thread_id", _post->thread_id);
-			gshkl_add_int(result, "post_id", _post->fourchan_post_id);
-			if (_post->body_content) {
-				gshkl_add_string(result, "post_content", _post->body_content);
-				free(_post->body_content);
-			} else {
-				gshkl_add_string(result, "post_content", "...");
-			}
-			vector_free(_post->replied_to_keys);
-		} else {
-			gshkl_add_string(result, "post_content", "...");
-			gshkl_add_string(result, "post_id", "...");
-			gshkl_add_string(result, "thread_id", "...");
-		}
-		free(_post);
-		gshkl_add_string(result, "board", _webm->board);
+/* Sends data back along with the query and how long it took. Takes data. */
+static int _render_search_results(m38_http_response *response, JSON_Value *_data, const char *query,
+		const uint64_t started) {
+	JSON_Value *root_value = json_value_init_object();
+	JSON_Object *root_object = json_value_get_object(root_value);
+
+	JSON_Object *data = json_value_get_object(_data);
+	json_object_set_string(data, "query", query);
+	json_object_set_number(data, "took_ms", (trace_now_ns() - started) / 1.0e6);
 
-		gshkl_add_string(result, "is_last", "asdf");
-		gshkl_add_sub_context_to_loop(&results, result);
+	json_object_set_boolean(root_object, "success", 1);
+	json_object_set_null(root_object, "error");
+	json_object_set_value(root_object, "data", _data);
+
+	char *out = json_serialize_to_string(root_value);
+	json_value_free(root_value);
+
+	return m38_return_raw_buffer(out, strlen(out), response);
+}
+
+int text_search_handler(const m38_http_request *request, m38_http_response *response) {
+	char query[TEXT_SEARCH_MAX_QUERY] = {0};
+	if (_search_query(request, query, TEXT_SEARCH_MAX_QUERY) <= 0)
+		return _api_failure(response, gshkl_init_context(), "'q' is required, and can't be that long.");
+
+	const uint64_t started = trace_now_ns();
+	text_hit hits[TEXT_INDEX_MAX_RESULTS];
+	const size_t found = text_index_search(query, hits, TEXT_INDEX_MAX_RESULTS);
+
+	size_t i;
+	PGresult *res = NULL;
+	if (found > 0) {
+		unsigned int ids[TEXT_INDEX_MAX_RESULTS] = {0};
+		for (i = 0; i < found; i++)
+			ids[i] = hits[i].post_id;
+		res = get_posts_by_ids(ids, found);
+		if (!res)
+			return _api_failure(response, gshkl_init_context(), "Could not look those posts up.");
 	}
 
-	if (_alias) {
-		found = 1;
-		/* TODO: Loop through webms and aliases here */
-		//greshunkel_ctext *result = gshkl_init_context();
-		//gshkl_add_string(result, "is_last", "asdf");
-		//gshkl_add_sub_context_to_loop(&results, result);
+	JSON_Value *_data = json_value_init_object();
+	JSON_Object *data = json_value_get_object(_data);
+
+	JSON_Value *_results = json_value_init_array();
+	JSON_Array *results = json_value_get_array(_results);
+	JSON_Value *_webms = json_value_init_array();
+	JSON_Array *webms = json_value_get_array(_webms);
+
+	post_cols cols;
+	post_cols_init(&cols, res);
+	const pg_col w_filename_col = pg_col_lookup(res, "w_filename");
+	const pg_col wa_filename_col = pg_col_lookup(res, "wa_filename");
+	const int rows = res ? PQntuples(res) : 0;
+
+	/* Rows come back in whatever order, and once per webm or alias. */
+	for (i = 0; i < found; i++) {
+		int row_idx = -1, r;
+		const char *filename = NULL;
+		int is_alias = 0;
+		for (r = 0; r < rows && !filename; r++) {
+			if ((unsigned int)pg_get_int(res, r, cols.id) != hits[i].post_id)
+				continue;
+			row_idx = r;
+			filename = pg_get_str(res, r, w_filename_col);
+			if (!filename || !filename[0]) {
+				filename = pg_get_str(res, r, wa_filename_col);
+				is_alias = 1;
+			}
+			if (filename && !filename[0])
+				filename = NULL;
+		}
+		/* Deleted since it was indexed. */
+		if (row_idx < 0)
+			continue;
+
+		post_row row;
+		post_row_get(&row, &cols, res, row_idx);
+
+		JSON_Value *_result = json_value_init_object();
+		JSON_Object *result = json_value_get_object(_result);
+		json_object_set_number(result, "post_id", row.fourchan_post_id);
+		json_object_set_number(result, "post_no", row.fourchan_post_no);
+		json_object_set_number(result, "thread_id", row.thread_id);
+		json_object_set_string(result, "board", row.board ? row.board : "");
+		json_object_set_string(result, "post_content", row.body_content ? row.body_content : "");
+		json_object_set_number(result, "score", hits[i].score);
+		if (filename) {
+			char *thumbnail = thumbnail_for_image(filename);
+			json_object_set_string(result, "filename", filename);
+			json_object_set_string(result, "thumbnail", thumbnail);
+			json_object_set_boolean(result, "is_alias", is_alias);
+			free(thumbnail);
+
+			/* Every webm once, best post first. */
+			size_t w;
+			for (w = 0; w < json_array_get_count(webms); w++) {
+				if (strcmp(json_array_get_string(webms, w), filename) == 0)
+					break;
+			}
+			if (w == json_array_get_count(webms))
+				json_array_append_string(webms, filename);
+		} else {
+			json_object_set_null(result, "filename");
+		}
+		json_array_append_value(results, _result);
 	}
+	PQclear(res);
 
-	free(_webm);
-	free(_alias);
+	json_object_set_value(data, "results", _results);
+	json_object_set_value(data, "webms", _webms);
+	return _render_search_results(response, _data, query, started);
+}
 
-	if (found) {
-		gshkl_add_string(ctext, "SUCCESS", "true");
-		gshkl_add_string(ctext, "ERROR", NULL);
-		return m38_render_file(ctext, "./templates/response_with_results.json", response);
+int filename_search_handler(const m38_http_request *request, m38_http_response *response) {
+	char query[TEXT_SEARCH_MAX_QUERY] = {0};
+	if (_search_query(request, query, MAX_IMAGE_FILENAME_SIZE) < 0)
+		return _api_failure(response, gshkl_init_context(), "That's longer than any filename.");
+	if (strlen(query) < FILENAME_SEARCH_MIN_QUERY)
+		return _api_failure(response, gshkl_init_context(), "'q' needs to be at least 3 characters.");
+
+	const uint64_t started = trace_now_ns();
+	filename_hit hits[FILENAME_SEARCH_MAX_RESULTS];
+	const size_t found = filename_index_search(query, hits, FILENAME_SEARCH_MAX_RESULTS);
+	size_t i;
+
+	JSON_Value *_data = json_value_init_object();
+	JSON_Object *data = json_value_get_object(_data);
+
+	JSON_Value *_results = json_value_init_array();
+	JSON_Array *results = json_value_get_array(_results);
+
+	for (i = 0; i < found; i++) {
+		JSON_Value *_result = json_value_init_object();
+		JSON_Object *result = json_value_get_object(_result);
+
+		char *thumbnail = thumbnail_for_image(hits[i].filename);
+		json_object_set_string(result, "filename", hits[i].filename);
+		json_object_set_string(result, "thumbnail", thumbnail);
+		json_object_set_string(result, "board", hits[i].board);
+		json_object_set_boolean(result, "is_alias", hits[i].is_alias);
+		if (hits[i].thread_id)
+			json_object_set_number(result, "thread_id", hits[i].thread_id);
+		else
+			json_object_set_null(result, "thread_id");
+		free(thumbnail);
+
+		json_array_append_value(results, _result);
 	}
 
-	gshkl_add_string(ctext, "SUCCESS", "true");
-	gshkl_add_string(ctext, "ERROR", NULL);
-	gshkl_add_string(ctext, "DATA", "[]");
+	json_object_set_value(data, "results", _results);
+	return _render_search_results(response, _data, query, started);
+}
+
+/* An alias as the webm it's a copy of, with its own post and date. */
+static webm *_webm_for_alias(const webm_alias *alias) {
+	webm *_webm = calloc(1, sizeof(webm));
+	if (!_webm)
+		return NULL;
+
+	_webm->id = alias->webm_id;
+	strncpy(_webm->filename, alias->filename, sizeof(_webm->filename) - 1);
+	strncpy(_webm->board, alias->board, sizeof(_webm->board) - 1);
+	_webm->post_id = alias->post_id;
+	_webm->created_at = alias->created_at;
+	return _webm;
+}
 
-	return m38_render_file(ctext, "./templates/response.json", response);
+static void _add_alias_to_loop(greshunkel_var *aliases, const time_t created_at,
+		const char *board, const char *filename, time_t *earliest_date) {
+	board = board ? board : "";
+	filename = filename ? filename : "";
+
+	if (created_at < *earliest_date)
+		*earliest_date = created_at;
+	const size_t buf_size = UINT_LEN(created_at) + strlen(", ") +
+		strnlen(board, MAX_BOARD_NAME_SIZE) + strlen(", ") +
+		strnlen(filename, MAX_IMAGE_FILENAME_SIZE);
+	char buf[buf_size + 1];
+	buf[buf_size] = '\0';
+	snprintf(buf, buf_size, "%lld, %s, %s", (long long)created_at, board, filename);
+	gshkl_add_string_to_loop(aliases, buf);
 }
 
 int webm_handler(const m38_http_request *request, m38_http_response *response) {
@@ -411,34 +653,36 @@ int webm_handler(const m38_http_request *request, m38_http_response *response) {
 	greshunkel_var aliases = gshkl_add_array(ctext, "aliases");
 	char image_hash[HASH_IMAGE_STR_SIZE] = {0};
 
-	char webm_key[MAX_KEY_SIZE] = {0};
 	hash_file(full_path, image_hash);
-	webm *_webm = get_image_by_oleg_key(image_hash, webm_key);
-
-	char alias_key[MAX_KEY_SIZE] = {0};
-	webm_alias *_alias = get_aliased_image_by_oleg_key(full_path, alias_key);
+	/* The snapshot only misses whatever came in since the downloader's last
+	 * pass, so try that before bothering the DB. */
+	webm *_webm = meta_snapshot_get_webm(image_hash);
+	if (!_webm) {
+		char webm_key[MAX_KEY_SIZE] = {0};
+		HASH_ALGORITHM algorithm = HASH_BMW256;
+		_webm = get_image_for_file(full_path, image_hash, &algorithm, webm_key);
+	}
 
-	/* This code is fucking terrible. */
-	int found = 0;
-	if (_webm) {
-		found = 1;
+	if (!_webm) {
+		char alias_key[MAX_KEY_SIZE] = {0};
+		webm_alias *_alias = meta_snapshot_get_alias(full_path);
+		if (!_alias)
+			_alias = get_aliased_image_by_oleg_key(full_path, alias_key);
 		if (_alias) {
-			/* This shouldn't happen, but whatever. */
+			_webm = _webm_for_alias(_alias);
 			free(_alias);
 		}
-	} else if (_alias) {
-		found = 1;
-		free(_webm);
-		_webm = (webm *)_alias;
 	}
 
-	if (!found) {
+	if (!_webm) {
 		gshkl_add_string(ctext, "image_date", NULL);
 		gshkl_add_string(ctext, "post_content", NULL);
 		gshkl_add_string(ctext, "post_id", NULL);
 		gshkl_add_string(ctext, "thread_id", NULL);
 	} else {
-		post *_post = get_post(_webm->post_id);
+		post *_post = meta_snapshot_get_post(_webm->post_id);
+		if (!_post)
+			_post = get_post(_webm->post_id);
 		if (_post) {
 			gshkl_add_int(ctext, "thread_id", _post->thread_id);
 			gshkl_add_int(ctext, "post_id", _post->fourchan_post_id);
@@ -448,7 +692,7 @@ int webm_handler(const m38_http_request *request, m38_http_response *response) {
 			} else {
 				gshkl_add_string(ctext, "post_content", NULL);
 			}
-			vector_free(_post->replied_to_keys);
+			vector_free(_post->replied_to);
 		} else {
 			gshkl_add_string(ctext, "post_content", NULL);
 			gshkl_add_string(ctext, "post_id", NULL);
@@ -457,54 +701,53 @@ int webm_handler(const m38_http_request *request, m38_http_response *response) {
 		free(_post);
 		time_t earliest_date = _webm->created_at;
 
-		/* Add known aliases from DB. We fetch every alias from the M2M,
-		 * and then fetch that key. Or try to, anyway. */
-		PGresult *res = get_aliases_by_webm_id(_webm->id);
-		unsigned int total_rows = 0;
-		if (res) {
-			unsigned int i = 0;
-			total_rows = PQntuples(res);
-			if (total_rows == 0) {
+		/* Add known aliases, from the snapshot if it knows about this webm
+		 * and the M2M otherwise. */
+		vector *known = vector_new(sizeof(webm_alias), 8);
+		if (known && meta_snapshot_get_aliases(_webm->id, known) >= 0) {
+			if (known->count == 0)
 				gshkl_add_string_to_loop(&aliases, "None");
+			unsigned int i;
+			for (i = 0; i < known->count; i++) {
+				const webm_alias *alias = vector_get(known, i);
+				_add_alias_to_loop(&aliases, alias->created_at, alias->board, alias->filename, &earliest_date);
 			}
-			for (i = 0; i < total_rows; i++) {
-				webm_alias *dsrlzd = deserialize_alias_from_tuples(res, i);
-
-				if (dsrlzd) {
-					if (dsrlzd->created_at < earliest_date)
-						earliest_date = dsrlzd->created_at;
-					const size_t buf_size = UINT_LEN(dsrlzd->created_at) + strlen(", ") +
-						strnlen(dsrlzd->board, MAX_BOARD_NAME_SIZE) + strlen(", ") +
-						strnlen(dsrlzd->filename, MAX_IMAGE_FILENAME_SIZE);
-					char buf[buf_size + 1];
-					buf[buf_size] = '\0';
-					snprintf(buf, buf_size, "%lld, %s, %s", (long long)dsrlzd->created_at, dsrlzd->board, dsrlzd->filename);
-					gshkl_add_string_to_loop(&aliases, buf);
-					free(dsrlzd);
+		} else {
+			PGresult *res = get_aliases_by_webm_id(_webm->id);
+			if (res) {
+				const unsigned int total_rows = PQntuples(res);
+				if (total_rows == 0) {
+					gshkl_add_string_to_loop(&aliases, "None");
 				}
+				webm_alias_cols cols;
+				webm_alias_cols_init(&cols, res);
+				unsigned int i;
+				for (i = 0; i < total_rows; i++) {
+					webm_alias_row alias;
+					webm_alias_row_get(&alias, &cols, res, i);
+					_add_alias_to_loop(&aliases, alias.created_at, alias.board, alias.filename, &earliest_date);
+				}
+				PQclear(res);
+			} else {
+				gshkl_add_string_to_loop(&aliases, "None");
 			}
-			PQclear(res);
-		} else {
-			gshkl_add_string_to_loop(&aliases, "None");
 		}
+		vector_free(known);
 
 		gshkl_add_int(ctext, "image_date", earliest_date);
 	}
 
 	free(_webm);
 	free(full_path);
-	return m38_render_file(ctext, "./templates/webm.html", response);
+	return _render_file(ctext, "./templates/webm.html", response);
 }
 
-static int _board_handler(const m38_http_request *request, m38_http_response *response, const unsigned int page) {
+/* filter is NULL, "long" or "audio". */
+static int _board_handler(const m38_http_request *request, m38_http_response *response,
+		const unsigned int page, const char *filter) {
 	char current_board[MAX_BOARD_NAME_SIZE] = {0};
 	get_current_board(current_board, request);
 
-	greshunkel_ctext *ctext = gshkl_init_context();
-	gshkl_add_filter(ctext, "thumbnail_for_image", thumbnail_for_image, gshkl_filter_cleanup);
-	gshkl_add_string(ctext, "current_board", current_board);
-	greshunkel_var images = gshkl_add_array(ctext, "IMAGES");
-
 	char images_dir[256] = {0};
 	snprintf(images_dir, sizeof(images_dir), "%s/%s", webm_location(), current_board);
 
@@ -513,8 +756,27 @@ static int _board_handler(const m38_http_request *request, m38_http_response *re
 	if (stat(images_dir, &dir_st) == -1)
 		return 404;
 
-	int total = _add_webms_in_dir_by_date(&images, images_dir,
-			OFFSET_FOR_PAGE(page), RESULTS_PER_PAGE);
+	greshunkel_ctext *ctext = gshkl_init_context();
+	gshkl_add_filter(ctext, "thumbnail_for_image", thumbnail_for_image, gshkl_filter_cleanup);
+	gshkl_add_string(ctext, "current_board", current_board);
+	greshunkel_var images = gshkl_add_array(ctext, "IMAGES");
+
+	/* Pagination links need to keep the filter. */
+	char page_base[128] = {0};
+	int total = 0;
+	if (filter == NULL) {
+		snprintf(page_base, sizeof(page_base), "/chug/%s", current_board);
+		total = _add_webms_in_dir_by_date(&images, images_dir,
+				OFFSET_FOR_PAGE(page), RESULTS_PER_PAGE);
+	} else {
+		snprintf(page_base, sizeof(page_base), "/chug/%s/%s", current_board, filter);
+		const int want_long = strcmp(filter, "long") == 0;
+		total = _add_filtered_webms_by_date(&images, current_board,
+				want_long ? WEBM_LONG_DURATION_MS : 0, !want_long,
+				OFFSET_FOR_PAGE(page), RESULTS_PER_PAGE);
+	}
+	gshkl_add_string(ctext, "page_base", page_base);
+	gshkl_add_string(ctext, "current_filter", filter ? filter : "all");
 
 	greshunkel_var pages = gshkl_add_array(ctext, "PAGES");
 	unsigned int i;
@@ -539,7 +801,7 @@ static int _board_handler(const m38_http_request *request, m38_http_response *re
 
 	gshkl_add_int(ctext, "total", total);
 
-	return m38_render_file(ctext, "./templates/board.html", response);
+	return _render_file(ctext, "./templates/board.html", response);
 }
 
 static unsigned int _add_sorted_by_aliases(greshunkel_var *images,
@@ -549,19 +811,18 @@ static unsigned int _add_sorted_by_aliases(greshunkel_var *images,
 	if (res) {
 		unsigned int i = 0;
 		total_rows = PQntuples(res);
+		webm_cols cols;
+		webm_cols_init(&cols, res);
 		for (i = 0; i < total_rows; i++) {
-			webm *dsrlzd = deserialize_webm_from_tuples(res, i);
-
-			if (dsrlzd) {
-				greshunkel_ctext *_webm_sub = gshkl_init_context();
+			webm_row row;
+			webm_row_get(&row, &cols, res, i);
 
-				gshkl_add_string(_webm_sub, "filename", dsrlzd->filename);
-				gshkl_add_string(_webm_sub, "board", dsrlzd->board);
+			greshunkel_ctext *_webm_sub = gshkl_init_context();
 
-				gshkl_add_sub_context_to_loop(images, _webm_sub);
-			}
+			gshkl_add_string(_webm_sub, "filename", row.filename ? row.filename : "");
+			gshkl_add_string(_webm_sub, "board", row.board ? row.board : "");
 
-			free(dsrlzd);
+			gshkl_add_sub_context_to_loop(images, _webm_sub);
 		}
 	}
 
@@ -593,41 +854,46 @@ int by_thread_handler(const m38_http_request *request, m38_http_response *respon
 	if (res) {
 		unsigned int i = 0;
 		total_rows = PQntuples(res);
+		post_cols cols;
+		post_cols_init(&cols, res);
+		const pg_col w_filename_col = pg_col_lookup(res, "w_filename");
+		const pg_col wa_filename_col = pg_col_lookup(res, "wa_filename");
+		const pg_col reply_count_col = pg_col_lookup(res, "reply_count");
 		for (i = 0; i < total_rows; i++) {
-			post *dsrlzd = deserialize_post_from_tuples(res, i);
-
-			if (dsrlzd) {
-				greshunkel_ctext *_post_sub = gshkl_init_context();
-				gshkl_add_int(_post_sub, "date", dsrlzd->fourchan_post_id);
-				gshkl_add_string(_post_sub, "board", dsrlzd->board);
-
-				if (dsrlzd->body_content)
-					gshkl_add_string(_post_sub, "content", dsrlzd->body_content);
-				else
-					gshkl_add_string(_post_sub, "content", "");
-
-				if (dsrlzd->fourchan_post_no)
-					gshkl_add_int(_post_sub, "post_no", dsrlzd->fourchan_post_no);
-				else
-					gshkl_add_string(_post_sub, "post_no", "");
-
-				const char *w_filename = PQgetvalue(res, i, PQfnumber(res, "w_filename"));
-				const char *wa_filename = PQgetvalue(res, i, PQfnumber(res, "wa_filename"));
-				if (w_filename && strlen(w_filename)) {
-					gshkl_add_string(_post_sub, "image", w_filename);
-				} else if (wa_filename && strlen(wa_filename)) {
-					gshkl_add_string(_post_sub, "image", wa_filename);
-				} else {
-					gshkl_add_string(_post_sub, "image", NULL);
-				}
-
-				gshkl_add_sub_context_to_loop(&posts, _post_sub);
-
-				vector_free(dsrlzd->replied_to_keys);
-				free(dsrlzd->body_content);
+			post_row row;
+			post_row_get(&row, &cols, res, i);
+
+			greshunkel_ctext *_post_sub = gshkl_init_context();
+			gshkl_add_int(_post_sub, "date", row.fourchan_post_id);
+			gshkl_add_string(_post_sub, "board", row.board ? row.board : "");
+
+			if (row.body_content)
+				gshkl_add_string(_post_sub, "content", row.body_content);
+			else
+				gshkl_add_string(_post_sub, "content", "");
+
+			if (row.fourchan_post_no)
+				gshkl_add_int(_post_sub, "post_no", row.fourchan_post_no);
+			else
+				gshkl_add_string(_post_sub, "post_no", "");
+
+			const int64_t replies = pg_get_int(res, i, reply_count_col);
+			if (replies)
+				gshkl_add_int(_post_sub, "replies", replies);
+			else
+				gshkl_add_string(_post_sub, "replies", "");
+
+			const char *w_filename = pg_get_str(res, i, w_filename_col);
+			const char *wa_filename = pg_get_str(res, i, wa_filename_col);
+			if (w_filename && strlen(w_filename)) {
+				gshkl_add_string(_post_sub, "image", w_filename);
+			} else if (wa_filename && strlen(wa_filename)) {
+				gshkl_add_string(_post_sub, "image", wa_filename);
+			} else {
+				gshkl_add_string(_post_sub, "image", NULL);
 			}
 
-			free(dsrlzd);
+			gshkl_add_sub_context_to_loop(&posts, _post_sub);
 		}
 	}
 
@@ -642,7 +908,7 @@ int by_thread_handler(const m38_http_request *request, m38_http_response *respon
 
 	gshkl_add_int(ctext, "total", total_rows);
 
-	return m38_render_file(ctext, "./templates/by_thread.html", response);
+	return _render_file(ctext, "./templates/by_thread.html", response);
 }
 
 int by_alias_handler(const m38_http_request *request, m38_http_response *response) {
@@ -678,16 +944,155 @@ int by_alias_handler(const m38_http_request *request, m38_http_response *respons
 	_add_files_in_dir_to_arr(&boards, webm_location());
 
 	gshkl_add_int(ctext, "total", total);
-	return m38_render_file(ctext, "./templates/no_board.html", response);
+	return _render_file(ctext, "./templates/no_board.html", response);
+}
+
+/* Copies the cursor in match out. Returns -1 if it's too long to be one. */
+static int _get_cursor(const m38_http_request *request, const int match,
+		char cursor[static META_SNAPSHOT_CURSOR_SIZE]) {
+	const size_t len = request->matches[match].rm_eo - request->matches[match].rm_so;
+	if (len >= META_SNAPSHOT_CURSOR_SIZE)
+		return -1;
+
+	memcpy(cursor, request->resource + request->matches[match].rm_so, len);
+	cursor[len] = '\0';
+	return 0;
+}
+
+/* Pages are cursors rather than numbers, so a page costs the same however far
+ * back it is. */
+static int _newest_handler(const m38_http_request *request, m38_http_response *response, const char *cursor) {
+	UNUSED(request);
+	newest_hit *hits = calloc(RESULTS_PER_PAGE, sizeof(newest_hit));
+	if (!hits)
+		return 500;
+
+	const int found = meta_snapshot_newest(cursor, hits, RESULTS_PER_PAGE);
+	if (found < 0) {
+		free(hits);
+		return 404;
+	}
+
+	greshunkel_ctext *ctext = gshkl_init_context();
+	gshkl_add_filter(ctext, "thumbnail_for_image", thumbnail_for_image, gshkl_filter_cleanup);
+	greshunkel_var images = gshkl_add_array(ctext, "IMAGES");
+	int i;
+	for (i = 0; i < found; i++) {
+		greshunkel_ctext *_image_sub = gshkl_init_context();
+		gshkl_add_string(_image_sub, "filename", hits[i].filename);
+		gshkl_add_string(_image_sub, "board", hits[i].board);
+		gshkl_add_sub_context_to_loop(&images, _image_sub);
+	}
+
+	char next_cursor[META_SNAPSHOT_CURSOR_SIZE] = {0};
+	if (found == RESULTS_PER_PAGE)
+		meta_snapshot_cursor(&hits[found - 1], next_cursor);
+	gshkl_add_string(ctext, "next_cursor", next_cursor);
+	free(hits);
+
+	greshunkel_var boards = gshkl_add_array(ctext, "BOARDS");
+	_add_files_in_dir_to_arr(&boards, webm_location());
+
+	return _render_file(ctext, "./templates/newest.html", response);
+}
+
+int newest_handler(const m38_http_request *request, m38_http_response *response) {
+	return _newest_handler(request, response, NULL);
+}
+
+int paged_newest_handler(const m38_http_request *request, m38_http_response *response) {
+	char cursor[META_SNAPSHOT_CURSOR_SIZE] = {0};
+	if (_get_cursor(request, 1, cursor) != 0)
+		return 404;
+	return _newest_handler(request, response, cursor);
+}
+
+static int _newest_json_handler(const m38_http_request *request, m38_http_response *response, const char *cursor) {
+	UNUSED(request);
+	newest_hit *hits = calloc(RESULTS_PER_PAGE, sizeof(newest_hit));
+	if (!hits)
+		return 500;
+
+	const uint64_t started = trace_now_ns();
+	const int found = meta_snapshot_newest(cursor, hits, RESULTS_PER_PAGE);
+	if (found < 0) {
+		free(hits);
+		return _api_failure(response, gshkl_init_context(), "That isn't a cursor from here.");
+	}
+
+	JSON_Value *root_value = json_value_init_object();
+	JSON_Object *root_object = json_value_get_object(root_value);
+
+	JSON_Value *_data = json_value_init_object();
+	JSON_Object *data = json_value_get_object(_data);
+
+	JSON_Value *_results = json_value_init_array();
+	JSON_Array *results = json_value_get_array(_results);
+
+	int i;
+	for (i = 0; i < found; i++) {
+		JSON_Value *_result = json_value_init_object();
+		JSON_Object *result = json_value_get_object(_result);
+
+		char *thumbnail = thumbnail_for_image(hits[i].filename);
+		json_object_set_string(result, "filename", hits[i].filename);
+		json_object_set_string(result, "thumbnail", thumbnail);
+		json_object_set_string(result, "board", hits[i].board);
+		json_object_set_boolean(result, "is_alias", hits[i].is_alias);
+		json_object_set_number(result, "id", hits[i].id);
+		json_object_set_number(result, "created_at", hits[i].created_at);
+		free(thumbnail);
+
+		json_array_append_value(results, _result);
+	}
+
+	/* A short page is the last one. */
+	if (found == RESULTS_PER_PAGE) {
+		char next_cursor[META_SNAPSHOT_CURSOR_SIZE] = {0};
+		meta_snapshot_cursor(&hits[found - 1], next_cursor);
+		json_object_set_string(data, "next", next_cursor);
+	} else {
+		json_object_set_null(data, "next");
+	}
+	free(hits);
+
+	json_object_set_number(data, "took_ms", (trace_now_ns() - started) / 1.0e6);
+	json_object_set_value(data, "results", _results);
+
+	json_object_set_boolean(root_object, "success", 1);
+	json_object_set_null(root_object, "error");
+	json_object_set_value(root_object, "data", _data);
+
+	char *out = json_serialize_to_string(root_value);
+	json_value_free(root_value);
+
+	return m38_return_raw_buffer(out, strlen(out), response);
+}
+
+int newest_json_handler(const m38_http_request *request, m38_http_response *response) {
+	return _newest_json_handler(request, response, NULL);
+}
+
+int paged_newest_json_handler(const m38_http_request *request, m38_http_response *response) {
+	char cursor[META_SNAPSHOT_CURSOR_SIZE] = {0};
+	if (_get_cursor(request, 1, cursor) != 0)
+		return _api_failure(response, gshkl_init_context(), "That isn't a cursor from here.");
+	return _newest_json_handler(request, response, cursor);
 }
 
 int board_handler(const m38_http_request *request, m38_http_response *response) {
-	return _board_handler(request, response, 0);
+	return _board_handler(request, response, 0, NULL);
 }
 
 int paged_board_handler(const m38_http_request *request, m38_http_response *response) {
 	const unsigned int page = strtol(request->resource + request->matches[2].rm_so, NULL, 10);
-	return _board_handler(request, response, page);
+	return _board_handler(request, response, page, NULL);
+}
+
+int filtered_board_handler(const m38_http_request *request, m38_http_response *response) {
+	const char *filter = request->resource + request->matches[2].rm_so;
+	const unsigned int page = strtol(request->resource + request->matches[3].rm_so, NULL, 10);
+	return _board_handler(request, response, page, strncmp(filter, "long", strlen("long")) == 0 ? "long" : "audio");
 }
 
 int favicon_handler(const m38_http_request *request, m38_http_response *response) {
@@ -762,6 +1167,103 @@ int api_index_stats(const m38_http_request *request, m38_http_response *response
 	return m38_return_raw_buffer(out, strlen(out), response);
 }
 
+int metrics_handler(const m38_http_request *request, m38_http_response *response) {
+	UNUSED(request);
+
+	size_t len = 0;
+	char *out = metrics_render(&len);
+	if (!out)
+		return 500;
+
+	const int rc = m38_return_raw_buffer(out, len, response);
+	strncpy(response->mimetype, "text/plain; version=0.0.4", sizeof(response->mimetype) - 1);
+	return rc;
+}
+
+int admin_trace_handler(const m38_http_request *request, m38_http_response *response) {
+	UNUSED(request);
+	char *out = NULL;
+
+	JSON_Value *root_value = json_value_init_object();
+	JSON_Object *root_object = json_value_get_object(root_value);
+
+	JSON_Value *_spans = json_value_init_array();
+	JSON_Array *spans = json_value_get_array(_spans);
+
+	trace_histogram *hist = malloc(sizeof(trace_histogram));
+	unsigned int i;
+	for (i = 0; hist && i < trace_span_count(); i++) {
+		trace_merge_histogram(i, hist);
+
+		JSON_Value *_span = json_value_init_object();
+		JSON_Object *span = json_value_get_object(_span);
+
+		json_object_set_string(span, "name", trace_span_name(i));
+		json_object_set_number(span, "count", hist->count);
+		json_object_set_number(span, "sum_ns", hist->sum_ns);
+		json_object_set_number(span, "min_ns", hist->min_ns);
+		json_object_set_number(span, "max_ns", hist->max_ns);
+		json_object_set_number(span, "p50_ns", trace_histogram_percentile(hist, 50.0));
+		json_object_set_number(span, "p90_ns", trace_histogram_percentile(hist, 90.0));
+		json_object_set_number(span, "p99_ns", trace_histogram_percentile(hist, 99.0));
+		json_object_set_number(span, "p999_ns", trace_histogram_percentile(hist, 99.9));
+
+		/* Only the buckets with something in them, as [upper_ns, count]. */
+		JSON_Value *_buckets = json_value_init_array();
+		JSON_Array *buckets = json_value_get_array(_buckets);
+		unsigned int j;
+		for (j = 0; j < TRACE_HIST_BUCKETS; j++) {
+			if (hist->buckets[j] == 0)
+				continue;
+
+			JSON_Value *_bucket = json_value_init_array();
+			JSON_Array *bucket = json_value_get_array(_bucket);
+			json_array_append_number(bucket, trace_bucket_upper_ns(j));
+			json_array_append_number(bucket, hist->buckets[j]);
+			json_array_append_value(buckets, _bucket);
+		}
+		json_object_set_value(span, "buckets", _buckets);
+
+		json_array_append_value(spans, _span);
+	}
+	free(hist);
+
+	JSON_Value *_recent = json_value_init_array();
+	JSON_Array *recent = json_value_get_array(_recent);
+
+	const size_t max_records = TRACE_RING_SIZE * 64;
+	trace_record *records = calloc(max_records, sizeof(trace_record));
+	const size_t num_records = records ? trace_recent_spans(records, max_records) : 0;
+	size_t r;
+	for (r = 0; r < num_records; r++) {
+		const trace_record *record = &records[r];
+
+		JSON_Value *_record = json_value_init_object();
+		JSON_Object *obj = json_value_get_object(_record);
+
+		json_object_set_number(obj, "thread", record->thread);
+		json_object_set_string(obj, "name", trace_span_name(record->id));
+		if (record->parent_id == TRACE_NO_PARENT)
+			json_object_set_null(obj, "parent");
+		else
+			json_object_set_string(obj, "parent", trace_span_name(record->parent_id));
+		json_object_set_number(obj, "depth", record->depth);
+		json_object_set_number(obj, "start_ns", record->start_ns);
+		json_object_set_number(obj, "duration_ns", record->duration_ns);
+
+		json_array_append_value(recent, _record);
+	}
+	free(records);
+
+	json_object_set_value(root_object, "spans", _spans);
+	json_object_set_value(root_object, "recent", _recent);
+
+	out = json_serialize_to_string(root_value);
+	json_value_free(root_value);
+
+	return m38_return_raw_buffer(out, strlen(out), response);
+}
+
 int admin_index_handler(const m38_http_request *request, m38_http_response *response) {
 	UNUSED(request);
 	greshunkel_ctext *ctext = gshkl_init_context();
@@ -771,5 +1273,5 @@ int admin_index_handler(const m38_http_request *request, m38_http_response *resp
 
 	greshunkel_var boards = gshkl_add_array(ctext, "BOARDS");
 	_add_files_in_dir_to_arr(&boards, webm_location());
-	return m38_render_file(ctext, "./templates/admin/index.html", response);
+	return _render_file(ctext, "./templates/admin/index.html", response);
 }
@@ -0,0 +1,1063 @@
+// vim: noet ts=4 sw=4
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "async_log.h"
+#include "db.h"
+#include "text_index.h"
+#include "utils.h"
+
+typedef struct __attribute__((__packed__)) _saved_header {
+	char magic[sizeof(TEXT_INDEX_MAGIC) - 1];
+	/* The segment's number. The base has the last one merged into it. */
+	uint64_t generation;
+	/* Highest post ID in here or anything older. */
+	uint64_t watermark;
+	uint64_t posts;
+	uint64_t terms;
+	uint64_t gaps;
+} _saved_header;
+
+typedef struct __attribute__((__packed__)) _saved_term {
+	char term[TEXT_INDEX_MAX_TERM];
+	/* From the start of the postings. */
+	uint64_t offset;
+	uint32_t bytes;
+	uint32_t posts;
+	uint32_t last_post;
+} _saved_term;
+
+typedef struct _mapping {
+	void *base;
+	size_t size;
+	const _saved_header *header;
+	const _saved_term *terms;
+	const uint32_t *gaps;
+	const unsigned char *postings;
+	/* What was mapped, so we know when it's been replaced. */
+	ino_t ino;
+	time_t mtime;
+} _mapping;
+
+/* The base, if there is one, then the segments oldest first. */
+typedef struct _index {
+	_mapping *segments;
+	size_t count;
+	int has_base;
+	/* The newest segment's, 0 if there's nothing. */
+	uint64_t generation;
+	uint64_t watermark;
+	uint64_t posts;
+} _index;
+
+/* Postings for one term that haven't been written out yet. */
+typedef struct _pending_term {
+	char term[TEXT_INDEX_MAX_TERM];
+	uint32_t posts;
+	uint32_t first_post;
+	uint32_t last_post;
+	/* Encoded just like the file. */
+	unsigned char *buf;
+	size_t len;
+	size_t cap;
+} _pending_term;
+
+typedef struct _pending {
+	_pending_term *slots;
+	/* Always a power of two. */
+	size_t cap;
+	size_t used;
+	uint64_t posts;
+} _pending;
+
+/* Where an update is up to: the highest post it has, and the IDs under that
+ * it skipped over, ascending. */
+typedef struct _progress {
+	uint64_t watermark;
+	uint32_t *gaps;
+	size_t count;
+} _progress;
+
+/* What the server searches. */
+static _index _current = {0};
+static pthread_rwlock_t _current_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* The base for generation 0, otherwise that segment. */
+static void _path(const uint64_t generation, char out[static MAX_IMAGE_FILENAME_SIZE]) {
+	if (generation == 0)
+		snprintf(out, MAX_IMAGE_FILENAME_SIZE, "%s/%s", webm_location(), TEXT_INDEX_FILE);
+	else
+		snprintf(out, MAX_IMAGE_FILENAME_SIZE, "%s/%s.%"PRIu64, webm_location(), TEXT_INDEX_FILE, generation);
+}
+
+/* Tokenizing */
+
+static int _is_term_char(const unsigned char c) {
+	/* Anything past ASCII is part of some UTF-8 word or another. */
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+const char *text_next_term(const char *text, char term[static TEXT_INDEX_MAX_TERM]) {
+	const char *cursor = text;
+	while (cursor && *cursor) {
+		if (*cursor == '<') {
+			const char *end = strchr(cursor, '>');
+			cursor = end ? end + 1 : cursor + strlen(cursor);
+			continue;
+		}
+		if (*cursor == '&') {
+			/* &gt;, &#039; and so on. A lone & is just punctuation. */
+			const size_t len = strspn(cursor + 1, "#abcdefghijklmnopqrstuvwxyz0123456789");
+			cursor += len > 0 && len < 8 && cursor[len + 1] == ';' ? len + 2 : 1;
+			continue;
+		}
+		if (!_is_term_char(*cursor)) {
+			cursor++;
+			continue;
+		}
+
+		size_t len = 0;
+		int digits_only = 1;
+		while (_is_term_char(*cursor) || strncmp(cursor, "<wbr>", strlen("<wbr>")) == 0) {
+			/* 4chan breaks up long words (links, mostly) with these. */
+			if (*cursor == '<') {
+				cursor += strlen("<wbr>");
+				continue;
+			}
+			unsigned char c = *cursor++;
+			if (c >= 'A' && c <= 'Z')
+				c += 'a' - 'A';
+			if (c < '0' || c > '9')
+				digits_only = 0;
+			if (len < TEXT_INDEX_MAX_TERM - 1)
+				term[len++] = c;
+		}
+		memset(term + len, 0, TEXT_INDEX_MAX_TERM - len);
+
+		/* Post numbers, mostly, and single letters. */
+		if (digits_only || len < 2)
+			continue;
+		return cursor;
+	}
+
+	return NULL;
+}
+
+/* Encoding */
+
+static size_t _varint_put(unsigned char *out, uint32_t value) {
+	size_t len = 0;
+	while (value >= 0x80) {
+		out[len++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	out[len++] = value;
+	return len;
+}
+
+static const unsigned char *_varint_get(const unsigned char *p, const unsigned char *end, uint32_t *value) {
+	uint32_t v = 0;
+	int shift = 0;
+	while (p < end && shift < 35) {
+		const unsigned char c = *p++;
+		v |= (uint32_t)(c & 0x7F) << shift;
+		if (!(c & 0x80)) {
+			*value = v;
+			return p;
+		}
+		shift += 7;
+	}
+	return NULL;
+}
+
+/* Mapping */
+
+static void _unmap(_mapping *mapping) {
+	if (mapping->base)
+		munmap(mapping->base, mapping->size);
+	memset(mapping, 0, sizeof(*mapping));
+}
+
+/* Returns 0 if there's a usable index at path in mapping now. */
+static int _map(const char *path, _mapping *mapping) {
+	memset(mapping, 0, sizeof(*mapping));
+
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	struct stat st = {0};
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(_saved_header)) {
+		close(fd);
+		return -1;
+	}
+
+	void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return -1;
+
+	const _saved_header *header = base;
+	const size_t terms_end = sizeof(_saved_header) + header->terms * sizeof(_saved_term);
+	const size_t gaps_end = terms_end + header->gaps * sizeof(uint32_t);
+	if (memcmp(header->magic, TEXT_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+			header->terms > st.st_size / sizeof(_saved_term) || header->gaps > st.st_size / sizeof(uint32_t) ||
+			gaps_end > (size_t)st.st_size) {
+		log_msg(LOG_WARN, "%s isn't a text index.", path);
+		munmap(base, st.st_size);
+		return -1;
+	}
+
+	mapping->base = base;
+	mapping->size = st.st_size;
+	mapping->header = header;
+	mapping->terms = (const _saved_term *)((const char *)base + sizeof(_saved_header));
+	mapping->gaps = (const uint32_t *)((const char *)base + terms_end);
+	mapping->postings = (const unsigned char *)base + gaps_end;
+	mapping->ino = st.st_ino;
+	mapping->mtime = st.st_mtime;
+	return 0;
+}
+
+static const _saved_term *_find_term(const _mapping *mapping, const char term[static TEXT_INDEX_MAX_TERM]) {
+	size_t lo = 0, hi = mapping->header ? mapping->header->terms : 0;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		const int cmp = memcmp(mapping->terms[mid].term, term, TEXT_INDEX_MAX_TERM);
+		if (cmp == 0)
+			return &mapping->terms[mid];
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+static int _postings_ok(const _mapping *mapping, const _saved_term *entry) {
+	const size_t available = mapping->size - (mapping->postings - (const unsigned char *)mapping->base);
+	return entry->offset <= available && entry->bytes <= available - entry->offset;
+}
+
+static void _index_unload(_index *index) {
+	size_t i;
+	for (i = 0; i < index->count; i++)
+		_unmap(&index->segments[i]);
+	free(index->segments);
+	memset(index, 0, sizeof(*index));
+}
+
+/* Maps the base and every segment after it. Returns 0 unless something went
+ * wrong, not having an index yet is fine. */
+static int _index_load(_index *index) {
+	memset(index, 0, sizeof(*index));
+
+	size_t cap = 0;
+	uint64_t next = 0;
+	while (1) {
+		char path[MAX_IMAGE_FILENAME_SIZE] = {0};
+		_path(next, path);
+
+		_mapping mapping = {0};
+		if (_map(path, &mapping) != 0) {
+			/* Nothing's been merged yet. */
+			if (next == 0) {
+				next = 1;
+				continue;
+			}
+			break;
+		}
+		if (next > 0 && mapping.header->generation != next) {
+			log_msg(LOG_WARN, "%s is out of place, ignoring it and anything after it.", path);
+			_unmap(&mapping);
+			break;
+		}
+
+		if (index->count == cap) {
+			cap = cap ? cap * 2 : 4;
+			_mapping *segments = realloc(index->segments, cap * sizeof(_mapping));
+			if (!segments) {
+				_unmap(&mapping);
+				_index_unload(index);
+				return -1;
+			}
+			index->segments = segments;
+		}
+		index->segments[index->count++] = mapping;
+		index->has_base |= next == 0;
+		index->generation = mapping.header->generation;
+		if (mapping.header->watermark > index->watermark)
+			index->watermark = mapping.header->watermark;
+		index->posts += mapping.header->posts;
+		next = index->generation + 1;
+	}
+
+	return 0;
+}
+
+/* Building */
+
+static uint64_t _term_hash(const char term[static TEXT_INDEX_MAX_TERM]) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+	for (i = 0; i < TEXT_INDEX_MAX_TERM && term[i]; i++)
+		hash = (hash ^ (unsigned char)term[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+static void _pending_free(_pending *pending) {
+	size_t i;
+	for (i = 0; i < pending->cap; i++)
+		free(pending->slots[i].buf);
+	free(pending->slots);
+	memset(pending, 0, sizeof(*pending));
+}
+
+static _pending_term *_pending_get(_pending *pending, const char term[static TEXT_INDEX_MAX_TERM]) {
+	if ((pending->used + 1) * 4 > pending->cap * 3) {
+		const size_t cap = pending->cap ? pending->cap * 2 : 4096;
+		_pending_term *slots = calloc(cap, sizeof(_pending_term));
+		if (!slots)
+			return NULL;
+
+		size_t i;
+		for (i = 0; i < pending->cap; i++) {
+			if (!pending->slots[i].buf)
+				continue;
+			size_t j = _term_hash(pending->slots[i].term) & (cap - 1);
+			while (slots[j].buf)
+				j = (j + 1) & (cap - 1);
+			slots[j] = pending->slots[i];
+		}
+		free(pending->slots);
+		pending->slots = slots;
+		pending->cap = cap;
+	}
+
+	size_t i = _term_hash(term) & (pending->cap - 1);
+	while (pending->slots[i].buf) {
+		if (memcmp(pending->slots[i].term, term, TEXT_INDEX_MAX_TERM) == 0)
+			return &pending->slots[i];
+		i = (i + 1) & (pending->cap - 1);
+	}
+
+	_pending_term *slot = &pending->slots[i];
+	slot->cap = 16;
+	slot->buf = malloc(slot->cap);
+	if (!slot->buf)
+		return NULL;
+	memcpy(slot->term, term, TEXT_INDEX_MAX_TERM);
+	pending->used++;
+	return slot;
+}
+
+static int _term_cmp(const void *a, const void *b) {
+	return memcmp(a, b, TEXT_INDEX_MAX_TERM);
+}
+
+static int _pending_add(_pending *pending, const uint32_t post_id, const char *body_content) {
+	/* Counted by sorting, posts aren't long enough for anything fancier. */
+	size_t count = 0, cap = 64;
+	char (*terms)[TEXT_INDEX_MAX_TERM] = malloc(cap * TEXT_INDEX_MAX_TERM);
+	if (!terms)
+		return -1;
+
+	char term[TEXT_INDEX_MAX_TERM] = {0};
+	const char *cursor = body_content;
+	while ((cursor = text_next_term(cursor, term)) != NULL) {
+		if (count == cap) {
+			void *grown = realloc(terms, cap * 2 * TEXT_INDEX_MAX_TERM);
+			if (!grown)
+				goto error;
+			terms = grown;
+			cap *= 2;
+		}
+		memcpy(terms[count++], term, TEXT_INDEX_MAX_TERM);
+	}
+	qsort(terms, count, TEXT_INDEX_MAX_TERM, _term_cmp);
+
+	size_t i = 0;
+	while (i < count) {
+		size_t j = i + 1;
+		while (j < count && memcmp(terms[i], terms[j], TEXT_INDEX_MAX_TERM) == 0)
+			j++;
+
+		_pending_term *pt = _pending_get(pending, terms[i]);
+		if (!pt)
+			goto error;
+		if (pt->len + 10 > pt->cap) {
+			void *grown = realloc(pt->buf, pt->cap * 2);
+			if (!grown)
+				goto error;
+			pt->buf = grown;
+			pt->cap *= 2;
+		}
+		if (!pt->posts)
+			pt->first_post = post_id;
+		pt->len += _varint_put(pt->buf + pt->len, post_id - pt->last_post);
+		pt->len += _varint_put(pt->buf + pt->len, j - i);
+		pt->last_post = post_id;
+		pt->posts++;
+		i = j;
+	}
+
+	free(terms);
+	pending->posts++;
+	return 0;
+
+error:
+	free(terms);
+	return -1;
+}
+
+static int _pending_term_cmp(const void *a, const void *b) {
+	const _pending_term *const *x = a, *const *y = b;
+	return memcmp((*x)->term, (*y)->term, TEXT_INDEX_MAX_TERM);
+}
+
+/* One of the things _write() merges: a segment, or postings still in memory.
+ * Either way the terms are sorted and each list starts from post 0. */
+typedef struct _source {
+	const _mapping *mapping;
+	_pending_term **pending;
+	size_t count;
+	size_t at;
+} _source;
+
+typedef struct _posting {
+	uint32_t post_id;
+	uint32_t tf;
+} _posting;
+
+/* Scratch space for one term that more than one source has. */
+typedef struct _merge_buf {
+	_posting *postings;
+	size_t count;
+	size_t cap;
+	unsigned char *bytes;
+	size_t bytes_cap;
+} _merge_buf;
+
+/* The term src is up to, NULL once it's out of them. */
+static const char *_source_term(const _source *src) {
+	if (src->at >= src->count)
+		return NULL;
+	return src->mapping ? src->mapping->terms[src->at].term : src->pending[src->at]->term;
+}
+
+static int _source_has(const _source *src, const char term[static TEXT_INDEX_MAX_TERM]) {
+	const char *current = _source_term(src);
+	return current && memcmp(current, term, TEXT_INDEX_MAX_TERM) == 0;
+}
+
+/* The smallest term any of them are up to, NULL once they're all done. */
+static const char *_next_term(const _source *sources, const size_t num_sources) {
+	const char *next = NULL;
+	size_t i;
+	for (i = 0; i < num_sources; i++) {
+		const char *term = _source_term(&sources[i]);
+		if (term && (!next || memcmp(term, next, TEXT_INDEX_MAX_TERM) < 0))
+			next = term;
+	}
+	return next;
+}
+
+/* The postings for the term src is up to, as they'd go in the file. */
+static int _source_postings(const _source *src, _saved_term *out, const unsigned char **buf) {
+	if (src->mapping) {
+		const _saved_term *entry = &src->mapping->terms[src->at];
+		if (!_postings_ok(src->mapping, entry))
+			return -1;
+		*out = *entry;
+		*buf = src->mapping->postings + entry->offset;
+		return 0;
+	}
+
+	const _pending_term *pt = src->pending[src->at];
+	out->bytes = pt->len;
+	out->posts = pt->posts;
+	out->last_post = pt->last_post;
+	*buf = pt->buf;
+	return 0;
+}
+
+static int _by_post_id(const void *a, const void *b) {
+	const _posting *x = a, *y = b;
+	return x->post_id < y->post_id ? -1 : x->post_id > y->post_id;
+}
+
+static int _merge_decode(_merge_buf *mb, const unsigned char *p, const size_t len) {
+	const unsigned char *end = p + len;
+	uint32_t post_id = 0;
+	while (p < end) {
+		uint32_t gap = 0, tf = 0;
+		p = _varint_get(p, end, &gap);
+		if (p)
+			p = _varint_get(p, end, &tf);
+		if (!p)
+			return -1;
+		post_id += gap;
+
+		if (mb->count == mb->cap) {
+			const size_t cap = mb->cap ? mb->cap * 2 : 1024;
+			_posting *grown = realloc(mb->postings, cap * sizeof(_posting));
+			if (!grown)
+				return -1;
+			mb->postings = grown;
+			mb->cap = cap;
+		}
+		mb->postings[mb->count++] = (_posting){ .post_id = post_id, .tf = tf };
+	}
+	return 0;
+}
+
+/* Sorts what's been decoded back into one list, into mb->bytes. */
+static int _merge_encode(_merge_buf *mb, _saved_term *entry) {
+	if (mb->count * 10 > mb->bytes_cap) {
+		unsigned char *grown = realloc(mb->bytes, mb->count * 10);
+		if (!grown)
+			return -1;
+		mb->bytes = grown;
+		mb->bytes_cap = mb->count * 10;
+	}
+	qsort(mb->postings, mb->count, sizeof(_posting), _by_post_id);
+
+	size_t len = 0, i;
+	uint32_t last_post = 0, posts = 0;
+	for (i = 0; i < mb->count; i++) {
+		if (posts > 0 && mb->postings[i].post_id == last_post)
+			continue;
+		len += _varint_put(mb->bytes + len, mb->postings[i].post_id - last_post);
+		len += _varint_put(mb->bytes + len, mb->postings[i].tf);
+		last_post = mb->postings[i].post_id;
+		posts++;
+	}
+
+	entry->bytes = len;
+	entry->posts = posts;
+	entry->last_post = last_post;
+	return 0;
+}
+
+/* Merges sources into a new file at path. header needs everything but the
+ * magic and the term count. */
+static int _write(const char *path, _source *sources, const size_t num_sources, _saved_header header,
+		const uint32_t *gaps) {
+	char tmp_path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	int ok = 0;
+	FILE *f = NULL;
+	_saved_term *terms = NULL;
+	_merge_buf mb = {0};
+
+	/* First how many terms there'll be, so we know where the postings go. */
+	uint64_t nterms = 0;
+	size_t i;
+	const char *next = NULL;
+	while ((next = _next_term(sources, num_sources)) != NULL) {
+		char term[TEXT_INDEX_MAX_TERM];
+		memcpy(term, next, TEXT_INDEX_MAX_TERM);
+		for (i = 0; i < num_sources; i++) {
+			if (_source_has(&sources[i], term))
+				sources[i].at++;
+		}
+		nterms++;
+	}
+	for (i = 0; i < num_sources; i++)
+		sources[i].at = 0;
+
+	terms = calloc(nterms + 1, sizeof(_saved_term));
+	f = fopen(tmp_path, "wb");
+	if (!terms || !f)
+		goto end;
+
+	/* Then the postings, leaving room for the table and gaps in front. */
+	const long postings_at = sizeof(_saved_header) + nterms * sizeof(_saved_term) +
+		header.gaps * sizeof(uint32_t);
+	if (fseek(f, postings_at, SEEK_SET) != 0)
+		goto end;
+
+	uint64_t t = 0, offset = 0;
+	while ((next = _next_term(sources, num_sources)) != NULL) {
+		_saved_term *entry = &terms[t++];
+		memcpy(entry->term, next, TEXT_INDEX_MAX_TERM);
+
+		size_t having = 0;
+		for (i = 0; i < num_sources; i++)
+			having += _source_has(&sources[i], entry->term);
+
+		/* Posts can turn up out of order, so lists from more than one
+		 * source get decoded and sorted back together. */
+		const unsigned char *buf = NULL;
+		mb.count = 0;
+		for (i = 0; i < num_sources; i++) {
+			if (!_source_has(&sources[i], entry->term))
+				continue;
+			if (_source_postings(&sources[i], entry, &buf) != 0)
+				goto end;
+			sources[i].at++;
+			if (having > 1 && _merge_decode(&mb, buf, entry->bytes) != 0)
+				goto end;
+		}
+		if (having > 1) {
+			if (_merge_encode(&mb, entry) != 0)
+				goto end;
+			buf = mb.bytes;
+		}
+		entry->offset = offset;
+		offset += entry->bytes;
+		if (entry->bytes > 0 && fwrite(buf, entry->bytes, 1, f) != 1)
+			goto end;
+	}
+
+	header.terms = nterms;
+	memcpy(header.magic, TEXT_INDEX_MAGIC, sizeof(header.magic));
+	ok = fseek(f, 0, SEEK_SET) == 0 &&
+		fwrite(&header, sizeof(header), 1, f) == 1 &&
+		(nterms == 0 || fwrite(terms, sizeof(_saved_term), nterms, f) == nterms) &&
+		(header.gaps == 0 || fwrite(gaps, sizeof(uint32_t), header.gaps, f) == header.gaps);
+
+end:
+	if (f && fclose(f) != 0)
+		ok = 0;
+	if (f && (!ok || rename(tmp_path, path) != 0)) {
+		ok = 0;
+		unlink(tmp_path);
+	}
+	if (!ok)
+		log_msg(LOG_WARN, "Could not write the text index to %s.", path);
+	free(terms);
+	free(mb.postings);
+	free(mb.bytes);
+	return ok ? 0 : -1;
+}
+
+/* Writes pending out as the next segment, and merges every segment into the
+ * base if that makes too many. index gets reloaded either way. */
+static int _flush(_index *index, const _pending *pending, const _progress *progress) {
+	_pending_term **sorted = calloc(pending->used + 1, sizeof(_pending_term *));
+	if (!sorted)
+		return -1;
+
+	size_t i, n = 0;
+	for (i = 0; i < pending->cap; i++) {
+		if (pending->slots[i].buf)
+			sorted[n++] = &pending->slots[i];
+	}
+	qsort(sorted, n, sizeof(_pending_term *), _pending_term_cmp);
+
+	char path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	_path(index->generation + 1, path);
+	_source fresh = { .pending = sorted, .count = n };
+	_saved_header header = {
+		.generation = index->generation + 1,
+		.watermark = progress->watermark,
+		.posts = pending->posts,
+		.gaps = progress->count
+	};
+	const int written = _write(path, &fresh, 1, header, progress->gaps);
+	free(sorted);
+	if (written != 0)
+		return -1;
+
+	const uint64_t merged_before = index->has_base ? index->segments[0].header->generation : 0;
+	_index_unload(index);
+	if (_index_load(index) != 0)
+		return -1;
+	if (index->count - index->has_base <= TEXT_INDEX_MAX_SEGMENTS)
+		return 0;
+
+	/* Everything into the base. If that doesn't work the segments are all
+	 * still there, and the next flush tries again. */
+	_source *sources = calloc(index->count, sizeof(_source));
+	if (!sources)
+		return -1;
+	for (i = 0; i < index->count; i++)
+		sources[i] = (_source){ .mapping = &index->segments[i], .count = index->segments[i].header->terms };
+
+	const _mapping *newest = &index->segments[index->count - 1];
+	header = (_saved_header){
+		.generation = index->generation,
+		.watermark = index->watermark,
+		.posts = index->posts,
+		.gaps = newest->header->gaps
+	};
+	_path(0, path);
+	const int merged = _write(path, sources, index->count, header, newest->gaps);
+	free(sources);
+	if (merged != 0)
+		return -1;
+
+	/* Anything at or under the base's generation gets ignored already. */
+	const uint64_t generation = index->generation;
+	_index_unload(index);
+	uint64_t g;
+	for (g = merged_before + 1; g <= generation; g++) {
+		_path(g, path);
+		unlink(path);
+	}
+	log_msg(LOG_INFO, "Merged %"PRIu64" text index segments.", generation - merged_before);
+	return _index_load(index);
+}
+
+/* Picks up where the newest segment left off. */
+static int _progress_load(_progress *progress, const _index *index) {
+	memset(progress, 0, sizeof(*progress));
+	progress->watermark = index->watermark;
+	progress->gaps = malloc(TEXT_INDEX_MAX_GAPS * sizeof(uint32_t));
+	if (!progress->gaps)
+		return -1;
+
+	if (index->count > 0) {
+		const _mapping *newest = &index->segments[index->count - 1];
+		const uint64_t gaps = newest->header->gaps;
+		progress->count = gaps < TEXT_INDEX_MAX_GAPS ? gaps : TEXT_INDEX_MAX_GAPS;
+		memcpy(progress->gaps, newest->gaps + (gaps - progress->count), progress->count * sizeof(uint32_t));
+	}
+	return 0;
+}
+
+static void _progress_free(_progress *progress) {
+	free(progress->gaps);
+	memset(progress, 0, sizeof(*progress));
+}
+
+/* Remembers an ID we went past, forgetting the oldest if there are too many. */
+static void _progress_skip(_progress *progress, const uint32_t post_id) {
+	if (progress->count == TEXT_INDEX_MAX_GAPS) {
+		memmove(progress->gaps, progress->gaps + 1, (progress->count - 1) * sizeof(uint32_t));
+		progress->count--;
+	}
+	progress->gaps[progress->count++] = post_id;
+}
+
+/* Forgets post_id if we were waiting on it. Returns 1 if we were. */
+static int _progress_found(_progress *progress, const uint32_t post_id) {
+	size_t lo = 0, hi = progress->count;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (progress->gaps[mid] == post_id) {
+			memmove(progress->gaps + mid, progress->gaps + mid + 1, (progress->count - mid - 1) * sizeof(uint32_t));
+			progress->count--;
+			return 1;
+		}
+		if (progress->gaps[mid] < post_id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return 0;
+}
+
+/* Rows of (id, body_content) in ID order. Takes anything past the watermark
+ * and anything we went past before, and leaves the last ID in cursor. */
+static int _pending_add_rows(_pending *pending, const PGresult *res, _progress *progress, uint64_t *cursor) {
+	const int rows = PQntuples(res);
+	int i;
+	for (i = 0; i < rows; i++) {
+		const uint32_t post_id = strtoul(PQgetvalue(res, i, 0), NULL, 10);
+		*cursor = post_id;
+		if (post_id > progress->watermark) {
+			uint64_t skipped = progress->watermark + 1;
+			if (post_id > TEXT_INDEX_MAX_GAPS && skipped < post_id - TEXT_INDEX_MAX_GAPS)
+				skipped = post_id - TEXT_INDEX_MAX_GAPS;
+			for (; skipped < post_id; skipped++)
+				_progress_skip(progress, skipped);
+			progress->watermark = post_id;
+		} else if (!_progress_found(progress, post_id)) {
+			continue;
+		}
+
+		if (_pending_add(pending, post_id, PQgetvalue(res, i, 1)) != 0)
+			return -1;
+	}
+
+	/* Anything this far back was rolled back or deleted. */
+	size_t stale = 0;
+	while (stale < progress->count && progress->gaps[stale] + TEXT_INDEX_RESCAN < progress->watermark)
+		stale++;
+	memmove(progress->gaps, progress->gaps + stale, (progress->count - stale) * sizeof(uint32_t));
+	progress->count -= stale;
+	return 0;
+}
+
+int text_index_add_posts(const PGresult *res) {
+	_index index = {0};
+	_progress progress = {0};
+	_pending pending = {0};
+	uint64_t cursor = 0;
+
+	int rc = _index_load(&index) == 0 && _progress_load(&progress, &index) == 0 ? 0 : -1;
+	if (rc == 0)
+		rc = _pending_add_rows(&pending, res, &progress, &cursor);
+	if (rc == 0 && pending.posts > 0)
+		rc = _flush(&index, &pending, &progress);
+
+	_pending_free(&pending);
+	_progress_free(&progress);
+	_index_unload(&index);
+	return rc;
+}
+
+int text_index_update() {
+	_index index = {0};
+	_progress progress = {0};
+	if (_index_load(&index) != 0 || _progress_load(&progress, &index) != 0) {
+		_index_unload(&index);
+		return -1;
+	}
+	const uint64_t started_at = progress.watermark;
+
+	/* From just under the oldest post we're still waiting on. */
+	uint64_t cursor = progress.count > 0 ? progress.gaps[0] - 1 : progress.watermark;
+	_pending pending = {0};
+	int rc = 0;
+	while (1) {
+		PGresult *res = get_post_bodies_after(cursor, TEXT_INDEX_PAGE);
+		if (!res) {
+			rc = -1;
+			break;
+		}
+
+		const int rows = PQntuples(res);
+		rc = _pending_add_rows(&pending, res, &progress, &cursor);
+		PQclear(res);
+
+		/* Written out as we go so a first build doesn't hold the lot. */
+		const int done = rc != 0 || rows < TEXT_INDEX_PAGE;
+		if (pending.posts > 0 && (done || pending.posts >= TEXT_INDEX_FLUSH_POSTS)) {
+			if (rc != 0 || _flush(&index, &pending, &progress) != 0) {
+				rc = -1;
+				break;
+			}
+			_pending_free(&pending);
+		}
+		if (done)
+			break;
+	}
+
+	if (rc == 0 && progress.watermark > started_at)
+		log_msg(LOG_INFO, "Text index is up to post %"PRIu64", %zu segments.", progress.watermark, index.count);
+	_pending_free(&pending);
+	_progress_free(&progress);
+	_index_unload(&index);
+	return rc;
+}
+
+/* Searching */
+
+typedef struct _candidate {
+	uint32_t post_id;
+	float score;
+} _candidate;
+
+/* A query term's entry in one segment, and how many posts have it overall. */
+typedef struct _query_term {
+	const _saved_term *entry;
+	uint64_t posts;
+} _query_term;
+
+/* Roughly BM25 without the length part, posts are all short. */
+static float _term_score(const uint32_t tf, const uint64_t posts, const uint64_t total) {
+	const float idf = logf(1.0f + (total - posts + 0.5f) / (posts + 0.5f));
+	return idf * (tf * 2.2f) / (tf + 1.2f);
+}
+
+static int _by_posts(const void *a, const void *b) {
+	const _query_term *x = a, *y = b;
+	return x->entry->posts < y->entry->posts ? -1 : x->entry->posts > y->entry->posts;
+}
+
+/* Adds a segment's matches to the best found of them in out. Returns how
+ * many are in there now. */
+static size_t _search_segment(const _mapping *mapping, char (*query)[TEXT_INDEX_MAX_TERM],
+		const uint64_t *posts, const size_t nterms, const uint64_t total,
+		text_hit *out, const size_t max, size_t found) {
+	_query_term terms[TEXT_INDEX_MAX_QUERY_TERMS] = {{0}};
+	size_t t;
+	for (t = 0; t < nterms; t++) {
+		const _saved_term *entry = _find_term(mapping, query[t]);
+		if (!entry || !_postings_ok(mapping, entry))
+			return found;
+		terms[t] = (_query_term){ .entry = entry, .posts = posts[t] };
+	}
+
+	/* Rarest first, so there's as little as possible to intersect. */
+	qsort(terms, nterms, sizeof(terms[0]), _by_posts);
+
+	_candidate *candidates = malloc((terms[0].entry->posts + 1) * sizeof(_candidate));
+	if (!candidates)
+		return found;
+
+	size_t count = 0;
+	for (t = 0; t < nterms; t++) {
+		const _saved_term *entry = terms[t].entry;
+		const unsigned char *p = mapping->postings + entry->offset;
+		const unsigned char *end = p + entry->bytes;
+		uint32_t post_id = 0;
+		size_t kept = 0, c = 0;
+		while (p && p < end && (t == 0 || c < count)) {
+			uint32_t gap = 0, tf = 0;
+			p = _varint_get(p, end, &gap);
+			if (p)
+				p = _varint_get(p, end, &tf);
+			if (!p)
+				break;
+			post_id += gap;
+
+			const float score = _term_score(tf, terms[t].posts, total);
+			if (t == 0) {
+				if (count < entry->posts)
+					candidates[count++] = (_candidate){ .post_id = post_id, .score = score };
+				continue;
+			}
+
+			/* Both are in ID order. */
+			while (c < count && candidates[c].post_id < post_id)
+				c++;
+			if (c < count && candidates[c].post_id == post_id) {
+				candidates[kept] = candidates[c++];
+				candidates[kept++].score += score;
+			}
+		}
+		if (t > 0)
+			count = kept;
+	}
+
+	/* Best max of them, newest first on ties. */
+	size_t i;
+	for (i = 0; i < count; i++) {
+		const _candidate *cand = &candidates[i];
+		if (found == max && (cand->score < out[found - 1].score ||
+				(cand->score == out[found - 1].score && cand->post_id < out[found - 1].post_id)))
+			continue;
+
+		size_t j = found < max ? found++ : found - 1;
+		while (j > 0 && (out[j - 1].score < cand->score ||
+				(out[j - 1].score == cand->score && out[j - 1].post_id < cand->post_id))) {
+			out[j] = out[j - 1];
+			j--;
+		}
+		out[j] = (text_hit){ .post_id = cand->post_id, .score = cand->score };
+	}
+
+	free(candidates);
+	return found;
+}
+
+static size_t _search(const _index *index, const char *query, text_hit *out, const size_t max) {
+	char terms[TEXT_INDEX_MAX_QUERY_TERMS][TEXT_INDEX_MAX_TERM];
+	uint64_t posts[TEXT_INDEX_MAX_QUERY_TERMS] = {0};
+	size_t nterms = 0;
+
+	char term[TEXT_INDEX_MAX_TERM] = {0};
+	const char *cursor = query;
+	while (nterms < TEXT_INDEX_MAX_QUERY_TERMS && (cursor = text_next_term(cursor, term)) != NULL) {
+		size_t i;
+		for (i = 0; i < nterms && memcmp(terms[i], term, TEXT_INDEX_MAX_TERM) != 0; i++)
+			;
+		if (i == nterms)
+			memcpy(terms[nterms++], term, TEXT_INDEX_MAX_TERM);
+	}
+	if (nterms == 0)
+		return 0;
+
+	/* Scored against the whole index, not just the segment a post is in. */
+	size_t t, s;
+	for (t = 0; t < nterms; t++) {
+		for (s = 0; s < index->count; s++) {
+			const _saved_term *entry = _find_term(&index->segments[s], terms[t]);
+			if (entry && _postings_ok(&index->segments[s], entry))
+				posts[t] += entry->posts;
+		}
+		if (posts[t] == 0)
+			return 0;
+	}
+
+	size_t found = 0;
+	for (s = 0; s < index->count; s++)
+		found = _search_segment(&index->segments[s], terms, posts, nterms, index->posts, out, max, found);
+	return found;
+}
+
+/* Whether the downloader has written a segment or merged since _current was
+ * loaded. */
+static int _stale() {
+	char path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	_path(0, path);
+	struct stat st = {0};
+	const int have_base = stat(path, &st) == 0;
+
+	pthread_rwlock_rdlock(&_current_lock);
+	int stale = have_base != _current.has_base;
+	if (!stale && have_base) {
+		const _mapping *base = &_current.segments[0];
+		stale = base->ino != st.st_ino || base->mtime != st.st_mtime || base->size != (size_t)st.st_size;
+	}
+	const uint64_t next = _current.generation + 1;
+	pthread_rwlock_unlock(&_current_lock);
+
+	if (!stale) {
+		_path(next, path);
+		stale = stat(path, &st) == 0;
+	}
+	return stale;
+}
+
+/* Remaps if the downloader has written something new since. */
+static void _refresh() {
+	if (!_stale())
+		return;
+
+	_index fresh = {0};
+	if (_index_load(&fresh) != 0)
+		return;
+
+	pthread_rwlock_wrlock(&_current_lock);
+	_index_unload(&_current);
+	_current = fresh;
+	pthread_rwlock_unlock(&_current_lock);
+}
+
+size_t text_index_search(const char *query, text_hit *out, const size_t max) {
+	if (!query || max == 0)
+		return 0;
+
+	_refresh();
+
+	pthread_rwlock_rdlock(&_current_lock);
+	const size_t found = _current.count > 0 ? _search(&_current, query, out, max) : 0;
+	pthread_rwlock_unlock(&_current_lock);
+	return found;
+}
+
+void text_index_close() {
+	pthread_rwlock_wrlock(&_current_lock);
+	_index_unload(&_current);
+	pthread_rwlock_unlock(&_current_lock);
+}
+
+void text_index_remove() {
+	text_index_close();
+
+	_index index = {0};
+	if (_index_load(&index) != 0)
+		return;
+
+	size_t i;
+	for (i = 0; i < index.count; i++) {
+		char path[MAX_IMAGE_FILENAME_SIZE] = {0};
+		_path(i == 0 && index.has_base ? 0 : index.segments[i].header->generation, path);
+		unlink(path);
+	}
+	_index_unload(&index);
+}
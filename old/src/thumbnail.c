@@ -0,0 +1,336 @@
+// vim: noet ts=4 sw=4
+#ifdef __clang__
+	#pragma clang diagnostic ignored "-Wmissing-field-initializers"
+#endif
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+#include <libswscale/swscale.h>
+
+#include "async_log.h"
+#include "metrics.h"
+#include "thumbnail.h"
+#include "utils.h"
+
+typedef struct thumbnail_job {
+	char webm_file_path[MAX_IMAGE_FILENAME_SIZE];
+	char out_filepath[MAX_IMAGE_FILENAME_SIZE];
+} thumbnail_job;
+
+/* Ring buffer of pending jobs. _in_flight counts jobs that have been popped
+ * but not finished, so thumbnail_pool_drain() knows when we're really done. */
+static thumbnail_job _queue[THUMBNAIL_QUEUE_SIZE];
+static unsigned int _queue_head = 0;
+static unsigned int _queue_count = 0;
+static unsigned int _in_flight = 0;
+static pthread_mutex_t _queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _queue_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t _queue_idle = PTHREAD_COND_INITIALIZER;
+
+/* Pulls frames out of the decoder until we get one, feeding it packets from
+ * the video stream as needed. Returns 1 if frame was filled in. */
+static int _decode_first_frame(AVFormatContext *fmt_ctx, AVCodecContext *dec_ctx,
+		const int stream_idx, AVPacket *pkt, AVFrame *frame) {
+	while (av_read_frame(fmt_ctx, pkt) >= 0) {
+		if (pkt->stream_index != stream_idx) {
+			av_packet_unref(pkt);
+			continue;
+		}
+
+		int rc = avcodec_send_packet(dec_ctx, pkt);
+		av_packet_unref(pkt);
+		if (rc < 0)
+			return 0;
+
+		rc = avcodec_receive_frame(dec_ctx, frame);
+		if (rc == 0)
+			return 1;
+		if (rc != AVERROR(EAGAIN))
+			return 0;
+	}
+
+	/* Short file, whatever is buffered in the decoder is all we get. */
+	avcodec_send_packet(dec_ctx, NULL);
+	return avcodec_receive_frame(dec_ctx, frame) == 0;
+}
+
+static size_t _encode_jpeg(const AVFrame *frame, const char *out_filepath) {
+	const AVCodec *encoder = NULL;
+	AVCodecContext *enc_ctx = NULL;
+	struct SwsContext *sws_ctx = NULL;
+	AVFrame *scaled = NULL;
+	AVPacket *pkt = NULL;
+	FILE *out_file = NULL;
+	size_t written = 0;
+
+	/* Fit it in the box, keeping the aspect ratio. MJPEG wants even sizes. */
+	int width = frame->width, height = frame->height;
+	if (width > THUMBNAIL_MAX_DIMENSION || height > THUMBNAIL_MAX_DIMENSION) {
+		if (width >= height) {
+			height = (int)((int64_t)height * THUMBNAIL_MAX_DIMENSION / width);
+			width = THUMBNAIL_MAX_DIMENSION;
+		} else {
+			width = (int)((int64_t)width * THUMBNAIL_MAX_DIMENSION / height);
+			height = THUMBNAIL_MAX_DIMENSION;
+		}
+	}
+	width = width < 2 ? 2 : width & ~1;
+	height = height < 2 ? 2 : height & ~1;
+
+	encoder = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+	if (!encoder)
+		goto end;
+
+	enc_ctx = avcodec_alloc_context3(encoder);
+	if (!enc_ctx)
+		goto end;
+
+	enc_ctx->width = width;
+	enc_ctx->height = height;
+	enc_ctx->pix_fmt = AV_PIX_FMT_YUVJ420P;
+	enc_ctx->time_base = (AVRational){1, 25};
+	enc_ctx->flags |= AV_CODEC_FLAG_QSCALE;
+	enc_ctx->thread_count = 1;
+	if (avcodec_open2(enc_ctx, encoder, NULL) < 0)
+		goto end;
+
+	scaled = av_frame_alloc();
+	if (!scaled)
+		goto end;
+
+	scaled->format = enc_ctx->pix_fmt;
+	scaled->width = width;
+	scaled->height = height;
+	scaled->quality = FF_QP2LAMBDA * THUMBNAIL_QSCALE;
+	if (av_frame_get_buffer(scaled, 0) < 0)
+		goto end;
+
+	sws_ctx = sws_getContext(frame->width, frame->height, frame->format,
+			width, height, enc_ctx->pix_fmt, SWS_BILINEAR, NULL, NULL, NULL);
+	if (!sws_ctx)
+		goto end;
+
+	sws_scale(sws_ctx, (const uint8_t * const *)frame->data, frame->linesize, 0,
+			frame->height, scaled->data, scaled->linesize);
+
+	pkt = av_packet_alloc();
+	if (!pkt)
+		goto end;
+
+	if (avcodec_send_frame(enc_ctx, scaled) < 0 || avcodec_receive_packet(enc_ctx, pkt) < 0)
+		goto end;
+
+	/* Write somewhere else first so a half-written thumbnail never exists
+	 * under the real name, and a re-run doesn't think it's done. */
+	char tmp_filepath[MAX_IMAGE_FILENAME_SIZE + 8] = {0};
+	snprintf(tmp_filepath, sizeof(tmp_filepath), "%s.tmp", out_filepath);
+
+	out_file = fopen(tmp_filepath, "wb");
+	if (!out_file) {
+		log_msg(LOG_ERR, "Could not open thumbnail file: %s", tmp_filepath);
+		goto end;
+	}
+
+	if (fwrite(pkt->data, 1, pkt->size, out_file) != (size_t)pkt->size) {
+		fclose(out_file);
+		out_file = NULL;
+		unlink(tmp_filepath);
+		goto end;
+	}
+	fclose(out_file);
+	out_file = NULL;
+
+	if (rename(tmp_filepath, out_filepath) != 0) {
+		unlink(tmp_filepath);
+		goto end;
+	}
+
+	written = pkt->size;
+
+end:
+	av_packet_free(&pkt);
+	av_frame_free(&scaled);
+	sws_freeContext(sws_ctx);
+	avcodec_free_context(&enc_ctx);
+	return written;
+}
+
+size_t create_thumbnail_for_webm(const char webm_file_path[static MAX_IMAGE_FILENAME_SIZE], const char *out_filepath) {
+	AVFormatContext *fmt_ctx = NULL;
+	AVCodecContext *dec_ctx = NULL;
+	AVPacket *pkt = NULL;
+	AVFrame *frame = NULL;
+	size_t written = 0;
+
+	/* Already done. This is what makes re-running the crawler cheap. */
+	const size_t existing = get_file_size(out_filepath);
+	metrics_cache("thumbnail", existing > 0);
+	if (existing > 0)
+		return existing;
+
+	if (avformat_open_input(&fmt_ctx, webm_file_path, NULL, NULL) < 0) {
+		log_msg(LOG_ERR, "Could not open '%s' for thumbnailing.", webm_file_path);
+		goto end;
+	}
+
+	/* Matroska headers tell us everything about the track, so we skip
+	 * avformat_find_stream_info() and the decoding it would do. */
+	const AVCodec *decoder = NULL;
+	const int stream_idx = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
+	if (stream_idx < 0 || !decoder) {
+		log_msg(LOG_WARN, "No video stream in '%s'.", webm_file_path);
+		goto end;
+	}
+
+	dec_ctx = avcodec_alloc_context3(decoder);
+	if (!dec_ctx)
+		goto end;
+
+	if (avcodec_parameters_to_context(dec_ctx, fmt_ctx->streams[stream_idx]->codecpar) < 0)
+		goto end;
+
+	/* Parallelism comes from the pool, not from inside a single decode. */
+	dec_ctx->thread_count = 1;
+	if (avcodec_open2(dec_ctx, decoder, NULL) < 0)
+		goto end;
+
+	pkt = av_packet_alloc();
+	frame = av_frame_alloc();
+	if (!pkt || !frame)
+		goto end;
+
+	if (!_decode_first_frame(fmt_ctx, dec_ctx, stream_idx, pkt, frame)) {
+		log_msg(LOG_WARN, "Could not decode a frame from '%s'.", webm_file_path);
+		goto end;
+	}
+
+	written = _encode_jpeg(frame, out_filepath);
+	if (!written)
+		log_msg(LOG_ERR, "Could not write thumbnail '%s'.", out_filepath);
+
+end:
+	av_frame_free(&frame);
+	av_packet_free(&pkt);
+	avcodec_free_context(&dec_ctx);
+	avformat_close_input(&fmt_ctx);
+	return written;
+}
+
+void get_thumb_path_for_webm(const char *webm_file_path, char out[static MAX_IMAGE_FILENAME_SIZE]) {
+	const char *slash = strrchr(webm_file_path, '/');
+	const char *base = slash ? slash + 1 : webm_file_path;
+	const int dir_len = slash ? (int)(slash - webm_file_path) : 1;
+	const char *dir = slash ? webm_file_path : ".";
+
+	/* Strip the extension, we're replacing it with .jpg */
+	const char *ext = strrchr(base, '.');
+	const int base_len = ext ? (int)(ext - base) : (int)strlen(base);
+
+	char thumb_dir[MAX_IMAGE_FILENAME_SIZE] = {0};
+	snprintf(thumb_dir, sizeof(thumb_dir), "%.*s/t", dir_len, dir);
+
+	struct stat st = {0};
+	if (stat(thumb_dir, &st) == -1) {
+		log_msg(LOG_WARN, "Creating thumb directory %s.", thumb_dir);
+		mkdir(thumb_dir, 0755);
+	}
+
+	snprintf(out, MAX_IMAGE_FILENAME_SIZE, "%s/thumb_%.*s.jpg", thumb_dir, base_len, base);
+}
+
+unsigned int thumbnail_default_threads() {
+	const char *env_var = getenv("WFU_THUMB_THREADS");
+	if (env_var) {
+		const long requested = strtol(env_var, NULL, 10);
+		if (requested > 0)
+			return requested;
+	}
+
+	/* Leave half the machine for everything else. */
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN) / 2;
+	if (cpus < 1)
+		cpus = 1;
+	if (cpus > THUMBNAIL_MAX_THREADS)
+		cpus = THUMBNAIL_MAX_THREADS;
+
+	return cpus;
+}
+
+int thumbnail_enqueue(const char *webm_file_path, const char *out_filepath) {
+	pthread_mutex_lock(&_queue_lock);
+	if (_queue_count == THUMBNAIL_QUEUE_SIZE) {
+		pthread_mutex_unlock(&_queue_lock);
+		return -1;
+	}
+
+	thumbnail_job *job = &_queue[(_queue_head + _queue_count) % THUMBNAIL_QUEUE_SIZE];
+	memset(job, 0, sizeof(thumbnail_job));
+	strncpy(job->webm_file_path, webm_file_path, sizeof(job->webm_file_path) - 1);
+	strncpy(job->out_filepath, out_filepath, sizeof(job->out_filepath) - 1);
+	_queue_count++;
+
+	pthread_cond_signal(&_queue_not_empty);
+	pthread_mutex_unlock(&_queue_lock);
+	return 0;
+}
+
+void thumbnail_pool_drain() {
+	pthread_mutex_lock(&_queue_lock);
+	while (_queue_count > 0 || _in_flight > 0)
+		pthread_cond_wait(&_queue_idle, &_queue_lock);
+	pthread_mutex_unlock(&_queue_lock);
+}
+
+static void *_thumbnail_worker(void *arg) {
+	UNUSED(arg);
+
+	/* Linux lets us renice just this thread. */
+	if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), THUMBNAIL_NICENESS) != 0)
+		log_msg(LOG_WARN, "Could not lower thumbnail worker priority.");
+
+	while (1) {
+		pthread_mutex_lock(&_queue_lock);
+		while (_queue_count == 0)
+			pthread_cond_wait(&_queue_not_empty, &_queue_lock);
+
+		const thumbnail_job job = _queue[_queue_head];
+		_queue_head = (_queue_head + 1) % THUMBNAIL_QUEUE_SIZE;
+		_queue_count--;
+		_in_flight++;
+		pthread_mutex_unlock(&_queue_lock);
+
+		create_thumbnail_for_webm(job.webm_file_path, job.out_filepath);
+
+		pthread_mutex_lock(&_queue_lock);
+		_in_flight--;
+		if (_queue_count == 0 && _in_flight == 0)
+			pthread_cond_broadcast(&_queue_idle);
+		pthread_mutex_unlock(&_queue_lock);
+	}
+
+	return NULL;
+}
+
+int thumbnail_pool_start(const unsigned int num_threads) {
+	unsigned int i;
+	for (i = 0; i < num_threads; i++) {
+		pthread_t worker;
+		if (pthread_create(&worker, NULL, _thumbnail_worker, NULL) != 0) {
+			log_msg(LOG_ERR, "Could not start thumbnail worker %u.", i);
+			return -1;
+		}
+		pthread_detach(worker);
+	}
+
+	log_msg(LOG_INFO, "Started %u thumbnail workers.", num_threads);
+	return 0;
+}
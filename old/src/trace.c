@@ -0,0 +1,282 @@
+// vim: noet ts=4 sw=4
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+/* Every thread that records anything gets one of these. They're never freed,
+ * so the totals survive threads exiting, and readers can walk the list
+ * without holding anything. Only the owning thread writes to one, and it
+ * does so with relaxed atomics so concurrent readers see sane values.
+ */
+typedef struct _ring_slot {
+	uint64_t seq; /* Odd while being written. */
+	uint64_t id;
+	uint64_t parent_id;
+	uint64_t depth;
+	uint64_t start_ns;
+	uint64_t duration_ns;
+} _ring_slot;
+
+typedef struct _trace_thread {
+	unsigned int number;
+	trace_histogram *histograms[TRACE_MAX_SPANS];
+	_ring_slot ring[TRACE_RING_SIZE];
+	uint64_t ring_next;
+	struct _trace_thread *next;
+} _trace_thread;
+
+static const char *_span_names[TRACE_MAX_SPANS];
+static unsigned int _num_spans = 0;
+static pthread_mutex_t _registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _trace_thread *_threads = NULL;
+static unsigned int _num_threads = 0;
+
+static __thread _trace_thread *_self = NULL;
+static __thread trace_span *_current = NULL;
+
+uint64_t trace_now_ns() {
+	struct timespec spec;
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+	return (uint64_t)spec.tv_sec * 1000000000ULL + spec.tv_nsec;
+}
+
+/* Names are compared by pointer first, which is all it takes for anything
+ * that's already been seen. New names take the lock. */
+static unsigned int _span_id(const char *name) {
+	const unsigned int count = __atomic_load_n(&_num_spans, __ATOMIC_ACQUIRE);
+	unsigned int i;
+	for (i = 0; i < count; i++) {
+		if (_span_names[i] == name)
+			return i;
+	}
+
+	pthread_mutex_lock(&_registry_lock);
+	unsigned int id = TRACE_MAX_SPANS;
+	for (i = 0; i < _num_spans; i++) {
+		if (strcmp(_span_names[i], name) == 0) {
+			id = i;
+			goto end;
+		}
+	}
+
+	if (_num_spans < TRACE_MAX_SPANS) {
+		id = _num_spans;
+		_span_names[id] = name;
+		__atomic_store_n(&_num_spans, _num_spans + 1, __ATOMIC_RELEASE);
+	}
+
+end:
+	pthread_mutex_unlock(&_registry_lock);
+	return id;
+}
+
+static _trace_thread *_get_self() {
+	if (_self)
+		return _self;
+
+	_trace_thread *self = calloc(1, sizeof(_trace_thread));
+	if (!self)
+		return NULL;
+
+	pthread_mutex_lock(&_registry_lock);
+	self->number = _num_threads++;
+	self->next = _threads;
+	__atomic_store_n(&_threads, self, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&_registry_lock);
+
+	_self = self;
+	return self;
+}
+
+static unsigned int _bucket_for(const uint64_t value) {
+	if (value < TRACE_SUB_BUCKETS)
+		return value;
+
+	const unsigned int magnitude = 63 - __builtin_clzll(value);
+	const unsigned int shift = magnitude - TRACE_SUB_BUCKET_BITS;
+	const unsigned int sub = (value >> shift) & (TRACE_SUB_BUCKETS - 1);
+	return (shift + 1) * TRACE_SUB_BUCKETS + sub;
+}
+
+uint64_t trace_bucket_upper_ns(const unsigned int bucket) {
+	if (bucket < TRACE_SUB_BUCKETS)
+		return bucket;
+
+	const unsigned int shift = bucket / TRACE_SUB_BUCKETS - 1;
+	const uint64_t sub = bucket % TRACE_SUB_BUCKETS;
+	const uint64_t lower = (TRACE_SUB_BUCKETS + sub) << shift;
+	return lower + ((1ULL << shift) - 1);
+}
+
+static void _record(_trace_thread *self, const unsigned int id, const uint64_t duration_ns) {
+	trace_histogram *hist = self->histograms[id];
+	if (!hist) {
+		hist = calloc(1, sizeof(trace_histogram));
+		if (!hist)
+			return;
+		hist->min_ns = UINT64_MAX;
+		__atomic_store_n(&self->histograms[id], hist, __ATOMIC_RELEASE);
+	}
+
+	/* Single writer, so plain read-modify-write is fine. The atomics are only
+	 * there so readers never see a torn value. */
+	const unsigned int bucket = _bucket_for(duration_ns);
+	__atomic_store_n(&hist->buckets[bucket], hist->buckets[bucket] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->sum_ns, hist->sum_ns + duration_ns, __ATOMIC_RELAXED);
+	if (duration_ns < hist->min_ns)
+		__atomic_store_n(&hist->min_ns, duration_ns, __ATOMIC_RELAXED);
+	if (duration_ns > hist->max_ns)
+		__atomic_store_n(&hist->max_ns, duration_ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELEASE);
+}
+
+void trace_begin(trace_span *span, const char *name) {
+	span->id = _span_id(name);
+	span->parent = _current;
+	span->depth = _current ? _current->depth + 1 : 0;
+	span->start_ns = trace_now_ns();
+	_current = span;
+}
+
+void trace_end(trace_span *span) {
+	const uint64_t end_ns = trace_now_ns();
+	_current = span->parent;
+
+	if (span->id >= TRACE_MAX_SPANS)
+		return;
+
+	_trace_thread *self = _get_self();
+	if (!self)
+		return;
+
+	const uint64_t duration_ns = end_ns - span->start_ns;
+	_record(self, span->id, duration_ns);
+
+	/* Seqlock-ish: readers skip any slot whose seq is odd or changed while
+	 * they were copying it. */
+	_ring_slot *slot = &self->ring[self->ring_next % TRACE_RING_SIZE];
+	const uint64_t seq = slot->seq;
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&slot->id, span->id, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->parent_id, span->parent ? span->parent->id : TRACE_NO_PARENT, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->depth, span->depth, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->start_ns, span->start_ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->duration_ns, duration_ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&self->ring_next, self->ring_next + 1, __ATOMIC_RELAXED);
+}
+
+void trace_record_ns(const char *name, const uint64_t duration_ns) {
+	const unsigned int id = _span_id(name);
+	_trace_thread *self = _get_self();
+	if (id >= TRACE_MAX_SPANS || !self)
+		return;
+
+	_record(self, id, duration_ns);
+}
+
+unsigned int trace_span_count() {
+	return __atomic_load_n(&_num_spans, __ATOMIC_ACQUIRE);
+}
+
+const char *trace_span_name(const unsigned int id) {
+	if (id >= trace_span_count())
+		return NULL;
+	return _span_names[id];
+}
+
+void trace_merge_histogram(const unsigned int id, trace_histogram *out) {
+	memset(out, 0, sizeof(trace_histogram));
+	out->min_ns = UINT64_MAX;
+
+	if (id >= TRACE_MAX_SPANS)
+		return;
+
+	const _trace_thread *thread = __atomic_load_n(&_threads, __ATOMIC_ACQUIRE);
+	for (; thread != NULL; thread = thread->next) {
+		trace_histogram *hist = __atomic_load_n(&thread->histograms[id], __ATOMIC_ACQUIRE);
+		if (!hist)
+			continue;
+
+		/* Count comes from the buckets themselves so the two always agree,
+		 * even if the owner records something while we're reading. */
+		unsigned int i;
+		for (i = 0; i < TRACE_HIST_BUCKETS; i++) {
+			const uint64_t bucket = __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+			out->buckets[i] += bucket;
+			out->count += bucket;
+		}
+		out->sum_ns += __atomic_load_n(&hist->sum_ns, __ATOMIC_RELAXED);
+
+		const uint64_t min_ns = __atomic_load_n(&hist->min_ns, __ATOMIC_RELAXED);
+		const uint64_t max_ns = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+		if (min_ns < out->min_ns)
+			out->min_ns = min_ns;
+		if (max_ns > out->max_ns)
+			out->max_ns = max_ns;
+	}
+
+	if (out->count == 0)
+		out->min_ns = 0;
+}
+
+uint64_t trace_histogram_percentile(const trace_histogram *hist, const double percentile) {
+	if (hist->count == 0)
+		return 0;
+
+	uint64_t wanted = (uint64_t)(hist->count * (percentile / 100.0) + 0.5);
+	if (wanted == 0)
+		wanted = 1;
+
+	uint64_t seen = 0;
+	unsigned int i;
+	for (i = 0; i < TRACE_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= wanted) {
+			const uint64_t upper = trace_bucket_upper_ns(i);
+			return upper > hist->max_ns ? hist->max_ns : upper;
+		}
+	}
+
+	return hist->max_ns;
+}
+
+size_t trace_recent_spans(trace_record *out, const size_t max) {
+	size_t copied = 0;
+
+	const _trace_thread *thread = __atomic_load_n(&_threads, __ATOMIC_ACQUIRE);
+	for (; thread != NULL && copied < max; thread = thread->next) {
+		const uint64_t next = __atomic_load_n(&thread->ring_next, __ATOMIC_RELAXED);
+		const uint64_t first = next > TRACE_RING_SIZE ? next - TRACE_RING_SIZE : 0;
+
+		uint64_t i;
+		for (i = first; i < next && copied < max; i++) {
+			const _ring_slot *slot = &thread->ring[i % TRACE_RING_SIZE];
+			const uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+			if (seq & 1)
+				continue;
+
+			trace_record record = {
+				.thread = thread->number,
+				.id = __atomic_load_n(&slot->id, __ATOMIC_RELAXED),
+				.parent_id = __atomic_load_n(&slot->parent_id, __ATOMIC_RELAXED),
+				.depth = __atomic_load_n(&slot->depth, __ATOMIC_RELAXED),
+				.start_ns = __atomic_load_n(&slot->start_ns, __ATOMIC_RELAXED),
+				.duration_ns = __atomic_load_n(&slot->duration_ns, __ATOMIC_RELAXED)
+			};
+
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+				continue;
+
+			out[copied++] = record;
+		}
+	}
+
+	return copied;
+}
@@ -1,15 +1,39 @@
 // vim: noet ts=4 sw=4
 #include <assert.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <38-moths/parse.h>
 #include <38-moths/logging.h>
 
+#include "async_log.h"
+#include "blake3.h"
+#include "blobstore.h"
+#include "bloom.h"
+#include "crawl_archive.h"
+#include "dirscan.h"
+#include "ebml.h"
+#include "filename_index.h"
+#include "hashing.h"
 #include "http.h"
+#include "journal.h"
+#include "known_keys.h"
+#include "meta_snapshot.h"
+#include "metrics.h"
 #include "utils.h"
 #include "parse.h"
+#include "pg_fields.h"
 #include "models.h"
+#include "search_jobs.h"
+#include "text_index.h"
+#include "trace.h"
 
 int hash_stuff() {
 	char outbuf[HASH_IMAGE_STR_SIZE] = {0};
@@ -86,11 +110,1305 @@ int can_parse_range_query() {
 	return 1;
 }
 
+int hash_stream_matches_hash_file() {
+	char path[] = "/tmp/mzbh_utest_XXXXXX";
+	const int fd = mkstemp(path);
+	assert(fd >= 0);
+
+	/* Odd size so the digest ends on a partial block and a partial byte. */
+	const size_t total = 123457;
+	unsigned char *data = malloc(total);
+	size_t i;
+	for (i = 0; i < total; i++)
+		data[i] = (unsigned char)(i * 31 + 7);
+
+	/* Feed it in uneven pieces, the way curl would. */
+	struct hash_stream *stream = hash_stream_new();
+	size_t written = 0;
+	while (written < total) {
+		size_t piece = 1000 + (written % 7777);
+		if (written + piece > total)
+			piece = total - written;
+		assert(write(fd, data + written, piece) == (ssize_t)piece);
+		written += piece;
+		assert(hash_stream_update_from_fd(stream, fd, written));
+	}
+
+	char streamed[HASH_IMAGE_STR_SIZE] = {0};
+	assert(hash_stream_finish(stream, fd, total, streamed));
+
+	char whole[HASH_IMAGE_STR_SIZE] = {0};
+	assert(hash_file(path, whole));
+	assert(strcmp(streamed, whole) == 0);
+
+	close(fd);
+	unlink(path);
+	free(data);
+	return 1;
+}
+
+int blake3_matches_known_vectors() {
+	/* From the reference test_vectors.json, where input byte i is i % 251. */
+	const struct { size_t len; const char *hash; } vectors[] = {
+		{0, "AF1349B9F5F9A1A6A0404DEA36DCC9499BCB25C9ADC112B7CC9A93CAE41F3262"},
+		{1024, "42214739F095A406F3FC83DEB889744AC00DF831C10DAA55189B5D121C855AF7"},
+		{1025, "D00278AE47EB27B34FAECF67B4FE263F82D5412916C1FFD97C8CB7FB814B8444"},
+	};
+	unsigned char *data = malloc(3 * 1024 * 1024);
+	size_t i;
+	for (i = 0; i < 3 * 1024 * 1024; i++)
+		data[i] = i % 251;
+
+	for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+		char outbuf[HASH_IMAGE_STR_SIZE] = {0};
+		assert(hash_string_with(HASH_BACKEND_BLAKE3, data, vectors[i].len, outbuf));
+		assert(strcmp(outbuf, vectors[i].hash) == 0);
+	}
+
+	/* Big enough to get split across threads, which has to change nothing. */
+	unsigned char one[BLAKE3_OUT_LEN] = {0}, many[BLAKE3_OUT_LEN] = {0}, streamed[BLAKE3_OUT_LEN] = {0};
+	blake3_hash(data, 3 * 1024 * 1024 - 7, 1, one);
+	blake3_hash(data, 3 * 1024 * 1024 - 7, 4, many);
+	assert(memcmp(one, many, sizeof(one)) == 0);
+
+	blake3_hasher hasher;
+	blake3_init(&hasher);
+	size_t fed = 0;
+	while (fed < 3 * 1024 * 1024 - 7) {
+		size_t piece = 1 + (fed % 5003);
+		if (fed + piece > 3 * 1024 * 1024 - 7)
+			piece = 3 * 1024 * 1024 - 7 - fed;
+		blake3_update(&hasher, data + fed, piece);
+		fed += piece;
+	}
+	blake3_final(&hasher, streamed);
+	assert(memcmp(one, streamed, sizeof(one)) == 0);
+
+	free(data);
+	return 1;
+}
+
+int bmw256_backends_agree() {
+	const size_t total = 70000;
+	unsigned char *data = malloc(total);
+	size_t i;
+	for (i = 0; i < total; i++)
+		data[i] = (unsigned char)(i * 131 + 17);
+
+	/* Every tail length, then a few that span lots of blocks. */
+	for (i = 0; i < 1100; i += (i < 600 ? 1 : 37)) {
+		char ref[HASH_IMAGE_STR_SIZE] = {0}, fast[HASH_IMAGE_STR_SIZE] = {0};
+		assert(hash_string_with(HASH_BACKEND_BMW256_REF, data, i, ref));
+		assert(hash_string_with(HASH_BACKEND_BMW256, data, i, fast));
+		assert(strcmp(ref, fast) == 0);
+	}
+
+	char ref[HASH_IMAGE_STR_SIZE] = {0}, fast[HASH_IMAGE_STR_SIZE] = {0};
+	assert(hash_string_with(HASH_BACKEND_BMW256_REF, data, total, ref));
+	assert(hash_string_with(HASH_BACKEND_BMW256, data, total, fast));
+	assert(strcmp(ref, fast) == 0);
+
+	assert(hash_backend_from_name("blake3") == HASH_BACKEND_BLAKE3);
+	assert(hash_backend_from_name("md5") == HASH_BACKENDS);
+	assert(hash_algorithm_from_name(hash_algorithm_name(HASH_BLAKE3)) == HASH_BLAKE3);
+
+	free(data);
+	return 1;
+}
+
+int fingerprints_tell_files_apart() {
+	char path[] = "/tmp/mzbh_utest_XXXXXX";
+	const int fd = mkstemp(path);
+	assert(fd >= 0);
+
+	const size_t total = 8 * 1024 * 1024 + 3;
+	const size_t covered = total / 8;
+	unsigned char *data = malloc(total);
+	size_t i;
+	for (i = 0; i < total; i++)
+		data[i] = (unsigned char)(i * 7 + 1);
+	assert(write(fd, data, total) == (ssize_t)total);
+
+	size_t size = 0;
+	char first[HASH_IMAGE_STR_SIZE] = {0}, again[HASH_IMAGE_STR_SIZE] = {0};
+	assert(hash_fingerprint_file(path, &size, first));
+	assert(size == total);
+
+	/* Inside the middle sample. */
+	const unsigned char flipped = data[covered / 2] ^ 1;
+	assert(pwrite(fd, &flipped, 1, covered / 2) == 1);
+	assert(hash_fingerprint_file(path, &size, again));
+	assert(strcmp(first, again) != 0);
+
+	/* Between the samples it can't tell, that's what the full hash is for. */
+	assert(pwrite(fd, &data[covered / 2], 1, covered / 2) == 1);
+	const unsigned char unsampled = data[200 * 1024] ^ 1;
+	assert(pwrite(fd, &unsampled, 1, 200 * 1024) == 1);
+	assert(hash_fingerprint_file(path, &size, again));
+	assert(strcmp(first, again) == 0);
+	assert(pwrite(fd, &data[200 * 1024], 1, 200 * 1024) == 1);
+
+	/* Same size and prefix but a different tail is the same file as far as
+	 * bmw256 goes, so it has to be a maybe rather than definitely new. */
+	char hash[HASH_IMAGE_STR_SIZE] = {0}, other_hash[HASH_IMAGE_STR_SIZE] = {0};
+	assert(hash_file_with(HASH_BACKEND_BMW256, path, hash));
+	const unsigned char tail = data[total - 1] ^ 1;
+	assert(pwrite(fd, &tail, 1, total - 1) == 1);
+	assert(pwrite(fd, &tail, 1, total / 2) == 1);
+	assert(hash_file_with(HASH_BACKEND_BMW256, path, other_hash));
+	assert(strcmp(hash, other_hash) == 0);
+	assert(hash_fingerprint_file(path, &size, again));
+	assert(strcmp(first, again) == 0);
+
+	/* Small files' prefixes are covered entirely, and so is the length. */
+	assert(ftruncate(fd, 8000) == 0);
+	assert(hash_fingerprint_file(path, &size, first));
+	assert(size == 8000);
+	const unsigned char early = data[999] ^ 1;
+	assert(pwrite(fd, &early, 1, 999) == 1);
+	assert(hash_fingerprint_file(path, &size, again));
+	assert(strcmp(first, again) != 0);
+	assert(pwrite(fd, &data[999], 1, 999) == 1);
+	assert(ftruncate(fd, 8001) == 0);
+	assert(hash_fingerprint_file(path, &size, again));
+	assert(strcmp(first, again) != 0);
+
+	close(fd);
+	unlink(path);
+	free(data);
+	return 1;
+}
+
+int binary_keys_round_trip() {
+	unsigned char bytes[HASH_ARRAY_SIZE] = {0};
+	char hex[HASH_IMAGE_STR_SIZE] = {0};
+	assert(hash_string((unsigned char *)"waifu", strlen("waifu"), hex));
+	assert(hash_hex_to_bytes(hex, bytes));
+
+	char again[HASH_IMAGE_STR_SIZE] = {0};
+	hash_bytes_to_hex(bytes, again);
+	assert(strcmp(hex, again) == 0);
+
+	/* Postgres hands bytea back in lowercase. */
+	char lower[HASH_IMAGE_STR_SIZE] = {0};
+	size_t i;
+	for (i = 0; i < sizeof(lower) - 1; i++)
+		lower[i] = tolower(hex[i]);
+	unsigned char from_lower[HASH_ARRAY_SIZE] = {0};
+	assert(hash_hex_to_bytes(lower, from_lower));
+	assert(memcmp(bytes, from_lower, sizeof(bytes)) == 0);
+
+	hex[10] = 'G';
+	assert(!hash_hex_to_bytes(hex, bytes));
+	assert(!hash_hex_to_bytes("ABCD", bytes));
+
+	/* The fnv1a half isn't zero-padded, so some of these are shorter. */
+	for (i = 0; i < 64; i++) {
+		char path[MAX_IMAGE_FILENAME_SIZE] = {0};
+		snprintf(path, sizeof(path), "./webms/wsg/%zu.webm", i);
+		char key[MAX_KEY_SIZE] = {0};
+		create_alias_key(path, key);
+
+		unsigned char key_bin[ALIAS_KEY_BIN_SIZE] = {0};
+		assert(alias_key_to_bin(key, key_bin));
+
+		/* Same as the SQL in 004_binary_keys.sql. */
+		char rebuilt[MAX_KEY_SIZE] = {0};
+		hash_bytes_to_hex(key_bin, hex);
+		uint64_t fnv = 0;
+		size_t j;
+		for (j = 0; j < 8; j++)
+			fnv = (fnv << 8) | key_bin[HASH_ARRAY_SIZE + j];
+		snprintf(rebuilt, sizeof(rebuilt), "%s%s%"PRIX64, ALIAS_NMSPC, hex, fnv);
+		assert(strcmp(key, rebuilt) == 0);
+	}
+
+	char key[MAX_KEY_SIZE] = "PSTwsg1451606400000";
+	unsigned char key_bin[ALIAS_KEY_BIN_SIZE] = {0};
+	assert(!alias_key_to_bin(key, key_bin));
+
+	return 1;
+}
+
+/* A result like the ones Postgres sends, in format (0 for text, 1 for
+ * binary). values go row by row with NULL for NULL, and lengths (only needed
+ * for binary) likewise, otherwise it's strlen(). No types means text. */
+static PGresult *_make_result(const char *names[], const Oid types[], const int cols, const int format,
+		const char *values[], const int lengths[], const int rows) {
+	PGresult *res = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+	PGresAttDesc attrs[16];
+	memset(attrs, 0, sizeof(attrs));
+	assert(cols <= 16);
+	int r, c;
+	for (c = 0; c < cols; c++) {
+		attrs[c].name = (char *)names[c];
+		attrs[c].typid = types ? types[c] : 25;
+		attrs[c].typlen = -1;
+		attrs[c].format = format;
+	}
+	assert(PQsetResultAttrs(res, cols, attrs));
+	for (r = 0; r < rows; r++) {
+		for (c = 0; c < cols; c++) {
+			const char *value = values[r * cols + c];
+			const int len = !value ? -1 : lengths ? lengths[r * cols + c] : (int)strlen(value);
+			assert(PQsetvalue(res, r, c, (char *)value, len));
+		}
+	}
+	return res;
+}
+
+int pg_fields_decode_binary_results() {
+	static const char *names[] = {"id", "size", "created_at", "stamp", "has_audio", "replied_to_keys",
+		"board", "nothing"};
+	static const Oid types[] = {23, 20, 1700, 1184, 16, 3802, 25, 25};
+
+	/* 1451606400.25 as numeric: 14 5160 6400 . 2500 */
+	const char numeric[] = {0, 4, 0, 2, 0, 0, 0, 2, 0, 14, 0x14, 0x28, 0x19, 0x00, 0x09, 0xC4};
+	/* 2016-01-01 00:00:00+00 in microseconds since 2000-01-01. */
+	const char stamp[] = {0x00, 0x01, 0xCB, 0x39, 0x38, 0x9B, 0x80, 0x00};
+	const char *binary_values[] = {"\x00\x00\x01\x02", "\x00\x00\x00\x01\x00\x00\x00\x00", numeric, stamp,
+		"\x01", "\x01[\"a\"]", "wsg", NULL};
+	const int binary_lengths[] = {4, 8, sizeof(numeric), sizeof(stamp), 1, 6, 3, -1};
+	const char *text_values[] = {"258", "4294967296", "1451606400.25", NULL, "t", "[\"a\"]", "wsg", NULL};
+
+	PGresult *binary = _make_result(names, types, 8, 1, binary_values, binary_lengths, 1);
+	PGresult *text = _make_result(names, types, 8, 0, text_values, NULL, 1);
+
+	PGresult *results[] = {binary, text};
+	unsigned int i;
+	for (i = 0; i < 2; i++) {
+		const PGresult *res = results[i];
+		assert(pg_get_int(res, 0, pg_col_lookup(res, "id")) == 258);
+		assert(pg_get_int(res, 0, pg_col_lookup(res, "size")) == 4294967296LL);
+		assert(pg_get_int(res, 0, pg_col_lookup(res, "created_at")) == 1451606400);
+		assert(pg_get_bool(res, 0, pg_col_lookup(res, "has_audio")));
+		assert(strcmp(pg_get_str(res, 0, pg_col_lookup(res, "replied_to_keys")), "[\"a\"]") == 0);
+		assert(strcmp(pg_get_str(res, 0, pg_col_lookup(res, "board")), "wsg") == 0);
+		assert(pg_get_str(res, 0, pg_col_lookup(res, "nothing")) == NULL);
+		assert(pg_isnull(res, 0, pg_col_lookup(res, "not_selected")));
+	}
+	assert(pg_get_int(binary, 0, pg_col_lookup(binary, "stamp")) == 1451606400);
+
+	PQclear(binary);
+	PQclear(text);
+	return 1;
+}
+
+int quote_links_round_trip() {
+	const char body[] = "&gt;&gt;1234<br>&gt;&gt;&gt;/wsg/ lol<br>>>5678 &gt;&gt;1234"
+		" &gt;&gt;12345678901234567890 &gt;>9 >&gt;10 >>";
+	uint64_t quotes[POST_MAX_QUOTES] = {0};
+	assert(extract_quote_links(body, quotes, POST_MAX_QUOTES) == 2);
+	assert(quotes[0] == 1234);
+	assert(quotes[1] == 5678);
+	assert(extract_quote_links(body, quotes, 1) == 1);
+	assert(extract_quote_links("no quotes &amp; stuff > here", quotes, POST_MAX_QUOTES) == 0);
+	assert(extract_quote_links(NULL, quotes, POST_MAX_QUOTES) == 0);
+
+	/* One dimension, no NULLs, int8, three elements starting at 1. */
+	const char array[] = {
+		0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 20, 0, 0, 0, 3, 0, 0, 0, 1,
+		0, 0, 0, 8, 0, 0, 0, 0, 0, 0, 0x04, 0xD2,
+		0, 0, 0, 8, 0, 0, 0, 0, 0, 0, 0x16, 0x2E,
+		0, 0, 0, 8, 0, 0, 0, 0, 0, 0, 0, 9
+	};
+	/* And '{}', which has no dimensions at all. */
+	const char empty[] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 20};
+	static const char *names[] = {"replied_to"};
+	static const Oid types[] = {1016};
+	const char *binary_values[] = {array, empty};
+	const int binary_lengths[] = {sizeof(array), sizeof(empty)};
+	const char *text_values[] = {"{1234,5678,9}", "{}"};
+	PGresult *binary = _make_result(names, types, 1, 1, binary_values, binary_lengths, 2);
+	PGresult *text = _make_result(names, types, 1, 0, text_values, NULL, 2);
+
+	PGresult *results[] = {binary, text};
+	unsigned int i;
+	for (i = 0; i < 2; i++) {
+		const PGresult *res = results[i];
+		const pg_col col = pg_col_lookup(res, "replied_to");
+		int64_t out[2] = {0};
+		assert(pg_get_int_array(res, 0, col, out, 2) == 3);
+		assert(out[0] == 1234);
+		assert(out[1] == 5678);
+		assert(pg_get_int_array(res, 1, col, out, 2) == 0);
+	}
+
+	PQclear(binary);
+	PQclear(text);
+	return 1;
+}
+
+int search_jobs_are_limited_per_client() {
+	/* No workers are started here, so everything just sits in the queue. */
+	uint64_t first = 0, second = 0, third = 0;
+	assert(search_job_submit("1.2.3.4", "http://example.com/a.webm", &first) == SEARCH_JOB_OK);
+	assert(search_job_submit("1.2.3.4", "http://example.com/b.webm", &second) == SEARCH_JOB_OK);
+	assert(first != second);
+	assert(search_job_submit("1.2.3.4", "http://example.com/c.webm", &third) == SEARCH_JOB_ERR_CLIENT_LIMIT);
+	assert(search_job_submit("5.6.7.8", "http://example.com/c.webm", &third) == SEARCH_JOB_OK);
+	assert(search_job_submit("5.6.7.8", "nope", &third) == SEARCH_JOB_ERR_BAD_URL);
+
+	search_job job = {0};
+	assert(search_job_get(first, 0, &job) == 0);
+	assert(job.state == SEARCH_JOB_QUEUED);
+	search_job_snapshot_free(&job);
+
+	assert(search_job_get(first + 1000, 0, &job) == -1);
+	return 1;
+}
+
+int can_parse_webm_metadata() {
+	/* A minimal webm: EBML header, an unknown-sized Segment with Info and
+	 * Tracks (one VP9 track, one Opus track) and then the first Cluster. */
+	const unsigned char buf[] = {
+		0x1A, 0x45, 0xDF, 0xA3, 0x87,
+			0x42, 0x82, 0x84, 'w', 'e', 'b', 'm',
+		0x18, 0x53, 0x80, 0x67, 0x01, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			0x15, 0x49, 0xA9, 0x66, 0x8E,
+				0x2A, 0xD7, 0xB1, 0x83, 0x0F, 0x42, 0x40,
+				0x44, 0x89, 0x84, 0x47, 0xAF, 0xC8, 0x00, /* 90000.0f */
+			0x16, 0x54, 0xAE, 0x6B, 0xA3,
+				0xAE, 0x94,
+					0x83, 0x81, 0x01,
+					0x86, 0x85, 'V', '_', 'V', 'P', '9',
+					0xE0, 0x88,
+						0xB0, 0x82, 0x05, 0x00,
+						0xBA, 0x82, 0x02, 0xD0,
+				0xAE, 0x8B,
+					0x83, 0x81, 0x02,
+					0x86, 0x86, 'A', '_', 'O', 'P', 'U', 'S',
+			0x1F, 0x43, 0xB6, 0x75, 0xFF,
+	};
+
+	webm_metadata metadata = {0};
+	assert(parse_webm_metadata_buf(buf, sizeof(buf), &metadata) == 1);
+	assert(metadata.duration_ms == 90000);
+	assert(metadata.width == 1280);
+	assert(metadata.height == 720);
+	assert(strcmp(metadata.video_codec, "V_VP9") == 0);
+	assert(strcmp(metadata.audio_codec, "A_OPUS") == 0);
+	assert(metadata.has_audio == 1);
+
+	/* Cut off before Tracks, we should still get what we saw. */
+	assert(parse_webm_metadata_buf(buf, 45, &metadata) == 1);
+	assert(metadata.duration_ms == 90000);
+	assert(metadata.has_audio == 0);
+
+	/* Not a webm at all. */
+	const unsigned char not_webm[] = {0x1A, 0x45, 0xDF, 0xA3, 0x84, 0x42, 0x82, 0x81, 'x'};
+	assert(parse_webm_metadata_buf(not_webm, sizeof(not_webm), &metadata) == 0);
+	assert(parse_webm_metadata_buf((const unsigned char *)"GIF89a", 6, &metadata) == 0);
+
+	return 1;
+}
+
+static void _write_test_file(const char *path, const char *contents) {
+	FILE *f = fopen(path, "wb");
+	assert(f != NULL);
+	assert(fwrite(contents, 1, strlen(contents), f) == strlen(contents));
+	fclose(f);
+}
+
+int blob_store_dedupes_webms() {
+	/* Has to run before anything else calls webm_location(). */
+	char root[] = "/tmp/mzbh_blobs_XXXXXX";
+	assert(mkdtemp(root) != NULL);
+	setenv("WFU_WEBMS_DIR", root, 1);
+	assert(strcmp(webm_location(), root) == 0);
+
+	char board_dir[MAX_IMAGE_FILENAME_SIZE] = {0};
+	char first[MAX_IMAGE_FILENAME_SIZE] = {0};
+	char second[MAX_IMAGE_FILENAME_SIZE] = {0};
+	snprintf(board_dir, sizeof(board_dir), "%s/b", root);
+	snprintf(first, sizeof(first), "%s/1_cat.webm", board_dir);
+	snprintf(second, sizeof(second), "%s/2_same_cat.webm", board_dir);
+	assert(mkdir(board_dir, 0755) == 0);
+
+	const char *contents = "not really a webm but it'll hash the same twice";
+	_write_test_file(first, contents);
+	_write_test_file(second, contents);
+
+	char hash[HASH_IMAGE_STR_SIZE] = {0};
+	assert(hash_file(first, hash));
+	assert(blob_store_webm(first, hash) == 0);
+	assert(blob_store_webm(second, hash) == 0);
+	/* Doing it again is a no-op. */
+	assert(blob_store_webm(first, hash) == 0);
+
+	char blob_path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	assert(get_blob_path(hash, BLOB_WEBM_EXT, blob_path) == 0);
+	assert(strstr(blob_path, "/" BLOB_DIR_NAME "/") != NULL);
+
+	char target[MAX_IMAGE_FILENAME_SIZE] = {0};
+	assert(readlink(first, target, sizeof(target) - 1) > 0);
+	assert(strcmp(target, blob_path) == 0);
+	memset(target, 0, sizeof(target));
+	assert(readlink(second, target, sizeof(target) - 1) > 0);
+	assert(strcmp(target, blob_path) == 0);
+	assert(get_file_size(second) == strlen(contents));
+
+	char thumb_blob[MAX_IMAGE_FILENAME_SIZE] = {0};
+	assert(get_blob_thumbnail_path(second, thumb_blob) == 0);
+	assert(endswith(thumb_blob, "." BLOB_THUMB_EXT));
+
+	/* Same hash, different size: left alone. */
+	char third[MAX_IMAGE_FILENAME_SIZE] = {0};
+	snprintf(third, sizeof(third), "%s/3_longer_cat.webm", board_dir);
+	_write_test_file(third, "not really a webm but it'll hash the same twice, honest");
+	assert(blob_store_webm(third, hash) == -1);
+	assert(get_blob_thumbnail_path(third, thumb_blob) == -1);
+
+	unlink(first);
+	unlink(second);
+	unlink(third);
+	unlink(blob_path);
+	return 1;
+}
+
+int scan_directory_finds_webms() {
+	char root[] = "/tmp/mzbh_scan_XXXXXX";
+	assert(mkdtemp(root) != NULL);
+
+	char path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	unsigned int i;
+	/* More than one ring's worth, so batching gets exercised. */
+	for (i = 0; i < DIRSCAN_RING_ENTRIES + 10; i++) {
+		snprintf(path, sizeof(path), "%s/%u.webm", root, i);
+		_write_test_file(path, "x");
+	}
+	snprintf(path, sizeof(path), "%s/not_a_webm.jpg", root);
+	_write_test_file(path, "x");
+	snprintf(path, sizeof(path), "%s/.hidden.webm", root);
+	_write_test_file(path, "x");
+	snprintf(path, sizeof(path), "%s/t.webm", root);
+	assert(mkdir(path, 0755) == 0);
+
+	vector *found = scan_directory(root, ".webm");
+	assert(found != NULL);
+	assert(found->count == DIRSCAN_RING_ENTRIES + 10);
+
+	const scanned_file *file = vector_get(found, 0);
+	assert(file->size == 1);
+	assert(file->mtime > 0);
+	vector_free(found);
+
+	const char *dirs[] = {root, root, "/nonexistent/mzbh"};
+	vector *out[3] = {0};
+	assert(scan_directories(dirs, 3, NULL, out, 2) == -1);
+	assert(out[0]->count == DIRSCAN_RING_ENTRIES + 11);
+	assert(out[1]->count == out[0]->count);
+	assert(out[2] == NULL);
+	vector_free(out[0]);
+	vector_free(out[1]);
+
+	rmdir(path);
+	for (i = 0; i < DIRSCAN_RING_ENTRIES + 10; i++) {
+		snprintf(path, sizeof(path), "%s/%u.webm", root, i);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/not_a_webm.jpg", root);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/.hidden.webm", root);
+	unlink(path);
+	rmdir(root);
+	return 1;
+}
+
+static void *_trace_some_spans(void *arg) {
+	UNUSED(arg);
+	unsigned int i;
+	for (i = 0; i < 1000; i++)
+		trace_record_ns("utest_threaded", 1000);
+	return NULL;
+}
+
+static unsigned int _trace_id(const char *name) {
+	unsigned int i;
+	for (i = 0; i < trace_span_count(); i++) {
+		if (strcmp(trace_span_name(i), name) == 0)
+			return i;
+	}
+	assert(0);
+	return 0;
+}
+
+int trace_histograms_add_up() {
+	/* Buckets are in order and never overlap. */
+	uint64_t v;
+	unsigned int b;
+	for (b = 1; b < TRACE_HIST_BUCKETS; b++)
+		assert(trace_bucket_upper_ns(b) > trace_bucket_upper_ns(b - 1));
+
+	trace_span outer, inner;
+	trace_begin(&outer, "utest_outer");
+	trace_begin(&inner, "utest_inner");
+	assert(inner.depth == outer.depth + 1);
+	assert(inner.parent == &outer);
+	trace_end(&inner);
+	trace_end(&outer);
+
+	trace_record records[TRACE_RING_SIZE * 4];
+	const size_t num_records = trace_recent_spans(records, sizeof(records) / sizeof(records[0]));
+	size_t i;
+	int saw_inner = 0;
+	for (i = 0; i < num_records; i++) {
+		if (records[i].id == _trace_id("utest_inner")) {
+			assert(records[i].parent_id == _trace_id("utest_outer"));
+			saw_inner = 1;
+		}
+	}
+	assert(saw_inner);
+
+	for (v = 1; v <= 100; v++)
+		trace_record_ns("utest_values", v * 1000);
+
+	trace_histogram hist;
+	trace_merge_histogram(_trace_id("utest_values"), &hist);
+	assert(hist.count == 100);
+	assert(hist.min_ns == 1000);
+	assert(hist.max_ns == 100000);
+	/* Within a bucket's width of the real answer. */
+	const uint64_t p50 = trace_histogram_percentile(&hist, 50.0);
+	assert(p50 >= 50000 && p50 <= 50000 * 9 / 8);
+	assert(trace_histogram_percentile(&hist, 100.0) == 100000);
+
+	pthread_t threads[4];
+	for (i = 0; i < 4; i++)
+		assert(pthread_create(&threads[i], NULL, _trace_some_spans, NULL) == 0);
+	for (i = 0; i < 4; i++)
+		pthread_join(threads[i], NULL);
+
+	trace_merge_histogram(_trace_id("utest_threaded"), &hist);
+	assert(hist.count == 4000);
+	assert(hist.sum_ns == 4000 * 1000);
+
+	return 1;
+}
+
+int metrics_render_prometheus() {
+	metrics_route_request("utest_route", 200, 100);
+	metrics_route_request("utest_route", 404, 50);
+	metrics_route_request("utest_\"quoted\"", 200, 0);
+	trace_record_ns("utest_route", 2000000);
+	metrics_cache("utest_cache", 1);
+	metrics_cache("utest_cache", 0);
+
+	size_t len = 0;
+	char *out = metrics_render(&len);
+	assert(out != NULL);
+	assert(strlen(out) == len);
+
+	assert(strstr(out, "mzbh_http_requests_total{route=\"utest_route\",code=\"2xx\"} 1\n"));
+	assert(strstr(out, "mzbh_http_requests_total{route=\"utest_route\",code=\"4xx\"} 1\n"));
+	assert(strstr(out, "mzbh_http_response_bytes_total{route=\"utest_route\"} 150\n"));
+	assert(strstr(out, "route=\"utest_\\\"quoted\\\"\""));
+
+	/* 2ms lands between the 1ms and 2.5ms bounds. */
+	assert(strstr(out, "mzbh_http_request_duration_seconds_bucket{route=\"utest_route\",le=\"0.001\"} 0\n"));
+	assert(strstr(out, "mzbh_http_request_duration_seconds_bucket{route=\"utest_route\",le=\"0.0025\"} 1\n"));
+	assert(strstr(out, "mzbh_http_request_duration_seconds_count{route=\"utest_route\"} 1\n"));
+	/* Routes aren't repeated as generic spans. */
+	assert(!strstr(out, "mzbh_span_duration_seconds_count{span=\"utest_route\"}"));
+
+	assert(strstr(out, "mzbh_cache_hit_ratio{cache=\"utest_cache\"} 0.5\n"));
+	assert(strstr(out, "mzbh_downloader_up "));
+
+	free(out);
+	return 1;
+}
+
+int log_msg_filters_and_samples() {
+	const LOG_LEVEL old_level = log_level;
+	const uint64_t sampled = log_sampled_total();
+	unsigned int i;
+
+	/* Filtered messages never get as far as being sampled. */
+	log_level = LOG_ERR;
+	for (i = 0; i < 100; i++)
+		log_msg(LOG_INFO, "utest filtered %u", i);
+	assert(log_sampled_total() == sampled);
+
+	/* At worst the loop straddles a second and gets two bursts. */
+	log_level = LOG_DB;
+	for (i = 0; i < 100; i++)
+		log_msg(LOG_DB, "utest sampled %u", i);
+	assert(log_sampled_total() - sampled >= 100 - 2 * LOG_SAMPLE_BURST);
+	assert(log_sampled_total() - sampled <= 100 - LOG_SAMPLE_BURST);
+
+	log_level = old_level;
+	return 1;
+}
+
+int crawl_archive_round_trips() {
+	char path[] = "/tmp/mzbh_crawl_XXXXXX";
+	const int fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	const char *catalog = "[{\"page\": 1, \"threads\": []}]";
+	const char *thread = "{\"posts\": []}";
+
+	crawl_archive *archive = crawl_archive_open_write(path);
+	assert(archive != NULL);
+	assert(crawl_archive_append(archive, CRAWL_CATALOG, "wsg", 0, catalog, strlen(catalog)) == 0);
+	crawl_archive_close(archive);
+
+	/* Reopening appends rather than starting over. */
+	archive = crawl_archive_open_write(path);
+	assert(archive != NULL);
+	assert(crawl_archive_append(archive, CRAWL_THREAD, "wsg", 1234, thread, strlen(thread)) == 0);
+	crawl_archive_close(archive);
+
+	crawl_record record;
+	archive = crawl_archive_open_read(path);
+	assert(archive != NULL);
+	assert(crawl_archive_next(archive, &record) == 1);
+	assert(record.type == CRAWL_CATALOG);
+	assert(strcmp(record.board, "wsg") == 0);
+	assert(strcmp(record.payload, catalog) == 0);
+	assert(record.fetched_at_ms > 0);
+	assert(crawl_archive_next(archive, &record) == 1);
+	assert(record.type == CRAWL_THREAD);
+	assert(record.thread_num == 1234);
+	assert(record.payload_len == strlen(thread));
+	assert(strcmp(record.payload, thread) == 0);
+	assert(crawl_archive_next(archive, &record) == 0);
+	crawl_archive_close(archive);
+
+	/* Lop a few bytes off the end, like a crash mid-write would. */
+	struct stat st = {0};
+	assert(stat(path, &st) == 0);
+	assert(truncate(path, st.st_size - 3) == 0);
+	archive = crawl_archive_open_read(path);
+	assert(crawl_archive_next(archive, &record) == 1);
+	assert(crawl_archive_next(archive, &record) == 0);
+	crawl_archive_close(archive);
+
+	/* Recording again goes where the torn record was, not after it. */
+	archive = crawl_archive_open_write(path);
+	assert(archive != NULL);
+	assert(crawl_archive_append(archive, CRAWL_THREAD, "wsg", 5678, thread, strlen(thread)) == 0);
+	crawl_archive_close(archive);
+	archive = crawl_archive_open_read(path);
+	assert(crawl_archive_next(archive, &record) == 1);
+	assert(record.type == CRAWL_CATALOG);
+	assert(crawl_archive_next(archive, &record) == 1);
+	assert(record.thread_num == 5678);
+	assert(strcmp(record.payload, thread) == 0);
+	assert(crawl_archive_next(archive, &record) == 0);
+	crawl_archive_close(archive);
+
+	_write_test_file(path, "definitely not an archive");
+	assert(crawl_archive_open_read(path) == NULL);
+	assert(crawl_archive_open_write(path) == NULL);
+
+	unlink(path);
+	return 1;
+}
+
+int journal_round_trips() {
+	char path[] = "/tmp/mzbh_journal_XXXXXX";
+	const int fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	post_match post = {
+		.board = "wsg",
+		.filename = "cat",
+		.file_ext = ".webm",
+		.post_no = "1001",
+		.post_date = "1451606400000",
+		.thread_number = "1000",
+		.body_content = "meow",
+		.should_download_image = 1,
+	};
+
+	ingest_journal *journal = journal_open(path);
+	assert(journal != NULL);
+	const uint64_t post_seq = journal_append_post(journal, &post);
+	assert(post_seq == 1);
+	assert(journal_append_image(journal, &post, post_seq, "/tmp/webms/wsg/cat.webm", "cat.webm") == 0);
+
+	/* Nothing's readable until it's synced. */
+	journal_entry entry;
+	uint64_t next = 0;
+	assert(journal_read(journal, 0, &entry, &next) == 0);
+	assert(journal_sync(journal) == 0);
+	assert(journal_pending_bytes(journal) > 0);
+
+	assert(journal_read(journal, 0, &entry, &next) == 1);
+	assert(entry.type == JOURNAL_POST);
+	assert(entry.seq == post_seq);
+	assert(strcmp(entry.post.board, "wsg") == 0);
+	assert(strcmp(entry.post.body_content, "meow") == 0);
+	journal_entry_free(&entry);
+
+	assert(journal_read(journal, next, &entry, &next) == 1);
+	assert(entry.type == JOURNAL_IMAGE);
+	assert(entry.post_seq == post_seq);
+	assert(entry.post.body_content == NULL);
+	assert(strcmp(entry.filename, "cat.webm") == 0);
+	assert(strcmp(entry.post.post_date, "1451606400000") == 0);
+	assert(journal_read(journal, next, &entry, &next) == 0);
+	journal_close(journal);
+
+	/* Half a record on the end, like we died mid-write. */
+	struct stat st = {0};
+	assert(stat(path, &st) == 0);
+	FILE *f = fopen(path, "ab");
+	const journal_header torn = {.magic = JOURNAL_MAGIC, .type = JOURNAL_POST, .len = 4096};
+	assert(fwrite(&torn, sizeof(torn), 1, f) == 1);
+	fclose(f);
+
+	journal = journal_open(path);
+	assert(journal != NULL);
+	struct stat after = {0};
+	assert(stat(path, &after) == 0);
+	assert(after.st_size == st.st_size);
+	/* Sequence numbers carry on from where they were. */
+	assert(journal_append_post(journal, &post) == post_seq + 2);
+
+	/* A bad entry at the checkpoint is an error, not nothing to do. */
+	const int raw = open(path, O_WRONLY);
+	assert(raw >= 0);
+	assert(pwrite(raw, "X", 1, sizeof(journal_header)) == 1);
+	close(raw);
+	const uint64_t pending = journal_pending_bytes(journal);
+	assert(journal_apply(journal, JOURNAL_APPLY_BATCH) == -1);
+	assert(journal_pending_bytes(journal) == pending);
+	journal_close(journal);
+
+	char checkpoint[64] = {0};
+	snprintf(checkpoint, sizeof(checkpoint), "%s.checkpoint", path);
+	unlink(checkpoint);
+	unlink(path);
+	return 1;
+}
+
+int bloom_has_no_false_negatives() {
+	bloom *filter = bloom_new(1000);
+	assert(filter != NULL);
+
+	char key[32] = {0};
+	int i;
+	for (i = 0; i < 1000; i++) {
+		snprintf(key, sizeof(key), "wsg/%d_cat.webm", i);
+		bloom_add(filter, key, strlen(key));
+	}
+	for (i = 0; i < 1000; i++) {
+		snprintf(key, sizeof(key), "wsg/%d_cat.webm", i);
+		assert(bloom_maybe(filter, key, strlen(key)));
+	}
+	assert(!bloom_overfull(filter));
+
+	/* Sized for about 1%, anything much past that means the hashing's off. */
+	int false_positives = 0;
+	for (i = 0; i < 10000; i++) {
+		snprintf(key, sizeof(key), "gif/%d_dog.webm", i);
+		false_positives += bloom_maybe(filter, key, strlen(key));
+	}
+	assert(false_positives < 300);
+
+	bloom_free(filter);
+	return 1;
+}
+
+static unsigned int _keys_asked_after = 0;
+static PGresult *_fake_post_keys(const unsigned int after_id, const unsigned int limit) {
+	static const char *cols[] = {"id", "oleg_key"};
+	static const char *rows[] = {"1", "PSTwsg1", "2", "PSTwsg2", "3", "PSTwsg3"};
+	(void)limit;
+	_keys_asked_after = after_id;
+	const unsigned int skip = after_id < 3 ? after_id : 3;
+	return _make_result(cols, NULL, 2, 0, rows + skip * 2, NULL, 3 - skip);
+}
+
+static PGresult *_fake_no_keys(const unsigned int after_id, const unsigned int limit) {
+	static const char *cols[] = {"id", "oleg_key"};
+	(void)after_id;
+	(void)limit;
+	return _make_result(cols, NULL, 2, 0, NULL, NULL, 0);
+}
+
+int known_keys_remember_inserts() {
+	char saved[MAX_IMAGE_FILENAME_SIZE] = {0};
+	snprintf(saved, sizeof(saved), "%s/%s", webm_location(), KNOWN_KEYS_FILE);
+	unlink(saved);
+	known_keys_set_source(KNOWN_POSTS, _fake_post_keys);
+	known_keys_set_source(KNOWN_ALIASES, _fake_no_keys);
+
+	assert(known_keys_load() == KNOWN_KINDS);
+	assert(known_keys_watermark(KNOWN_POSTS) == 3);
+	assert(known_maybe(KNOWN_POSTS, "PSTwsg2"));
+	assert(!known_maybe(KNOWN_POSTS, "PSTwsg10"));
+
+	/* Inserted after the load, so the next one shouldn't fetch it again. */
+	known_add(KNOWN_POSTS, "PSTwsg10", 10);
+	known_add(KNOWN_POSTS, "PSTwsg9", 9);
+	assert(known_keys_watermark(KNOWN_POSTS) == 10);
+	assert(known_keys_save() == 0);
+	known_keys_unload();
+	assert(known_keys_watermark(KNOWN_POSTS) == 0);
+
+	assert(known_keys_load() == KNOWN_KINDS);
+	assert(_keys_asked_after == 10);
+	assert(known_keys_watermark(KNOWN_POSTS) == 10);
+	assert(known_maybe(KNOWN_POSTS, "PSTwsg10"));
+	assert(known_maybe(KNOWN_POSTS, "PSTwsg1"));
+	known_keys_unload();
+
+	known_keys_set_source(KNOWN_POSTS, NULL);
+	known_keys_set_source(KNOWN_ALIASES, NULL);
+	unlink(saved);
+	return 1;
+}
+
+int known_keys_survive_a_restart() {
+	/* Nothing's loaded, so everything might be a dupe. */
+	assert(known_maybe(KNOWN_FILES, "kk/1_cat.webm"));
+
+	char board_dir[MAX_IMAGE_FILENAME_SIZE] = {0};
+	char file[MAX_IMAGE_FILENAME_SIZE] = {0};
+	char saved[MAX_IMAGE_FILENAME_SIZE] = {0};
+	snprintf(board_dir, sizeof(board_dir), "%s/kk", webm_location());
+	snprintf(file, sizeof(file), "%s/1_cat.webm", board_dir);
+	snprintf(saved, sizeof(saved), "%s/%s", webm_location(), KNOWN_KEYS_FILE);
+	assert(mkdir(board_dir, 0755) == 0);
+	_write_test_file(file, "meow");
+
+	assert(known_keys_load() >= 1);
+	assert(known_maybe(KNOWN_FILES, "kk/1_cat.webm"));
+	assert(!known_maybe(KNOWN_FILES, "kk/2_dog.webm"));
+	known_add(KNOWN_FILES, "kk/2_dog.webm", 0);
+	assert(known_maybe(KNOWN_FILES, "kk/2_dog.webm"));
+
+	assert(known_keys_save() == 0);
+	known_keys_unload();
+	assert(known_maybe(KNOWN_FILES, "kk/3_bird.webm"));
+
+	/* The added key came back from the file, it isn't on disk. */
+	assert(known_keys_load() >= 1);
+	assert(known_maybe(KNOWN_FILES, "kk/1_cat.webm"));
+	assert(known_maybe(KNOWN_FILES, "kk/2_dog.webm"));
+	assert(!known_maybe(KNOWN_FILES, "kk/3_bird.webm"));
+	known_keys_unload();
+
+	unlink(saved);
+	unlink(file);
+	rmdir(board_dir);
+	return 1;
+}
+
+static const char *_post_body_cols[] = {"id", "body_content"};
+static const Oid _post_body_types[] = {23, 25};
+
+int text_index_finds_posts() {
+	char term[TEXT_INDEX_MAX_TERM] = {0};
+	const char *cursor = "<a href=\"#p123\" class=\"quotelink\">&gt;&gt;123</a><br>"
+		"Comfy LOOP &amp; stuff, don&#039;t x https://exam<wbr>ple.com";
+	const char *expected[] = {"comfy", "loop", "stuff", "don", "https", "example", "com"};
+	unsigned int i;
+	for (i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+		cursor = text_next_term(cursor, term);
+		assert(cursor != NULL);
+		assert(strcmp(term, expected[i]) == 0);
+	}
+	assert(text_next_term(cursor, term) == NULL);
+
+	/* Two updates, so the second has to be tacked onto the first's lists. */
+	const char *first[] = {
+		"1", "comfy loop",
+		"2", "comfy comfy comfy music",
+		"300", "loud music, not comfy"
+	};
+	const char *second[] = {
+		"2", "already in there",
+		"70000", "comfy loop with music",
+		"70001", "something else entirely"
+	};
+	PGresult *res = _make_result(_post_body_cols, _post_body_types, 2, 0, first, NULL, 3);
+	assert(text_index_add_posts(res) == 0);
+	PQclear(res);
+
+	text_hit hits[4];
+	assert(text_index_search("comfy", hits, 4) == 3);
+	assert(hits[0].post_id == 2);
+
+	res = _make_result(_post_body_cols, _post_body_types, 2, 0, second, NULL, 3);
+	assert(text_index_add_posts(res) == 0);
+	PQclear(res);
+
+	assert(text_index_search("Comfy MUSIC", hits, 4) == 3);
+	assert(hits[0].post_id == 2);
+	for (i = 0; i < 3; i++)
+		assert(hits[i].post_id == 2 || hits[i].post_id == 300 || hits[i].post_id == 70000);
+	assert(text_index_search("comfy comfy", hits, 1) == 1);
+	assert(text_index_search("loop", hits, 4) == 2);
+	assert(hits[0].post_id == 70000 && hits[1].post_id == 1);
+	assert(text_index_search("already", hits, 4) == 0);
+	assert(text_index_search("comfy nowhere", hits, 4) == 0);
+	assert(text_index_search("&gt;&gt;", hits, 4) == 0);
+
+	text_index_remove();
+	return 1;
+}
+
+static void _add_post_bodies(const char **rows, const int count) {
+	PGresult *res = _make_result(_post_body_cols, _post_body_types, 2, 0, rows, NULL, count);
+	assert(text_index_add_posts(res) == 0);
+	PQclear(res);
+}
+
+int text_index_picks_up_late_posts() {
+	text_index_remove();
+
+	const char *first[] = {
+		"1", "comfy loop",
+		"2", "comfy music",
+		"5", "comfy rain"
+	};
+	/* 3 committed after 5 did, 4 hasn't yet. */
+	const char *second[] = {
+		"2", "comfy again",
+		"3", "late comfy",
+		"6", "comfy night"
+	};
+	_add_post_bodies(first, 3);
+	_add_post_bodies(second, 3);
+
+	text_hit hits[16];
+	assert(text_index_search("comfy", hits, 16) == 5);
+	assert(text_index_search("late", hits, 16) == 1);
+	assert(hits[0].post_id == 3);
+	assert(text_index_search("again", hits, 16) == 0);
+
+	/* Enough more that the segments get merged into the base. */
+	unsigned int i;
+	for (i = 0; i < TEXT_INDEX_MAX_SEGMENTS; i++) {
+		char post_id[16] = {0};
+		snprintf(post_id, sizeof(post_id), "%u", 7 + i);
+		const char *row[] = {post_id, "comfy later"};
+		_add_post_bodies(row, 1);
+	}
+
+	char path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	struct stat st = {0};
+	snprintf(path, sizeof(path), "%s/%s", webm_location(), TEXT_INDEX_FILE);
+	assert(stat(path, &st) == 0);
+	snprintf(path, sizeof(path), "%s/%s.1", webm_location(), TEXT_INDEX_FILE);
+	assert(stat(path, &st) != 0);
+
+	assert(text_index_search("comfy", hits, 16) == 5 + TEXT_INDEX_MAX_SEGMENTS);
+	assert(text_index_search("late", hits, 16) == 1);
+
+	/* The merge kept track of 4 too. */
+	const char *fourth[] = {"4", "late comfy too"};
+	_add_post_bodies(fourth, 1);
+	assert(text_index_search("late", hits, 16) == 2);
+	assert(hits[0].post_id == 4 || hits[1].post_id == 4);
+
+	text_index_remove();
+	snprintf(path, sizeof(path), "%s/%s", webm_location(), TEXT_INDEX_FILE);
+	assert(stat(path, &st) != 0);
+	return 1;
+}
+
+int filename_index_finds_substrings() {
+	filename_index_clear();
+	assert(filename_index_add(0, 1, "1451606400_comfy loop.webm", "wsg", 10) == 0);
+	assert(filename_index_add(1, 1, "Comfy &#039;Loop&#039; (music).webm", "wsg", 11) == 0);
+	assert(filename_index_add(0, 2, "not so comfy.webm", "gif", 0) == 0);
+	assert(filename_index_add(0, 3, "uncomfy.webm", "gif", 12) == 0);
+	assert(filename_index_add(0, 4, "loop comfy.webm", "b", 13) == 0);
+
+	filename_hit hits[FILENAME_SEARCH_MAX_RESULTS];
+	assert(filename_index_search("co", hits, FILENAME_SEARCH_MAX_RESULTS) == 0);
+	assert(filename_index_search("COMFY", hits, FILENAME_SEARCH_MAX_RESULTS) == 5);
+	/* Prefix, then word starts by length, then the middle of a word. */
+	assert(strcmp(hits[0].filename, "Comfy &#039;Loop&#039; (music).webm") == 0);
+	assert(hits[0].is_alias && hits[0].thread_id == 11);
+	assert(strcmp(hits[1].filename, "loop comfy.webm") == 0);
+	assert(strcmp(hits[1].board, "b") == 0);
+	assert(strcmp(hits[2].filename, "not so comfy.webm") == 0);
+	assert(strcmp(hits[3].filename, "1451606400_comfy loop.webm") == 0);
+	assert(strcmp(hits[4].filename, "uncomfy.webm") == 0);
+
+	/* Has the trigrams, just not together. */
+	assert(filename_index_search("loop comfy", hits, FILENAME_SEARCH_MAX_RESULTS) == 1);
+	assert(filename_index_search("comfy 'loop'", hits, FILENAME_SEARCH_MAX_RESULTS) == 1);
+	assert(hits[0].id == 1 && hits[0].is_alias);
+	assert(filename_index_search("comfy", hits, 2) == 2);
+	assert(filename_index_search("nothing like it", hits, 2) == 0);
+
+	/* And back from a snapshot. */
+	assert(filename_index_save() == 0);
+	filename_index_clear();
+	assert(filename_index_search("comfy", hits, FILENAME_SEARCH_MAX_RESULTS) == 0);
+
+	char path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	snprintf(path, sizeof(path), "%s/%s", webm_location(), FILENAME_INDEX_FILE);
+	assert(filename_index_load() == 5);
+	assert(filename_index_search("comfy", hits, FILENAME_SEARCH_MAX_RESULTS) == 5);
+	assert(strcmp(hits[1].board, "b") == 0 && hits[1].thread_id == 13);
+
+	unlink(path);
+	return 1;
+}
+
+int meta_snapshot_serves_lookups() {
+	char path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	snprintf(path, sizeof(path), "%s/%s", webm_location(), META_SNAPSHOT_FILE);
+	unlink(path);
+	meta_snapshot_close();
+	assert(meta_snapshot_open() == -1);
+
+	char hashes[4][HASH_IMAGE_STR_SIZE];
+	int i;
+	for (i = 0; i < 4; i++) {
+		memset(hashes[i], "ABCD"[i], HASH_IMAGE_STR_SIZE - 1);
+		hashes[i][HASH_IMAGE_STR_SIZE - 1] = '\0';
+	}
+	char alias_path[MAX_IMAGE_FILENAME_SIZE] = "/webms/wsg/copy.webm";
+	char alias_key[MAX_KEY_SIZE] = {0};
+	create_alias_key(alias_path, alias_key);
+	char other_path[MAX_IMAGE_FILENAME_SIZE] = "/webms/b/other copy.webm";
+	char other_key[MAX_KEY_SIZE] = {0};
+	create_alias_key(other_path, other_key);
+
+	static const char *webm_cols[] = {"id", "file_hash", "hash_algorithm", "filename", "board", "created_at",
+		"duration_ms", "has_audio", "post_id", "thread_id", "fourchan_post_id", "body_content"};
+	static const char *alias_cols[] = {"id", "oleg_key", "webm_id", "filename", "board", "created_at",
+		"duration_ms", "has_audio", "post_id", "thread_id", "fourchan_post_id", "body_content"};
+	const char *webms[] = {
+		"1", hashes[0], "blake3", "first.webm", "wsg", "100", "5000", "t", "10", "7", "1000", "comfy",
+		"2", hashes[1], NULL, "second.webm", "wsg", "200", "60000", "f", "11", NULL, NULL, NULL,
+		"3", hashes[2], "bmw256", "gif.webm", "gif", "150", "1000", "t", "10", "7", "1000", "comfy"
+	};
+	const char *aliases[] = {
+		"1", alias_key, "1", "copy.webm", "wsg", "300", "5000", "t", "12", "8", "2000", NULL
+	};
+	/* The delta gets the old rows again, they should be skipped. */
+	const char *new_webms[] = {
+		"2", hashes[1], NULL, "second.webm", "wsg", "200", "60000", "f", "11", NULL, NULL, NULL,
+		"4", hashes[3], "bmw256", "new.webm", "wsg", "400", "70000", "t", "13", "9", "3000", "new"
+	};
+	const char *new_aliases[] = {
+		"2", other_key, "1", "other copy.webm", "b", "500", "5000", "t", "14", "9", "3001", "again"
+	};
+
+	PGresult *webm_res = _make_result(webm_cols, NULL, 12, 0, webms, NULL, 3);
+	PGresult *alias_res = _make_result(alias_cols, NULL, 12, 0, aliases, NULL, 1);
+	assert(meta_snapshot_write(webm_res, alias_res, 1) == -1);
+	assert(meta_snapshot_write(webm_res, alias_res, 0) == 0);
+	PQclear(webm_res);
+	PQclear(alias_res);
+	assert(meta_snapshot_open() == 0);
+
+	webm *_webm = meta_snapshot_get_webm(hashes[0]);
+	assert(_webm && _webm->id == 1 && _webm->post_id == 10 && _webm->created_at == 100);
+	assert(strcmp(_webm->filename, "first.webm") == 0 && strcmp(_webm->board, "wsg") == 0);
+	assert(strcmp(_webm->file_hash, hashes[0]) == 0);
+	assert(_webm->hash_algorithm == HASH_BLAKE3);
+	free(_webm);
+	assert(meta_snapshot_get_webm(hashes[3]) == NULL);
+
+	webm_alias *_alias = meta_snapshot_get_alias(alias_path);
+	assert(_alias && _alias->id == 1 && _alias->webm_id == 1 && _alias->post_id == 12);
+	free(_alias);
+	assert(meta_snapshot_get_alias(other_path) == NULL);
+
+	post *_post = meta_snapshot_get_post(10);
+	assert(_post && _post->thread_id == 7 && _post->fourchan_post_id == 1000);
+	assert(strcmp(_post->body_content, "comfy") == 0);
+	free(_post->body_content);
+	vector_free(_post->replied_to);
+	free(_post);
+	_post = meta_snapshot_get_post(12);
+	assert(_post && _post->body_content == NULL);
+	vector_free(_post->replied_to);
+	free(_post);
+	assert(meta_snapshot_get_post(11) == NULL);
+
+	vector *found = vector_new(sizeof(webm_alias), 4);
+	assert(meta_snapshot_get_aliases(1, found) == 1);
+	assert(meta_snapshot_get_aliases(3, found) == 0);
+	assert(meta_snapshot_get_aliases(4, found) == -1);
+	vector_free(found);
+
+	/* Newest first, aliases included. */
+	vector *names = vector_new(MAX_IMAGE_FILENAME_SIZE, 4);
+	assert(meta_snapshot_board_page("wsg", 0, 0, 0, 10, names) == 3);
+	assert(names->count == 3);
+	assert(strcmp(vector_get(names, 0), "copy.webm") == 0);
+	assert(strcmp(vector_get(names, 2), "first.webm") == 0);
+	vector_clear(names);
+	assert(meta_snapshot_board_page("wsg", 0, 0, 1, 1, names) == 3);
+	assert(names->count == 1 && strcmp(vector_get(names, 0), "second.webm") == 0);
+	vector_clear(names);
+	assert(meta_snapshot_board_page("wsg", 60000, 0, 0, 10, names) == 1);
+	assert(meta_snapshot_board_page("wsg", 0, 1, 0, 10, names) == 2);
+	/* Not one that's counted up front, so it's walked. */
+	assert(meta_snapshot_board_page("wsg", 6000, 1, 0, 10, names) == 0);
+	assert(meta_snapshot_board_page("wsg", 0, 1, 5, 10, names) == 2);
+	/* A board it's never heard of is a miss rather than an empty page. */
+	assert(meta_snapshot_board_page("pol", 0, 0, 0, 10, names) == -1);
+	vector_clear(names);
+
+	/* Then a delta on top. */
+	webm_res = _make_result(webm_cols, NULL, 12, 0, new_webms, NULL, 2);
+	alias_res = _make_result(alias_cols, NULL, 12, 0, new_aliases, NULL, 1);
+	assert(meta_snapshot_write(webm_res, alias_res, 1) == 0);
+	assert(meta_snapshot_open() == 0);
+
+	_webm = meta_snapshot_get_webm(hashes[3]);
+	assert(_webm && _webm->id == 4);
+	free(_webm);
+	_webm = meta_snapshot_get_webm(hashes[1]);
+	assert(_webm && _webm->id == 2 && _webm->hash_algorithm == HASH_BMW256);
+	free(_webm);
+	_alias = meta_snapshot_get_alias(other_path);
+	assert(_alias && _alias->id == 2 && _alias->webm_id == 1);
+	free(_alias);
+
+	found = vector_new(sizeof(webm_alias), 4);
+	assert(meta_snapshot_get_aliases(1, found) == 2);
+	assert(((const webm_alias *)vector_get(found, 0))->id == 2);
+	assert(((const webm_alias *)vector_get(found, 1))->id == 1);
+	assert(meta_snapshot_get_aliases(4, found) == 0);
+	vector_free(found);
+
+	assert(meta_snapshot_board_page("wsg", 0, 0, 0, 10, names) == 4);
+	assert(strcmp(vector_get(names, 0), "new.webm") == 0);
+	assert(strcmp(vector_get(names, 3), "first.webm") == 0);
+	vector_clear(names);
+	/* Counts from the snapshot and the delta add up. */
+	assert(meta_snapshot_board_page("wsg", 60000, 0, 0, 1, names) == 2);
+	assert(meta_snapshot_board_page("wsg", 0, 1, 0, 1, names) == 3);
+	vector_clear(names);
+	assert(meta_snapshot_board_page("b", 0, 0, 0, 10, names) == 1);
+	vector_free(names);
+
+	/* A new snapshot leaves the delta behind. */
+	assert(meta_snapshot_write(webm_res, alias_res, 0) == 0);
+	PQclear(webm_res);
+	PQclear(alias_res);
+	assert(meta_snapshot_open() == 0);
+	assert(meta_snapshot_get_webm(hashes[0]) == NULL);
+	_webm = meta_snapshot_get_webm(hashes[3]);
+	assert(_webm && _webm->id == 4);
+	free(_webm);
+
+	meta_snapshot_close();
+	unlink(path);
+	return 1;
+}
+
+int meta_snapshot_pages_newest() {
+	char path[MAX_IMAGE_FILENAME_SIZE] = {0};
+	snprintf(path, sizeof(path), "%s/%s", webm_location(), META_SNAPSHOT_FILE);
+	meta_snapshot_close();
+	unlink(path);
+
+	newest_hit hits[8];
+	assert(meta_snapshot_newest(NULL, hits, 8) == 0);
+
+	char hashes[5][HASH_IMAGE_STR_SIZE];
+	int i;
+	for (i = 0; i < 5; i++) {
+		memset(hashes[i], "ABCDE"[i], HASH_IMAGE_STR_SIZE - 1);
+		hashes[i][HASH_IMAGE_STR_SIZE - 1] = '\0';
+	}
+	static const char *webm_cols[] = {"id", "file_hash", "filename", "board", "created_at"};
+	static const char *alias_cols[] = {"id", "oleg_key", "webm_id", "filename", "board", "created_at"};
+	/* Two share a date, the alias goes first. */
+	const char *webms[] = {
+		"1", hashes[0], "b1.webm", "b", "100",
+		"2", hashes[1], "gif2.webm", "gif", "300",
+		"3", hashes[2], "b3.webm", "b", "200",
+		"4", hashes[3], "wsg4.webm", "wsg", "300"
+	};
+	const char *aliases[] = {
+		"1", "alias", "1", "gif-alias.webm", "gif", "300"
+	};
+	const char *new_webms[] = {
+		"5", hashes[4], "wsg5.webm", "wsg", "250"
+	};
+
+	PGresult *webm_res = _make_result(webm_cols, NULL, 5, 0, webms, NULL, 4);
+	PGresult *alias_res = _make_result(alias_cols, NULL, 6, 0, aliases, NULL, 1);
+	assert(meta_snapshot_write(webm_res, alias_res, 0) == 0);
+	PQclear(webm_res);
+	PQclear(alias_res);
+	webm_res = _make_result(webm_cols, NULL, 5, 0, new_webms, NULL, 1);
+	alias_res = _make_result(alias_cols, NULL, 6, 0, aliases, NULL, 0);
+	assert(meta_snapshot_write(webm_res, alias_res, 1) == 0);
+	PQclear(webm_res);
+	PQclear(alias_res);
+	assert(meta_snapshot_open() == 0);
+
+	const char *expected[] = {"gif-alias.webm", "wsg4.webm", "gif2.webm", "wsg5.webm", "b3.webm", "b1.webm"};
+	assert(meta_snapshot_newest(NULL, hits, 8) == 6);
+	for (i = 0; i < 6; i++)
+		assert(strcmp(hits[i].filename, expected[i]) == 0);
+	assert(hits[0].is_alias && strcmp(hits[0].board, "gif") == 0 && hits[0].created_at == 300);
+
+	/* Two at a time gets the same thing. */
+	char cursor[META_SNAPSHOT_CURSOR_SIZE] = {0};
+	int seen = 0, found;
+	while ((found = meta_snapshot_newest(cursor, hits, 2)) > 0) {
+		for (i = 0; i < found; i++)
+			assert(strcmp(hits[i].filename, expected[seen++]) == 0);
+		meta_snapshot_cursor(&hits[found - 1], cursor);
+	}
+	assert(seen == 6);
+	assert(strcmp(cursor, "100-w1") == 0);
+
+	/* Somewhere that isn't an entry works too. */
+	assert(meta_snapshot_newest("260-w0", hits, 8) == 3);
+	assert(strcmp(hits[0].filename, "wsg5.webm") == 0);
+	assert(meta_snapshot_newest("300-a1", hits, 1) == 1);
+	assert(strcmp(hits[0].filename, "wsg4.webm") == 0);
+	assert(meta_snapshot_newest("300", hits, 8) == -1);
+	assert(meta_snapshot_newest("300-x1", hits, 8) == -1);
+	assert(meta_snapshot_newest("300-w1z", hits, 8) == -1);
+
+	meta_snapshot_close();
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/%s", webm_location(), META_SNAPSHOT_DELTA_FILE);
+	unlink(path);
+	return 1;
+}
+
 int run_tests() {
+	blob_store_dedupes_webms();
 	hash_stuff();
 	can_get_header_values();
 	vectors_are_zeroed();
 	can_parse_range_query();
+	hash_stream_matches_hash_file();
+	blake3_matches_known_vectors();
+	bmw256_backends_agree();
+	fingerprints_tell_files_apart();
+	binary_keys_round_trip();
+	pg_fields_decode_binary_results();
+	quote_links_round_trip();
+	search_jobs_are_limited_per_client();
+	can_parse_webm_metadata();
+	scan_directory_finds_webms();
+	trace_histograms_add_up();
+	metrics_render_prometheus();
+	log_msg_filters_and_samples();
+	crawl_archive_round_trips();
+	journal_round_trips();
+	bloom_has_no_false_negatives();
+	known_keys_survive_a_restart();
+	known_keys_remember_inserts();
+	text_index_finds_posts();
+	text_index_picks_up_late_posts();
+	filename_index_finds_substrings();
+	meta_snapshot_serves_lookups();
+	meta_snapshot_pages_newest();
 
 	return 0;
 }
@@ -8,18 +8,16 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
 #include <stdint.h>
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
 #include <unistd.h>
 
-#include <38-moths/logging.h>
-
+#include "async_log.h"
+#include "known_keys.h"
 #include "models.h"
 #include "parse.h"
-#include "sha3api_ref.h"
 #include "utils.h"
 
 const char WEBMS_DIR_DEFAULT[] = "./webms";
@@ -55,7 +53,7 @@ void ensure_directory_for_board(const char *board) {
 
 	struct stat st = {0};
 	if (stat(to_create, &st) == -1) {
-		m38_log_msg(LOG_WARN, "Creating directory %s.", to_create);
+		log_msg(LOG_WARN, "Creating directory %s.", to_create);
 		mkdir(to_create, 0755);
 	}
 }
@@ -73,14 +71,21 @@ int get_non_colliding_image_file_path(char fname[static MAX_IMAGE_FILENAME_SIZE]
 
 	snprintf(fname, MAX_IMAGE_FILENAME_SIZE, "%s/%s/%s", webm_location(), p_match->board, _real_fname);
 
+	/* Only webms get scanned into the filter, anything else always gets
+	 * the stat(). */
+	char key[MAX_IMAGE_FILENAME_SIZE] = {0};
+	snprintf(key, sizeof(key), "%s/%s", p_match->board, _real_fname);
+	if (endswith(_real_fname, ".webm") && !known_maybe(KNOWN_FILES, key))
+		return 0;
+
 	size_t fsize = get_file_size(fname);
 	if (fsize == 0) {
 		return 0;
 	} else if (fsize == p_match->size) {
-		m38_log_msg(LOG_INFO, "Skipping %s.", fname);
+		log_msg(LOG_INFO, "Skipping %s.", fname);
 		return 1;
 	} else if (fsize != p_match->size) {
-		m38_log_msg(LOG_WARN, "Found duplicate filename for %s with incorrect size. Bad download?",
+		log_msg(LOG_WARN, "Found duplicate filename for %s with incorrect size. Bad download?",
 				fname);
 		return 0;
 	}
@@ -94,7 +99,7 @@ void ensure_thumb_directory(const post_match *p_match) {
 
 	struct stat st = {0};
 	if (stat(thumb_dir, &st) == -1) {
-		m38_log_msg(LOG_WARN, "Creating thumb directory %s.", thumb_dir);
+		log_msg(LOG_WARN, "Creating thumb directory %s.", thumb_dir);
 		mkdir(thumb_dir, 0755);
 	}
 }
@@ -158,6 +163,7 @@ void url_decode(const char *src, const size_t src_siz, char *dest) {
 
 			srcIter += 3;
 			destIter++;
+			continue;
 		}
 
 		dest[destIter] = src[srcIter];
@@ -180,49 +186,6 @@ size_t get_file_size(const char *file_path) {
 	return st.st_size;
 }
 
-int hash_string(const unsigned char *string, const size_t siz, char outbuf[static HASH_IMAGE_STR_SIZE]) {
-	unsigned char hash[HASH_ARRAY_SIZE] = {0};
-
-	if (Hash(IMAGE_HASH_SIZE, string, siz, hash) != 0)
-		return 0;
-
-	int j = 0;
-	for (j = 0; j < HASH_ARRAY_SIZE; j++)
-		sprintf(outbuf + (j * 2), "%02X", hash[j]);
-
-	return 1;
-}
-
-int hash_file(const char *file_path, char outbuf[static HASH_IMAGE_STR_SIZE]) {
-	unsigned char *data_ptr = NULL;
-	int fd = open(file_path, O_RDONLY);
-	if (fd < 0) {
-		m38_log_msg(LOG_ERR, "Could not open file for hashing.");
-		perror("hash_file");
-		goto error;
-	}
-
-	struct stat st = {0};
-	if (stat(file_path, &st) == -1)
-		goto error;
-
-	data_ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-
-	int rc = hash_string(data_ptr, st.st_size, outbuf);
-
-	munmap(data_ptr, st.st_size);
-	close(fd);
-
-	return rc;
-
-error:
-	if (data_ptr != NULL)
-		munmap(data_ptr, st.st_size);
-	close(fd);
-	errno = 0;
-	return 0;
-}
-
 int hash_string_fnv1a(const unsigned char *key, const size_t siz, char outbuf[static HASH_IMAGE_STR_SIZE]) {
 	/* https://en.wikipedia.org/wiki/Fowler_Noll_Vo_hash */
 	const uint64_t fnv_prime = 1099511628211ULL;
@@ -264,14 +227,3 @@ char *get_full_path_for_webm(const char current_board[MAX_BOARD_NAME_SIZE],
 
 	return full_path;
 }
-
-size_t create_thumbnail_for_webm(const char webm_file_path[static MAX_IMAGE_FILENAME_SIZE], const char *out_filepath) {
-	FILE *webm_file_handle = NULL;
-	size_t written = 0;
-	(void)webm_file_path;
-	(void)out_filepath;
-	(void)webm_file_handle;
-	(void)written;
-
-	return written;
-}
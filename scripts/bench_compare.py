@@ -0,0 +1,49 @@
+#!/usr/bin/env python3
+"""
+Compares two runs of the bench target saved with -j:
+
+    ./mzbh_bench -j > before.json
+    ./mzbh_bench -j > after.json
+    ./scripts/bench_compare.py before.json after.json
+
+Changes smaller than the spread between runs are marked with a ~.
+"""
+import json
+import sys
+
+
+def load(path):
+    results = {}
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if line.startswith("{"):
+                result = json.loads(line)
+                results[result["name"]] = result
+    return results
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.stderr.write(__doc__)
+        return 1
+
+    before, after = load(sys.argv[1]), load(sys.argv[2])
+    print("%-32s %14s %14s %9s %12s" % ("benchmark", "before ns/op", "after ns/op", "delta", "allocs/op"))
+    for name, old in before.items():
+        new = after.get(name)
+        if new is None:
+            continue
+
+        delta = (new["ns_per_op"] - old["ns_per_op"]) / old["ns_per_op"] * 100
+        noise = max(old["max_ns_per_op"] - old["min_ns_per_op"],
+                    new["max_ns_per_op"] - new["min_ns_per_op"])
+        marker = "~" if abs(new["ns_per_op"] - old["ns_per_op"]) < noise else " "
+        allocs = "%.1f -> %.1f" % (old["allocs_per_op"], new["allocs_per_op"])
+        print("%-32s %14.0f %14.0f %+8.1f%%%s %s" % (name, old["ns_per_op"], new["ns_per_op"], delta, marker, allocs))
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
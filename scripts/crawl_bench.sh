@@ -0,0 +1,67 @@
+#!/bin/bash
+# Times one downloader pass against scripts/mock_4chan.py. Run it from the
+# directory with the downloader binary in it, with PGHOST/PGPORT pointed at a
+# scratch mzbh database:
+#
+#   ./scripts/crawl_bench.sh [mock_4chan.py options...]
+#
+# e.g. ./scripts/crawl_bench.sh --latency-ms 80 --bandwidth-kbps 2048 --error-rate 0.02
+set -e
+
+SCRIPTS="$(cd "$(dirname "$0")" && pwd)"
+PORT="${MOCK_PORT:-8404}"
+DOWNLOADER="${DOWNLOADER:-./downloader}"
+
+WEBMS_DIR="$(mktemp -d)"
+LOG="$(mktemp)"
+MOCK_PID=""
+
+cleanup() {
+	[ -n "$MOCK_PID" ] && kill "$MOCK_PID" 2>/dev/null || true
+	rm -rf "$WEBMS_DIR" "$LOG"
+}
+trap cleanup EXIT
+
+python3 "$SCRIPTS/mock_4chan.py" --port "$PORT" "$@" &
+MOCK_PID=$!
+
+for _ in $(seq 50); do
+	curl -sf "http://127.0.0.1:$PORT/wsg/catalog.json" >/dev/null && break
+	sleep 0.1
+done
+
+export WFU_API_HOST="http://127.0.0.1:$PORT"
+export WFU_CDN_HOST="http://127.0.0.1:$PORT"
+export WFU_WEBMS_DIR="$WEBMS_DIR"
+export WFU_LOG_LEVEL="${WFU_LOG_LEVEL:-info}"
+
+set +e
+"$DOWNLOADER" -o > "$LOG"
+RC=$?
+set -e
+
+SUMMARY="$(grep -o 'Pass summary: .*' "$LOG" | tail -n 1)"
+if [ -z "$SUMMARY" ]; then
+	echo "No pass summary, downloader exited with $RC:" >&2
+	tail -n 20 "$LOG" >&2
+	exit 1
+fi
+
+# Every query gets its own connection, so a round trip is one of either.
+echo "$SUMMARY" | tr ' ' '\n' | grep = | awk -F= '
+	{ v[$1] = $2 }
+	END {
+		files = v["files"] > 0 ? v["files"] : 1
+		secs = v["seconds"] > 0 ? v["seconds"] : 1
+		printf "pass time:        %.3fs\n", v["seconds"]
+		printf "threads:          %d\n", v["threads"]
+		printf "files:            %d (%.2f/s)\n", v["files"], v["files"] / secs
+		printf "bytes:            %d (%.2f MB/s)\n", v["bytes"], v["bytes"] / secs / 1048576
+		printf "errors:           %d\n", v["errors"]
+		printf "DB round trips:   %d (%.2f/file)\n", v["queries"] + v["connections"],
+			(v["queries"] + v["connections"]) / files
+		printf "fingerprint:      %d new, %d full lookups\n", v["fingerprint_new"], v["fingerprint_maybe"]
+		printf "peak RSS:         %.1f MB\n", v["max_rss_kb"] / 1024
+	}'
+
+exit $RC
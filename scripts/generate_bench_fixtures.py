@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+"""
+Writes the JSON fixtures the bench target runs against, shaped like what
+a.4cdn.org hands back for a busy /wsg/. They're generated from a fixed seed
+so every checkout benchmarks the same bytes. To bench against the real thing
+instead, save a live catalog.json and thread/<no>.json over them.
+
+    ./scripts/generate_bench_fixtures.py old/fixtures
+"""
+import json
+import os
+import random
+import sys
+
+SEED = 38
+PAGES = 10
+THREADS_PER_PAGE = 15
+POSTS_PER_THREAD = 300
+
+WORDS = ("webm", "sauce", "comfy", "thread", "based", "music", "loop", "edit",
+         "original", "anyone", "have", "more", "like", "this", "please", "kino")
+
+
+def _comment(rng, no):
+    words = " ".join(rng.choice(WORDS) for _ in range(rng.randint(4, 60)))
+    quote = '<a href="#p%d" class="quotelink">&gt;&gt;%d</a><br>' % (no - 1, no - 1)
+    return (quote if rng.random() < 0.4 else "") + words
+
+
+def _post(rng, no, tim, with_file):
+    post = {
+        "no": no,
+        "now": "01/01/16(Fri)00:00:%02d" % (no % 60),
+        "name": "Anonymous",
+        "com": _comment(rng, no),
+        "time": 1451606400 + no,
+        "resto": 0,
+    }
+    if with_file:
+        post.update({
+            "filename": "%s %s %d" % (rng.choice(WORDS), rng.choice(WORDS), no),
+            "ext": ".webm" if rng.random() < 0.8 else ".jpg",
+            "w": 1280, "h": 720, "tn_w": 250, "tn_h": 140,
+            "tim": tim,
+            "md5": "%024x==" % rng.getrandbits(96),
+            "fsize": rng.randint(100000, 4000000),
+        })
+    return post
+
+
+def catalog(rng):
+    pages = []
+    no = 1000000
+    for page in range(1, PAGES + 1):
+        threads = []
+        for _ in range(THREADS_PER_PAGE):
+            no += 1000
+            thread = _post(rng, no, 1451606400000 + no, True)
+            thread["sub"] = "%s %s thread" % (rng.choice(WORDS), rng.choice(WORDS))
+            thread["replies"] = rng.randint(0, 300)
+            thread["images"] = rng.randint(0, thread["replies"])
+            thread["last_replies"] = [_post(rng, no + i, 1451606400000 + no + i, rng.random() < 0.5)
+                                      for i in range(1, 6)]
+            threads.append(thread)
+        pages.append({"page": page, "threads": threads})
+    return pages
+
+
+def thread(rng):
+    op = 2000000
+    posts = [_post(rng, op, 1451606400000 + op, True)]
+    posts[0]["sub"] = "webm thread"
+    for i in range(1, POSTS_PER_THREAD):
+        post = _post(rng, op + i, 1451606400000 + op + i, rng.random() < 0.6)
+        post["resto"] = op
+        posts.append(post)
+    return {"posts": posts}
+
+
+def main():
+    out_dir = sys.argv[1] if len(sys.argv) > 1 else "fixtures"
+    rng = random.Random(SEED)
+    with open(os.path.join(out_dir, "catalog.json"), "w") as f:
+        json.dump(catalog(rng), f, separators=(",", ":"))
+    with open(os.path.join(out_dir, "thread.json"), "w") as f:
+        json.dump(thread(rng), f, separators=(",", ":"))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,44 @@
+#!/bin/bash
+# Fills WFU_WEBMS_DIR and the mzbh database with a synthetic corpus for
+# scripts/load_test.py: about N webms (default 1000) spread over every board
+# the downloader crawls, POSTS to a thread, with DUPLICATE_RATE of them
+# reposts that end up as aliases. Each one is generate_test_webm.sh's output
+# with a unique tail, so thumbnails and range requests behave like the real
+# thing. Run from the directory with the downloader in it:
+#
+#   WFU_WEBMS_DIR=./webms ./scripts/generate_load_corpus.sh 20000
+set -e
+
+SCRIPTS="$(cd "$(dirname "$0")" && pwd)"
+FILES="${1:-1000}"
+POSTS="${POSTS:-20}"
+DUPLICATE_RATE="${DUPLICATE_RATE:-0.05}"
+PORT="${MOCK_PORT:-8404}"
+# Length of BOARDS[] in downloader.c.
+BOARDS=15
+THREADS=$(( (FILES + BOARDS * POSTS - 1) / (BOARDS * POSTS) ))
+
+WORK="$(mktemp -d)"
+MOCK_PID=""
+
+cleanup() {
+	[ -n "$MOCK_PID" ] && kill "$MOCK_PID" 2>/dev/null || true
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+"$SCRIPTS/generate_test_webm.sh" "$WORK" >/dev/null 2>&1
+
+python3 "$SCRIPTS/mock_4chan.py" --port "$PORT" --threads "$THREADS" --posts "$POSTS" \
+	--file-rate 1 --webm-rate 1 --churn 0 --duplicate-rate "$DUPLICATE_RATE" \
+	--webm-file "$WORK/silence.webm" &
+MOCK_PID=$!
+
+for _ in $(seq 50); do
+	curl -sf "http://127.0.0.1:$PORT/wsg/catalog.json" >/dev/null && break
+	sleep 0.1
+done
+
+echo "Crawling $THREADS threads of $POSTS posts on each of $BOARDS boards into ${WFU_WEBMS_DIR:-./webms}..."
+WFU_API_HOST="http://127.0.0.1:$PORT" WFU_CDN_HOST="http://127.0.0.1:$PORT" \
+	WFU_LOG_LEVEL="${WFU_LOG_LEVEL:-warn}" ./downloader -o
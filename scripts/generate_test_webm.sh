@@ -1,4 +1,8 @@
 #!/bin/bash
+# A 10 second blank webm and its thumbnail, in the directory given or this
+# one. Works with either avconv or ffmpeg.
+OUT="${1:-.}"
+AVCONV="$(command -v avconv || command -v ffmpeg)"
 
-avconv -t 10 -s 640x480 -f rawvideo -pix_fmt rgb24 -r 25 -i /dev/zero -t 10 silence.webm
-avconv -i silence.webm -vframes 1 thumb_silence.jpg
+$AVCONV -y -t 10 -s 640x480 -f rawvideo -pix_fmt rgb24 -r 25 -i /dev/zero -t 10 "$OUT/silence.webm"
+$AVCONV -y -i "$OUT/silence.webm" -vframes 1 "$OUT/thumb_silence.jpg"
@@ -0,0 +1,286 @@
+#!/usr/bin/env python3
+"""
+Load generator for mzbh_server. Finds its URLs by crawling the server it's
+pointed at, so it works against any corpus (scripts/generate_load_corpus.sh
+makes one), then hammers a weighted mix of routes from a pool of worker
+processes and reports throughput and p50/p99/p999 per route.
+
+    ./scripts/load_test.py --duration 30 --clients 32 --mix browse
+    ./scripts/load_test.py --server ./mzbh_server --server-threads 1,2,4,8
+
+With --server it starts the binary itself with each -t in turn, so you can
+see where adding threads stops helping. -j prints JSON lines instead of the
+table, one per route per run.
+"""
+import argparse
+import http.client
+import json
+import multiprocessing
+import random
+import re
+import socket
+import subprocess
+import sys
+import time
+import urllib.parse
+
+# Route weights for each scenario. Names match TRACED_HANDLER routes where
+# there's a one to one mapping.
+MIXES = {
+    # Someone clicking around.
+    "browse": {"index": 5, "board": 30, "deep_page": 5, "webm": 25,
+               "by_thread": 10, "by_alias": 5, "thumb": 20},
+    # What the page loads pull in after the HTML.
+    "media": {"thumb": 60, "range": 40},
+    # Everything, with video weighted like a busy evening.
+    "mixed": {"index": 3, "board": 20, "deep_page": 5, "webm": 15,
+              "by_thread": 7, "by_alias": 3, "thumb": 30, "range": 17},
+}
+
+LINK_RE = re.compile(r'(?:href|src)="(/[^"]*)"')
+BOARD_RE = re.compile(r"^/chug/([a-zA-Z]+)$")
+PAGE_RE = re.compile(r"^/chug/([a-zA-Z]+)/([0-9]+)$")
+SLURP_RE = re.compile(r"^/slurp/[a-zA-Z]+/.+\.webm$")
+THUMB_RE = re.compile(r"^/chug/[a-zA-Z]+/t/.+\.jpg$")
+VIDEO_RE = re.compile(r"^/chug/[a-zA-Z]+/[^/]+\.webm$")
+THREAD_RE = re.compile(r"^/by/thread/[0-9]+$")
+ALIAS_RE = re.compile(r"^/by/alias/[0-9]+$")
+
+RANGE_CHUNK = 256 * 1024
+
+
+def fetch(host, port, path, headers=None, timeout=30):
+    conn = http.client.HTTPConnection(host, port, timeout=timeout)
+    try:
+        conn.request("GET", urllib.parse.quote(path, safe="/:?=&%"), headers=headers or {})
+        response = conn.getresponse()
+        body = response.read()
+        return response.status, response.getheader("Content-Range"), body
+    finally:
+        conn.close()
+
+
+def links(host, port, path):
+    try:
+        status, _, body = fetch(host, port, path)
+    except (OSError, http.client.HTTPException):
+        return []
+    if status != 200:
+        return []
+    return [urllib.parse.unquote(l) for l in LINK_RE.findall(body.decode("utf-8", "replace"))]
+
+
+def discover(host, port, pages_per_board, sample):
+    """Builds a pool of paths for each route by following links, the way a
+    visitor would find them."""
+    pools = {name: set() for name in ("index", "board", "deep_page", "webm",
+                                      "by_thread", "by_alias", "thumb", "range")}
+    pools["index"].add("/")
+
+    boards = sorted({m.group(1) for l in links(host, port, "/") for m in [BOARD_RE.match(l)] if m})
+    webm_pages = []
+    for board in boards:
+        found = links(host, port, "/chug/%s/0" % board)
+        last_page = max([int(m.group(2)) for l in found for m in [PAGE_RE.match(l)] if m] + [0])
+        for page in range(0, min(pages_per_board, last_page + 1)):
+            pools["board"].add("/chug/%s/%d" % (board, page))
+        for page in range(max(0, last_page - pages_per_board + 1), last_page + 1):
+            pools["deep_page"].add("/chug/%s/%d" % (board, page))
+
+        for l in found:
+            if SLURP_RE.match(l):
+                webm_pages.append(l)
+            elif THUMB_RE.match(l):
+                pools["thumb"].add(l)
+            elif VIDEO_RE.match(l):
+                pools["range"].add(l)
+
+    random.shuffle(webm_pages)
+    for page in webm_pages[:sample]:
+        pools["webm"].add(page)
+        for l in links(host, port, page):
+            if THREAD_RE.match(l):
+                pools["by_thread"].add(l)
+            elif VIDEO_RE.match(l):
+                pools["range"].add(l)
+
+    for l in links(host, port, "/by/alias/0") + ["/by/alias/0"]:
+        if ALIAS_RE.match(l):
+            pools["by_alias"].add(l)
+
+    # Range requests want to know how big the file is.
+    sized = []
+    for path in list(pools["range"])[:sample]:
+        try:
+            status, content_range, _ = fetch(host, port, path, {"Range": "bytes=0-0"})
+        except (OSError, http.client.HTTPException):
+            continue
+        if status == 206 and content_range and "/" in content_range:
+            sized.append((path, int(content_range.rsplit("/", 1)[1])))
+    pools["range"] = sized
+
+    return {name: sorted(pool) for name, pool in pools.items() if pool}
+
+
+def _worker(args):
+    host, port, pools, weights, deadline, warmup_until, seed = args
+    rng = random.Random(seed)
+    routes = [r for r in weights if r in pools]
+    cumulative = []
+    total = 0
+    for route in routes:
+        total += weights[route]
+        cumulative.append(total)
+
+    samples = {}
+    while True:
+        now = time.monotonic()
+        if now >= deadline:
+            break
+
+        pick = rng.uniform(0, total)
+        route = routes[next(i for i, c in enumerate(cumulative) if pick <= c)]
+        headers = {}
+        if route == "range":
+            path, size = rng.choice(pools[route])
+            start = rng.randrange(0, max(1, size - RANGE_CHUNK)) if rng.random() < 0.7 else 0
+            headers["Range"] = "bytes=%d-%d" % (start, min(size - 1, start + RANGE_CHUNK - 1))
+        else:
+            path = rng.choice(pools[route])
+
+        started = time.monotonic()
+        try:
+            status, _, body = fetch(host, port, path, headers)
+            size = len(body)
+        except (OSError, http.client.HTTPException):
+            status, size = 0, 0
+        elapsed = time.monotonic() - started
+
+        if started < warmup_until:
+            continue
+        latencies, errors, nbytes = samples.setdefault(route, ([], 0, 0))
+        latencies.append(elapsed)
+        samples[route] = (latencies, errors + (status not in (200, 206)), nbytes + size)
+
+    return samples
+
+
+def _percentile(ordered, p):
+    if not ordered:
+        return 0.0
+    return ordered[min(len(ordered) - 1, int(len(ordered) * p))]
+
+
+def run(host, port, pools, weights, clients, duration, warmup):
+    now = time.monotonic()
+    deadline = now + warmup + duration
+    jobs = [(host, port, pools, weights, deadline, now + warmup, i) for i in range(clients)]
+    with multiprocessing.Pool(clients) as pool:
+        results = pool.map(_worker, jobs)
+
+    merged = {}
+    for samples in results:
+        for route, (latencies, errors, nbytes) in samples.items():
+            all_latencies, all_errors, all_bytes = merged.setdefault(route, ([], 0, 0))
+            all_latencies.extend(latencies)
+            merged[route] = (all_latencies, all_errors + errors, all_bytes + nbytes)
+
+    report = []
+    for route in sorted(merged):
+        latencies, errors, nbytes = merged[route]
+        latencies.sort()
+        report.append({
+            "route": route,
+            "requests": len(latencies),
+            "errors": errors,
+            "rps": len(latencies) / duration,
+            "mb_per_s": nbytes / duration / 1048576,
+            "p50_ms": _percentile(latencies, 0.50) * 1000,
+            "p99_ms": _percentile(latencies, 0.99) * 1000,
+            "p999_ms": _percentile(latencies, 0.999) * 1000,
+        })
+    return report
+
+
+def print_report(report, label):
+    print("\n%s" % label)
+    print("%-10s %9s %7s %9s %8s %9s %9s %9s" % (
+        "route", "requests", "errors", "req/s", "MB/s", "p50 ms", "p99 ms", "p999 ms"))
+    for row in report:
+        print("%-10s %9d %7d %9.1f %8.2f %9.2f %9.2f %9.2f" % (
+            row["route"], row["requests"], row["errors"], row["rps"], row["mb_per_s"],
+            row["p50_ms"], row["p99_ms"], row["p999_ms"]))
+    total = sum(row["requests"] for row in report)
+    rps = sum(row["rps"] for row in report)
+    print("%-10s %9d %7d %9.1f" % ("total", total, sum(row["errors"] for row in report), rps))
+
+
+def wait_for_port(host, port, timeout=30):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        try:
+            socket.create_connection((host, port), timeout=1).close()
+            return True
+        except OSError:
+            time.sleep(0.1)
+    return False
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Load test mzbh_server.")
+    parser.add_argument("--url", default="http://127.0.0.1:8666")
+    parser.add_argument("--mix", default="mixed",
+                        help="one of %s, or weights like board=3,thumb=1" % ", ".join(sorted(MIXES)))
+    parser.add_argument("--clients", type=int, default=16, help="concurrent client processes")
+    parser.add_argument("--duration", type=float, default=20, help="seconds to measure for")
+    parser.add_argument("--warmup", type=float, default=3, help="seconds to run before measuring")
+    parser.add_argument("--pages", type=int, default=3, help="shallow and deep pages to hit per board")
+    parser.add_argument("--sample", type=int, default=200, help="webm pages to crawl for more links")
+    parser.add_argument("--server", help="mzbh_server binary to start for each --server-threads")
+    parser.add_argument("--server-threads", default="", help="comma separated -t values, needs --server")
+    parser.add_argument("-j", "--json", action="store_true")
+    opts = parser.parse_args()
+
+    url = urllib.parse.urlparse(opts.url)
+    host, port = url.hostname, url.port or 80
+
+    if opts.mix in MIXES:
+        weights = MIXES[opts.mix]
+    else:
+        weights = {k: float(v) for k, v in (pair.split("=") for pair in opts.mix.split(","))}
+
+    thread_counts = [int(t) for t in opts.server_threads.split(",") if t] or [None]
+    if thread_counts != [None] and not opts.server:
+        parser.error("--server-threads needs --server")
+
+    for threads in thread_counts:
+        server = None
+        if threads is not None:
+            server = subprocess.Popen([opts.server, "-t", str(threads)],
+                                      stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+            if not wait_for_port(host, port):
+                server.kill()
+                sys.exit("%s didn't start listening on %d." % (opts.server, port))
+
+        try:
+            pools = discover(host, port, opts.pages, opts.sample)
+            if not any(route in pools for route in weights):
+                sys.exit("Found nothing to request, is there a corpus loaded?")
+            report = run(host, port, pools, weights, opts.clients, opts.duration, opts.warmup)
+        finally:
+            if server:
+                server.terminate()
+                server.wait()
+
+        label = "mix=%s clients=%d%s" % (opts.mix, opts.clients,
+                                          "" if threads is None else " -t %d" % threads)
+        if opts.json:
+            for row in report:
+                row.update({"mix": opts.mix, "clients": opts.clients, "server_threads": threads})
+                print(json.dumps(row))
+        else:
+            print_report(report, label)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,297 @@
+#!/usr/bin/env python3
+"""
+A stand-in for a.4cdn.org, i.4cdn.org and t.4cdn.org so the downloader can be
+run (and timed) without going anywhere near 4chan. Every board exists and
+is filled with generated threads, or with recorded JSON if you have some:
+
+    ./scripts/mock_4chan.py --port 8404 --latency-ms 50 --error-rate 0.01
+    WFU_API_HOST=http://127.0.0.1:8404 WFU_CDN_HOST=http://127.0.0.1:8404 ./downloader -o
+
+Recorded payloads are picked up from --recorded DIR as DIR/<board>/catalog.json
+and DIR/<board>/thread/<no>.json, with anything missing generated as usual.
+
+Generated webms are a valid EBML header (so durations and dimensions come
+out right) followed by noise, which means thumbnailing them fails. Pass
+--webm-file to serve a real one instead, e.g. from generate_test_webm.sh,
+with a Void element unique to each post right after the EBML header so they
+all hash differently. It has to go near the front: the stored hash only
+covers the first eighth of the file. Decoders skip Void elements.
+"""
+import argparse
+import json
+import os
+import random
+import re
+import struct
+import threading
+import time
+import zlib
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+EPOCH_MS = 1451606400000
+WORDS = ("webm", "sauce", "comfy", "thread", "based", "music", "loop", "edit",
+         "original", "anyone", "have", "more", "like", "this", "please", "kino")
+
+CATALOG_RE = re.compile(r"^/(\w+)/catalog\.json$")
+THREAD_RE = re.compile(r"^/(\w+)/thread/(\d+)\.json$")
+IMAGE_RE = re.compile(r"^/(\w+)/(\d+)(s?)\.(webm|jpg|png|gif)$")
+
+
+def _ebml_size(n):
+    return bytes([0x01]) + n.to_bytes(7, "big")
+
+
+def _element(element_id, payload):
+    return element_id + _ebml_size(len(payload)) + payload
+
+
+def _read_vint(data, pos):
+    length = 1
+    while length <= 8 and not data[pos] & (0x80 >> (length - 1)):
+        length += 1
+    value = data[pos] & (0xff >> length)
+    for byte in data[pos + 1:pos + length]:
+        value = (value << 8) | byte
+    return value, pos + length
+
+
+def with_void(webm, payload):
+    """webm with a Void element holding payload just after its EBML header."""
+    if webm[:4] != b"\x1a\x45\xdf\xa3":
+        raise ValueError("not a webm")
+    size, pos = _read_vint(webm, 4)
+    end = pos + size
+    return webm[:end] + _element(b"\xec", payload) + webm[end:]
+
+
+def fake_webm(rng, size, duration_ms, width, height):
+    header = _element(b"\x1a\x45\xdf\xa3", _element(b"\x42\x82", b"webm"))
+    info = _element(b"\x15\x49\xa9\x66",
+                    _element(b"\x2a\xd7\xb1", (1000000).to_bytes(3, "big")) +
+                    _element(b"\x44\x89", struct.pack(">d", float(duration_ms))))
+    video = _element(b"\xe0", _element(b"\xb0", width.to_bytes(2, "big")) +
+                     _element(b"\xba", height.to_bytes(2, "big")))
+    track = _element(b"\xae", _element(b"\x83", b"\x01") + _element(b"\x86", b"V_VP8") + video)
+    tracks = _element(b"\x16\x54\xae\x6b", track)
+    head = header + b"\x18\x53\x80\x67\x01\xff\xff\xff\xff\xff\xff\xff" + info + tracks
+    body_len = max(0, size - len(head) - 12)
+    return head + _element(b"\x1f\x43\xb6\x75", rng.randbytes(body_len))
+
+
+class Board(object):
+    """Threads on one board. Every catalog fetch churns a few of them off the
+    end and new ones on at the top, like a busy board would."""
+
+    def __init__(self, name, opts):
+        self.name = name
+        self.opts = opts
+        self.lock = threading.Lock()
+        self.next_no = 1000000 + (zlib.crc32(name.encode()) % 1000) * 1000000
+        self.threads = [self._new_thread() for _ in range(opts.threads)]
+
+    def _new_thread(self):
+        no = self.next_no
+        self.next_no += self.opts.posts + 1
+        return no
+
+    def churn(self):
+        with self.lock:
+            count = int(len(self.threads) * self.opts.churn)
+            if self.opts.churn > 0 and count == 0 and random.random() < self.opts.churn * len(self.threads):
+                count = 1
+            for _ in range(count):
+                self.threads.pop()
+                self.threads.insert(0, self._new_thread())
+            return list(self.threads)
+
+
+def _rng(opts, *key):
+    return random.Random("%d:%s" % (opts.seed, ":".join(str(k) for k in key)))
+
+
+def _post(opts, board, thread_no, index):
+    rng = _rng(opts, board, thread_no, index)
+    no = thread_no + index
+    post = {
+        "no": no,
+        "resto": 0 if index == 0 else thread_no,
+        "now": "01/01/16(Fri)00:00:%02d" % (no % 60),
+        "name": "Anonymous",
+        "time": EPOCH_MS // 1000 + no % 1000000,
+        "com": " ".join(rng.choice(WORDS) for _ in range(rng.randint(3, 40))),
+    }
+    if index == 0:
+        post["sub"] = "%s %s thread" % (rng.choice(WORDS), rng.choice(WORDS))
+
+    if index == 0 or rng.random() < opts.file_rate:
+        webm = rng.random() < opts.webm_rate
+        post.update({
+            "filename": "%s_%s_%d" % (rng.choice(WORDS), rng.choice(WORDS), no),
+            "ext": ".webm" if webm else ".jpg",
+            "tim": EPOCH_MS + no,
+            "w": 1280, "h": 720, "tn_w": 250, "tn_h": 140,
+            "fsize": opts.webm_kb * 1024,
+            "md5": "%024x==" % rng.getrandbits(96),
+        })
+    return post
+
+
+def thread_json(opts, board, thread_no):
+    return {"posts": [_post(opts, board, thread_no, i) for i in range(opts.posts)]}
+
+
+def catalog_json(opts, board, threads):
+    pages = []
+    per_page = 15
+    for page in range(0, len(threads), per_page):
+        entries = []
+        for thread_no in threads[page:page + per_page]:
+            op = _post(opts, board, thread_no, 0)
+            op["replies"] = opts.posts - 1
+            op["last_replies"] = [_post(opts, board, thread_no, i)
+                                  for i in range(max(1, opts.posts - 5), opts.posts)]
+            entries.append(op)
+        pages.append({"page": page // per_page + 1, "threads": entries})
+    return pages
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, fmt, *args):
+        if self.server.opts.verbose:
+            BaseHTTPRequestHandler.log_message(self, fmt, *args)
+
+    def _send(self, status, body, content_type):
+        opts = self.server.opts
+        self.send_response(status)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+
+        if opts.bandwidth_kbps <= 0:
+            self.wfile.write(body)
+            return
+
+        chunk = 16 * 1024
+        per_chunk = chunk / (opts.bandwidth_kbps * 1024.0)
+        for offset in range(0, len(body), chunk):
+            started = time.monotonic()
+            self.wfile.write(body[offset:offset + chunk])
+            remaining = per_chunk - (time.monotonic() - started)
+            if remaining > 0:
+                time.sleep(remaining)
+
+    def _recorded(self, *parts):
+        if not self.server.opts.recorded:
+            return None
+        path = os.path.join(self.server.opts.recorded, *parts)
+        if os.path.exists(path):
+            with open(path, "rb") as f:
+                return f.read()
+        return None
+
+    def do_GET(self):
+        opts = self.server.opts
+        path = self.path.split("?", 1)[0]
+
+        if opts.latency_ms > 0:
+            time.sleep(max(0, random.gauss(opts.latency_ms, opts.latency_ms / 4.0)) / 1000.0)
+
+        if random.random() < opts.error_rate:
+            self._send(random.choice((500, 502, 503)), b"nope", "text/plain")
+            return
+
+        match = CATALOG_RE.match(path)
+        if match:
+            board = self.server.board(match.group(1))
+            body = self._recorded(board.name, "catalog.json")
+            if body is None:
+                body = json.dumps(catalog_json(opts, board.name, board.churn())).encode()
+            self._send(200, body, "application/json")
+            return
+
+        match = THREAD_RE.match(path)
+        if match:
+            board, thread_no = match.group(1), int(match.group(2))
+            body = self._recorded(board, "thread", "%d.json" % thread_no)
+            if body is None:
+                body = json.dumps(thread_json(opts, board, thread_no)).encode()
+            self._send(200, body, "application/json")
+            return
+
+        match = IMAGE_RE.match(path)
+        if match:
+            board, tim, thumb, ext = match.groups()
+            if thumb or ext != "webm":
+                self._send(200, self.server.jpeg, "image/jpeg")
+                return
+
+            # Some fraction of uploads are reposts of something else.
+            rng = _rng(opts, board, tim, "file")
+            key = "%s/%s" % (board, tim) if rng.random() >= opts.duplicate_rate else "dupe%d" % rng.randint(0, 9)
+            if opts.webm_file:
+                body = with_void(self.server.webm_file, key.encode())
+            else:
+                rng = _rng(opts, key, "body")
+                body = fake_webm(rng, opts.webm_kb * 1024, rng.randint(2000, 120000), 1280, 720)
+            self._send(200, body, "video/webm")
+            return
+
+        self._send(404, b"not found", "text/plain")
+
+
+class MockServer(ThreadingHTTPServer):
+    daemon_threads = True
+
+    def __init__(self, address, opts):
+        ThreadingHTTPServer.__init__(self, address, Handler)
+        self.opts = opts
+        self.boards = {}
+        self.boards_lock = threading.Lock()
+        self.webm_file = None
+        if opts.webm_file:
+            with open(opts.webm_file, "rb") as f:
+                self.webm_file = f.read()
+        # Smallest thing that passes for a JPEG.
+        self.jpeg = b"\xff\xd8\xff\xe0" + b"\x00" * 16 + b"\xff\xd9"
+
+    def board(self, name):
+        with self.boards_lock:
+            if name not in self.boards:
+                self.boards[name] = Board(name, self.opts)
+            return self.boards[name]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Mock 4chan API and CDN.")
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=8404)
+    parser.add_argument("--seed", type=int, default=38)
+    parser.add_argument("--threads", type=int, default=5, help="threads per board")
+    parser.add_argument("--posts", type=int, default=50, help="posts per thread")
+    parser.add_argument("--file-rate", type=float, default=0.3, help="fraction of replies with a file")
+    parser.add_argument("--webm-rate", type=float, default=0.8, help="fraction of files that are webms")
+    parser.add_argument("--webm-kb", type=int, default=256, help="size of generated webms")
+    parser.add_argument("--webm-file", help="serve this file for every webm instead")
+    parser.add_argument("--duplicate-rate", type=float, default=0.05,
+                        help="fraction of webms that are byte-for-byte reposts")
+    parser.add_argument("--churn", type=float, default=0.1,
+                        help="fraction of threads replaced on each catalog fetch")
+    parser.add_argument("--latency-ms", type=float, default=0, help="mean added latency per request")
+    parser.add_argument("--bandwidth-kbps", type=float, default=0, help="per connection, 0 is unlimited")
+    parser.add_argument("--error-rate", type=float, default=0, help="fraction of requests that 5xx")
+    parser.add_argument("--recorded", help="directory of recorded catalog/thread JSON")
+    parser.add_argument("--verbose", action="store_true")
+    opts = parser.parse_args()
+
+    server = MockServer((opts.host, opts.port), opts)
+    print("Mock 4chan on http://%s:%d" % (opts.host, opts.port), flush=True)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -120,10 +120,17 @@ def create_tables(conn):
         file_path TEXT,
         post_id INTEGER REFERENCES posts,
         created_at TIMESTAMPTZ DEFAULT now(),
-        size INTEGER);""")
+        size INTEGER,
+        duration_ms BIGINT,
+        width INTEGER,
+        height INTEGER,
+        video_codec TEXT,
+        audio_codec TEXT,
+        has_audio BOOLEAN);""")
     cur.execute("CREATE INDEX webms_oleg_key ON webms (oleg_key)")
     cur.execute("CREATE INDEX webms_file_hash_idx ON webms (file_hash)")
     cur.execute("CREATE INDEX webms_filename_idx ON webms (filename)")
+    cur.execute("CREATE INDEX webms_board_duration_idx ON webms (board, duration_ms)")
 
     cur.execute("""CREATE TABLE webm_aliases (
         id SERIAL PRIMARY KEY,